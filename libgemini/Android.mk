@@ -22,13 +22,53 @@ LOCAL_SRC_FILES := \
     gemini.c \
     gemini_hw.c \
     gemini_huffman_table.c \
+    gemini_jfif.c \
+    gemini_bandpool.c \
+    gemini_convert.c \
+    gemini_rotate.c \
+    gemini_ratectl.c \
+    gemini_scan.c \
+    gemini_mjpeg.c \
+    gemini_thumbnail.c \
 
 LOCAL_C_INCLUDES := $(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ/usr/include
 LOCAL_ADDITIONAL_DEPENDENCIES := $(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ/usr
 LOCAL_CFLAGS := -pthread -std=c99
 LOCAL_ARM_MODE := arm
+LOCAL_ARM_NEON := true
 LOCAL_SHARED_LIBRARIES := liblog
 LOCAL_MODULE := libgemini
 LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    GeminiSession.cpp \
+
+LOCAL_C_INCLUDES := $(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ/usr/include
+LOCAL_ADDITIONAL_DEPENDENCIES := $(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ/usr
+LOCAL_CPPFLAGS := -std=c++17
+LOCAL_ARM_MODE := arm
+LOCAL_SHARED_LIBRARIES := libgemini liblog
+LOCAL_MODULE := libgemini_async
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    gemini_bench.c \
+    gemini_sim.c \
+
+LOCAL_C_INCLUDES := $(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ/usr/include
+LOCAL_ADDITIONAL_DEPENDENCIES := $(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ/usr
+LOCAL_CFLAGS := -pthread -std=c99
+LOCAL_ARM_MODE := arm
+LOCAL_SHARED_LIBRARIES := libgemini
+LOCAL_MODULE := gemini_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
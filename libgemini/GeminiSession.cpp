@@ -0,0 +1,416 @@
+/* MSM gemini (JPEG hardware encoder) userspace library
+ * Copyright (C) 2018 DafabHoid
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#define LOG_TAG "gemini"
+#include "GeminiSession.h"
+#include <cerrno>
+#include <chrono>
+#include <new>
+#include <media/msm_gemini.h>
+#include <log/log.h>
+
+namespace android
+{
+
+namespace
+{
+
+constexpr unsigned int kDefaultTimeoutMs = 2000;
+
+/* Shared states of the promises. They are all the same size, so a free
+ * list of fixed slots serves them; bigger or surplus ones come from the
+ * heap. Process wide, so a future may outlive its session. */
+class StatePool
+{
+public:
+	static constexpr size_t kSlotSize = 512;
+	static constexpr unsigned int kSlots = 64;
+
+	void* allocate(size_t size)
+	{
+		if (size <= kSlotSize) {
+			std::lock_guard lock(mLock);
+			if (mFree) {
+				FreeSlot* slot = mFree;
+				mFree = slot->next;
+				return slot;
+			}
+			if (mUsed < kSlots)
+				return &mStorage[kSlotSize * mUsed++];
+		}
+		return ::operator new(size);
+	}
+
+	void deallocate(void* p)
+	{
+		const uintptr_t address = reinterpret_cast<uintptr_t>(p);
+		const uintptr_t start = reinterpret_cast<uintptr_t>(mStorage);
+		if (address >= start && address < start + sizeof(mStorage)) {
+			std::lock_guard lock(mLock);
+			FreeSlot* slot = static_cast<FreeSlot*>(p);
+			slot->next = mFree;
+			mFree = slot;
+			return;
+		}
+		::operator delete(p);
+	}
+
+private:
+	struct FreeSlot
+	{
+		FreeSlot* next;
+	};
+
+	alignas(std::max_align_t) unsigned char mStorage[kSlots * kSlotSize];
+	std::mutex mLock;
+	FreeSlot* mFree = nullptr;
+	unsigned int mUsed = 0;
+};
+
+StatePool& statePool()
+{
+	static StatePool pool;
+	return pool;
+}
+
+template<class T>
+struct StateAllocator
+{
+	using value_type = T;
+
+	StateAllocator() = default;
+	template<class U>
+	StateAllocator(const StateAllocator<U>&) {}
+
+	T* allocate(size_t n) { return static_cast<T*>(statePool().allocate(n * sizeof(T))); }
+	void deallocate(T* p, size_t) { statePool().deallocate(p); }
+};
+
+template<class T, class U>
+bool operator==(const StateAllocator<T>&, const StateAllocator<U>&) { return true; }
+template<class T, class U>
+bool operator!=(const StateAllocator<T>&, const StateAllocator<U>&) { return false; }
+
+size_t lumaSize(const gemini_input_cfg& in)
+{
+	return in.frame_width_mcus * 8 * gemini_lib_mcu_h_samp(in.inputFormat)
+		* in.frame_height_mcus * 8 * gemini_lib_mcu_v_samp(in.inputFormat);
+}
+
+size_t chromaSize(const gemini_input_cfg& in)
+{
+	return in.frame_width_mcus * 16 * in.frame_height_mcus * 8;
+}
+
+};
+
+GeminiBuffer::GeminiBuffer(size_t size)
+{
+	mData = do_mmap(size, &mFd);
+	mSize = mData ? size : 0;
+}
+
+GeminiBuffer::GeminiBuffer(GeminiBuffer&& other) noexcept
+	: mData(other.mData), mFd(other.mFd), mSize(other.mSize)
+{
+	other.mData = nullptr;
+	other.mFd = -1;
+	other.mSize = 0;
+}
+
+GeminiBuffer& GeminiBuffer::operator=(GeminiBuffer&& other) noexcept
+{
+	if (this != &other) {
+		reset();
+		mData = other.mData;
+		mFd = other.mFd;
+		mSize = other.mSize;
+		other.mData = nullptr;
+		other.mFd = -1;
+		other.mSize = 0;
+	}
+	return *this;
+}
+
+GeminiBuffer::~GeminiBuffer()
+{
+	reset();
+}
+
+void GeminiBuffer::reset()
+{
+	if (mData)
+		do_munmap(mFd, mData, mSize);
+	mData = nullptr;
+	mFd = -1;
+	mSize = 0;
+}
+
+std::unique_ptr<GeminiSession> GeminiSession::create(const GeminiConfig& config)
+{
+	std::unique_ptr<GeminiSession> session(new (std::nothrow) GeminiSession(config));
+	if (!session || !session->start())
+		return nullptr;
+	return session;
+}
+
+GeminiSession::GeminiSession(const GeminiConfig& config)
+	: mConfig(config)
+{
+	if (!mConfig.window)
+		mConfig.window = 1;
+	if (!mConfig.jobTimeoutMs)
+		mConfig.jobTimeoutMs = kDefaultTimeoutMs;
+}
+
+bool GeminiSession::start()
+{
+	mSlots.resize(mConfig.window);
+	int* fd;
+	if (gemini_lib_init(&fd, eventCallback, inputCallback, outputCallback) < 0)
+		return false;
+	mLib = gemini_lib_from_fd(fd);
+	gemini_lib_set_user_data(mLib, this);
+	gemini_lib_set_container(mLib, &mConfig.jfif);
+	if (configure() != 0) {
+		ALOGE("%s: configuration failed", __func__);
+		return false;
+	}
+	mWorker = std::thread(&GeminiSession::workerLoop, this);
+	return true;
+}
+
+GeminiSession::~GeminiSession()
+{
+	{
+		std::lock_guard lock(mLock);
+		mStop = true;
+		for (unsigned int i = 0; i < mCount; ++i)
+			mSlots[(mHead + i) % mSlots.size()].cancelled = true;
+		stopRunningJob();
+	}
+	mQueueCond.notify_all();
+	mSpaceCond.notify_all();
+	if (mWorker.joinable())
+		mWorker.join();
+	if (mLib)
+		gemini_lib_release(mLib);
+}
+
+int GeminiSession::configure()
+{
+	return gemini_lib_hw_config(mLib, &mConfig.inputCfg, mConfig.weCfgParams,
+								&mConfig.hwCfg, &mConfig.opCfg);
+}
+
+/** Queue job, waiting while the window is full. The future is ready with
+ * status -EINVAL right away if the buffers don't fit the configuration.
+ */
+std::future<EncodedImage> GeminiSession::submit(GeminiJob&& job)
+{
+	std::promise<EncodedImage> promise(std::allocator_arg, StateAllocator<EncodedImage>());
+	std::future<EncodedImage> result = promise.get_future();
+
+	const size_t inputSize = lumaSize(mConfig.inputCfg) + chromaSize(mConfig.inputCfg);
+	if (!job.input.valid() || job.input.size() < inputSize || !job.output.valid()) {
+		EncodedImage image;
+		image.status = -EINVAL;
+		image.tag = job.tag;
+		image.input = std::move(job.input);
+		image.output = std::move(job.output);
+		promise.set_value(std::move(image));
+		return result;
+	}
+
+	std::unique_lock lock(mLock);
+	mSpaceCond.wait(lock, [this] { return mStop || mCount + mRunning < mSlots.size(); });
+	Slot& slot = mSlots[(mHead + mCount) % mSlots.size()];
+	slot.job = std::move(job);
+	slot.promise = std::move(promise);
+	slot.cancelled = mStop;
+	mCount++;
+	lock.unlock();
+	mQueueCond.notify_one();
+	return result;
+}
+
+/* Abort the job in the hardware, if one is still running. Called with the
+ * lock held; gemini_lib_stop() doesn't wait for the worker threads. */
+bool GeminiSession::stopRunningJob()
+{
+	if (!mRunning || mJobCancelled || (mJobDone && mJobOutput))
+		return false;
+	mJobCancelled = true;
+	gemini_lib_stop(mLib, 1);
+	mJobCond.notify_all();
+	return true;
+}
+
+/** Cancel the job submitted with tag. A queued job is completed with
+ * -ECANCELED without reaching the hardware, a running one is stopped.
+ * @return false if the job is unknown or already finished.
+ */
+bool GeminiSession::cancel(uint64_t tag)
+{
+	std::lock_guard lock(mLock);
+	for (unsigned int i = 0; i < mCount; ++i) {
+		Slot& slot = mSlots[(mHead + i) % mSlots.size()];
+		if (slot.job.tag == tag && !slot.cancelled) {
+			slot.cancelled = true;
+			return true;
+		}
+	}
+	return mRunningTag == tag && stopRunningJob();
+}
+
+void GeminiSession::cancelAll()
+{
+	std::lock_guard lock(mLock);
+	for (unsigned int i = 0; i < mCount; ++i)
+		mSlots[(mHead + i) % mSlots.size()].cancelled = true;
+	stopRunningJob();
+}
+
+unsigned int GeminiSession::inFlight()
+{
+	std::lock_guard lock(mLock);
+	return mCount + mRunning;
+}
+
+void GeminiSession::workerLoop()
+{
+	std::unique_lock lock(mLock);
+	for (;;) {
+		mQueueCond.wait(lock, [this] { return mStop || mCount > 0; });
+		if (mCount == 0)
+			break;
+		Slot& slot = mSlots[mHead];
+		GeminiJob job = std::move(slot.job);
+		std::promise<EncodedImage> promise = std::move(slot.promise);
+		const bool cancelled = slot.cancelled;
+		mHead = (mHead + 1) % mSlots.size();
+		mCount--;
+
+		EncodedImage image;
+		image.tag = job.tag;
+		if (cancelled) {
+			image.status = -ECANCELED;
+		} else {
+			mRunning = true;
+			mRunningTag = job.tag;
+			mJobDone = mJobOutput = mJobError = mJobCancelled = false;
+			image.status = runJob(lock, job, image);
+			mRunning = false;
+		}
+		image.input = std::move(job.input);
+		image.output = std::move(job.output);
+		lock.unlock();
+		mSpaceCond.notify_one();
+		promise.set_value(std::move(image));
+		lock.lock();
+	}
+}
+
+int GeminiSession::runJob(std::unique_lock<std::mutex>& lock, GeminiJob& job, EncodedImage& image)
+{
+	const gemini_input_cfg& in = mConfig.inputCfg;
+	const size_t ySize = lumaSize(in);
+	struct msm_gemini_buf input = {};
+	input.fd = job.input.fd();
+	input.vaddr = job.input.data();
+	input.y_off = 0;
+	input.y_len = ySize;
+	input.cbcr_off = ySize;
+	input.cbcr_len = chromaSize(in);
+	input.num_of_mcu_rows = in.frame_height_mcus;
+	struct msm_gemini_buf output = {};
+	output.fd = job.output.fd();
+	output.vaddr = job.output.data();
+	output.y_off = 0;
+	output.y_len = job.output.size();
+
+	lock.unlock();
+	int ret = gemini_lib_output_buf_enq(mLib, &output);
+	if (ret == 0)
+		ret = gemini_lib_input_buf_enq(mLib, &input);
+	if (ret == 0)
+		ret = gemini_lib_encode(mLib);
+	lock.lock();
+
+	int status = 0;
+	if (ret != 0) {
+		status = -EIO;
+	} else {
+		const bool finished = mJobCond.wait_for(lock, std::chrono::milliseconds(mConfig.jobTimeoutMs), [this] {
+			return (mJobDone && mJobOutput) || mJobError || mJobCancelled;
+		});
+		if (mJobCancelled)
+			status = -ECANCELED;
+		else if (!finished)
+			status = -ETIMEDOUT;
+		else if (mJobError)
+			status = -EIO;
+	}
+	if (status != 0) {
+		const bool stopped = mJobCancelled;
+		lock.unlock();
+		if (!stopped)
+			gemini_lib_stop(mLib, 1);
+		if (configure() != 0)
+			ALOGE("%s: reconfiguration failed", __func__);
+		lock.lock();
+		return status;
+	}
+
+	lock.unlock();
+	image.iovcnt = gemini_lib_container_get_iov(mLib, image.iov, EncodedImage::kMaxIov);
+	lock.lock();
+	if (image.iovcnt <= 0)
+		return -EIO;
+	image.length = 0;
+	for (int i = 0; i < image.iovcnt; ++i)
+		image.length += image.iov[i].iov_len;
+	return 0;
+}
+
+void GeminiSession::eventCallback(struct gemini* lib, struct msm_gemini_ctrl_cmd* cmd)
+{
+	GeminiSession* session = static_cast<GeminiSession*>(gemini_lib_get_user_data(lib));
+	if (!session)
+		return;
+	std::lock_guard lock(session->mLock);
+	if (cmd->type == MSM_GEMINI_EVT_FRAMEDONE)
+		session->mJobDone = true;
+	else if (cmd->type == MSM_GEMINI_EVT_ERR)
+		session->mJobError = true;
+	session->mJobCond.notify_all();
+}
+
+void GeminiSession::inputCallback(struct gemini*, struct msm_gemini_buf*)
+{
+}
+
+void GeminiSession::outputCallback(struct gemini* lib, struct msm_gemini_buf*)
+{
+	GeminiSession* session = static_cast<GeminiSession*>(gemini_lib_get_user_data(lib));
+	if (!session)
+		return;
+	std::lock_guard lock(session->mLock);
+	session->mJobOutput = true;
+	session->mJobCond.notify_all();
+}
+
+};
@@ -0,0 +1,149 @@
+/* MSM gemini (JPEG hardware encoder) userspace library
+ * Copyright (C) 2018 DafabHoid
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "gemini.h"
+}
+
+struct msm_gemini_ctrl_cmd;
+struct msm_gemini_buf;
+
+namespace android
+{
+
+// Move-only handle of a pmem buffer the hardware can access
+class GeminiBuffer
+{
+public:
+	GeminiBuffer() = default;
+	explicit GeminiBuffer(size_t size);
+	GeminiBuffer(GeminiBuffer&& other) noexcept;
+	GeminiBuffer& operator=(GeminiBuffer&& other) noexcept;
+	GeminiBuffer(const GeminiBuffer&) = delete;
+	GeminiBuffer& operator=(const GeminiBuffer&) = delete;
+	~GeminiBuffer();
+
+	bool valid() const { return mData != nullptr; }
+	uint8_t* data() const { return static_cast<uint8_t*>(mData); }
+	int fd() const { return mFd; }
+	size_t size() const { return mSize; }
+
+private:
+	void reset();
+
+	void* mData = nullptr;
+	int mFd = -1;
+	size_t mSize = 0;
+};
+
+struct GeminiConfig
+{
+	// passed to gemini_lib_hw_config(), the tables must stay valid
+	gemini_input_cfg inputCfg;
+	uint8_t weCfgParams[2];
+	gemini_hw_cfg hwCfg;
+	gemini_op_cfg opCfg;
+	gemini_jfif_cfg jfif; // header of every image
+	unsigned int window; // jobs queued or running, submit() blocks beyond
+	unsigned int jobTimeoutMs; // 0 for 2 s
+};
+
+struct GeminiJob
+{
+	GeminiBuffer input; // Y plane followed by the CrCb plane of the configured frame
+	GeminiBuffer output;
+	uint64_t tag; // for cancel()
+};
+
+struct EncodedImage
+{
+	static constexpr int kMaxIov = 18;
+
+	int status = 0; // 0, -ECANCELED, -ETIMEDOUT, -EINVAL or -EIO
+	uint64_t tag = 0;
+	GeminiBuffer input; // handed back for the next job
+	GeminiBuffer output;
+	struct iovec iov[kMaxIov]; // the JPEG file, pointing into output
+	int iovcnt = 0;
+	size_t length = 0;
+};
+
+/* Encoding session over one libgemini instance, which runs the jobs one
+ * after the other in its own thread. Buffers and promise states are
+ * recycled, so a steady stream of jobs doesn't allocate. Futures should not
+ * be kept much longer than the window, their states come from a small
+ * fixed pool first. */
+class GeminiSession
+{
+public:
+	static std::unique_ptr<GeminiSession> create(const GeminiConfig& config);
+	~GeminiSession();
+	GeminiSession(const GeminiSession&) = delete;
+	GeminiSession& operator=(const GeminiSession&) = delete;
+
+	std::future<EncodedImage> submit(GeminiJob&& job);
+	bool cancel(uint64_t tag);
+	void cancelAll();
+	unsigned int inFlight();
+
+private:
+	struct Slot
+	{
+		GeminiJob job;
+		std::promise<EncodedImage> promise;
+		bool cancelled = false;
+	};
+
+	explicit GeminiSession(const GeminiConfig& config);
+	bool start();
+	void workerLoop();
+	int runJob(std::unique_lock<std::mutex>& lock, GeminiJob& job, EncodedImage& image);
+	bool stopRunningJob();
+	int configure();
+
+	static void eventCallback(struct gemini* lib, struct msm_gemini_ctrl_cmd* cmd);
+	static void inputCallback(struct gemini* lib, struct msm_gemini_buf* buf);
+	static void outputCallback(struct gemini* lib, struct msm_gemini_buf* buf);
+
+	GeminiConfig mConfig;
+	struct gemini* mLib = nullptr;
+	std::mutex mLock;
+	std::condition_variable mQueueCond;
+	std::condition_variable mSpaceCond;
+	std::condition_variable mJobCond;
+	std::vector<Slot> mSlots;
+	unsigned int mHead = 0;
+	unsigned int mCount = 0;
+	bool mStop = false;
+	bool mRunning = false;
+	uint64_t mRunningTag = 0;
+	bool mJobDone = false;
+	bool mJobOutput = false;
+	bool mJobError = false;
+	bool mJobCancelled = false;
+	std::thread mWorker;
+};
+
+};
@@ -23,13 +23,47 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <media/msm_gemini.h> // Kernel header
+#include <linux/android_pmem.h> // Kernel header
 #include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
 
 #define LOGD(message, ...) \
 	ALOGE("%s:%d] " message, __func__, __LINE__, ##__VA_ARGS__)
 
 #define GEMINI_DEVICE "/dev/gemini0"
 
+/* Replacement for the kernel device, see gemini_lib_set_device_ops() */
+static const struct gemini_device_ops *g_deviceOps;
+
+/** Talk to something else than GEMINI_DEVICE, like a simulated device, or
+ * go back to it with NULL. Must not be changed while a session is open
+ * (including a parked warm session).
+ */
+void gemini_lib_set_device_ops(const struct gemini_device_ops *ops)
+{
+	__atomic_store_n(&g_deviceOps, ops, __ATOMIC_RELEASE);
+}
+
+static int deviceOpen(void)
+{
+	const struct gemini_device_ops *ops = __atomic_load_n(&g_deviceOps, __ATOMIC_ACQUIRE);
+	return ops ? ops->open(ops->ctx) : open(GEMINI_DEVICE, O_RDWR);
+}
+
+static int deviceClose(int fd)
+{
+	const struct gemini_device_ops *ops = __atomic_load_n(&g_deviceOps, __ATOMIC_ACQUIRE);
+	return ops ? ops->close(ops->ctx, fd) : close(fd);
+}
+
+static int deviceIoctl(int fd, unsigned long request, void *arg)
+{
+	const struct gemini_device_ops *ops = __atomic_load_n(&g_deviceOps, __ATOMIC_ACQUIRE);
+	return ops ? ops->ioctl(ops->ctx, fd, request, arg) : ioctl(fd, request, arg);
+}
+
 struct workerThread
 {
 	pthread_t tid;
@@ -39,6 +73,160 @@ struct workerThread
 	bool isReady;
 };
 
+struct jobWatchdog
+{
+	pthread_t tid;
+	bool started;
+	bool shouldStop;
+	bool jobActive;
+	unsigned int timeoutMs;
+	uint64_t deadlineUs;
+	unsigned int errorsPending; // aborted jobs, reported by the event thread
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+/* Deep copy of the last configuration passed to gemini_lib_hw_config(), so it
+ * can be replayed after a soft reset without any help from the caller. */
+struct cachedConfig
+{
+	bool valid;
+	struct gemini_input_cfg inputCfg;
+	uint8_t weCfgParams[2];
+	struct gemini_hw_cfg hwCfg;
+	struct gemini_op_cfg opCfg;
+	uint8_t huffmanTables[4][16 + 256];
+	uint8_t quantTables[2][64];
+};
+
+#define MAX_CONTAINER_FRAGMENTS 16
+
+/* State of the JPEG container wrapped around the bitstream of the current
+ * job, see gemini_lib_set_container() */
+struct outputContainer
+{
+	bool enabled;
+	bool headerPending;
+	struct gemini_jfif_cfg cfg;
+	uint8_t *header;
+	size_t headerLength;
+	struct gemini_jfif_layout layout;
+	unsigned int fragmentCount;
+	struct iovec fragments[MAX_CONTAINER_FRAGMENTS];
+	size_t fragmentCapacity[MAX_CONTAINER_FRAGMENTS];
+	bool fragmentsLost; // the job had more than MAX_CONTAINER_FRAGMENTS
+	bool eoiWritten;
+	bool eoiInPlace;
+	pthread_mutex_t mutex;
+};
+
+/* Offsets of the RSTn markers in the bitstream of the current job, found by
+ * scanning the output fragments in the output thread. Protected by the
+ * container mutex. */
+struct restartIndex
+{
+	bool enabled;
+	uint32_t *offsets;
+	unsigned int capacity;
+	unsigned int count;
+	uint32_t streamOffset;
+	bool pendingFF;
+};
+
+/* State of the target size mode, see gemini_lib_set_target_size().
+ * Protected by the config mutex, jobBytes by the stats mutex. */
+struct rateControl
+{
+	struct gemini_ratectl model;
+	bool jobOpen; // quality of the current job is chosen
+	unsigned int jobQuality; // 0 before the first job
+	uint32_t jobPixels;
+	size_t jobBytes;
+};
+
+/* Tables of the Huffman optimisation, see gemini_lib_learn_huffman().
+ * Protected by the config mutex. */
+struct huffmanOptimizer
+{
+	bool enabled;
+	bool learned;
+	bool pending; // learned tables not yet in the hardware
+	bool inConfig; // the cached configuration has the learned tables
+	uint8_t tables[4][16 + 256];
+};
+
+// Repacked input buffers that can be in flight at the same time
+#define INPUT_REPACK_BUFFERS 3
+
+/* A repacked copy of a client input buffer, busy from the enqueue until the
+ * input thread gets it back. */
+struct repackSlot
+{
+	struct pmemBuffer buffer;
+	bool busy;
+	void *clientVaddr;
+	int clientFd;
+};
+
+/* See gemini_lib_set_input_layout(). The strides actually programmed into
+ * the fetch engine by the last configuration are kept next to the layout,
+ * to decide per buffer whether it can be fetched in place. */
+struct inputLayout
+{
+	bool enabled;
+	struct gemini_plane_layout layout;
+	unsigned int programmedYStride;
+	unsigned int programmedCbcrStride;
+	struct repackSlot repack[INPUT_REPACK_BUFFERS];
+};
+
+enum
+{
+	THUMBNAIL_IDLE,
+	THUMBNAIL_MAIN, // main image of gemini_lib_encode_with_thumbnail()
+	THUMBNAIL_ENCODE, // its thumbnail
+};
+
+/* State of gemini_lib_encode_with_thumbnail(). While it runs, events and
+ * buffers are consumed here instead of being passed to the callbacks. The
+ * phase only changes while no job is in flight. */
+struct thumbnailJob
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned int phase;
+	bool done;
+	bool error;
+	unsigned int outputs;
+	size_t outputBytes;
+	struct pmemBuffer input;
+	uint16_t *acc; // downscale accumulator rows, kept for the session
+	size_t accLength;
+};
+
+/* Single producer, single consumer ring of completions. Only the producer
+ * writes tail and only the consumer writes head, so neither side locks. */
+struct completionRing
+{
+	struct gemini_completion *items;
+	unsigned int mask;
+	unsigned int head;
+	unsigned int tail;
+};
+
+/* State of gemini_lib_init_eventfd(). Each worker thread produces into its
+ * own ring, indexed by GEMINI_COMPLETION_*. */
+struct completionQueue
+{
+	bool ready;
+	int eventFd;
+	struct completionRing rings[3];
+	// a worker finding its ring full waits on drained
+	pthread_mutex_t mutex;
+	pthread_cond_t drained;
+	unsigned int waiters;
+};
+
 struct gemini
 {
 	int deviceFd;
@@ -50,12 +238,71 @@ struct gemini
 	struct workerThread lib_output_thread;
 	unsigned char cmd_type;
 	int data1;
+	struct jobWatchdog watchdog;
+	pthread_mutex_t configMutex; // nests inside container.mutex, never around it
+	struct cachedConfig config;
+	pthread_mutex_t statsMutex;
+	struct gemini_lib_stats stats;
+	bool persistent;
+	bool parked;
+	struct outputContainer container;
+	struct restartIndex restartIndex;
+	struct inputLayout inputLayout;
+	struct gemini_bandpool *bandpool;
+	struct rateControl rateControl;
+	struct huffmanOptimizer huffman;
+	bool grayscale;
+	struct pmemBuffer neutralChroma; // see grayscaleChromaOffset()
+	uint32_t neutralChromaPhys;
+	void *userData;
+	struct thumbnailJob thumbnail;
+	struct completionQueue completions;
+};
+
+/* Process wide warm session, see gemini_lib_set_keepalive() */
+static struct
+{
+	pthread_once_t once;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct gemini *lib;
+	unsigned int refCount;
+	unsigned int idleTimeoutMs;
+	uint64_t idleSinceUs;
+	bool reaperRunning;
+} g_warmSession = {
+	.once = PTHREAD_ONCE_INIT,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
 };
 
 
 static void* gemini_lib_event_thread(void *arg);
 static void* gemini_lib_input_thread(void *arg);
 static void* gemini_lib_output_thread(void *arg);
+static void* gemini_lib_watchdog_thread(void *arg);
+static void disarmJobWatchdog(struct gemini *lib);
+static void huffmanJobStart(struct gemini *lib, bool program);
+static size_t huffmanTableLength(const uint8_t *table);
+static bool thumbnailJobEvent(struct gemini *lib, const struct msm_gemini_ctrl_cmd *cmd);
+static unsigned int thumbnailJobPhase(struct gemini *lib);
+static void thumbnailJobOutput(struct gemini *lib, const struct msm_gemini_buf *buf);
+static int setupCompletionQueue(struct completionQueue *q, unsigned int capacity);
+static void wakeCompletionWaiters(struct completionQueue *q);
+static void returnRepackedInput(struct gemini *lib, struct msm_gemini_buf *buf);
+static int gemini_lib_hw_apply_config(struct gemini *lib,
+						const struct gemini_input_cfg* inputCfg,
+						const uint8_t* hw_we_cfg_params,
+						const struct gemini_hw_cfg *pHwCfg,
+						const struct gemini_op_cfg *pOpCfg,
+						const struct gemini_plane_layout *layout);
+static const struct gemini_plane_layout* configuredLayout(struct gemini *lib);
+
+static uint64_t monotonicTimeUs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
 static __inline void initWorkerThread(struct workerThread* thread)
 {
@@ -64,7 +311,17 @@ static __inline void initWorkerThread(struct workerThread* thread)
 	thread->isReady = false;
 }
 
-int gemini_lib_init(int **fdOut,
+static __inline void initJobWatchdog(struct jobWatchdog* wd)
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&wd->mutex, NULL);
+	pthread_cond_init(&wd->cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+static int gemini_lib_create(int **fdOut,
 					eventThreadCallback_t eventThreadCallback,
 					inputThreadCallback_t inputThreadCallback,
 					outputThreadCallback_t outputThreadCallback)
@@ -76,7 +333,7 @@ int gemini_lib_init(int **fdOut,
 		return -1;
 	}
 	memset(libgemini, 0, sizeof(struct gemini));
-	int fd = open(GEMINI_DEVICE, O_RDWR);
+	int fd = deviceOpen();
 	ALOGE("open %s: fd = %d\n", GEMINI_DEVICE, fd);
 	if ( fd < 0 )
 	{
@@ -92,6 +349,14 @@ int gemini_lib_init(int **fdOut,
 	initWorkerThread(&libgemini->lib_event_thread);
 	initWorkerThread(&libgemini->lib_input_thread);
 	initWorkerThread(&libgemini->lib_output_thread);
+	initJobWatchdog(&libgemini->watchdog);
+	pthread_mutex_init(&libgemini->configMutex, NULL);
+	pthread_mutex_init(&libgemini->statsMutex, NULL);
+	pthread_mutex_init(&libgemini->container.mutex, NULL);
+	pthread_mutex_init(&libgemini->thumbnail.mutex, NULL);
+	pthread_cond_init(&libgemini->thumbnail.cond, NULL);
+	pthread_mutex_init(&libgemini->completions.mutex, NULL);
+	pthread_cond_init(&libgemini->completions.drained, NULL);
 	
 	pthread_mutex_t* mutexToCleanup;
 	if (eventThreadCallback)
@@ -208,152 +473,1713 @@ static __inline void destroyWorkerThread(struct workerThread* thread)
 	pthread_cond_destroy(&thread->cond);
 }
 
-void gemini_lib_release(struct gemini *lib)
+static void gemini_lib_destroy(struct gemini *lib)
 {
+	if ( lib->watchdog.started )
+	{
+		pthread_mutex_lock(&lib->watchdog.mutex);
+		lib->watchdog.shouldStop = 1;
+		pthread_cond_signal(&lib->watchdog.cond);
+		pthread_mutex_unlock(&lib->watchdog.mutex);
+		LOGD("pthread_join: watchdog_thread\n");
+		if ( pthread_join(lib->watchdog.tid, 0) )
+			LOGD("failed\n");
+	}
 	lib->lib_event_thread.shouldStop = 1;
 	lib->lib_input_thread.shouldStop = 1;
 	lib->lib_output_thread.shouldStop = 1;
+	wakeCompletionWaiters(&lib->completions);
 	if ( lib->eventThreadCallback )
 	{
-		ioctl(lib->deviceFd, MSM_GMN_IOCTL_EVT_GET_UNBLOCK);
+		deviceIoctl(lib->deviceFd, MSM_GMN_IOCTL_EVT_GET_UNBLOCK, NULL);
 		LOGD("pthread_join: event_thread\n");
 		if ( pthread_join(lib->lib_event_thread.tid, 0) )
 			LOGD("failed\n");
 	}
 	if ( lib->inputThreadCallback )
 	{
-		ioctl(lib->deviceFd, MSM_GMN_IOCTL_INPUT_GET_UNBLOCK);
+		deviceIoctl(lib->deviceFd, MSM_GMN_IOCTL_INPUT_GET_UNBLOCK, NULL);
 		LOGD("pthread_join: input_thread\n");
 		if ( pthread_join(lib->lib_input_thread.tid, 0) )
 			LOGD("failed\n");
 	}
 	if ( lib->outputThreadCallback )
 	{
-		ioctl(lib->deviceFd, MSM_GMN_IOCTL_OUTPUT_GET_UNBLOCK);
+		deviceIoctl(lib->deviceFd, MSM_GMN_IOCTL_OUTPUT_GET_UNBLOCK, NULL);
 		LOGD("pthread_join: output_thread\n");
 		if ( pthread_join(lib->lib_output_thread.tid, 0) )
 			LOGD("failed\n");
 	}
-	close(lib->deviceFd);
+	deviceClose(lib->deviceFd);
 	destroyWorkerThread(&lib->lib_event_thread);
 	destroyWorkerThread(&lib->lib_input_thread);
 	destroyWorkerThread(&lib->lib_output_thread);
+	pthread_mutex_destroy(&lib->watchdog.mutex);
+	pthread_cond_destroy(&lib->watchdog.cond);
+	pthread_mutex_destroy(&lib->configMutex);
+	pthread_mutex_destroy(&lib->statsMutex);
+	pthread_mutex_destroy(&lib->container.mutex);
+	pthread_mutex_destroy(&lib->thumbnail.mutex);
+	pthread_cond_destroy(&lib->thumbnail.cond);
+	pthread_mutex_destroy(&lib->completions.mutex);
+	pthread_cond_destroy(&lib->completions.drained);
+	free(lib->restartIndex.offsets);
+	for (unsigned int i = 0; i < INPUT_REPACK_BUFFERS; ++i)
+	{
+		struct pmemBuffer *repack = &lib->inputLayout.repack[i].buffer;
+		if (repack->vaddr)
+			do_munmap(repack->fd, repack->vaddr, repack->size);
+	}
+	if (lib->thumbnail.input.vaddr)
+		do_munmap(lib->thumbnail.input.fd, lib->thumbnail.input.vaddr, lib->thumbnail.input.size);
+	free(lib->thumbnail.acc);
+	if (lib->neutralChroma.vaddr)
+		do_munmap(lib->neutralChroma.fd, lib->neutralChroma.vaddr, lib->neutralChroma.size);
+	gemini_bandpool_destroy(lib->bandpool);
+	if (lib->completions.ready)
+	{
+		close(lib->completions.eventFd);
+		for (unsigned int i = 0; i < 3; ++i)
+			free(lib->completions.rings[i].items);
+	}
 	LOGD("closed\n");
 }
 
-int gemini_lib_stop(struct gemini *lib, int dontUnblock)
+static void destroySession(struct gemini *lib)
 {
-	int ret = 0;
-	struct msm_gemini_hw_cmds* hw_stop = gemini_lib_hw_stop(&lib->cmd_type, dontUnblock);
-	if (hw_stop)
+	gemini_lib_destroy(lib);
+	free(lib);
+}
+
+static void initWarmSession(void)
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&g_warmSession.cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+/* Must be called with g_warmSession.mutex held */
+static void destroyWarmSession(void)
+{
+	struct gemini *lib = g_warmSession.lib;
+	g_warmSession.lib = NULL;
+	LOGD("tearing down parked session\n");
+	destroySession(lib);
+}
+
+static void* gemini_lib_keepalive_thread(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&g_warmSession.mutex);
+	while ( g_warmSession.lib )
 	{
-		int deviceFd = lib->deviceFd;
-		LOGD("ioctl MSM_GMN_IOCTL_STOP\n");
-		ret = ioctl(deviceFd, MSM_GMN_IOCTL_STOP, hw_stop);
-		ALOGE("ioctl %s: rc = %d\n", GEMINI_DEVICE, ret);
-		if (!dontUnblock)
+		if ( g_warmSession.refCount > 0 )
 		{
-			ioctl(deviceFd, MSM_GMN_IOCTL_EVT_GET_UNBLOCK);
-			ioctl(deviceFd, MSM_GMN_IOCTL_INPUT_GET_UNBLOCK);
-			ioctl(deviceFd, MSM_GMN_IOCTL_OUTPUT_GET_UNBLOCK);
+			pthread_cond_wait(&g_warmSession.cond, &g_warmSession.mutex);
+			continue;
+		}
+		uint64_t deadlineUs = g_warmSession.idleSinceUs + g_warmSession.idleTimeoutMs * 1000ULL;
+		if ( g_warmSession.idleTimeoutMs && monotonicTimeUs() < deadlineUs )
+		{
+			struct timespec deadline = {
+				.tv_sec = deadlineUs / 1000000,
+				.tv_nsec = (deadlineUs % 1000000) * 1000,
+			};
+			pthread_cond_timedwait(&g_warmSession.cond, &g_warmSession.mutex, &deadline);
+			continue;
+		}
+		// Held across the teardown, so a concurrent gemini_lib_init() can't
+		// race us for the device node
+		destroyWarmSession();
+	}
+	g_warmSession.reaperRunning = false;
+	pthread_mutex_unlock(&g_warmSession.mutex);
+	return NULL;
+}
+
+int gemini_lib_set_keepalive(unsigned int idleTimeoutMs)
+{
+	pthread_once(&g_warmSession.once, initWarmSession);
+	pthread_mutex_lock(&g_warmSession.mutex);
+	g_warmSession.idleTimeoutMs = idleTimeoutMs;
+	if ( !idleTimeoutMs && g_warmSession.lib && g_warmSession.refCount == 0 )
+		destroyWarmSession();
+	pthread_cond_signal(&g_warmSession.cond);
+	pthread_mutex_unlock(&g_warmSession.mutex);
+	return 0;
+}
+
+static __inline bool sameThreadSet(const struct gemini *lib,
+					eventThreadCallback_t eventThreadCallback,
+					inputThreadCallback_t inputThreadCallback,
+					outputThreadCallback_t outputThreadCallback)
+{
+	return !lib->eventThreadCallback == !eventThreadCallback
+		&& !lib->inputThreadCallback == !inputThreadCallback
+		&& !lib->outputThreadCallback == !outputThreadCallback;
+}
+
+/* Hand out the parked session, or create it. The worker threads of a parked
+ * session stay blocked in their *_GET ioctls and drop anything they receive,
+ * so reacquiring it only means rebinding the callbacks, and resetting the
+ * completion queue of gemini_lib_init_eventfd() if queueCapacity is set.
+ * Must be called with g_warmSession.mutex held. */
+static int acquireWarmSession(int **fdOut,
+					eventThreadCallback_t eventThreadCallback,
+					inputThreadCallback_t inputThreadCallback,
+					outputThreadCallback_t outputThreadCallback,
+					unsigned int queueCapacity)
+{
+	struct gemini *lib = g_warmSession.lib;
+	if ( lib && g_warmSession.refCount > 0 )
+	{
+		if ( lib->eventThreadCallback != eventThreadCallback
+			|| lib->inputThreadCallback != inputThreadCallback
+			|| lib->outputThreadCallback != outputThreadCallback )
+		{
+			ALOGE("%s: session busy with other callbacks\n", __func__);
+			return -1;
+		}
+		g_warmSession.refCount++;
+		*fdOut = &lib->deviceFd;
+		return lib->deviceFd;
+	}
+	if ( lib && !sameThreadSet(lib, eventThreadCallback, inputThreadCallback, outputThreadCallback) )
+	{
+		destroyWarmSession();
+		lib = NULL;
+	}
+	if ( !lib )
+	{
+		int *fd;
+		if ( gemini_lib_create(&fd, eventThreadCallback, inputThreadCallback, outputThreadCallback) < 0 )
+			return -1;
+		lib = gemini_lib_from_fd(fd);
+		lib->persistent = true;
+		g_warmSession.lib = lib;
+		if ( !g_warmSession.reaperRunning )
+		{
+			pthread_t tid;
+			if ( pthread_create(&tid, NULL, gemini_lib_keepalive_thread, NULL) == 0 )
+			{
+				pthread_detach(tid);
+				g_warmSession.reaperRunning = true;
+			}
+			else
+			{
+				ALOGE("%s keepalive thread creation failed\n", __func__);
+			}
 		}
-		free(hw_stop);
+	}
+	else
+	{
+		lib->eventThreadCallback = eventThreadCallback;
+		lib->inputThreadCallback = inputThreadCallback;
+		lib->outputThreadCallback = outputThreadCallback;
+		lib->userData = NULL;
+		pthread_mutex_lock(&lib->statsMutex);
+		lib->stats.warmInits++;
+		pthread_mutex_unlock(&lib->statsMutex);
+		LOGD("reusing parked session\n");
+	}
+	// the workers must not produce into the rings before they are set up
+	if ( queueCapacity && setupCompletionQueue(&lib->completions, queueCapacity) != 0 )
+	{
+		__atomic_store_n(&lib->parked, true, __ATOMIC_RELEASE);
+		g_warmSession.idleSinceUs = monotonicTimeUs();
+		return -1;
+	}
+	__atomic_store_n(&lib->parked, false, __ATOMIC_RELEASE);
+	g_warmSession.refCount = 1;
+	*fdOut = &lib->deviceFd;
+	return lib->deviceFd;
+}
+
+static void parkWarmSession(struct gemini *lib)
+{
+	pthread_mutex_lock(&g_warmSession.mutex);
+	if ( g_warmSession.refCount > 0 && --g_warmSession.refCount == 0 )
+	{
+		// a job the last user left running must not complete into the next one
+		gemini_lib_stop(lib, 1);
+		__atomic_store_n(&lib->parked, true, __ATOMIC_RELEASE);
+		wakeCompletionWaiters(&lib->completions);
+		g_warmSession.idleSinceUs = monotonicTimeUs();
+		if ( !g_warmSession.idleTimeoutMs || !g_warmSession.reaperRunning )
+			destroyWarmSession();
+		else
+			pthread_cond_signal(&g_warmSession.cond);
+		LOGD("parked\n");
+	}
+	pthread_mutex_unlock(&g_warmSession.mutex);
+}
+
+static int initSession(int **fdOut,
+					eventThreadCallback_t eventThreadCallback,
+					inputThreadCallback_t inputThreadCallback,
+					outputThreadCallback_t outputThreadCallback,
+					unsigned int queueCapacity)
+{
+	pthread_once(&g_warmSession.once, initWarmSession);
+	pthread_mutex_lock(&g_warmSession.mutex);
+	if ( g_warmSession.idleTimeoutMs )
+	{
+		int ret = acquireWarmSession(fdOut, eventThreadCallback, inputThreadCallback, outputThreadCallback,
+				queueCapacity);
+		pthread_mutex_unlock(&g_warmSession.mutex);
+		return ret;
+	}
+	pthread_mutex_unlock(&g_warmSession.mutex);
+	int ret = gemini_lib_create(fdOut, eventThreadCallback, inputThreadCallback, outputThreadCallback);
+	// no job can have been started on a new session yet
+	if ( ret >= 0 && queueCapacity
+		&& setupCompletionQueue(&gemini_lib_from_fd(*fdOut)->completions, queueCapacity) != 0 )
+	{
+		destroySession(gemini_lib_from_fd(*fdOut));
+		*fdOut = NULL;
+		return -1;
 	}
 	return ret;
 }
 
-static void* gemini_lib_event_thread(void *arg)
+int gemini_lib_init(int **fdOut,
+					eventThreadCallback_t eventThreadCallback,
+					inputThreadCallback_t inputThreadCallback,
+					outputThreadCallback_t outputThreadCallback)
 {
-	struct gemini* lib = arg;
-	struct msm_gemini_ctrl_cmd gemin_ctrl_cmd;
-	struct workerThread* thread = &lib->lib_event_thread;
-	
-	LOGD("Enter threadid %lu\n",
-		thread->tid);
-	gemini_lib_send_thread_ready(lib, thread);
+	return initSession(fdOut, eventThreadCallback, inputThreadCallback, outputThreadCallback, 0);
+}
 
-	do
+struct gemini *gemini_lib_from_fd(int *fd)
+{
+	return (struct gemini *)((char *)fd - offsetof(struct gemini, deviceFd));
+}
+
+void gemini_lib_release(struct gemini *lib)
+{
+	if ( lib->persistent )
+		parkWarmSession(lib);
+	else
+		destroySession(lib);
+}
+
+static bool completionRingPush(struct completionRing *ring, const struct gemini_completion *c)
+{
+	const unsigned int tail = ring->tail;
+	if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask)
+		return false;
+	ring->items[tail & ring->mask] = *c;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static bool completionRingPop(struct completionRing *ring, struct gemini_completion *c)
+{
+	const unsigned int head = ring->head;
+	if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+		return false;
+	*c = ring->items[head & ring->mask];
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void signalCompletion(struct completionQueue *q)
+{
+	const uint64_t one = 1;
+	if (write(q->eventFd, &one, sizeof(one)) < 0)
+		LOGD("eventfd write failed: %s\n", strerror(errno));
+}
+
+static void wakeCompletionWaiters(struct completionQueue *q)
+{
+	pthread_mutex_lock(&q->mutex);
+	if (q->waiters)
+		pthread_cond_broadcast(&q->drained);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+/* Called from the worker thread that owns the ring. A full ring is waited
+ * out instead of dropping the completion, the application is expected to
+ * drain on every wakeup. gemini_lib_poll_completions() wakes us up, as do
+ * teardown and parking, which drop the completion. */
+static void postCompletion(struct gemini *lib, struct workerThread *thread, struct gemini_completion *c)
+{
+	struct completionQueue *q = &lib->completions;
+	struct completionRing *ring = &q->rings[c->kind];
+	c->timestampUs = monotonicTimeUs();
+	if (!completionRingPush(ring, c))
 	{
-		int ret = ioctl(lib->deviceFd, MSM_GMN_IOCTL_EVT_GET, &gemin_ctrl_cmd);
-		LOGD("MSM_GMN_IOCTL_EVT_GET rc = %d\n", ret);
-		if ( ret )
+		bool pushed;
+		pthread_mutex_lock(&q->mutex);
+		q->waiters++;
+		signalCompletion(q);
+		// retried under the mutex, so a drain in between can't be missed
+		while (!(pushed = completionRingPush(ring, c)) && !thread->shouldStop
+			&& !__atomic_load_n(&lib->parked, __ATOMIC_ACQUIRE))
+			pthread_cond_wait(&q->drained, &q->mutex);
+		q->waiters--;
+		pthread_mutex_unlock(&q->mutex);
+		if (!pushed)
+			return;
+		pthread_mutex_lock(&lib->statsMutex);
+		lib->stats.completionQueueFull++;
+		pthread_mutex_unlock(&lib->statsMutex);
+	}
+	signalCompletion(q);
+}
+
+static void postEventCompletion(struct gemini *lib, struct msm_gemini_ctrl_cmd *cmd)
+{
+	struct gemini_completion c = {
+		.kind = GEMINI_COMPLETION_EVENT,
+		.eventType = cmd->type,
+	};
+	postCompletion(lib, &lib->lib_event_thread, &c);
+}
+
+static void postInputCompletion(struct gemini *lib, struct msm_gemini_buf *buf)
+{
+	struct gemini_completion c = {
+		.kind = GEMINI_COMPLETION_INPUT,
+		.vaddr = buf->vaddr,
+		.fd = buf->fd,
+		.length = buf->y_len,
+	};
+	postCompletion(lib, &lib->lib_input_thread, &c);
+}
+
+static void postOutputCompletion(struct gemini *lib, struct msm_gemini_buf *buf)
+{
+	struct gemini_completion c = {
+		.kind = GEMINI_COMPLETION_OUTPUT,
+		.vaddr = buf->vaddr,
+		.fd = buf->fd,
+		.length = buf->framedone_len,
+	};
+	postCompletion(lib, &lib->lib_output_thread, &c);
+}
+
+static int setupCompletionQueue(struct completionQueue *q, unsigned int capacity)
+{
+	if (!q->ready)
+	{
+		q->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (q->eventFd < 0)
 		{
-			if ( !thread->shouldStop )
-				LOGD("fail\n");
+			ALOGE("%s: eventfd failed: %s\n", __func__, strerror(errno));
+			return -1;
+		}
+		q->ready = true;
+	}
+	for (unsigned int i = 0; i < 3; ++i)
+	{
+		struct completionRing *ring = &q->rings[i];
+		if (ring->mask + 1 != capacity || !ring->items)
+		{
+			struct gemini_completion *items = realloc(ring->items, capacity * sizeof(*items));
+			if (!items)
+				return -1;
+			ring->items = items;
+			ring->mask = capacity - 1;
+		}
+		ring->head = ring->tail = 0;
+	}
+	uint64_t value;
+	while (read(q->eventFd, &value, sizeof(value)) > 0)
+		;
+	return 0;
+}
+
+/** Like gemini_lib_init(), but instead of calling back from the worker
+ * threads, completions are queued and signalled through an eventfd, see
+ * gemini_lib_poll_completions().
+ * @param queueSize completions per kind that can be pending, rounded up to a
+ *        power of two of at least 16
+ * @param eventFdOut receives the non-blocking eventfd, owned by the library
+ *        and valid until gemini_lib_release()
+ */
+int gemini_lib_init_eventfd(int **fdOut, unsigned int queueSize, int *eventFdOut)
+{
+	unsigned int capacity = 16;
+	while (capacity < queueSize)
+		capacity <<= 1;
+	int ret = initSession(fdOut, postEventCompletion, postInputCompletion, postOutputCompletion, capacity);
+	if (ret < 0)
+		return ret;
+	*eventFdOut = gemini_lib_from_fd(*fdOut)->completions.eventFd;
+	return ret;
+}
+
+/** Take up to maxCount queued completions, to be called whenever the eventfd
+ * of gemini_lib_init_eventfd() is readable. Output buffers are returned
+ * before input buffers and events, so the output of a job normally precedes
+ * its MSM_GEMINI_EVT_FRAMEDONE. If completions are left over, the eventfd
+ * stays readable.
+ * @return number of completions stored, -1 if the session has no eventfd
+ */
+int gemini_lib_poll_completions(struct gemini *lib, struct gemini_completion *completions,
+								unsigned int maxCount)
+{
+	static const unsigned int order[3] = {
+		GEMINI_COMPLETION_OUTPUT, GEMINI_COMPLETION_INPUT, GEMINI_COMPLETION_EVENT,
+	};
+	struct completionQueue *q = &lib->completions;
+	if (!q->ready)
+		return -1;
+	uint64_t value;
+	if (read(q->eventFd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+		return -1;
+
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < 3; ++i)
+	{
+		while (n < maxCount && completionRingPop(&q->rings[order[i]], &completions[n]))
+			++n;
+	}
+	if (n > 0)
+		wakeCompletionWaiters(q);
+	bool leftOver = false;
+	for (unsigned int i = 0; i < 3 && !leftOver; ++i)
+		leftOver = q->rings[i].head != __atomic_load_n(&q->rings[i].tail, __ATOMIC_ACQUIRE);
+	if (leftOver)
+		signalCompletion(q);
+	return n;
+}
+
+static void armJobWatchdog(struct gemini *lib)
+{
+	struct jobWatchdog *wd = &lib->watchdog;
+	pthread_mutex_lock(&wd->mutex);
+	if (wd->timeoutMs)
+	{
+		wd->deadlineUs = monotonicTimeUs() + wd->timeoutMs * 1000ULL;
+		wd->jobActive = true;
+		pthread_cond_signal(&wd->cond);
+	}
+	pthread_mutex_unlock(&wd->mutex);
+}
+
+static void disarmJobWatchdog(struct gemini *lib)
+{
+	struct jobWatchdog *wd = &lib->watchdog;
+	pthread_mutex_lock(&wd->mutex);
+	wd->jobActive = false;
+	pthread_mutex_unlock(&wd->mutex);
+}
+
+void gemini_lib_set_user_data(struct gemini *lib, void *userData)
+{
+	lib->userData = userData;
+}
+
+/** Pointer set with gemini_lib_set_user_data(), for the thread callbacks.
+ */
+void* gemini_lib_get_user_data(struct gemini *lib)
+{
+	return lib->userData;
+}
+
+int gemini_lib_set_job_timeout(struct gemini *lib, unsigned int timeoutMs)
+{
+	struct jobWatchdog *wd = &lib->watchdog;
+	int ret = 0;
+	pthread_mutex_lock(&wd->mutex);
+	wd->timeoutMs = timeoutMs;
+	if (!timeoutMs)
+	{
+		wd->jobActive = false;
+	}
+	else if (!wd->started)
+	{
+		if (pthread_create(&wd->tid, NULL, gemini_lib_watchdog_thread, lib) != 0)
+		{
+			ALOGE("%s watchdog thread creation failed\n", __func__);
+			wd->timeoutMs = 0;
+			ret = -1;
 		}
 		else
 		{
-			lib->eventThreadCallback(lib, &gemin_ctrl_cmd);
+			wd->started = true;
+		}
+	}
+	pthread_mutex_unlock(&wd->mutex);
+	return ret;
+}
+
+void gemini_lib_get_stats(struct gemini *lib, struct gemini_lib_stats *stats)
+{
+	pthread_mutex_lock(&lib->statsMutex);
+	memcpy(stats, &lib->stats, sizeof(*stats));
+	pthread_mutex_unlock(&lib->statsMutex);
+}
+
+/* Bring a hung device back into a usable state without tearing down the
+ * session: stop the core, kick the worker threads out of their blocking
+ * *_GET ioctls (they loop right back in), then reset and replay the cached
+ * configuration. The caller learns about the aborted job through an
+ * MSM_GEMINI_EVT_ERR event; it is only counted here and the event thread is
+ * kicked out of MSM_GMN_IOCTL_EVT_GET to deliver it, so the event callback
+ * never runs on two threads at once. */
+static void gemini_lib_recover(struct gemini *lib)
+{
+	uint64_t start = monotonicTimeUs();
+	int ret = -1;
+	
+	ALOGE("%s: job exceeded %u ms, resetting\n", __func__, lib->watchdog.timeoutMs);
+	gemini_lib_stop(lib, 0);
+	
+	pthread_mutex_lock(&lib->configMutex);
+	if (lib->config.valid)
+	{
+		ret = gemini_lib_hw_apply_config(lib,
+				&lib->config.inputCfg,
+				lib->config.weCfgParams,
+				&lib->config.hwCfg,
+				&lib->config.opCfg,
+				configuredLayout(lib));
+	}
+	pthread_mutex_unlock(&lib->configMutex);
+	
+	uint64_t elapsed = monotonicTimeUs() - start;
+	pthread_mutex_lock(&lib->statsMutex);
+	lib->stats.timeouts++;
+	if (ret == 0)
+		lib->stats.recoveries++;
+	else
+		lib->stats.failedRecoveries++;
+	lib->stats.lastRecoveryUs = elapsed;
+	lib->stats.totalRecoveryUs += elapsed;
+	if (elapsed > lib->stats.maxRecoveryUs)
+		lib->stats.maxRecoveryUs = elapsed;
+	pthread_mutex_unlock(&lib->statsMutex);
+	ALOGE("%s: recovery %s after %llu us\n", __func__,
+		ret == 0 ? "done" : "failed", (unsigned long long)elapsed);
+	
+	if (lib->eventThreadCallback)
+	{
+		__atomic_add_fetch(&lib->watchdog.errorsPending, 1, __ATOMIC_RELEASE);
+		deviceIoctl(lib->deviceFd, MSM_GMN_IOCTL_EVT_GET_UNBLOCK, NULL);
+	}
+}
+
+static void* gemini_lib_watchdog_thread(void *arg)
+{
+	struct gemini *lib = arg;
+	struct jobWatchdog *wd = &lib->watchdog;
+	
+	LOGD("Enter\n");
+	pthread_mutex_lock(&wd->mutex);
+	while ( !wd->shouldStop )
+	{
+		if ( !wd->jobActive )
+		{
+			pthread_cond_wait(&wd->cond, &wd->mutex);
+			continue;
+		}
+		if ( monotonicTimeUs() < wd->deadlineUs )
+		{
+			struct timespec deadline = {
+				.tv_sec = wd->deadlineUs / 1000000,
+				.tv_nsec = (wd->deadlineUs % 1000000) * 1000,
+			};
+			pthread_cond_timedwait(&wd->cond, &wd->mutex, &deadline);
+			continue;
+		}
+		wd->jobActive = false;
+		pthread_mutex_unlock(&wd->mutex);
+		gemini_lib_recover(lib);
+		pthread_mutex_lock(&wd->mutex);
+	}
+	pthread_mutex_unlock(&wd->mutex);
+	LOGD("Exit\n");
+	return NULL;
+}
+
+static void containerJobEnded(struct gemini *lib)
+{
+	pthread_mutex_lock(&lib->container.mutex);
+	lib->container.headerPending = true;
+	pthread_mutex_unlock(&lib->container.mutex);
+	pthread_mutex_lock(&lib->configMutex);
+	lib->rateControl.jobOpen = false;
+	pthread_mutex_unlock(&lib->configMutex);
+}
+
+int gemini_lib_stop(struct gemini *lib, int dontUnblock)
+{
+	int ret = 0;
+	disarmJobWatchdog(lib);
+	containerJobEnded(lib);
+	struct msm_gemini_hw_cmds* hw_stop = gemini_lib_hw_stop(&lib->cmd_type, dontUnblock);
+	if (hw_stop)
+	{
+		int deviceFd = lib->deviceFd;
+		LOGD("ioctl MSM_GMN_IOCTL_STOP\n");
+		ret = deviceIoctl(deviceFd, MSM_GMN_IOCTL_STOP, hw_stop);
+		ALOGE("ioctl %s: rc = %d\n", GEMINI_DEVICE, ret);
+		if (!dontUnblock)
+		{
+			deviceIoctl(deviceFd, MSM_GMN_IOCTL_EVT_GET_UNBLOCK, NULL);
+			deviceIoctl(deviceFd, MSM_GMN_IOCTL_INPUT_GET_UNBLOCK, NULL);
+			deviceIoctl(deviceFd, MSM_GMN_IOCTL_OUTPUT_GET_UNBLOCK, NULL);
+		}
+		free(hw_stop);
+	}
+	return ret;
+}
+
+static void deliverEvent(struct gemini *lib, struct msm_gemini_ctrl_cmd *cmd)
+{
+	if ( !thumbnailJobEvent(lib, cmd)
+		&& !__atomic_load_n(&lib->parked, __ATOMIC_ACQUIRE) )
+		lib->eventThreadCallback(lib, cmd);
+}
+
+static void* gemini_lib_event_thread(void *arg)
+{
+	struct gemini* lib = arg;
+	struct msm_gemini_ctrl_cmd gemin_ctrl_cmd;
+	struct workerThread* thread = &lib->lib_event_thread;
+	
+	LOGD("Enter threadid %lu\n",
+		thread->tid);
+	gemini_lib_send_thread_ready(lib, thread);
+
+	do
+	{
+		int ret = deviceIoctl(lib->deviceFd, MSM_GMN_IOCTL_EVT_GET, &gemin_ctrl_cmd);
+		LOGD("MSM_GMN_IOCTL_EVT_GET rc = %d\n", ret);
+		if ( ret )
+		{
+			if ( !thread->shouldStop )
+				LOGD("fail\n");
+		}
+		else
+		{
+			if ( gemin_ctrl_cmd.type != MSM_GEMINI_EVT_RESET )
+			{
+				disarmJobWatchdog(lib);
+				containerJobEnded(lib);
+			}
+			deliverEvent(lib, &gemin_ctrl_cmd);
+		}
+		// jobs aborted by gemini_lib_recover()
+		while ( __atomic_load_n(&lib->watchdog.errorsPending, __ATOMIC_ACQUIRE) > 0 )
+		{
+			struct msm_gemini_ctrl_cmd errorEvent = {
+				.type = MSM_GEMINI_EVT_ERR,
+				.len = 0,
+				.value = NULL,
+			};
+			__atomic_sub_fetch(&lib->watchdog.errorsPending, 1, __ATOMIC_ACQ_REL);
+			deliverEvent(lib, &errorEvent);
+		}
+		gemini_lib_send_thread_ready(lib, thread);
+	}
+	while ( !thread->shouldStop );
+	
+	LOGD("Exit\n");
+	return NULL;
+}
+
+static void* gemini_lib_input_thread(void *arg)
+{
+	struct gemini *lib = arg;
+	struct msm_gemini_buf gemini_buf;
+	struct workerThread* thread = &lib->lib_input_thread;
+	
+	LOGD("Enter threadid %lu\n", thread->tid);
+	
+	gemini_lib_send_thread_ready(lib, thread);
+	do
+	{
+		int ret = deviceIoctl(lib->deviceFd, MSM_GMN_IOCTL_INPUT_GET, &gemini_buf);
+		LOGD("MSM_GMN_IOCTL_INPUT_GET rc = %d\n", ret);
+		if ( ret )
+		{
+			if ( !thread->shouldStop )
+				LOGD("fail\n");
+		}
+		else
+		{
+			returnRepackedInput(lib, &gemini_buf);
+			if ( thumbnailJobPhase(lib) == THUMBNAIL_IDLE
+				&& !__atomic_load_n(&lib->parked, __ATOMIC_ACQUIRE) )
+				lib->inputThreadCallback(lib, &gemini_buf);
+		}
+		gemini_lib_send_thread_ready(lib, thread);
+	}
+	while ( !thread->shouldStop );
+	
+	LOGD("Exit\n");
+	return NULL;
+}
+
+static __inline void addRestartMarker(struct restartIndex *idx, uint32_t offset)
+{
+	if (idx->count < idx->capacity)
+		idx->offsets[idx->count] = offset;
+	idx->count++;
+}
+
+/* Entropy coded data only contains 0xFF as FF00 (stuffing) or FFDx (RSTn),
+ * so a memchr() for 0xFF is enough to find the markers. A marker can be split
+ * between two fragments. */
+static void scanRestartMarkers(struct restartIndex *idx, const uint8_t *data, size_t length)
+{
+	size_t pos = 0;
+	if (idx->pendingFF && length > 0)
+	{
+		if (data[0] >= 0xD0 && data[0] <= 0xD7)
+			addRestartMarker(idx, idx->streamOffset - 1);
+		pos = 1;
+	}
+	idx->pendingFF = false;
+	while (pos < length)
+	{
+		const uint8_t *ff = memchr(data + pos, 0xFF, length - pos);
+		if (!ff)
+			break;
+		pos = ff - data;
+		if (pos + 1 == length)
+		{
+			idx->pendingFF = true;
+			break;
+		}
+		if (data[pos + 1] >= 0xD0 && data[pos + 1] <= 0xD7)
+			addRestartMarker(idx, idx->streamOffset + pos);
+		pos += 2;
+	}
+	idx->streamOffset += length;
+}
+
+int gemini_lib_set_restart_index(struct gemini *lib, bool enable)
+{
+	pthread_mutex_lock(&lib->container.mutex);
+	lib->restartIndex.enabled = enable;
+	lib->restartIndex.count = 0;
+	lib->restartIndex.streamOffset = 0;
+	lib->restartIndex.pendingFF = false;
+	pthread_mutex_unlock(&lib->container.mutex);
+	return 0;
+}
+
+/** Get the byte offsets of the RSTn markers of the last job, relative to SOI
+ * if a container is written, or to the start of the bitstream otherwise.
+ * @return The number of markers found, which may be larger than maxCount.
+ */
+int gemini_lib_get_restart_index(struct gemini *lib, uint32_t *offsets, unsigned int maxCount)
+{
+	struct restartIndex *idx = &lib->restartIndex;
+	pthread_mutex_lock(&lib->container.mutex);
+	uint32_t base = lib->container.header ? lib->container.headerLength : 0;
+	unsigned int count = idx->count < idx->capacity ? idx->count : idx->capacity;
+	if (count > maxCount)
+		count = maxCount;
+	for (unsigned int i = 0; i < count; ++i)
+		offsets[i] = base + idx->offsets[i];
+	int ret = idx->enabled ? (int)idx->count : -1;
+	pthread_mutex_unlock(&lib->container.mutex);
+	return ret;
+}
+
+static void resetRestartIndex(struct gemini *lib)
+{
+	pthread_mutex_lock(&lib->container.mutex);
+	lib->restartIndex.count = 0;
+	lib->restartIndex.streamOffset = 0;
+	lib->restartIndex.pendingFF = false;
+	pthread_mutex_unlock(&lib->container.mutex);
+}
+
+static void sizeRestartIndex(struct gemini *lib, const struct gemini_input_cfg *inputCfg, uint16_t restartInterval)
+{
+	struct restartIndex *idx = &lib->restartIndex;
+	unsigned int needed = gemini_lib_restart_marker_count(inputCfg, restartInterval);
+	pthread_mutex_lock(&lib->container.mutex);
+	if (needed > idx->capacity)
+	{
+		uint32_t *offsets = realloc(idx->offsets, needed * sizeof(*offsets));
+		if (offsets)
+		{
+			idx->offsets = offsets;
+			idx->capacity = needed;
+		}
+	}
+	pthread_mutex_unlock(&lib->container.mutex);
+}
+
+static void recordOutputFragment(struct gemini *lib, const struct msm_gemini_buf *buf)
+{
+	struct outputContainer *c = &lib->container;
+	pthread_mutex_lock(&c->mutex);
+	if ( lib->restartIndex.enabled )
+		scanRestartMarkers(&lib->restartIndex, buf->vaddr, buf->framedone_len);
+	if ( c->header )
+	{
+		if ( c->fragmentCount < MAX_CONTAINER_FRAGMENTS )
+		{
+			c->fragments[c->fragmentCount].iov_base = buf->vaddr;
+			c->fragments[c->fragmentCount].iov_len = buf->framedone_len;
+			c->fragmentCapacity[c->fragmentCount] = buf->y_len;
+			c->fragmentCount++;
+		}
+		else if ( !c->fragmentsLost )
+		{
+			ALOGE("%s: too many output fragments\n", __func__);
+			c->fragmentsLost = true;
+		}
+	}
+	pthread_mutex_unlock(&c->mutex);
+}
+
+static void* gemini_lib_output_thread(void *arg)
+{
+	struct gemini *lib = arg;
+	struct msm_gemini_buf gemini_buf;
+	struct workerThread* thread = &lib->lib_output_thread;
+	
+	LOGD("Enter threadid %lu\n", thread->tid);
+	
+	gemini_lib_send_thread_ready(lib, thread);
+	do
+	{
+		int ret = deviceIoctl(lib->deviceFd, MSM_GMN_IOCTL_OUTPUT_GET, &gemini_buf);
+		LOGD("MSM_GMN_IOCTL_OUTPUT_GET rc = %d\n", ret);
+		if ( ret )
+		{
+			if ( !thread->shouldStop )
+				LOGD("fail\n");
+		}
+		else
+		{
+			const unsigned int phase = thumbnailJobPhase(lib);
+			if ( phase != THUMBNAIL_ENCODE )
+			{
+				recordOutputFragment(lib, &gemini_buf);
+				pthread_mutex_lock(&lib->statsMutex);
+				lib->rateControl.jobBytes += gemini_buf.framedone_len;
+				pthread_mutex_unlock(&lib->statsMutex);
+			}
+			if ( phase != THUMBNAIL_IDLE )
+				thumbnailJobOutput(lib, &gemini_buf);
+			else if ( !__atomic_load_n(&lib->parked, __ATOMIC_ACQUIRE) )
+				lib->outputThreadCallback(lib, &gemini_buf);
+		}
+		gemini_lib_send_thread_ready(lib, thread);
+	}
+	while ( !thread->shouldStop );
+	
+	LOGD("Exit\n");
+	return NULL;
+}
+
+// Conservative guess for the address alignment the fetch engine needs
+#define FE_ADDRESS_ALIGNMENT 8
+
+/** Describe where the encoded area lies in the buffers given to
+ * gemini_lib_input_buf_enq() from now on, or go back to tightly packed planes
+ * with NULL. Padded strides are programmed into the fetch engine by the next
+ * gemini_lib_hw_config() where the operation mode allows it; buffers that
+ * still can't be fetched in place are repacked into an internal pmem buffer.
+ * Up to INPUT_REPACK_BUFFERS repacked buffers may be in flight; the input
+ * thread callback sees the client's buffer again once the device returns it.
+ */
+int gemini_lib_set_input_layout(struct gemini *lib, const struct gemini_plane_layout *layout)
+{
+	pthread_mutex_lock(&lib->configMutex);
+	lib->inputLayout.enabled = layout != NULL;
+	if (layout)
+		lib->inputLayout.layout = *layout;
+	pthread_mutex_unlock(&lib->configMutex);
+	return 0;
+}
+
+/* Offsets of the top left corner of the encoded area in the two planes. The
+ * interleaved CbCr plane has one byte pair per hSamp luma pixels. */
+static uint32_t yCropOffset(const struct gemini_plane_layout *l)
+{
+	return l->yOffset + l->cropY * l->yStride + l->cropX;
+}
+
+static uint32_t cbcrCropOffset(const struct gemini_plane_layout *l, unsigned int hSamp, unsigned int vSamp)
+{
+	return l->cbcrOffset + (l->cropY / vSamp) * l->cbcrStride + (l->cropX / hSamp) * 2;
+}
+
+/* Called with the config mutex held */
+static const struct gemini_plane_layout* configuredLayout(struct gemini *lib)
+{
+	return lib->inputLayout.enabled ? &lib->inputLayout.layout : NULL;
+}
+
+static bool fetchStridesProgrammable(const struct gemini_op_cfg *opCfg)
+{
+	return opCfg->op_mode == MSM_GEMINI_MODE_REALTIME_ENCODE && opCfg->value == 0;
+}
+
+static int ensurePmemBuffer(struct pmemBuffer *buffer, size_t size)
+{
+	if (buffer->vaddr && buffer->size >= size)
+		return 0;
+	if (buffer->vaddr)
+		do_munmap(buffer->fd, buffer->vaddr, buffer->size);
+	buffer->vaddr = do_mmap(size, &buffer->fd);
+	buffer->size = buffer->vaddr ? size : 0;
+	return buffer->vaddr ? 0 : -1;
+}
+
+static void copyPlane(uint8_t *dest, const uint8_t *src, size_t rowBytes, unsigned int rows, size_t stride)
+{
+	// memcpy() is the NEON optimized copy of the C library
+	for (unsigned int i = 0; i < rows; ++i)
+	{
+		memcpy(dest, src, rowBytes);
+		dest += rowBytes;
+		src += stride;
+	}
+}
+
+static void releaseRepackSlot(struct gemini *lib, struct repackSlot *slot)
+{
+	pthread_mutex_lock(&lib->configMutex);
+	slot->busy = false;
+	pthread_mutex_unlock(&lib->configMutex);
+}
+
+/* Give an input buffer the device returned back its client identity if it
+ * was a repacked copy, and make the copy available again. */
+static void returnRepackedInput(struct gemini *lib, struct msm_gemini_buf *buf)
+{
+	struct inputLayout *in = &lib->inputLayout;
+	pthread_mutex_lock(&lib->configMutex);
+	for (unsigned int i = 0; i < INPUT_REPACK_BUFFERS; ++i)
+	{
+		struct repackSlot *slot = &in->repack[i];
+		if (slot->busy && slot->buffer.vaddr == buf->vaddr)
+		{
+			buf->vaddr = slot->clientVaddr;
+			buf->fd = slot->clientFd;
+			slot->busy = false;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lib->configMutex);
+}
+
+/* Point buf at the encoded area, in place if the fetch engine walks the
+ * buffer with the right strides, or in a tightly packed copy otherwise. */
+static int applyInputLayout(struct gemini *lib, struct msm_gemini_buf *buf)
+{
+	struct inputLayout *in = &lib->inputLayout;
+	
+	pthread_mutex_lock(&lib->configMutex);
+	if (!lib->config.valid)
+	{
+		pthread_mutex_unlock(&lib->configMutex);
+		LOGD("not configured\n");
+		return -1;
+	}
+	const struct gemini_plane_layout l = in->layout;
+	const unsigned int format = lib->config.inputCfg.inputFormat;
+	const unsigned int hSamp = gemini_lib_mcu_h_samp(format);
+	const unsigned int vSamp = gemini_lib_mcu_v_samp(format);
+	const size_t yRowBytes = lib->config.inputCfg.frame_width_mcus * 8 * hSamp;
+	const unsigned int yRows = lib->config.inputCfg.frame_height_mcus * 8 * vSamp;
+	const size_t cbcrRowBytes = lib->config.inputCfg.frame_width_mcus * 16;
+	const unsigned int cbcrRows = lib->config.inputCfg.frame_height_mcus * 8;
+	const unsigned int walkedYStride = in->programmedYStride ? in->programmedYStride : yRowBytes;
+	const unsigned int walkedCbcrStride = in->programmedCbcrStride ? in->programmedCbcrStride : cbcrRowBytes;
+	pthread_mutex_unlock(&lib->configMutex);
+	
+	const uint32_t yOffset = yCropOffset(&l);
+	const uint32_t cbcrOffset = cbcrCropOffset(&l, hSamp, vSamp);
+	
+	if (l.yStride == walkedYStride && l.cbcrStride == walkedCbcrStride
+		&& yOffset % FE_ADDRESS_ALIGNMENT == 0 && cbcrOffset % FE_ADDRESS_ALIGNMENT == 0)
+	{
+		buf->y_off = yOffset;
+		buf->y_len = (yRows - 1) * l.yStride + yRowBytes;
+		buf->cbcr_off = cbcrOffset;
+		buf->cbcr_len = (cbcrRows - 1) * l.cbcrStride + cbcrRowBytes;
+		pthread_mutex_lock(&lib->statsMutex);
+		lib->stats.inputDirect++;
+		pthread_mutex_unlock(&lib->statsMutex);
+		return 0;
+	}
+	
+	const size_t ySize = yRowBytes * yRows;
+	const size_t cbcrSize = cbcrRowBytes * cbcrRows;
+	struct repackSlot *slot = NULL;
+	pthread_mutex_lock(&lib->configMutex);
+	for (unsigned int i = 0; i < INPUT_REPACK_BUFFERS && !slot; ++i)
+	{
+		if (!in->repack[i].busy)
+			slot = &in->repack[i];
+	}
+	if (slot)
+		slot->busy = true;
+	pthread_mutex_unlock(&lib->configMutex);
+	if (!slot)
+	{
+		LOGD("%d repacked buffers already in flight\n", INPUT_REPACK_BUFFERS);
+		return -1;
+	}
+	if (ensurePmemBuffer(&slot->buffer, ySize + cbcrSize) != 0)
+	{
+		releaseRepackSlot(lib, slot);
+		return -1;
+	}
+	uint8_t *dest = slot->buffer.vaddr;
+	const uint8_t *src = buf->vaddr;
+	copyPlane(dest, src + yOffset, yRowBytes, yRows, l.yStride);
+	copyPlane(dest + ySize, src + cbcrOffset, cbcrRowBytes, cbcrRows, l.cbcrStride);
+	slot->clientVaddr = buf->vaddr;
+	slot->clientFd = buf->fd;
+	buf->fd = slot->buffer.fd;
+	buf->vaddr = dest;
+	buf->y_off = 0;
+	buf->y_len = ySize;
+	buf->cbcr_off = ySize;
+	buf->cbcr_len = cbcrSize;
+	pthread_mutex_lock(&lib->statsMutex);
+	lib->stats.inputRepacked++;
+	pthread_mutex_unlock(&lib->statsMutex);
+	return 0;
+}
+
+static int pmemPhysAddr(int fd, uint32_t *paddr)
+{
+	struct pmem_region region;
+	if (deviceIoctl(fd, PMEM_GET_PHYS, &region) != 0)
+	{
+		LOGD("no physical address for fd %d\n", fd);
+		return -1;
+	}
+	*paddr = region.offset;
+	return 0;
+}
+
+/* The chroma offset that makes the hardware fetch a neutral grey plane of the
+ * library instead of the chroma of buf. The driver adds the offsets to the
+ * physical address of buf->fd only, so the offset is the distance between
+ * the two buffers in the pmem carveout, modulo 2^32. The plane is filled
+ * once and reallocated only for a larger frame. */
+static int grayscaleChromaOffset(struct gemini *lib, const struct msm_gemini_buf *buf, uint32_t *offset)
+{
+	uint32_t bufPhys;
+	if (pmemPhysAddr(buf->fd, &bufPhys) != 0)
+		return -1;
+	
+	struct pmemBuffer *plane = &lib->neutralChroma;
+	int ret = 0;
+	pthread_mutex_lock(&lib->configMutex);
+	if (!plane->vaddr || plane->size < buf->cbcr_len)
+	{
+		ret = ensurePmemBuffer(plane, buf->cbcr_len);
+		if (ret == 0)
+		{
+			memset(plane->vaddr, 0x80, plane->size);
+			ret = pmemPhysAddr(plane->fd, &lib->neutralChromaPhys);
+		}
+		if (ret != 0 && plane->vaddr)
+		{
+			do_munmap(plane->fd, plane->vaddr, plane->size);
+			plane->vaddr = NULL;
+			plane->size = 0;
+		}
+	}
+	if (ret == 0)
+		*offset = lib->neutralChromaPhys - bufPhys;
+	pthread_mutex_unlock(&lib->configMutex);
+	return ret;
+}
+
+int gemini_lib_input_buf_enq(struct gemini *lib, struct msm_gemini_buf *buf)
+{
+	struct msm_gemini_buf geminibuf;
+	
+	geminibuf.type = buf->type;
+	geminibuf.y_off = buf->y_off;
+	geminibuf.y_len = buf->y_len;
+	geminibuf.cbcr_len = buf->cbcr_len;
+	geminibuf.num_of_mcu_rows = buf->num_of_mcu_rows;
+	geminibuf.fd = buf->fd;
+	geminibuf.vaddr = buf->vaddr;
+	geminibuf.framedone_len = buf->framedone_len;
+	geminibuf.cbcr_off = buf->cbcr_off;
+	geminibuf.cbcr_len = buf->cbcr_len;
+	geminibuf.num_of_mcu_rows = buf->num_of_mcu_rows;
+	geminibuf.framedone_len = buf->framedone_len;
+	geminibuf.cbcr_off = buf->cbcr_off;
+	
+	if (lib->inputLayout.enabled && applyInputLayout(lib, &geminibuf) != 0)
+		return -1;
+	if (lib->grayscale && geminibuf.cbcr_len
+		&& grayscaleChromaOffset(lib, &geminibuf, &geminibuf.cbcr_off) != 0)
+		return -1;
+	
+	int ret = deviceIoctl(lib->deviceFd, MSM_GMN_IOCTL_INPUT_BUF_ENQUEUE, &geminibuf);
+	LOGD("inputbuf: 0x%p enqueue %d, result %d\n",
+		buf->vaddr, buf->y_len, ret);
+	return ret;
+}
+
+/** Use threads helper threads (besides the calling one) for the CPU side
+ * pre-stages like gemini_lib_convert_input(). 0 does everything in the
+ * calling thread. Must not be called while such a stage is running.
+ */
+int gemini_lib_set_worker_threads(struct gemini *lib, unsigned int threads)
+{
+	gemini_bandpool_destroy(lib->bandpool);
+	lib->bandpool = NULL;
+	if (threads == 0)
+		return 0;
+	lib->bandpool = gemini_bandpool_create(threads);
+	return lib->bandpool ? 0 : -1;
+}
+
+struct convertJob
+{
+	struct gemini *lib;
+	const struct gemini_source_image *src;
+	unsigned int transform;
+	unsigned int height; // of the source after the transformation
+	struct msm_gemini_buf dest;
+	uint8_t *yBase;
+	uint8_t *crcbBase;
+	size_t yStride;
+	size_t crcbStride;
+	unsigned int mcuHeight;
+	unsigned int mcuRows;
+	unsigned int streamMcuRows;
+	unsigned int enqueuedMcuRows;
+	bool subsampleV;
+	int error;
+};
+
+static bool isSemiPlanar(unsigned int format)
+{
+	return format == GEMINI_SOURCE_NV12 || format == GEMINI_SOURCE_NV21;
+}
+
+static void convertBand(void *arg, unsigned int band)
+{
+	struct convertJob *job = arg;
+	const unsigned int firstRow = band * job->mcuHeight;
+	unsigned int rows = job->mcuHeight;
+	if (firstRow + rows > job->height)
+		rows = firstRow < job->height ? job->height - firstRow : 0;
+	uint8_t *yDest = job->yBase + firstRow * job->yStride;
+	uint8_t *crcbDest = job->crcbBase + band * 8 * job->crcbStride;
+	if (isSemiPlanar(job->src->format))
+	{
+		gemini_transform_rows(job->src, job->transform, firstRow, rows,
+							yDest, job->yStride, crcbDest, job->crcbStride);
+	}
+	else
+	{
+		gemini_convert_rows(job->src, firstRow, rows, yDest, job->yStride,
+							crcbDest, job->crcbStride, job->subsampleV);
+	}
+}
+
+// Runs in band order, hands the converted rows to the hardware in fragments
+static void convertBandDone(void *arg, unsigned int band)
+{
+	struct convertJob *job = arg;
+	const unsigned int converted = band + 1;
+	const unsigned int pending = converted - job->enqueuedMcuRows;
+	if (converted != job->mcuRows && (job->streamMcuRows == 0 || pending < job->streamMcuRows))
+		return;
+	
+	struct msm_gemini_buf fragment = job->dest;
+	fragment.y_off += job->enqueuedMcuRows * job->mcuHeight * job->yStride;
+	fragment.y_len = pending * job->mcuHeight * job->yStride;
+	fragment.cbcr_off += job->enqueuedMcuRows * 8 * job->crcbStride;
+	fragment.cbcr_len = pending * 8 * job->crcbStride;
+	fragment.num_of_mcu_rows = pending;
+	job->enqueuedMcuRows = converted;
+	if (job->error)
+		return;
+	int ret = deviceIoctl(job->lib->deviceFd, MSM_GMN_IOCTL_INPUT_BUF_ENQUEUE, &fragment);
+	LOGD("inputbuf: 0x%p enqueue %u MCU rows, result %d\n",
+		fragment.vaddr, pending, ret);
+	if (ret != 0)
+		job->error = ret;
+}
+
+/** Convert src into the tightly packed Y and CrCb planes of dest (y_off and
+ * cbcr_off must be set, the lengths are filled in) in the H2V1 or H2V2
+ * format of the current configuration, and enqueue it as input buffer.
+ * With streamMcuRows set, every streamMcuRows converted MCU rows are
+ * enqueued as soon as they are ready, so the hardware (started with
+ * gemini_lib_encode()) can begin before the whole frame is converted.
+ * Rows of the frame below the source image are left untouched.
+ */
+int gemini_lib_convert_input(struct gemini *lib, const struct gemini_source_image *src,
+						const struct msm_gemini_buf *dest, unsigned int streamMcuRows)
+{
+	return gemini_lib_transform_input(lib, src, GEMINI_TRANSFORM_NONE, dest, streamMcuRows);
+}
+
+/** Same as gemini_lib_convert_input(), rotating or mirroring the source on
+ * the way. Transformations other than GEMINI_TRANSFORM_NONE are supported
+ * for NV12 and NV21 sources with even dimensions into H2V2. The frame size
+ * of the configuration must fit the transformed size (height and width
+ * swapped for the 90 and 270 degree variants).
+ */
+int gemini_lib_transform_input(struct gemini *lib, const struct gemini_source_image *src, unsigned int transform,
+						const struct msm_gemini_buf *dest, unsigned int streamMcuRows)
+{
+	if (src->format >= GEMINI_SOURCE_FORMAT_COUNT || transform > GEMINI_TRANSFORM_ROT270 || src->width % 2 != 0
+		|| (isSemiPlanar(src->format) && src->height % 2 != 0)
+		|| (!isSemiPlanar(src->format) && transform != GEMINI_TRANSFORM_NONE))
+	{
+		LOGD("unsupported source (format %u, %ux%u, transform %u)\n",
+			src->format, src->width, src->height, transform);
+		return -1;
+	}
+	pthread_mutex_lock(&lib->configMutex);
+	const bool configured = lib->config.valid;
+	const struct gemini_input_cfg inputCfg = lib->config.inputCfg;
+	pthread_mutex_unlock(&lib->configMutex);
+	if (!configured || gemini_lib_mcu_h_samp(inputCfg.inputFormat) != 2
+		|| (isSemiPlanar(src->format) && inputCfg.inputFormat != GEMINI_INPUT_H2V2))
+	{
+		LOGD("need an H2V1 or H2V2 configuration (H2V2 for NV12/NV21)\n");
+		return -1;
+	}
+	const unsigned int vSamp = gemini_lib_mcu_v_samp(inputCfg.inputFormat);
+	unsigned int width, height;
+	gemini_transform_size(src, transform, &width, &height);
+	struct convertJob job = {
+		.lib = lib,
+		.src = src,
+		.transform = transform,
+		.height = height,
+		.dest = *dest,
+		.yStride = inputCfg.frame_width_mcus * 16,
+		.crcbStride = inputCfg.frame_width_mcus * 16,
+		.mcuHeight = 8 * vSamp,
+		.mcuRows = inputCfg.frame_height_mcus,
+		.streamMcuRows = streamMcuRows,
+		.subsampleV = vSamp == 2,
+	};
+	if (width > job.yStride || height > job.mcuRows * job.mcuHeight)
+	{
+		LOGD("source %ux%u larger than frame\n", width, height);
+		return -1;
+	}
+	job.yBase = (uint8_t *)dest->vaddr + dest->y_off;
+	job.crcbBase = (uint8_t *)dest->vaddr + dest->cbcr_off;
+	
+	uint64_t startUs = monotonicTimeUs();
+	if (gemini_bandpool_run(lib->bandpool, job.mcuRows, convertBand, convertBandDone, &job) != 0)
+		return -1;
+	const uint64_t elapsedUs = monotonicTimeUs() - startUs;
+	pthread_mutex_lock(&lib->statsMutex);
+	if (transform == GEMINI_TRANSFORM_NONE)
+	{
+		lib->stats.convertPixels[src->format] += (uint64_t)width * height;
+		lib->stats.convertUs[src->format] += elapsedUs;
+	}
+	else
+	{
+		lib->stats.transformPixels += (uint64_t)width * height;
+		lib->stats.transformUs += elapsedUs;
+	}
+	pthread_mutex_unlock(&lib->statsMutex);
+	return job.error;
+}
+
+int gemini_lib_set_container(struct gemini *lib, const struct gemini_jfif_cfg *cfg)
+{
+	struct outputContainer *c = &lib->container;
+	pthread_mutex_lock(&c->mutex);
+	c->enabled = cfg != NULL;
+	if (cfg)
+		c->cfg = *cfg;
+	c->headerPending = true;
+	c->header = NULL;
+	c->fragmentCount = 0;
+	c->fragmentsLost = false;
+	pthread_mutex_unlock(&c->mutex);
+	return 0;
+}
+
+/* Write the container header into the start of the first output buffer of a
+ * job and hand only the remainder to the hardware, so the bitstream lands
+ * right behind the header. jobCfg replaces the configuration of
+ * gemini_lib_set_container() for this job. c->header is only set while the
+ * current job has a header. */
+static void reserveContainerHeader(struct gemini *lib, struct msm_gemini_buf *buf,
+						const struct gemini_jfif_cfg *jobCfg)
+{
+	struct outputContainer *c = &lib->container;
+	pthread_mutex_lock(&c->mutex);
+	const struct gemini_jfif_cfg *cfg = jobCfg ? jobCfg : c->enabled ? &c->cfg : NULL;
+	if (c->headerPending)
+	{
+		int length = -1;
+		if (cfg && !lib->grayscale)
+		{
+			pthread_mutex_lock(&lib->configMutex);
+			if (lib->config.valid)
+			{
+				length = gemini_jfif_write_header(buf->vaddr, buf->y_len,
+						cfg, &lib->config.inputCfg, &lib->config.hwCfg, &c->layout);
+			}
+			pthread_mutex_unlock(&lib->configMutex);
+			if (length < 0)
+				LOGD("no container header written\n");
+		}
+		if (length < 0)
+		{
+			c->header = NULL;
+		}
+		else
+		{
+			c->header = buf->vaddr;
+			c->headerLength = length;
+			c->fragmentCount = 0;
+			c->fragmentsLost = false;
+			c->eoiWritten = false;
+			c->eoiInPlace = false;
+			c->headerPending = false;
+			pthread_mutex_lock(&lib->statsMutex);
+			lib->rateControl.jobBytes += length + 2; // and EOI
+			pthread_mutex_unlock(&lib->statsMutex);
+			buf->vaddr = (uint8_t *)buf->vaddr + length;
+			buf->y_off += length;
+			buf->y_len -= length;
 		}
-		gemini_lib_send_thread_ready(lib, thread);
 	}
-	while ( !thread->shouldStop );
-	
-	LOGD("Exit\n");
-	return NULL;
+	pthread_mutex_unlock(&c->mutex);
 }
 
-static void* gemini_lib_input_thread(void *arg)
+/** Describe the complete JPEG file of the last job: the header and the output
+ * fragments, merged where they are contiguous in memory, followed by the EOI
+ * marker. EOI is appended in place if the last output buffer has room for it.
+ * Call this after the output callback of the last fragment has run.
+ * @return The number of iovec entries used, or -1, also if the job was split
+ *         into more than MAX_CONTAINER_FRAGMENTS output buffers.
+ */
+int gemini_lib_container_get_iov(struct gemini *lib, struct iovec *iov, int iovcnt)
 {
-	struct gemini *lib = arg;
-	struct msm_gemini_buf gemini_buf;
-	struct workerThread* thread = &lib->lib_input_thread;
+	static const uint8_t eoi[2] = {0xFF, 0xD9};
+	struct outputContainer *c = &lib->container;
+	int n = 0;
 	
-	LOGD("Enter threadid %lu\n", thread->tid);
-	
-	gemini_lib_send_thread_ready(lib, thread);
-	do
+	pthread_mutex_lock(&c->mutex);
+	if (!c->header || c->fragmentsLost || iovcnt < 2)
+		goto fail;
+	if (!c->eoiWritten && c->fragmentCount > 0)
 	{
-		int ret = ioctl(lib->deviceFd, MSM_GMN_IOCTL_INPUT_GET, &gemini_buf);
-		LOGD("MSM_GMN_IOCTL_INPUT_GET rc = %d\n", ret);
-		if ( ret )
+		struct iovec *last = &c->fragments[c->fragmentCount - 1];
+		if (c->fragmentCapacity[c->fragmentCount - 1] >= last->iov_len + sizeof(eoi))
 		{
-			if ( !thread->shouldStop )
-				LOGD("fail\n");
+			memcpy((uint8_t *)last->iov_base + last->iov_len, eoi, sizeof(eoi));
+			last->iov_len += sizeof(eoi);
+			c->eoiInPlace = true;
 		}
-		else
+		c->eoiWritten = true;
+	}
+	if (lib->restartIndex.enabled)
+	{
+		struct restartIndex *idx = &lib->restartIndex;
+		unsigned int count = idx->count < idx->capacity ? idx->count : idx->capacity;
+		gemini_jfif_fill_restart_index(c->header, &c->layout, c->headerLength, idx->offsets, count);
+	}
+	iov[n].iov_base = c->header;
+	iov[n].iov_len = c->headerLength;
+	++n;
+	for (unsigned int i = 0; i < c->fragmentCount; ++i)
+	{
+		struct iovec *prev = &iov[n - 1];
+		if ((uint8_t *)prev->iov_base + prev->iov_len == c->fragments[i].iov_base)
 		{
-			lib->inputThreadCallback(lib, &gemini_buf);
+			prev->iov_len += c->fragments[i].iov_len;
+			continue;
 		}
-		gemini_lib_send_thread_ready(lib, thread);
+		if (n == iovcnt)
+			goto fail;
+		iov[n++] = c->fragments[i];
 	}
-	while ( !thread->shouldStop );
+	if (!c->eoiInPlace)
+	{
+		if (n == iovcnt)
+			goto fail;
+		iov[n].iov_base = (void *)eoi;
+		iov[n].iov_len = sizeof(eoi);
+		++n;
+	}
+	pthread_mutex_unlock(&c->mutex);
+	return n;
 	
-	LOGD("Exit\n");
-	return NULL;
+fail:
+	pthread_mutex_unlock(&c->mutex);
+	return -1;
 }
 
-static void* gemini_lib_output_thread(void *arg)
+/** Encode luma only. There is no single component mode known for the
+ * hardware, so it fetches the chroma of every input buffer from a neutral
+ * grey plane of the library instead (which costs next to nothing in the
+ * bitstream, the client's chroma is left alone), and
+ * gemini_lib_grayscale_jpeg() drops the chroma blocks from the result.
+ * Input buffers must be pmem. The JPEG container of
+ * gemini_lib_set_container() isn't written meanwhile.
+ */
+int gemini_lib_set_grayscale(struct gemini *lib, bool enable)
 {
-	struct gemini *lib = arg;
-	struct msm_gemini_buf gemini_buf;
-	struct workerThread* thread = &lib->lib_output_thread;
+	lib->grayscale = enable;
+	return 0;
+}
+
+/** Write the single component JPEG file of the job whose output fragments
+ * are in iov into dest.
+ * @return The file length, or -1.
+ */
+int gemini_lib_grayscale_jpeg(struct gemini *lib, const struct iovec *iov, int iovcnt,
+						const struct gemini_jfif_cfg *cfg, uint8_t *dest, size_t size)
+{
+	int ret = -1;
+	pthread_mutex_lock(&lib->configMutex);
+	if (lib->config.valid)
+	{
+		ret = gemini_jfif_transcode_grayscale(iov, iovcnt, cfg,
+				&lib->config.inputCfg, &lib->config.hwCfg, dest, size);
+	}
+	pthread_mutex_unlock(&lib->configMutex);
+	return ret;
+}
+
+/** Let the library choose the quality of every job from now on, so the
+ * JPEG files come out at most targetBytes long and at least tolerancePercent
+ * below. The choice comes from a size model updated with the actual size of
+ * each job, starting with initialQuality. The quantisation tables passed to
+ * gemini_lib_hw_config() are replaced while this is active. The file size
+ * includes the container header when gemini_lib_set_container() is used.
+ * targetBytes 0 goes back to the caller's tables with the next
+ * gemini_lib_hw_config().
+ */
+int gemini_lib_set_target_size(struct gemini *lib, size_t targetBytes,
+						unsigned int tolerancePercent, unsigned int initialQuality)
+{
+	pthread_mutex_lock(&lib->configMutex);
+	gemini_ratectl_init(&lib->rateControl.model, targetBytes, tolerancePercent, initialQuality);
+	lib->rateControl.jobQuality = 0;
+	lib->rateControl.jobOpen = false;
+	pthread_mutex_unlock(&lib->configMutex);
+	pthread_mutex_lock(&lib->statsMutex);
+	lib->rateControl.jobBytes = 0;
+	pthread_mutex_unlock(&lib->statsMutex);
+	return 0;
+}
+
+/* Learn from the size of the previous job and choose the quantisation tables
+ * of the one that is starting. The tables go into the cached configuration,
+ * and with program set also into the hardware. Called with the config mutex
+ * held. */
+static void rateControlJobStart(struct gemini *lib, bool program)
+{
+	struct rateControl *rc = &lib->rateControl;
+	if (!rc->model.targetBytes || rc->jobOpen)
+		return;
+	if (program && !lib->config.valid)
+		return;
 	
-	LOGD("Enter threadid %lu\n", thread->tid);
+	const struct gemini_input_cfg *in = &lib->config.inputCfg;
+	const uint32_t pixels = in->frame_width_mcus * 8 * gemini_lib_mcu_h_samp(in->inputFormat)
+						* in->frame_height_mcus * 8 * gemini_lib_mcu_v_samp(in->inputFormat);
+	pthread_mutex_lock(&lib->statsMutex);
+	const size_t bytes = rc->jobBytes;
+	rc->jobBytes = 0;
+	if (rc->jobQuality && bytes)
+	{
+		gemini_ratectl_update(&rc->model, rc->jobQuality, bytes, rc->jobPixels);
+		lib->stats.rateJobs++;
+		if (gemini_ratectl_hit(&rc->model, bytes))
+			lib->stats.rateHits++;
+		else if (bytes > rc->model.targetBytes)
+			lib->stats.rateOvershoots++;
+		else
+			lib->stats.rateUndershoots++;
+	}
+	pthread_mutex_unlock(&lib->statsMutex);
 	
-	gemini_lib_send_thread_ready(lib, thread);
-	do
+	const unsigned int quality = gemini_ratectl_quality(&rc->model, pixels);
+	LOGD("%zu bytes at quality %u, next quality %u\n", bytes, rc->jobQuality, quality);
+	gemini_lib_quant_tables(quality, lib->config.quantTables[0], lib->config.quantTables[1]);
+	lib->config.hwCfg.quantTable[0] = lib->config.quantTables[0];
+	lib->config.hwCfg.quantTable[1] = lib->config.quantTables[1];
+	if (program && quality != rc->jobQuality)
 	{
-		int ret = ioctl(lib->deviceFd, MSM_GMN_IOCTL_OUTPUT_GET, &gemini_buf);
-		LOGD("MSM_GMN_IOCTL_OUTPUT_GET rc = %d\n", ret);
-		if ( ret )
+		struct msm_gemini_hw_cmds *cmds = gemini_lib_hw_set_quant_tables(lib->config.quantTables[0],
+															lib->config.quantTables[1]);
+		if (cmds)
 		{
-			if ( !thread->shouldStop )
-				LOGD("fail\n");
+			int ret = deviceIoctl(lib->deviceFd, MSM_GMN_IOCTL_HW_CMDS, cmds);
+			free(cmds);
+			if (ret != 0)
+				LOGD("quant tables not set, rc = %d\n", ret);
 		}
-		else
+	}
+	rc->jobQuality = quality;
+	rc->jobPixels = pixels;
+	rc->jobOpen = true;
+	pthread_mutex_lock(&lib->statsMutex);
+	lib->stats.rateLastQuality = quality;
+	pthread_mutex_unlock(&lib->statsMutex);
+}
+
+/** Encode with Huffman tables built for the symbol statistics of the
+ * previous job from now on, which are smaller than the standard tables for
+ * about any content. The statistics come from gemini_lib_learn_huffman(),
+ * until it has been called the tables of gemini_lib_hw_config() stay in
+ * use. false goes back to the caller's tables with the next
+ * gemini_lib_hw_config().
+ */
+int gemini_lib_set_huffman_optimization(struct gemini *lib, bool enable)
+{
+	pthread_mutex_lock(&lib->configMutex);
+	lib->huffman.enabled = enable;
+	lib->huffman.learned = false;
+	lib->huffman.pending = false;
+	pthread_mutex_unlock(&lib->configMutex);
+	return 0;
+}
+
+/** Count the Huffman symbols of the bitstream of the last job and build the
+ * tables for the next one (used from its gemini_lib_output_buf_enq() or
+ * gemini_lib_encode() on). With iov NULL, the output fragments recorded for
+ * the container of gemini_lib_set_container() are analysed. Must be called
+ * before the next job starts, as the bitstream is decoded with the tables
+ * of the current configuration. Updates the huffman* statistics.
+ * @return 0, or -1 if the bitstream couldn't be decoded or wasn't recorded
+ *         completely.
+ */
+int gemini_lib_learn_huffman(struct gemini *lib, const struct iovec *iov, int iovcnt)
+{
+	struct iovec fragments[MAX_CONTAINER_FRAGMENTS];
+	uint8_t usedTables[4][16 + 256];
+	uint8_t learnedTables[4][16 + 256];
+	uint32_t (*counts)[256] = calloc(4, sizeof(*counts));
+	if (!counts)
+		return -1;
+
+	pthread_mutex_lock(&lib->configMutex);
+	const bool usable = lib->config.valid && lib->huffman.enabled;
+	const bool optimized = lib->huffman.inConfig;
+	const struct gemini_input_cfg inputCfg = lib->config.inputCfg;
+	struct gemini_hw_cfg hwCfg = lib->config.hwCfg;
+	for (int i = 0; usable && i < 4; ++i)
+	{
+		const uint8_t *table = hwCfg.huffmanTablesAllocated ? hwCfg.huffmanTable[i]
+				: gemini_lib_std_huffman_table(i);
+		memcpy(usedTables[i], table, huffmanTableLength(table));
+		hwCfg.huffmanTable[i] = usedTables[i];
+	}
+	hwCfg.huffmanTablesAllocated = true;
+	pthread_mutex_unlock(&lib->configMutex);
+	if (!usable)
+	{
+		free(counts);
+		LOGD("not configured or not enabled\n");
+		return -1;
+	}
+
+	if (!iov)
+	{
+		struct outputContainer *c = &lib->container;
+		pthread_mutex_lock(&c->mutex);
+		iovcnt = c->header && !c->fragmentsLost ? (int)c->fragmentCount : 0;
+		memcpy(fragments, c->fragments, iovcnt * sizeof(*fragments));
+		pthread_mutex_unlock(&c->mutex);
+		iov = fragments;
+	}
+	const struct gemini_scan_visitor visitor = {
+		.block = NULL,
+		.counts = counts,
+		.arg = NULL,
+	};
+	if (iovcnt <= 0 || gemini_scan_walk(iov, iovcnt, &inputCfg, &hwCfg, &visitor) != 0)
+	{
+		free(counts);
+		return -1;
+	}
+
+	int64_t savedBits = 0;
+	for (int i = 0; i < 4; ++i)
+	{
+		savedBits += gemini_huffman_code_bits(counts[i], gemini_lib_std_huffman_table(i));
+		savedBits -= gemini_huffman_code_bits(counts[i], usedTables[i]);
+		gemini_huffman_optimal_table(counts[i], i, learnedTables[i]);
+	}
+	free(counts);
+
+	pthread_mutex_lock(&lib->configMutex);
+	if (lib->huffman.enabled)
+	{
+		memcpy(lib->huffman.tables, learnedTables, sizeof(learnedTables));
+		lib->huffman.learned = true;
+		lib->huffman.pending = true;
+	}
+	pthread_mutex_unlock(&lib->configMutex);
+
+	pthread_mutex_lock(&lib->statsMutex);
+	lib->stats.huffmanLearned++;
+	if (optimized)
+		lib->stats.huffmanOptimizedJobs++;
+	lib->stats.huffmanLastSavedBytes = savedBits / 8;
+	lib->stats.huffmanSavedBytes += savedBits / 8;
+	pthread_mutex_unlock(&lib->statsMutex);
+	LOGD("%lld bytes saved by the tables in use\n", (long long)(savedBits / 8));
+	return 0;
+}
+
+/* Put the learned Huffman tables into the cached configuration, and with
+ * program set also into the hardware, unless that already happened. Called
+ * with the config mutex held. */
+static void huffmanJobStart(struct gemini *lib, bool program)
+{
+	struct huffmanOptimizer *h = &lib->huffman;
+	if (!h->enabled || !h->learned || (h->inConfig && !h->pending))
+		return;
+	if (program && !lib->config.valid)
+		return;
+
+	for (int i = 0; i < 4; ++i)
+	{
+		memcpy(lib->config.huffmanTables[i], h->tables[i], sizeof(lib->config.huffmanTables[i]));
+		lib->config.hwCfg.huffmanTable[i] = lib->config.huffmanTables[i];
+	}
+	lib->config.hwCfg.huffmanTablesAllocated = true;
+	h->inConfig = true;
+	if (program)
+	{
+		uint16_t huffmanValues4[512];
+		uint16_t huffmanValues3[512];
+		uint16_t huffmanValues2[24];
+		uint16_t huffmanValues1[24];
+		gemini_lib_hw_create_huffman_tables(&lib->config.hwCfg, huffmanValues1, huffmanValues2,
+											huffmanValues3, huffmanValues4);
+		struct msm_gemini_hw_cmds *cmds = gemini_lib_hw_set_huffman_tables(huffmanValues1, huffmanValues2,
+																		huffmanValues3, huffmanValues4);
+		if (cmds)
 		{
-			lib->outputThreadCallback(lib, &gemini_buf);
+			int ret = deviceIoctl(lib->deviceFd, MSM_GMN_IOCTL_HW_CMDS, cmds);
+			free(cmds);
+			if (ret != 0)
+				LOGD("huffman tables not set, rc = %d\n", ret);
 		}
-		gemini_lib_send_thread_ready(lib, thread);
 	}
-	while ( !thread->shouldStop );
-	
-	LOGD("Exit\n");
-	return NULL;
+	h->pending = false;
 }
 
-int gemini_lib_input_buf_enq(struct gemini *lib, struct msm_gemini_buf *buf)
+static int outputBufEnqueue(struct gemini *lib, struct msm_gemini_buf *buf, const struct gemini_jfif_cfg *jobCfg)
 {
 	struct msm_gemini_buf geminibuf;
 	
@@ -371,34 +2197,21 @@ int gemini_lib_input_buf_enq(struct gemini *lib, struct msm_gemini_buf *buf)
 	geminibuf.framedone_len = buf->framedone_len;
 	geminibuf.cbcr_off = buf->cbcr_off;
 	
-	int ret = ioctl(lib->deviceFd, MSM_GMN_IOCTL_INPUT_BUF_ENQUEUE, &geminibuf);
-	LOGD("inputbuf: 0x%p enqueue %d, result %d\n",
+	pthread_mutex_lock(&lib->configMutex);
+	rateControlJobStart(lib, true);
+	huffmanJobStart(lib, true);
+	pthread_mutex_unlock(&lib->configMutex);
+	reserveContainerHeader(lib, &geminibuf, jobCfg);
+	
+	int ret = deviceIoctl(lib->deviceFd, MSM_GMN_IOCTL_OUTPUT_BUF_ENQUEUE, &geminibuf);
+	LOGD("outputbuf: 0x%p enqueue %d, result %d\n",
 		buf->vaddr, buf->y_len, ret);
 	return ret;
 }
 
 int gemini_lib_output_buf_enq(struct gemini *lib, struct msm_gemini_buf *buf)
 {
-	struct msm_gemini_buf geminibuf;
-	
-	geminibuf.type = buf->type;
-	geminibuf.y_off = buf->y_off;
-	geminibuf.y_len = buf->y_len;
-	geminibuf.cbcr_len = buf->cbcr_len;
-	geminibuf.num_of_mcu_rows = buf->num_of_mcu_rows;
-	geminibuf.fd = buf->fd;
-	geminibuf.vaddr = buf->vaddr;
-	geminibuf.framedone_len = buf->framedone_len;
-	geminibuf.cbcr_off = buf->cbcr_off;
-	geminibuf.cbcr_len = buf->cbcr_len;
-	geminibuf.num_of_mcu_rows = buf->num_of_mcu_rows;
-	geminibuf.framedone_len = buf->framedone_len;
-	geminibuf.cbcr_off = buf->cbcr_off;
-	
-	int ret = ioctl(lib->deviceFd, MSM_GMN_IOCTL_OUTPUT_BUF_ENQUEUE, &geminibuf);
-	LOGD("outputbuf: 0x%p enqueue %d, result %d\n",
-		buf->vaddr, buf->y_len, ret);
-	return ret;
+	return outputBufEnqueue(lib, buf, NULL);
 }
 
 int gemini_lib_encode(struct gemini* lib)
@@ -407,11 +2220,384 @@ int gemini_lib_encode(struct gemini* lib)
 	if (!hw_start)
 		return -1;
 	
-	int ret = ioctl(lib->deviceFd, MSM_GMN_IOCTL_START, hw_start);
+	pthread_mutex_lock(&lib->configMutex);
+	rateControlJobStart(lib, true);
+	huffmanJobStart(lib, true);
+	pthread_mutex_unlock(&lib->configMutex);
+	resetRestartIndex(lib);
+	armJobWatchdog(lib);
+	int ret = deviceIoctl(lib->deviceFd, MSM_GMN_IOCTL_START, hw_start);
+	free(hw_start);
 	ALOGE("ioctl %s: rc = %d\n", GEMINI_DEVICE, ret);
+	if (ret != 0)
+	{
+		disarmJobWatchdog(lib);
+		return ret;
+	}
+	pthread_mutex_lock(&lib->statsMutex);
+	lib->stats.jobs++;
+	pthread_mutex_unlock(&lib->statsMutex);
+	return ret;
+}
+
+#define THUMBNAIL_TIMEOUT_MS 2000
+#define THUMBNAIL_MAX_FACTOR 64 // keeps the vertical sums in 16 bit
+
+static bool thumbnailJobEvent(struct gemini *lib, const struct msm_gemini_ctrl_cmd *cmd)
+{
+	struct thumbnailJob *t = &lib->thumbnail;
+	pthread_mutex_lock(&t->mutex);
+	const bool consumed = t->phase != THUMBNAIL_IDLE;
+	if (consumed)
+	{
+		if (cmd->type == MSM_GEMINI_EVT_FRAMEDONE)
+			t->done = true;
+		else if (cmd->type == MSM_GEMINI_EVT_ERR)
+			t->error = true;
+		pthread_cond_signal(&t->cond);
+	}
+	pthread_mutex_unlock(&t->mutex);
+	return consumed;
+}
+
+static unsigned int thumbnailJobPhase(struct gemini *lib)
+{
+	pthread_mutex_lock(&lib->thumbnail.mutex);
+	const unsigned int phase = lib->thumbnail.phase;
+	pthread_mutex_unlock(&lib->thumbnail.mutex);
+	return phase;
+}
+
+static void thumbnailJobOutput(struct gemini *lib, const struct msm_gemini_buf *buf)
+{
+	struct thumbnailJob *t = &lib->thumbnail;
+	pthread_mutex_lock(&t->mutex);
+	t->outputs++;
+	t->outputBytes += buf->framedone_len;
+	pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->mutex);
+}
+
+static void startThumbnailPhase(struct gemini *lib, unsigned int phase)
+{
+	struct thumbnailJob *t = &lib->thumbnail;
+	pthread_mutex_lock(&t->mutex);
+	t->phase = phase;
+	t->done = t->error = false;
+	t->outputs = 0;
+	t->outputBytes = 0;
+	pthread_mutex_unlock(&t->mutex);
+}
+
+/* Wait for the frame done event and the output buffer of the current phase.
+ * A job that doesn't finish in time is stopped. */
+static int waitThumbnailPhase(struct gemini *lib, size_t *outputBytes)
+{
+	struct thumbnailJob *t = &lib->thumbnail;
+	int ret = 0;
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += THUMBNAIL_TIMEOUT_MS / 1000;
+	pthread_mutex_lock(&t->mutex);
+	while (!(t->done && t->outputs > 0) && !t->error && ret == 0)
+		ret = pthread_cond_timedwait(&t->cond, &t->mutex, &deadline);
+	if (t->error && ret == 0)
+		ret = -1;
+	if (outputBytes)
+		*outputBytes = t->outputBytes;
+	pthread_mutex_unlock(&t->mutex);
+	if (ret != 0)
+	{
+		ALOGE("%s: job %s\n", __func__, t->error ? "failed" : "timed out");
+		gemini_lib_stop(lib, 1);
+	}
+	return ret;
+}
+
+static __inline unsigned int alignMcu(unsigned int pixels)
+{
+	return (pixels + 15) & ~15u;
+}
+
+/* Smallest scale factor that makes the MCU aligned thumbnail fit. */
+static int thumbnailGeometry(const struct gemini_input_cfg *in, const struct gemini_thumbnail_cfg *cfg,
+						struct gemini_downscale *d)
+{
+	d->width = in->frame_width_mcus * 16;
+	d->height = in->frame_height_mcus * 8 * gemini_lib_mcu_v_samp(in->inputFormat);
+	d->subsampledV = in->inputFormat == GEMINI_INPUT_H2V2;
+	for (unsigned int f = 1; f <= THUMBNAIL_MAX_FACTOR && 2 * f <= d->width && 2 * f <= d->height; ++f)
+	{
+		unsigned int width, height;
+		gemini_downscale_size(d->width, d->height, f, &width, &height);
+		if (alignMcu(width) <= cfg->maxWidth && alignMcu(height) <= cfg->maxHeight)
+		{
+			d->factor = f;
+			d->destWidth = alignMcu(width);
+			d->destHeight = alignMcu(height);
+			return 0;
+		}
+	}
+	LOGD("no thumbnail of at most %ux%u for %ux%u\n", cfg->maxWidth, cfg->maxHeight, d->width, d->height);
+	return -1;
+}
+
+/* The encoded area of an input buffer as gemini_lib_input_buf_enq() sees it,
+ * before any repacking. */
+static void thumbnailSource(struct gemini *lib, const struct msm_gemini_buf *input, struct gemini_downscale *d)
+{
+	const uint8_t *base = input->vaddr;
+	pthread_mutex_lock(&lib->configMutex);
+	const bool layoutEnabled = lib->inputLayout.enabled;
+	const struct gemini_plane_layout l = lib->inputLayout.layout;
+	pthread_mutex_unlock(&lib->configMutex);
+	if (layoutEnabled)
+	{
+		// thumbnails are only made of H2V1 and H2V2 sources
+		d->y = base + yCropOffset(&l);
+		d->yStride = l.yStride;
+		d->crcb = base + cbcrCropOffset(&l, 2, d->subsampledV ? 2 : 1);
+		d->crcbStride = l.cbcrStride;
+	}
+	else
+	{
+		d->y = base + input->y_off;
+		d->yStride = d->width;
+		d->crcb = base + input->cbcr_off;
+		d->crcbStride = d->width;
+	}
+}
+
+struct thumbnailScale
+{
+	struct gemini_downscale d;
+	uint16_t *acc; // a row of d.width per band
+};
+
+static void thumbnailScaleBand(void *arg, unsigned int band)
+{
+	struct thumbnailScale *job = arg;
+	gemini_downscale_rows(&job->d, band, 1, job->acc + (size_t)band * job->d.width);
+}
+
+/* Encode the downscaled frame in the thumbnail input buffer into slot, the
+ * reserved room in the main output buffer starting slotOffset bytes after
+ * the output's y_off. The thumbnail's own header goes first, the hardware
+ * writes the bitstream right behind it.
+ * @return The length of the thumbnail JPEG file, or -1. */
+static int encodeThumbnail(struct gemini *lib, const struct gemini_downscale *d,
+						const struct gemini_thumbnail_cfg *thumbnailCfg, unsigned int alignment,
+						const struct msm_gemini_buf *input, const struct msm_gemini_buf *output,
+						uint8_t *slot, size_t slotOffset)
+{
+	struct pmemBuffer *mem = &lib->thumbnail.input;
+	uint8_t quantTables[2][64];
+	int ret = -1;
+
+	pthread_mutex_lock(&lib->configMutex);
+	struct gemini_input_cfg inputCfg = lib->config.inputCfg;
+	inputCfg.inputFormat = GEMINI_INPUT_H2V2;
+	inputCfg.frame_width_mcus = d->destWidth / 16;
+	inputCfg.frame_height_mcus = d->destHeight / 16;
+	struct gemini_hw_cfg hwCfg = lib->config.hwCfg;
+	hwCfg.restartMarker = 0;
+	hwCfg.setFilesizeCtrl = false;
+	if (thumbnailCfg->quality)
+	{
+		gemini_lib_quant_tables(thumbnailCfg->quality, quantTables[0], quantTables[1]);
+		hwCfg.quantTable[0] = quantTables[0];
+		hwCfg.quantTable[1] = quantTables[1];
+	}
+	const struct gemini_jfif_cfg jfifCfg = {
+		.embedded = true,
+		.alignment = alignment,
+	};
+	int headerLength = gemini_jfif_write_header(slot, thumbnailCfg->maxBytes, &jfifCfg, &inputCfg, &hwCfg, NULL);
+	if (headerLength < 0 || (size_t)headerLength + 2 >= thumbnailCfg->maxBytes)
+	{
+		pthread_mutex_unlock(&lib->configMutex);
+		LOGD("no room for the thumbnail header\n");
+		return -1;
+	}
+	// the fetch engine walks the thumbnail tightly packed
+	int applied = gemini_lib_hw_apply_config(lib, &inputCfg, lib->config.weCfgParams, &hwCfg,
+									&lib->config.opCfg, NULL);
+	pthread_mutex_unlock(&lib->configMutex);
+
+	const size_t ySize = (size_t)d->destWidth * d->destHeight;
+	struct msm_gemini_buf thumbnailOutput = {
+		.type = output->type,
+		.fd = output->fd,
+		.vaddr = slot + headerLength,
+		.y_off = output->y_off + slotOffset + headerLength,
+		.y_len = thumbnailCfg->maxBytes - headerLength - 2, // and EOI
+	};
+	struct msm_gemini_buf thumbnailInput = {
+		.type = input->type,
+		.fd = mem->fd,
+		.vaddr = mem->vaddr,
+		.y_off = 0,
+		.y_len = ySize,
+		.cbcr_off = ySize,
+		.cbcr_len = ySize / 2,
+		.num_of_mcu_rows = inputCfg.frame_height_mcus,
+	};
+	struct msm_gemini_hw_cmds *hw_start = applied == 0 ? gemini_lib_hw_start(&lib->cmd_type) : NULL;
+	if (hw_start)
+	{
+		startThumbnailPhase(lib, THUMBNAIL_ENCODE);
+		size_t bitstreamLength;
+		if (deviceIoctl(lib->deviceFd, MSM_GMN_IOCTL_OUTPUT_BUF_ENQUEUE, &thumbnailOutput) == 0
+			&& deviceIoctl(lib->deviceFd, MSM_GMN_IOCTL_INPUT_BUF_ENQUEUE, &thumbnailInput) == 0
+			&& deviceIoctl(lib->deviceFd, MSM_GMN_IOCTL_START, hw_start) == 0
+			&& waitThumbnailPhase(lib, &bitstreamLength) == 0
+			&& bitstreamLength <= thumbnailOutput.y_len)
+		{
+			uint8_t *eoi = slot + headerLength + bitstreamLength;
+			eoi[0] = 0xFF;
+			eoi[1] = 0xD9;
+			ret = headerLength + bitstreamLength + 2;
+		}
+		free(hw_start);
+	}
+
+	// back to the main configuration for the next job
+	pthread_mutex_lock(&lib->configMutex);
+	applied = gemini_lib_hw_apply_config(lib, &lib->config.inputCfg, lib->config.weCfgParams,
+									&lib->config.hwCfg, &lib->config.opCfg, configuredLayout(lib));
+	lib->config.valid = (applied == 0);
+	pthread_mutex_unlock(&lib->configMutex);
 	return ret;
 }
 
+/** Encode the frame in input into output, together with a thumbnail that is
+ * embedded into the EXIF APP1 segment of the main image. The thumbnail is
+ * scaled down from input by the CPU (using the threads of
+ * gemini_lib_set_worker_threads()) while the hardware encodes the main
+ * image, then the hardware encodes it straight into room reserved in the
+ * header of output, so nothing is copied afterwards.
+ * Needs an H2V1 or H2V2 configuration, a single output buffer large enough
+ * for the main image plus thumbnailCfg->maxBytes, and the event and output
+ * threads. Runs synchronously: the callbacks are not called for either job.
+ * The container configured with gemini_lib_set_container() (which must not
+ * have EXIF data or a thumbnail of its own) is used for the main image.
+ * @param thumbnailLength Set to the length of the embedded thumbnail JPEG
+ *                        file, 0 if only the main image could be encoded.
+ * @return The number of iovec entries describing the main image, see
+ *         gemini_lib_container_get_iov(), or -1.
+ */
+int gemini_lib_encode_with_thumbnail(struct gemini *lib, struct msm_gemini_buf *input, struct msm_gemini_buf *output,
+						const struct gemini_thumbnail_cfg *thumbnailCfg, struct iovec *iov, int iovcnt,
+						size_t *thumbnailLength)
+{
+	struct outputContainer *c = &lib->container;
+	struct thumbnailScale scale;
+	*thumbnailLength = 0;
+	if (!lib->eventThreadCallback || !lib->outputThreadCallback || lib->grayscale)
+	{
+		LOGD("needs the event and output threads, and colour\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&lib->configMutex);
+	const bool configured = lib->config.valid;
+	const struct gemini_input_cfg inputCfg = lib->config.inputCfg;
+	pthread_mutex_unlock(&lib->configMutex);
+	if (!configured || gemini_lib_mcu_h_samp(inputCfg.inputFormat) != 2)
+	{
+		LOGD("need an H2V1 or H2V2 configuration\n");
+		return -1;
+	}
+	memset(&scale, 0, sizeof(scale));
+	if (thumbnailGeometry(&inputCfg, thumbnailCfg, &scale.d) != 0)
+		return -1;
+	const size_t thumbnailSize = (size_t)scale.d.destWidth * scale.d.destHeight * 3 / 2;
+	if (ensurePmemBuffer(&lib->thumbnail.input, thumbnailSize) != 0)
+		return -1;
+	const unsigned int bands = scale.d.destHeight / 16;
+	const size_t accLength = (size_t)bands * scale.d.width;
+	if (lib->thumbnail.accLength < accLength)
+	{
+		uint16_t *acc = realloc(lib->thumbnail.acc, accLength * sizeof(*acc));
+		if (!acc)
+			return -1;
+		lib->thumbnail.acc = acc;
+		lib->thumbnail.accLength = accLength;
+	}
+	scale.acc = lib->thumbnail.acc;
+	thumbnailSource(lib, input, &scale.d);
+	scale.d.yDest = lib->thumbnail.input.vaddr;
+	scale.d.yDestStride = scale.d.destWidth;
+	scale.d.crcbDest = scale.d.yDest + scale.d.destWidth * scale.d.destHeight;
+	scale.d.crcbDestStride = scale.d.destWidth;
+
+	// main image header with room for the thumbnail
+	struct gemini_jfif_cfg cfg;
+	pthread_mutex_lock(&c->mutex);
+	if (c->enabled)
+		cfg = c->cfg;
+	else
+		memset(&cfg, 0, sizeof(cfg));
+	pthread_mutex_unlock(&c->mutex);
+	if (cfg.exif || cfg.thumbnail)
+	{
+		LOGD("container already has EXIF data\n");
+		return -1;
+	}
+	cfg.thumbnailLength = thumbnailCfg->maxBytes;
+	cfg.embedded = false;
+
+	startThumbnailPhase(lib, THUMBNAIL_MAIN);
+	int ret = outputBufEnqueue(lib, output, &cfg);
+	pthread_mutex_lock(&c->mutex);
+	uint8_t *header = c->header;
+	const struct gemini_jfif_layout layout = c->layout;
+	pthread_mutex_unlock(&c->mutex);
+	if (ret == 0 && header != output->vaddr)
+	{
+		LOGD("no room for the header in the output buffer\n");
+		gemini_lib_stop(lib, 1);
+		ret = -1;
+	}
+	if (ret == 0)
+		ret = gemini_lib_input_buf_enq(lib, input);
+	if (ret == 0)
+		ret = gemini_lib_encode(lib);
+
+	// downscale while the hardware is busy with the main image
+	uint64_t startUs = monotonicTimeUs();
+	if (ret == 0)
+		ret = gemini_bandpool_run(lib->bandpool, bands, thumbnailScaleBand, NULL, &scale);
+	const uint64_t scaledUs = monotonicTimeUs();
+	if (ret == 0)
+		ret = waitThumbnailPhase(lib, NULL);
+	const uint64_t mainDoneUs = monotonicTimeUs();
+
+	bool thumbnailDone = false;
+	if (ret == 0)
+	{
+		int length = encodeThumbnail(lib, &scale.d, thumbnailCfg, cfg.alignment, input, output,
+									header + layout.thumbnailOffset, layout.thumbnailOffset);
+		thumbnailDone = length > 0;
+		*thumbnailLength = thumbnailDone ? (size_t)length : 0;
+		gemini_jfif_fill_thumbnail_length(header, &layout, *thumbnailLength);
+	}
+	const uint64_t endUs = monotonicTimeUs();
+	startThumbnailPhase(lib, THUMBNAIL_IDLE);
+
+	pthread_mutex_lock(&lib->statsMutex);
+	lib->stats.thumbnailJobs++;
+	if (!thumbnailDone)
+		lib->stats.thumbnailFailures++;
+	lib->stats.thumbnailScaleUs += scaledUs - startUs;
+	lib->stats.thumbnailWaitUs += mainDoneUs - scaledUs;
+	lib->stats.thumbnailEncodeUs += endUs - mainDoneUs;
+	pthread_mutex_unlock(&lib->statsMutex);
+	if (ret != 0)
+		return -1;
+	return gemini_lib_container_get_iov(lib, iov, iovcnt);
+}
+
 void gemini_lib_send_thread_ready(struct gemini *lib, struct workerThread *thread)
 {
 	pthread_t threadId = thread->tid;
@@ -447,7 +2633,8 @@ void gemini_lib_send_thread_ready(struct gemini *lib, struct workerThread *threa
 
 void* do_mmap(size_t allocSize, int *pmemFd)
 {	
-	int fd = open(PMEM_DEVICE, O_RDWR | O_DSYNC);
+	const struct gemini_device_ops *ops = __atomic_load_n(&g_deviceOps, __ATOMIC_ACQUIRE);
+	int fd = ops && ops->openBuffer ? ops->openBuffer(ops->ctx) : open(PMEM_DEVICE, O_RDWR | O_DSYNC);
 	LOGD("Open device %s!\n", PMEM_DEVICE);
 	if (fd < 0)
 	{
@@ -585,11 +2772,84 @@ int gemini_app_calc_param(struct gemini_app_param *appParam, unsigned int param1
 	return 0;
 }
 
+/** The standard quantisation tables scaled for quality, as
+ * gemini_app_calc_param() makes them.
+ */
+void gemini_lib_quant_tables(unsigned int quality, uint8_t *lumaTable, uint8_t *chromaTable)
+{
+	createQuantisizerMatrix(lumaTable, quantisizer1, quality);
+	createQuantisizerMatrix(chromaTable, quantisizer2, quality);
+}
+
+static size_t huffmanTableLength(const uint8_t *table)
+{
+	size_t length = 16;
+	for (int i = 0; i < 16; ++i)
+		length += table[i];
+	return length;
+}
+
+static void cacheConfig(struct cachedConfig *cache,
+						const struct gemini_input_cfg* inputCfg,
+						const uint8_t* hw_we_cfg_params,
+						const struct gemini_hw_cfg *pHwCfg,
+						const struct gemini_op_cfg *pOpCfg)
+{
+	cache->inputCfg = *inputCfg;
+	cache->weCfgParams[0] = hw_we_cfg_params[0];
+	cache->weCfgParams[1] = hw_we_cfg_params[1];
+	cache->hwCfg = *pHwCfg;
+	cache->opCfg = *pOpCfg;
+	if (pHwCfg->huffmanTablesAllocated)
+	{
+		for (int i = 0; i < 4; ++i)
+		{
+			size_t length = huffmanTableLength(pHwCfg->huffmanTable[i]);
+			if (length > sizeof(cache->huffmanTables[i]))
+				length = sizeof(cache->huffmanTables[i]);
+			memcpy(cache->huffmanTables[i], pHwCfg->huffmanTable[i], length);
+			cache->hwCfg.huffmanTable[i] = cache->huffmanTables[i];
+		}
+	}
+	for (int i = 0; i < 2; ++i)
+	{
+		if (pHwCfg->quantTable[i])
+		{
+			memcpy(cache->quantTables[i], pHwCfg->quantTable[i], sizeof(cache->quantTables[i]));
+			cache->hwCfg.quantTable[i] = cache->quantTables[i];
+		}
+	}
+}
+
 int gemini_lib_hw_config(struct gemini *lib,
 						const struct gemini_input_cfg* inputCfg,
 						const uint8_t* hw_we_cfg_params,
 						const struct gemini_hw_cfg *pHwCfg,
 						const struct gemini_op_cfg *pOpCfg)
+{
+	pthread_mutex_lock(&lib->configMutex);
+	cacheConfig(&lib->config, inputCfg, hw_we_cfg_params, pHwCfg, pOpCfg);
+	lib->rateControl.jobOpen = false;
+	rateControlJobStart(lib, false);
+	lib->huffman.inConfig = false;
+	huffmanJobStart(lib, false);
+	int ret = gemini_lib_hw_apply_config(lib, inputCfg, hw_we_cfg_params, &lib->config.hwCfg, pOpCfg,
+									configuredLayout(lib));
+	lib->config.valid = (ret == 0);
+	pthread_mutex_unlock(&lib->configMutex);
+	if (ret == 0)
+		sizeRestartIndex(lib, inputCfg, pHwCfg->restartMarker);
+	return ret;
+}
+
+/* layout is the one of gemini_lib_set_input_layout() the fetch engine walks,
+ * NULL for tightly packed planes. */
+static int gemini_lib_hw_apply_config(struct gemini *lib,
+						const struct gemini_input_cfg* inputCfg,
+						const uint8_t* hw_we_cfg_params,
+						const struct gemini_hw_cfg *pHwCfg,
+						const struct gemini_op_cfg *pOpCfg,
+						const struct gemini_plane_layout *layout)
 {
 	uint16_t huffmanValues4[512];
 	uint16_t huffmanValues3[512];
@@ -600,7 +2860,7 @@ int gemini_lib_hw_config(struct gemini *lib,
 	
 	// Reset device
 	struct msm_gemini_ctrl_cmd gemini_reset_ctrl_cmd = {pOpCfg->op_mode};
-	ret = ioctl(deviceFd, MSM_GMN_IOCTL_RESET, &gemini_reset_ctrl_cmd);
+	ret = deviceIoctl(deviceFd, MSM_GMN_IOCTL_RESET, &gemini_reset_ctrl_cmd);
 	ALOGE("ioctl MSM_GMN_IOCTL_RESET: rc = %d\n", ret);
 	if (ret != 0)
 		goto fail;
@@ -608,7 +2868,7 @@ int gemini_lib_hw_config(struct gemini *lib,
 	// Get HW version
 	struct msm_gemini_hw_cmd getVersion; // [sp+880h] [bp-48h]
 	gemini_lib_hw_get_version(&getVersion);
-	ret = ioctl(deviceFd, MSM_GMN_IOCTL_GET_HW_VERSION, &getVersion);
+	ret = deviceIoctl(deviceFd, MSM_GMN_IOCTL_GET_HW_VERSION, &getVersion);
 	ALOGE("ioctl %s: rc = %d, version: %d\n", GEMINI_DEVICE, ret, getVersion.data);
 	if (ret != 0)
 		goto fail;
@@ -617,7 +2877,7 @@ int gemini_lib_hw_config(struct gemini *lib,
 	struct msm_gemini_hw_cmds *hw_fe_cfg = gemini_lib_hw_fe_cfg(inputCfg);
 	if (!hw_fe_cfg)
 		goto fail;
-	ret = ioctl(deviceFd, MSM_GMN_IOCTL_HW_CMDS, hw_fe_cfg);
+	ret = deviceIoctl(deviceFd, MSM_GMN_IOCTL_HW_CMDS, hw_fe_cfg);
 	free(hw_fe_cfg);
 	ALOGE("ioctl gemini_lib_hw_fe_cfg: rc = %d\n", ret);
 	if (ret != 0)
@@ -630,20 +2890,28 @@ int gemini_lib_hw_config(struct gemini *lib,
 		.frame_width_mcus = inputCfg->frame_width_mcus,
 		.frame_height_mcus = inputCfg->frame_height_mcus,
 	};
-	struct msm_gemini_hw_cmds *hw_op_cfg = gemini_lib_hw_op_cfg(pOpCfg, &outputCfg);
+	unsigned int yStride = 0, cbcrStride = 0;
+	if (layout && fetchStridesProgrammable(pOpCfg))
+	{
+		yStride = layout->yStride;
+		cbcrStride = layout->cbcrStride;
+	}
+	struct msm_gemini_hw_cmds *hw_op_cfg = gemini_lib_hw_op_cfg_strided(pOpCfg, &outputCfg, yStride, cbcrStride);
 	if (!hw_op_cfg)
 		goto fail;
-	ret = ioctl(deviceFd, MSM_GMN_IOCTL_HW_CMDS, hw_op_cfg);
+	ret = deviceIoctl(deviceFd, MSM_GMN_IOCTL_HW_CMDS, hw_op_cfg);
 	free(hw_op_cfg);
 	ALOGE("ioctl gemini_lib_hw_op_cfg: rc = %d\n", ret);
 	if (ret != 0)
 		goto fail;
+	lib->inputLayout.programmedYStride = yStride;
+	lib->inputLayout.programmedCbcrStride = cbcrStride;
 	
 	// Configure WE
 	struct msm_gemini_hw_cmds *hw_we_cfg = gemini_lib_hw_we_cfg(hw_we_cfg_params);
 	if (!hw_we_cfg)
 		goto fail;
-	ret = ioctl(deviceFd, MSM_GMN_IOCTL_HW_CMDS, hw_we_cfg);
+	ret = deviceIoctl(deviceFd, MSM_GMN_IOCTL_HW_CMDS, hw_we_cfg);
 	free(hw_we_cfg);
 	ALOGE("ioctl gemini_lib_hw_we_cfg: rc = %d\n", ret);
 	if (ret != 0)
@@ -658,7 +2926,7 @@ int gemini_lib_hw_config(struct gemini *lib,
 	struct msm_gemini_hw_cmds *hw_pipeline_cfg = gemini_lib_hw_pipeline_cfg(&pipelineCfg);
 	if (!hw_pipeline_cfg)
 		goto fail;
-	ret = ioctl(deviceFd, MSM_GMN_IOCTL_HW_CMDS, hw_pipeline_cfg);
+	ret = deviceIoctl(deviceFd, MSM_GMN_IOCTL_HW_CMDS, hw_pipeline_cfg);
 	free(hw_pipeline_cfg);
 	ALOGE("ioctl gemini_lib_hw_pipeline_cfg: rc = %d\n", ret);
 	if (ret != 0)
@@ -668,7 +2936,7 @@ int gemini_lib_hw_config(struct gemini *lib,
 	struct msm_gemini_hw_cmds *hw_restart_marker_set = gemini_lib_hw_restart_marker_set(pHwCfg->restartMarker);
 	if (!hw_restart_marker_set)
 		goto fail;
-	ret = ioctl(deviceFd, MSM_GMN_IOCTL_HW_CMDS, hw_restart_marker_set);
+	ret = deviceIoctl(deviceFd, MSM_GMN_IOCTL_HW_CMDS, hw_restart_marker_set);
 	free(hw_restart_marker_set);
 	ALOGE("ioctl restart marker: rc = %d\n", ret);
 	if (ret != 0)
@@ -687,7 +2955,7 @@ int gemini_lib_hw_config(struct gemini *lib,
 		{
 			goto fail;
 		}
-		ret = ioctl(deviceFd, MSM_GMN_IOCTL_HW_CMDS, hw_set_huffman_tables);
+		ret = deviceIoctl(deviceFd, MSM_GMN_IOCTL_HW_CMDS, hw_set_huffman_tables);
 		free(hw_set_huffman_tables);
 		ALOGE("ioctl huffman: rc = %d\n", ret);
 		if (ret != 0)
@@ -704,7 +2972,7 @@ int gemini_lib_hw_config(struct gemini *lib,
 		struct msm_gemini_hw_cmds *hw_set_quant_tables = gemini_lib_hw_set_quant_tables(quantTable1, quantTable2);
 		if (!hw_set_quant_tables)
 			goto fail;
-		ret = ioctl(deviceFd, MSM_GMN_IOCTL_HW_CMDS, hw_set_quant_tables);
+		ret = deviceIoctl(deviceFd, MSM_GMN_IOCTL_HW_CMDS, hw_set_quant_tables);
 		free(hw_set_quant_tables);
 		ALOGE("ioctl gemini_lib_hw_set_quant_tables: rc = %d\n", ret);
 		if (ret != 0)
@@ -712,7 +2980,7 @@ int gemini_lib_hw_config(struct gemini *lib,
 		struct msm_gemini_hw_cmds *hw_read_quant_tables = gemini_lib_hw_read_quant_tables();
 		if (!hw_read_quant_tables)
 			goto fail;
-		ret = ioctl(deviceFd, MSM_GMN_IOCTL_HW_CMDS, hw_read_quant_tables);
+		ret = deviceIoctl(deviceFd, MSM_GMN_IOCTL_HW_CMDS, hw_read_quant_tables);
 		free(hw_read_quant_tables);
 	}
 	
@@ -722,7 +2990,7 @@ int gemini_lib_hw_config(struct gemini *lib,
 		struct msm_gemini_hw_cmds *hw_set_filesize_ctrl = gemini_lib_hw_set_filesize_ctrl(&pHwCfg->filesizeCtrlCfg);
 		if (!hw_set_filesize_ctrl)
 			goto fail;
-		ret = ioctl(deviceFd, MSM_GMN_IOCTL_HW_CMDS, hw_set_filesize_ctrl);
+		ret = deviceIoctl(deviceFd, MSM_GMN_IOCTL_HW_CMDS, hw_set_filesize_ctrl);
 		free(hw_set_filesize_ctrl);
 		ALOGE("ioctl gemini_lib_hw_set_filesize_ctrl: rc = %d\n", ret);
 		if (ret != 0)
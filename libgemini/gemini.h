@@ -16,8 +16,9 @@
 
 #include <stdbool.h>
 #include <stdint.h>
-
-typedef long pthread_t;
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 struct gemini;
 struct workerThread;
@@ -26,6 +27,25 @@ struct msm_gemini_hw_cmd;
 struct msm_gemini_buf;
 struct msm_gemini_ctrl_cmd;
 
+// Values of gemini_input_cfg.inputFormat, as used by gemini_lib_hw_op_cfg()
+enum gemini_input_format
+{
+	GEMINI_INPUT_H1V1,
+	GEMINI_INPUT_H1V2,
+	GEMINI_INPUT_H2V1,
+	GEMINI_INPUT_H2V2,
+};
+
+static __inline unsigned int gemini_lib_mcu_h_samp(unsigned int inputFormat)
+{
+	return inputFormat == GEMINI_INPUT_H2V1 || inputFormat == GEMINI_INPUT_H2V2 ? 2 : 1;
+}
+
+static __inline unsigned int gemini_lib_mcu_v_samp(unsigned int inputFormat)
+{
+	return inputFormat == GEMINI_INPUT_H1V2 || inputFormat == GEMINI_INPUT_H2V2 ? 2 : 1;
+}
+
 struct gemini_input_cfg
 {
 	unsigned int inputFormat;
@@ -85,6 +105,218 @@ struct gemini_hw_cfg
 	struct gemini_filesize_ctrl_cfg filesizeCtrlCfg;
 };
 
+/* Where the encoded area is located in an input buffer. The size of the area
+ * is the frame size given to gemini_lib_hw_config(). */
+struct gemini_plane_layout
+{
+	unsigned int yOffset;
+	unsigned int yStride; // bytes per row
+	unsigned int cbcrOffset;
+	unsigned int cbcrStride; // bytes per row of the interleaved plane
+	unsigned int cropX; // top left corner of the encoded area, in pixels
+	unsigned int cropY;
+};
+
+// Formats gemini_lib_convert_input() accepts
+enum gemini_source_format
+{
+	GEMINI_SOURCE_YUYV,
+	GEMINI_SOURCE_I420,
+	GEMINI_SOURCE_RGB565,
+	GEMINI_SOURCE_RGBA8888,
+	GEMINI_SOURCE_NV12, // Y plane and interleaved CbCr plane in planes[1]
+	GEMINI_SOURCE_NV21, // same with CrCb
+	GEMINI_SOURCE_FORMAT_COUNT,
+};
+
+/* Transformation of the source by gemini_lib_transform_input(), the values
+ * are the EXIF orientation minus one. Rotation is clockwise. */
+enum gemini_transform
+{
+	GEMINI_TRANSFORM_NONE,
+	GEMINI_TRANSFORM_MIRROR, // left-right
+	GEMINI_TRANSFORM_ROT180,
+	GEMINI_TRANSFORM_FLIP, // top-bottom
+	GEMINI_TRANSFORM_TRANSPOSE,
+	GEMINI_TRANSFORM_ROT90,
+	GEMINI_TRANSFORM_TRANSVERSE,
+	GEMINI_TRANSFORM_ROT270,
+};
+
+struct gemini_source_image
+{
+	unsigned int format; // one of GEMINI_SOURCE_*
+	unsigned int width; // in pixels, even
+	unsigned int height;
+	const uint8_t *planes[3]; // Y, U, V for I420, only planes[0] otherwise
+	unsigned int strides[3]; // bytes per row
+};
+
+struct gemini_jfif_cfg
+{
+	const uint8_t *exif; // TIFF structure following "Exif\0\0", or NULL
+	size_t exifLength;
+	const uint8_t *thumbnail; // complete JPEG, needs exif to be NULL
+	size_t thumbnailLength; // with thumbnail NULL, room reserved for one
+	bool embedded; // no APP0/APP1 segment, for a thumbnail inside another file
+	unsigned int alignment; // entropy coded data starts at a multiple of this
+	bool restartIndex; // reserve an APP9 segment for the RSTn marker offsets
+	bool grayscale; // single component frame, see gemini_jfif_transcode_grayscale()
+};
+
+// See gemini_scan_walk()
+struct gemini_scan_visitor
+{
+	void (*block)(void *arg, const uint8_t *data, unsigned int component, int dc,
+				size_t acStart, size_t acEnd);
+	uint32_t (*counts)[256];
+	void *arg;
+};
+
+// Where gemini_jfif_write_header() put the parts that are filled in later
+struct gemini_jfif_layout
+{
+	size_t restartIndexOffset;
+	unsigned int restartIndexSlots;
+	size_t thumbnailOffset; // room reserved with gemini_jfif_cfg.thumbnailLength
+	size_t thumbnailLengthOffset;
+};
+
+// See gemini_lib_encode_with_thumbnail()
+struct gemini_thumbnail_cfg
+{
+	unsigned int maxWidth; // the thumbnail fits into this, keeping the aspect ratio
+	unsigned int maxHeight;
+	unsigned int quality; // 0 for the quantisation tables of the main image
+	size_t maxBytes; // room for the thumbnail JPEG file in APP1
+};
+
+// Downscaling job of gemini_downscale_rows()
+struct gemini_downscale
+{
+	const uint8_t *y;
+	size_t yStride;
+	const uint8_t *crcb;
+	size_t crcbStride;
+	unsigned int width; // of the source frame in pixels
+	unsigned int height;
+	bool subsampledV; // H2V2 source, H2V1 otherwise
+	unsigned int factor;
+	uint8_t *yDest; // H2V2 thumbnail frame
+	size_t yDestStride;
+	uint8_t *crcbDest;
+	size_t crcbDestStride;
+	unsigned int destWidth; // MCU aligned
+	unsigned int destHeight;
+};
+
+struct gemini_lib_stats
+{
+	unsigned int jobs;
+	unsigned int timeouts;
+	unsigned int recoveries;
+	unsigned int failedRecoveries;
+	uint64_t lastRecoveryUs;
+	uint64_t maxRecoveryUs;
+	uint64_t totalRecoveryUs;
+	unsigned int warmInits;
+	unsigned int inputDirect;
+	unsigned int inputRepacked;
+	uint64_t convertPixels[GEMINI_SOURCE_FORMAT_COUNT];
+	uint64_t convertUs[GEMINI_SOURCE_FORMAT_COUNT];
+	uint64_t transformPixels; // only rotated or mirrored NV12/NV21 input
+	uint64_t transformUs;
+	unsigned int rateJobs; // jobs encoded in target size mode
+	unsigned int rateHits; // ... that ended up in the tolerance band
+	unsigned int rateOvershoots;
+	unsigned int rateUndershoots;
+	unsigned int rateLastQuality;
+	unsigned int thumbnailJobs; // gemini_lib_encode_with_thumbnail() calls
+	unsigned int thumbnailFailures; // ... that produced the main image only
+	uint64_t thumbnailScaleUs; // downscaling, overlapped with the main image
+	uint64_t thumbnailWaitUs; // waiting for the main image after downscaling
+	uint64_t thumbnailEncodeUs; // thumbnail job including both reconfigurations
+	unsigned int huffmanLearned; // jobs analysed by gemini_lib_learn_huffman()
+	unsigned int huffmanOptimizedJobs; // ... that were encoded with learned tables
+	int64_t huffmanLastSavedBytes; // of the last analysed job, against the standard tables
+	int64_t huffmanSavedBytes; // sum over all analysed jobs
+	unsigned int completionQueueFull; // worker thread waited for gemini_lib_poll_completions()
+};
+
+enum gemini_mjpeg_mux
+{
+	GEMINI_MJPEG_MUX_MULTIPART, // multipart/x-mixed-replace like stream
+	GEMINI_MJPEG_MUX_AVI,
+};
+
+// What gemini_mjpeg_get_frame() does when all input frames are in use
+enum gemini_mjpeg_drop_policy
+{
+	GEMINI_MJPEG_DROP_NEWEST,
+	GEMINI_MJPEG_DROP_OLDEST,
+	GEMINI_MJPEG_BLOCK,
+};
+
+struct gemini_mjpeg_cfg
+{
+	// passed to gemini_lib_hw_config(), the tables must stay valid
+	struct gemini_input_cfg inputCfg;
+	uint8_t weCfgParams[2];
+	struct gemini_hw_cfg hwCfg;
+	struct gemini_op_cfg opCfg;
+	struct gemini_jfif_cfg jfif; // header of every frame
+	unsigned int inputBuffers;
+	unsigned int outputBuffers;
+	size_t outputBufferSize; // 0 for the size of the luma plane
+	int fd; // stream destination
+	unsigned int mux; // one of GEMINI_MJPEG_MUX_*
+	unsigned int dropPolicy; // one of GEMINI_MJPEG_DROP_*, GEMINI_MJPEG_BLOCK
+	unsigned int framesPerSecond; // nominal rate for the AVI header
+	bool optimizeHuffman; // see gemini_lib_set_huffman_optimization()
+};
+
+// Input frame of a gemini_mjpeg pipeline, fill y and cbcr
+struct gemini_mjpeg_frame
+{
+	uint8_t *y;
+	size_t yLength;
+	uint8_t *cbcr;
+	size_t cbcrLength;
+	unsigned int index;
+	uint64_t timestampUs;
+	uint64_t submitUs;
+};
+
+struct gemini_mjpeg_stats
+{
+	unsigned int submitted;
+	unsigned int encoded;
+	unsigned int written;
+	unsigned int dropped;
+	unsigned int errors;
+	uint64_t bytes;
+	unsigned int averageFpsMilli; // written frames per 1000 s since the start
+	unsigned int recentFpsMilli; // ... over the last second or so
+	uint64_t lastLatencyUs; // submission until written
+	uint64_t maxLatencyUs;
+	uint64_t totalLatencyUs;
+	uint64_t lastEncodeUs; // hardware job
+	uint64_t maxEncodeUs;
+};
+
+// Size model of the target size mode, see gemini_ratectl.c
+struct gemini_ratectl
+{
+	size_t targetBytes;
+	unsigned int tolerancePercent;
+	unsigned int initialQuality;
+	unsigned int observations;
+	double logK;
+	double gamma;
+	double lastLogScale;
+	double lastLogBpp;
+};
+
 typedef void (*eventThreadCallback_t)(struct gemini *, struct msm_gemini_ctrl_cmd *);
 typedef void (*inputThreadCallback_t)(struct gemini *, struct msm_gemini_buf *);
 typedef void (*outputThreadCallback_t)(struct gemini *, struct msm_gemini_buf *);
@@ -95,6 +327,47 @@ int gemini_lib_init(int **fdOut,
 					outputThreadCallback_t outputThreadCallback);
 
 void gemini_lib_release(struct gemini *lib);
+// Session owning the descriptor handed out by gemini_lib_init()
+struct gemini *gemini_lib_from_fd(int *fd);
+
+enum gemini_completion_kind
+{
+	GEMINI_COMPLETION_EVENT,
+	GEMINI_COMPLETION_INPUT,
+	GEMINI_COMPLETION_OUTPUT,
+};
+
+// What the thread callbacks would have been passed, see gemini_lib_init_eventfd()
+struct gemini_completion
+{
+	unsigned int kind; // one of GEMINI_COMPLETION_*
+	int eventType; // MSM_GEMINI_EVT_* of events
+	void *vaddr; // input or output buffer
+	int fd;
+	uint32_t length; // y_len of inputs, framedone_len of outputs
+	uint64_t timestampUs; // CLOCK_MONOTONIC when it was queued
+};
+
+int gemini_lib_init_eventfd(int **fdOut, unsigned int queueSize, int *eventFdOut);
+int gemini_lib_poll_completions(struct gemini *lib, struct gemini_completion *completions,
+								unsigned int maxCount);
+
+int gemini_lib_set_keepalive(unsigned int idleTimeoutMs);
+
+// Replacement for the kernel device, see gemini_lib_set_device_ops()
+struct gemini_device_ops
+{
+	int (*open)(void *ctx);
+	int (*close)(void *ctx, int fd);
+	int (*ioctl)(void *ctx, int fd, unsigned long request, void *arg);
+	void *ctx;
+	int (*openBuffer)(void *ctx); // file to map in do_mmap(), NULL for pmem
+};
+
+void gemini_lib_set_device_ops(const struct gemini_device_ops *ops);
+
+void gemini_lib_set_user_data(struct gemini *lib, void *userData);
+void* gemini_lib_get_user_data(struct gemini *lib);
 
 int gemini_lib_wait_done(struct gemini *lib);
 
@@ -102,6 +375,10 @@ int gemini_lib_encode(struct gemini* lib);
 
 int gemini_lib_stop(struct gemini *lib, int lazyStop);
 
+int gemini_lib_set_job_timeout(struct gemini *lib, unsigned int timeoutMs);
+
+void gemini_lib_get_stats(struct gemini *lib, struct gemini_lib_stats *stats);
+
 void gemini_lib_wait_thread_ready(struct gemini *lib, pthread_t *tid);
 
 void gemini_lib_send_thread_ready(struct gemini *lib, struct workerThread *thread);
@@ -112,16 +389,104 @@ int gemini_lib_hw_config(struct gemini *lib,
 						const struct gemini_hw_cfg *pHwCfg,
 						const struct gemini_op_cfg *pOpCfg);
 
+struct pmemBuffer
+{
+	void *vaddr;
+	int fd;
+	size_t size;
+};
+
 void* do_mmap(size_t allocSize, int *pmemFd);
 int do_munmap(int pmemFd, void* memory, size_t allocSize);
 
 void gemini_lib_hw_create_huffman_table(unsigned char *table, unsigned char *table2, uint16_t *table3, bool flag);
 
+const uint8_t* gemini_lib_std_huffman_table(int index);
+void gemini_huffman_optimal_table(const uint32_t *counts, int index, uint8_t *table);
+uint64_t gemini_huffman_code_bits(const uint32_t *counts, const uint8_t *table);
+
 void gemini_lib_hw_create_huffman_tables(const struct gemini_hw_cfg* huffmanTable, uint16_t* huffmanValues1, uint16_t* huffmanValues2, uint16_t* huffmanValues3, uint16_t* huffmanValues4);
 
+int gemini_lib_set_container(struct gemini *lib, const struct gemini_jfif_cfg *cfg);
+int gemini_lib_container_get_iov(struct gemini *lib, struct iovec *iov, int iovcnt);
+int gemini_lib_set_restart_index(struct gemini *lib, bool enable);
+int gemini_lib_get_restart_index(struct gemini *lib, uint32_t *offsets, unsigned int maxCount);
+unsigned int gemini_lib_restart_marker_count(const struct gemini_input_cfg *inputCfg, uint16_t restartInterval);
+
+int gemini_jfif_header_size(const struct gemini_jfif_cfg *cfg,
+						const struct gemini_input_cfg *inputCfg,
+						const struct gemini_hw_cfg *hwCfg);
+int gemini_jfif_write_header(uint8_t *dest, size_t size,
+						const struct gemini_jfif_cfg *cfg,
+						const struct gemini_input_cfg *inputCfg,
+						const struct gemini_hw_cfg *hwCfg,
+						struct gemini_jfif_layout *layout);
+int gemini_jfif_transcode_grayscale(const struct iovec *iov, int iovcnt,
+						const struct gemini_jfif_cfg *cfg,
+						const struct gemini_input_cfg *inputCfg,
+						const struct gemini_hw_cfg *hwCfg,
+						uint8_t *dest, size_t size);
+int gemini_scan_walk(const struct iovec *iov, int iovcnt,
+						const struct gemini_input_cfg *inputCfg,
+						const struct gemini_hw_cfg *hwCfg,
+						const struct gemini_scan_visitor *visitor);
+void gemini_jfif_fill_restart_index(uint8_t *header, const struct gemini_jfif_layout *layout,
+						uint32_t base, const uint32_t *offsets, unsigned int count);
+void gemini_jfif_fill_thumbnail_length(uint8_t *header, const struct gemini_jfif_layout *layout,
+						uint32_t length);
+
+int gemini_lib_set_input_layout(struct gemini *lib, const struct gemini_plane_layout *layout);
+int gemini_lib_set_grayscale(struct gemini *lib, bool enable);
+int gemini_lib_grayscale_jpeg(struct gemini *lib, const struct iovec *iov, int iovcnt,
+						const struct gemini_jfif_cfg *cfg, uint8_t *dest, size_t size);
+int gemini_lib_set_worker_threads(struct gemini *lib, unsigned int threads);
+int gemini_lib_convert_input(struct gemini *lib, const struct gemini_source_image *src,
+						const struct msm_gemini_buf *dest, unsigned int streamMcuRows);
+int gemini_lib_transform_input(struct gemini *lib, const struct gemini_source_image *src, unsigned int transform,
+						const struct msm_gemini_buf *dest, unsigned int streamMcuRows);
+void gemini_transform_size(const struct gemini_source_image *src, unsigned int transform,
+						unsigned int *width, unsigned int *height);
+void gemini_transform_rows(const struct gemini_source_image *src, unsigned int transform,
+						unsigned int firstRow, unsigned int rows,
+						uint8_t *yDest, size_t yStride, uint8_t *crcbDest, size_t crcbStride);
+void gemini_convert_rows(const struct gemini_source_image *src, unsigned int firstRow, unsigned int rows,
+						uint8_t *yDest, size_t yStride, uint8_t *crcbDest, size_t crcbStride, bool subsampleV);
+int gemini_lib_encode_with_thumbnail(struct gemini *lib, struct msm_gemini_buf *input, struct msm_gemini_buf *output,
+						const struct gemini_thumbnail_cfg *thumbnailCfg, struct iovec *iov, int iovcnt,
+						size_t *thumbnailLength);
+void gemini_downscale_size(unsigned int width, unsigned int height, unsigned int factor,
+						unsigned int *outWidth, unsigned int *outHeight);
+void gemini_downscale_rows(const struct gemini_downscale *d, unsigned int firstMcuRow, unsigned int mcuRows,
+						uint16_t *acc);
+
+#define GEMINI_BANDPOOL_MAX_BANDS 512
+struct gemini_bandpool;
+typedef void (*gemini_band_fn)(void *arg, unsigned int band);
+struct gemini_bandpool* gemini_bandpool_create(unsigned int threads);
+void gemini_bandpool_destroy(struct gemini_bandpool *pool);
+int gemini_bandpool_run(struct gemini_bandpool *pool, unsigned int bands,
+						gemini_band_fn work, gemini_band_fn done, void *arg);
 int gemini_lib_input_buf_enq(struct gemini *lib, struct msm_gemini_buf *buf);
 int gemini_lib_output_buf_enq(struct gemini *lib, struct msm_gemini_buf *buf);
 
+int gemini_lib_set_huffman_optimization(struct gemini *lib, bool enable);
+int gemini_lib_learn_huffman(struct gemini *lib, const struct iovec *iov, int iovcnt);
+int gemini_lib_set_target_size(struct gemini *lib, size_t targetBytes,
+						unsigned int tolerancePercent, unsigned int initialQuality);
+void gemini_lib_quant_tables(unsigned int quality, uint8_t *lumaTable, uint8_t *chromaTable);
+void gemini_ratectl_init(struct gemini_ratectl *rc, size_t targetBytes,
+						unsigned int tolerancePercent, unsigned int initialQuality);
+void gemini_ratectl_update(struct gemini_ratectl *rc, unsigned int quality, size_t bytes, uint32_t pixels);
+unsigned int gemini_ratectl_quality(const struct gemini_ratectl *rc, uint32_t pixels);
+bool gemini_ratectl_hit(const struct gemini_ratectl *rc, size_t bytes);
+
+struct gemini_mjpeg;
+struct gemini_mjpeg* gemini_mjpeg_create(const struct gemini_mjpeg_cfg *cfg);
+struct gemini_mjpeg_frame* gemini_mjpeg_get_frame(struct gemini_mjpeg *m);
+int gemini_mjpeg_submit(struct gemini_mjpeg *m, struct gemini_mjpeg_frame *frame, uint64_t timestampUs);
+void gemini_mjpeg_get_stats(struct gemini_mjpeg *m, struct gemini_mjpeg_stats *stats);
+int gemini_mjpeg_destroy(struct gemini_mjpeg *m);
+
 int gemini_app_calc_param(struct gemini_app_param *appParam, unsigned int param1, unsigned int jpegQuality, int param3, unsigned int param4, int param5, int param6);
 
 void gemini_lib_hw_get_version(struct msm_gemini_hw_cmd *out);
@@ -136,6 +501,8 @@ struct msm_gemini_hw_cmds* gemini_lib_hw_stop_realtime(bool flag);
 struct msm_gemini_hw_cmds* gemini_lib_hw_stop(const unsigned char* cmdType, bool flagRealtime);
 struct msm_gemini_hw_cmds* gemini_lib_hw_pipeline_cfg(const struct gemini_pipeline_cfg *pIn);
 struct msm_gemini_hw_cmds* gemini_lib_hw_op_cfg(const struct gemini_op_cfg* opCfg, const struct gemini_output_cfg* outCfg);
+struct msm_gemini_hw_cmds* gemini_lib_hw_op_cfg_strided(const struct gemini_op_cfg* opCfg, const struct gemini_output_cfg* outCfg,
+						unsigned int yStride, unsigned int cbcrStride);
 struct msm_gemini_hw_cmds* gemini_lib_hw_read_quant_tables();
 struct msm_gemini_hw_cmds* gemini_lib_hw_set_quant_tables(const uint8_t* table1, const uint8_t* table2);
 struct msm_gemini_hw_cmds* gemini_lib_hw_set_huffman_tables(const uint16_t* table1, const uint16_t* table2, const uint16_t* table3, const uint16_t* table4);
@@ -0,0 +1,174 @@
+/* MSM gemini (JPEG hardware encoder) userspace library
+ * Copyright (C) 2018 DafabHoid
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#define LOG_TAG "gemini"
+#include "gemini.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <log/log.h>
+
+/* Small persistent thread pool for CPU side pre-stages that work on bands of
+ * MCU rows. The calling thread works on bands as well, and is the only one
+ * to run the completion callback, strictly in band order, so finished bands
+ * can be handed to the hardware while later ones are still in progress. */
+
+struct gemini_bandpool
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t workCond;
+	pthread_cond_t doneCond;
+	bool shouldStop;
+	unsigned int threadCount;
+	pthread_t *threads;
+	// current job, protected by mutex
+	gemini_band_fn work;
+	void *arg;
+	unsigned int bandCount;
+	unsigned int nextBand;
+	uint8_t bandDone[GEMINI_BANDPOOL_MAX_BANDS];
+};
+
+static void* bandpoolThread(void *arg)
+{
+	struct gemini_bandpool *pool = arg;
+	pthread_mutex_lock(&pool->mutex);
+	while (!pool->shouldStop)
+	{
+		if (pool->nextBand >= pool->bandCount)
+		{
+			pthread_cond_wait(&pool->workCond, &pool->mutex);
+			continue;
+		}
+		unsigned int band = pool->nextBand++;
+		gemini_band_fn work = pool->work;
+		void *workArg = pool->arg;
+		pthread_mutex_unlock(&pool->mutex);
+		work(workArg, band);
+		pthread_mutex_lock(&pool->mutex);
+		pool->bandDone[band] = 1;
+		pthread_cond_signal(&pool->doneCond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+struct gemini_bandpool* gemini_bandpool_create(unsigned int threads)
+{
+	struct gemini_bandpool *pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->workCond, NULL);
+	pthread_cond_init(&pool->doneCond, NULL);
+	if (threads)
+	{
+		pool->threads = calloc(threads, sizeof(pool->threads[0]));
+		if (!pool->threads)
+		{
+			gemini_bandpool_destroy(pool);
+			return NULL;
+		}
+	}
+	for (; pool->threadCount < threads; ++pool->threadCount)
+	{
+		if (pthread_create(&pool->threads[pool->threadCount], NULL, bandpoolThread, pool) != 0)
+		{
+			ALOGE("%s: only %u of %u threads created\n", __func__, pool->threadCount, threads);
+			break;
+		}
+	}
+	return pool;
+}
+
+void gemini_bandpool_destroy(struct gemini_bandpool *pool)
+{
+	if (!pool)
+		return;
+	pthread_mutex_lock(&pool->mutex);
+	pool->shouldStop = true;
+	pthread_cond_broadcast(&pool->workCond);
+	pthread_mutex_unlock(&pool->mutex);
+	for (unsigned int i = 0; i < pool->threadCount; ++i)
+		pthread_join(pool->threads[i], NULL);
+	free(pool->threads);
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->workCond);
+	pthread_cond_destroy(&pool->doneCond);
+	free(pool);
+}
+
+/** Run work() for every band in 0..bands-1, spread over the pool and the
+ * calling thread, and done() in band order from the calling thread as soon as
+ * all bands up to that one are finished. pool may be NULL to run everything
+ * in the calling thread. done may be NULL.
+ */
+int gemini_bandpool_run(struct gemini_bandpool *pool, unsigned int bands,
+						gemini_band_fn work, gemini_band_fn done, void *arg)
+{
+	if (!pool || pool->threadCount == 0 || bands == 1)
+	{
+		for (unsigned int band = 0; band < bands; ++band)
+		{
+			work(arg, band);
+			if (done)
+				done(arg, band);
+		}
+		return 0;
+	}
+	if (bands > GEMINI_BANDPOOL_MAX_BANDS)
+	{
+		ALOGE("%s: too many bands (%u)\n", __func__, bands);
+		return -1;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	memset(pool->bandDone, 0, bands);
+	pool->work = work;
+	pool->arg = arg;
+	pool->nextBand = 0;
+	pool->bandCount = bands;
+	pthread_cond_broadcast(&pool->workCond);
+
+	unsigned int nextDone = 0;
+	while (nextDone < bands)
+	{
+		if (pool->bandDone[nextDone])
+		{
+			pthread_mutex_unlock(&pool->mutex);
+			if (done)
+				done(arg, nextDone);
+			pthread_mutex_lock(&pool->mutex);
+			++nextDone;
+		}
+		else if (pool->nextBand < bands)
+		{
+			unsigned int band = pool->nextBand++;
+			pthread_mutex_unlock(&pool->mutex);
+			work(arg, band);
+			pthread_mutex_lock(&pool->mutex);
+			pool->bandDone[band] = 1;
+		}
+		else
+		{
+			pthread_cond_wait(&pool->doneCond, &pool->mutex);
+		}
+	}
+	pool->bandCount = 0;
+	pool->nextBand = 0;
+	pthread_mutex_unlock(&pool->mutex);
+	return 0;
+}
@@ -0,0 +1,1145 @@
+/* MSM gemini (JPEG hardware encoder) userspace library
+ * Copyright (C) 2018 DafabHoid
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "gemini.h"
+#include "gemini_sim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <media/msm_gemini.h> // Kernel header
+
+/* Capture pipeline benchmark. A sensor thread reads frames out MCU row by
+ * MCU row at a fixed rate into a pool of pmem input buffers. The main
+ * thread encodes them one after the other on the simulated device of
+ * gemini_sim.c (or the hardware with -H), waiting for the completions on
+ * the eventfd of gemini_lib_init_eventfd(). A writer thread writes the
+ * finished files. Reported are the sustained shots per second, the latency
+ * from the start of the readout until the file is written, the CPU time of
+ * every stage and the memory high-water marks.
+ *
+ * With -t the quality is chosen by the target size mode of
+ * gemini_lib_set_target_size(), with -t and -R by a retry loop that
+ * re-encodes until the file fits, for comparing the two. With -t and -V the
+ * same shots go through both, the size model driven directly, and the run
+ * fails unless the model hits the target from the given shot on and needs
+ * no more encodes than the retry loop.
+ *
+ * With -M the frames go through the gemini_mjpeg pipeline into a multipart
+ * stream instead. A reader thread takes the stream apart and measures the
+ * latency of every frame from the start of its readout, which is passed as
+ * the timestamp, until it left the pipeline.
+ *
+ * With -C the CPU conversion of gemini_lib_convert_input() is measured
+ * instead, for one or all source formats at a range of frame sizes. With -X
+ * an NV21 frame is rotated and mirrored by gemini_lib_transform_input() in
+ * every way, next to the plain path that hands it to the hardware as is. */
+
+#define MAX_SHOT_IOV (16 + 2)
+#define JOB_TIMEOUT_MS 2000
+#define RETRY_LIMIT 6
+#define SWEEP_SHOTS 10 // default -n of -C and -X
+
+static const char *const sourceFormatNames[GEMINI_SOURCE_FORMAT_COUNT] = {
+	"yuyv", "i420", "rgb565", "rgba8888", "nv12", "nv21",
+};
+
+static const char *const transformNames[] = {
+	"none", "mirror", "rot180", "flip", "transpose", "rot90", "transverse", "rot270",
+};
+
+// Frame sizes of -C, the largest first
+static const unsigned int sweepSizes[][2] = {
+	{ 2592, 1952 }, { 1920, 1088 }, { 1280, 720 }, { 640, 480 },
+};
+
+struct shot
+{
+	unsigned int input;
+	unsigned int output;
+	struct iovec iov[MAX_SHOT_IOV];
+	int iovcnt;
+	size_t length;
+	unsigned int encodes;
+	bool failed;
+	uint64_t readoutStartUs;
+	uint64_t readoutEndUs;
+	uint64_t encodedUs;
+	uint64_t writtenUs;
+};
+
+struct bench
+{
+	// options
+	unsigned int width;
+	unsigned int height;
+	unsigned int shotCount;
+	unsigned int rowsPerSecond; // 0 for an unpaced readout
+	unsigned int intervalMs; // between readout starts, 0 for back to back
+	unsigned int inputBuffers;
+	unsigned int outputBuffers;
+	unsigned int quality;
+	size_t targetBytes;
+	unsigned int tolerancePercent;
+	bool retryLoop;
+	unsigned int convergeShots; // -V, 0 if not checking
+	bool hardware;
+	bool mjpeg;
+	bool convert;
+	unsigned int convertFormat; // GEMINI_SOURCE_FORMAT_COUNT for all
+	bool transform;
+	const char *outputDir;
+	struct gemini_sim_cfg simCfg;
+
+	struct gemini_sim *sim;
+	struct gemini *lib;
+	int eventFd;
+	int epollFd;
+	int writeFd;
+	struct gemini_input_cfg inputCfg;
+	uint8_t weCfgParams[2];
+	struct gemini_hw_cfg hwCfg;
+	struct gemini_op_cfg opCfg;
+	struct gemini_jfif_cfg jfif;
+	uint8_t lumaTable[64];
+	uint8_t chromaTable[64];
+	unsigned int configuredQuality;
+
+	size_t ySize;
+	size_t cbcrSize;
+	size_t outputSize;
+	struct pmemBuffer *inputs;
+	struct pmemBuffer *outputs;
+	struct shot *shots;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t inputCond; // free inputs
+	pthread_cond_t captureCond; // captured shots
+	pthread_cond_t outputCond; // free outputs
+	pthread_cond_t writeCond; // encoded shots
+	unsigned int *freeInputs; // stack
+	unsigned int freeInputCount;
+	unsigned int *freeOutputs; // stack
+	unsigned int freeOutputCount;
+	unsigned int captured; // shots read out
+	unsigned int encoded; // shots encoded, or failed
+	unsigned int written;
+	unsigned int maxCaptureQueue;
+	unsigned int maxWriteQueue;
+	unsigned int inputStalls; // readouts that waited for a free input buffer
+	unsigned int outputStalls;
+	unsigned int writeErrors;
+
+	uint64_t sensorCpuUs;
+	uint64_t encoderCpuUs;
+	uint64_t writerCpuUs;
+
+	// -M
+	int streamFd; // read end of the stream pipe
+	uint64_t *frameLatency;
+	unsigned int streamFrames;
+	uint64_t streamBytes;
+	uint64_t firstReadoutUs;
+	uint64_t lastFrameUs;
+};
+
+static uint64_t nowUs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static uint64_t cpuUs(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void sleepUntilUs(uint64_t deadlineUs)
+{
+	struct timespec ts;
+	ts.tv_sec = deadlineUs / 1000000;
+	ts.tv_nsec = (deadlineUs % 1000000) * 1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* Peak resident set size in kB, 0 if unknown */
+static unsigned long residentHighWaterKb(void)
+{
+	FILE *f = fopen("/proc/self/status", "r");
+	if (!f)
+		return 0;
+	char line[128];
+	unsigned long kb = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		if (sscanf(line, "VmHWM: %lu kB", &kb) == 1)
+			break;
+	}
+	fclose(f);
+	return kb;
+}
+
+static void fillRows(uint8_t *dest, size_t stride, unsigned int firstRow, unsigned int rows, unsigned int seed)
+{
+	for (unsigned int r = firstRow; r < firstRow + rows; ++r)
+		memset(dest + r * stride, (r + seed) & 0xFF, stride);
+}
+
+static void* sensorThread(void *arg)
+{
+	struct bench *b = arg;
+	const unsigned int mcuRows = b->inputCfg.frame_height_mcus;
+	const uint64_t firstUs = nowUs();
+
+	for (unsigned int i = 0; i < b->shotCount; ++i)
+	{
+		struct shot *s = &b->shots[i];
+		if (b->intervalMs)
+			sleepUntilUs(firstUs + (uint64_t)i * b->intervalMs * 1000);
+
+		pthread_mutex_lock(&b->mutex);
+		if (!b->freeInputCount)
+			b->inputStalls++;
+		while (!b->freeInputCount)
+			pthread_cond_wait(&b->inputCond, &b->mutex);
+		s->input = b->freeInputs[--b->freeInputCount];
+		pthread_mutex_unlock(&b->mutex);
+
+		uint8_t *y = b->inputs[s->input].vaddr;
+		uint8_t *cbcr = y + b->ySize;
+		s->readoutStartUs = nowUs();
+		for (unsigned int row = 0; row < mcuRows; ++row)
+		{
+			fillRows(y, b->width, row * 16, 16, i);
+			fillRows(cbcr, b->width, row * 8, 8, 128 + i);
+			if (b->rowsPerSecond)
+				sleepUntilUs(s->readoutStartUs + (row + 1) * 1000000ULL / b->rowsPerSecond);
+		}
+		s->readoutEndUs = nowUs();
+
+		pthread_mutex_lock(&b->mutex);
+		b->captured++;
+		if (b->captured - b->encoded > b->maxCaptureQueue)
+			b->maxCaptureQueue = b->captured - b->encoded;
+		pthread_cond_signal(&b->captureCond);
+		pthread_mutex_unlock(&b->mutex);
+	}
+	b->sensorCpuUs = cpuUs(CLOCK_THREAD_CPUTIME_ID);
+	return NULL;
+}
+
+static void* writerThread(void *arg)
+{
+	struct bench *b = arg;
+	for (unsigned int i = 0; i < b->shotCount; ++i)
+	{
+		struct shot *s = &b->shots[i];
+		pthread_mutex_lock(&b->mutex);
+		while (b->encoded <= i)
+			pthread_cond_wait(&b->writeCond, &b->mutex);
+		pthread_mutex_unlock(&b->mutex);
+
+		if (!s->failed)
+		{
+			int fd = b->writeFd;
+			if (b->outputDir)
+			{
+				char path[512];
+				snprintf(path, sizeof(path), "%s/shot%04u.jpg", b->outputDir, i);
+				fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			}
+			ssize_t ret = fd >= 0 ? writev(fd, s->iov, s->iovcnt) : -1;
+			if (ret < 0 || (size_t)ret != s->length)
+				b->writeErrors++;
+			if (b->outputDir && fd >= 0)
+				close(fd);
+		}
+		s->writtenUs = nowUs();
+
+		pthread_mutex_lock(&b->mutex);
+		b->freeOutputs[b->freeOutputCount++] = s->output;
+		b->written++;
+		pthread_cond_signal(&b->outputCond);
+		pthread_mutex_unlock(&b->mutex);
+	}
+	b->writerCpuUs = cpuUs(CLOCK_THREAD_CPUTIME_ID);
+	return NULL;
+}
+
+static int configure(struct bench *b, unsigned int quality)
+{
+	gemini_lib_quant_tables(quality, b->lumaTable, b->chromaTable);
+	b->hwCfg.quantTable[0] = b->lumaTable;
+	b->hwCfg.quantTable[1] = b->chromaTable;
+	b->configuredQuality = quality;
+	return gemini_lib_hw_config(b->lib, &b->inputCfg, b->weCfgParams, &b->hwCfg, &b->opCfg);
+}
+
+/* Drain the eventfd until the job has returned its input, at least one
+ * output buffer and MSM_GEMINI_EVT_FRAMEDONE. */
+static int waitJob(struct bench *b)
+{
+	bool done = false;
+	bool inputBack = false;
+	unsigned int outputs = 0;
+	while (!done || !inputBack || !outputs)
+	{
+		struct epoll_event event;
+		int n = epoll_wait(b->epollFd, &event, 1, JOB_TIMEOUT_MS);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		struct gemini_completion completions[8];
+		n = gemini_lib_poll_completions(b->lib, completions, 8);
+		for (int i = 0; i < n; ++i)
+		{
+			const struct gemini_completion *c = &completions[i];
+			if (c->kind == GEMINI_COMPLETION_OUTPUT)
+				outputs++;
+			else if (c->kind == GEMINI_COMPLETION_INPUT)
+				inputBack = true;
+			else if (c->eventType == MSM_GEMINI_EVT_FRAMEDONE)
+				done = true;
+			else if (c->eventType == MSM_GEMINI_EVT_ERR)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static int encodeOnce(struct bench *b, struct shot *s)
+{
+	struct msm_gemini_buf input = {
+		.fd = b->inputs[s->input].fd,
+		.vaddr = b->inputs[s->input].vaddr,
+		.y_off = 0,
+		.y_len = b->ySize,
+		.cbcr_off = b->ySize,
+		.cbcr_len = b->cbcrSize,
+		.num_of_mcu_rows = b->inputCfg.frame_height_mcus,
+	};
+	struct msm_gemini_buf output = {
+		.fd = b->outputs[s->output].fd,
+		.vaddr = b->outputs[s->output].vaddr,
+		.y_off = 0,
+		.y_len = b->outputSize,
+	};
+	if (gemini_lib_output_buf_enq(b->lib, &output) != 0
+		|| gemini_lib_input_buf_enq(b->lib, &input) != 0
+		|| gemini_lib_encode(b->lib) != 0
+		|| waitJob(b) != 0)
+	{
+		gemini_lib_stop(b->lib, 1);
+		configure(b, b->configuredQuality);
+		return -1;
+	}
+	s->encodes++;
+	s->iovcnt = gemini_lib_container_get_iov(b->lib, s->iov, MAX_SHOT_IOV);
+	if (s->iovcnt <= 0)
+		return -1;
+	s->length = 0;
+	for (int i = 0; i < s->iovcnt; ++i)
+		s->length += s->iov[i].iov_len;
+	return 0;
+}
+
+/* Bisect the quality until the file is within the tolerance band below the
+ * target, starting from the quality of the previous shot. */
+static int encodeWithRetries(struct bench *b, struct shot *s)
+{
+	const size_t minBytes = b->targetBytes * (100 - b->tolerancePercent) / 100;
+	unsigned int low = 1, high = 100;
+	unsigned int quality = b->configuredQuality;
+	for (unsigned int attempt = 0; attempt < RETRY_LIMIT; ++attempt)
+	{
+		if (quality != b->configuredQuality && configure(b, quality) != 0)
+			return -1;
+		if (encodeOnce(b, s) != 0)
+			return -1;
+		if (s->length > b->targetBytes)
+			high = quality - 1;
+		else if (s->length < minBytes)
+			low = quality + 1;
+		else
+			return 0;
+		if (low > high)
+			break;
+		quality = (low + high) / 2;
+	}
+	// the last attempt may still be too large, a real retry loop would drop it
+	return 0;
+}
+
+static void encoderLoop(struct bench *b)
+{
+	const uint64_t cpuStart = cpuUs(CLOCK_THREAD_CPUTIME_ID);
+	for (unsigned int i = 0; i < b->shotCount; ++i)
+	{
+		struct shot *s = &b->shots[i];
+		pthread_mutex_lock(&b->mutex);
+		while (b->captured <= i)
+			pthread_cond_wait(&b->captureCond, &b->mutex);
+		if (!b->freeOutputCount)
+			b->outputStalls++;
+		while (!b->freeOutputCount)
+			pthread_cond_wait(&b->outputCond, &b->mutex);
+		s->output = b->freeOutputs[--b->freeOutputCount];
+		pthread_mutex_unlock(&b->mutex);
+
+		int ret = b->retryLoop ? encodeWithRetries(b, s) : encodeOnce(b, s);
+		s->failed = ret != 0;
+		s->encodedUs = nowUs();
+
+		pthread_mutex_lock(&b->mutex);
+		b->freeInputs[b->freeInputCount++] = s->input;
+		b->encoded++;
+		if (b->encoded - b->written > b->maxWriteQueue)
+			b->maxWriteQueue = b->encoded - b->written;
+		pthread_cond_signal(&b->inputCond);
+		pthread_cond_signal(&b->writeCond);
+		pthread_mutex_unlock(&b->mutex);
+	}
+	b->encoderCpuUs = cpuUs(CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+}
+
+static int compareU64(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, unsigned int count, unsigned int p)
+{
+	unsigned int i = (count * p + 99) / 100;
+	return sorted[i ? i - 1 : 0];
+}
+
+static void report(struct bench *b, uint64_t processCpuUs)
+{
+	uint64_t *latency = malloc(b->shotCount * sizeof(*latency));
+	uint64_t first = b->shots[0].readoutStartUs, last = 0;
+	unsigned int ok = 0, encodes = 0;
+	uint64_t bytes = 0;
+	for (unsigned int i = 0; i < b->shotCount; ++i)
+	{
+		const struct shot *s = &b->shots[i];
+		if (s->writtenUs > last)
+			last = s->writtenUs;
+		encodes += s->encodes;
+		if (s->failed)
+			continue;
+		latency[ok++] = s->writtenUs - s->readoutStartUs;
+		bytes += s->length;
+	}
+	const uint64_t wallUs = last > first ? last - first : 1;
+
+	printf("frame %ux%u, %u shots, %u failed, %u write errors\n",
+		b->width, b->height, b->shotCount, b->shotCount - ok, b->writeErrors);
+	printf("sustained %.2f shots/s over %.3f s, %llu bytes per shot\n",
+		ok * 1e6 / wallUs, wallUs / 1e6, ok ? (unsigned long long)(bytes / ok) : 0ULL);
+	if (ok && latency)
+	{
+		qsort(latency, ok, sizeof(*latency), compareU64);
+		printf("capture to file latency (ms): p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+			percentile(latency, ok, 50) / 1e3, percentile(latency, ok, 90) / 1e3,
+			percentile(latency, ok, 99) / 1e3, latency[ok - 1] / 1e3);
+	}
+	free(latency);
+
+	const uint64_t stages = b->sensorCpuUs + b->encoderCpuUs + b->writerCpuUs;
+	printf("cpu (ms): sensor %.1f, encoder %.1f, writer %.1f, library and device threads %.1f\n",
+		b->sensorCpuUs / 1e3, b->encoderCpuUs / 1e3, b->writerCpuUs / 1e3,
+		processCpuUs > stages ? (processCpuUs - stages) / 1e3 : 0.0);
+	printf("memory: %zu kB input pool, %zu kB output pool, resident high-water %lu kB\n",
+		b->inputBuffers * (b->ySize + b->cbcrSize) / 1024, b->outputBuffers * b->outputSize / 1024,
+		residentHighWaterKb());
+	printf("queues: max %u captured, max %u encoded, %u input stalls, %u output stalls\n",
+		b->maxCaptureQueue, b->maxWriteQueue, b->inputStalls, b->outputStalls);
+
+	struct gemini_lib_stats stats;
+	gemini_lib_get_stats(b->lib, &stats);
+	printf("encoder: %u jobs, %.2f per shot", stats.jobs, (double)encodes / b->shotCount);
+	if (b->retryLoop)
+		printf(", %u re-encodes", encodes - b->shotCount);
+	if (stats.rateJobs)
+		printf(", target size %u hits %u over %u under, last quality %u", stats.rateHits,
+			stats.rateOvershoots, stats.rateUndershoots, stats.rateLastQuality);
+	printf(", %u timeouts\n", stats.timeouts);
+	if (b->sim)
+	{
+		struct gemini_sim_stats simStats;
+		gemini_sim_get_stats(b->sim, &simStats);
+		printf("device: %u jobs, %u aborted, %.1f%% busy\n",
+			simStats.jobs, simStats.aborted, simStats.busyUs * 100.0 / wallUs);
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -s WxH    frame size, multiples of 16 (2592x1952)\n"
+		"  -n N      shots (100)\n"
+		"  -r N      sensor readout in MCU rows per second, 0 unpaced (30 frames/s)\n"
+		"  -i MS     interval between shots, 0 back to back (0)\n"
+		"  -I N      input buffers (3)\n"
+		"  -O N      output buffers (2)\n"
+		"  -q N      quality, initial quality of -t (85)\n"
+		"  -t KB     target file size\n"
+		"  -T N      target tolerance in percent (10)\n"
+		"  -R        reach the target size by re-encoding instead\n"
+		"  -V N      check that the size model of -t hits the target from shot N on\n"
+		"            and saves re-encodes over -R, encoding the shots with both\n"
+		"  -m NS     simulated encoding time per MCU (4000)\n"
+		"  -c US     simulated job start latency (500)\n"
+		"  -b N      simulated bytes per MCU at quantiser step 16 (60)\n"
+		"  -H        use the hardware instead of the simulator\n"
+		"  -M        encode a motion JPEG stream with gemini_mjpeg instead\n"
+		"  -C FMT    measure the conversion from yuyv, i420, rgb565, rgba8888,\n"
+		"            nv12, nv21 or all source formats at several frame sizes instead,\n"
+		"            -n shots per point (%u)\n"
+		"  -X        measure the rotations and mirrorings of an NV21 frame against\n"
+		"            encoding it as is instead, -n shots each as with -C\n"
+		"  -o DIR    write the files there instead of /dev/null\n",
+		name, SWEEP_SHOTS);
+}
+
+static int parseOptions(struct bench *b, int argc, char **argv)
+{
+	bool rateGiven = false;
+	bool shotsGiven = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:n:r:i:I:O:q:t:T:RV:m:c:b:HMC:Xo:")) != -1)
+	{
+		switch (opt)
+		{
+		case 's':
+			if (sscanf(optarg, "%ux%u", &b->width, &b->height) != 2)
+				return -1;
+			break;
+		case 'n': b->shotCount = strtoul(optarg, NULL, 0); shotsGiven = true; break;
+		case 'r': b->rowsPerSecond = strtoul(optarg, NULL, 0); rateGiven = true; break;
+		case 'i': b->intervalMs = strtoul(optarg, NULL, 0); break;
+		case 'I': b->inputBuffers = strtoul(optarg, NULL, 0); break;
+		case 'O': b->outputBuffers = strtoul(optarg, NULL, 0); break;
+		case 'q': b->quality = strtoul(optarg, NULL, 0); break;
+		case 't': b->targetBytes = strtoul(optarg, NULL, 0) * 1024; break;
+		case 'T': b->tolerancePercent = strtoul(optarg, NULL, 0); break;
+		case 'R': b->retryLoop = true; break;
+		case 'V': b->convergeShots = strtoul(optarg, NULL, 0); break;
+		case 'm': b->simCfg.nsPerMcu = strtoul(optarg, NULL, 0); break;
+		case 'c': b->simCfg.startUs = strtoul(optarg, NULL, 0); break;
+		case 'b': b->simCfg.bytesPerMcu = strtoul(optarg, NULL, 0); break;
+		case 'H': b->hardware = true; break;
+		case 'M': b->mjpeg = true; break;
+		case 'C':
+			b->convert = true;
+			for (b->convertFormat = 0; b->convertFormat < GEMINI_SOURCE_FORMAT_COUNT; ++b->convertFormat)
+			{
+				if (strcmp(optarg, sourceFormatNames[b->convertFormat]) == 0)
+					break;
+			}
+			if (b->convertFormat == GEMINI_SOURCE_FORMAT_COUNT && strcmp(optarg, "all") != 0)
+				return -1;
+			break;
+		case 'X': b->transform = true; break;
+		case 'o': b->outputDir = optarg; break;
+		default: return -1;
+		}
+	}
+	if (!b->width || !b->height || b->width % 16 || b->height % 16 || b->width > 8192 || b->height > 8192
+		|| !b->shotCount || !b->inputBuffers || !b->outputBuffers
+		|| !b->quality || b->quality > 100 || b->tolerancePercent >= 100
+		|| ((b->retryLoop || b->convergeShots) && !b->targetBytes) || (b->mjpeg && b->targetBytes))
+		return -1;
+	if (!rateGiven)
+		b->rowsPerSecond = b->height / 16 * 30;
+	if ((b->convert || b->transform) && !shotsGiven)
+		b->shotCount = SWEEP_SHOTS;
+	return 0;
+}
+
+static int setupDevice(struct bench *b)
+{
+	if (!b->hardware)
+	{
+		b->sim = gemini_sim_create(&b->simCfg);
+		if (!b->sim)
+			return -1;
+		gemini_lib_set_device_ops(gemini_sim_device_ops(b->sim));
+	}
+	return 0;
+}
+
+static int setup(struct bench *b)
+{
+	if (setupDevice(b) != 0)
+		return -1;
+	int *fd;
+	if (gemini_lib_init_eventfd(&fd, 16, &b->eventFd) < 0)
+		return -1;
+	b->lib = gemini_lib_from_fd(fd);
+
+	b->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event event = { .events = EPOLLIN };
+	if (b->epollFd < 0 || epoll_ctl(b->epollFd, EPOLL_CTL_ADD, b->eventFd, &event) != 0)
+		return -1;
+	b->writeFd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+	b->inputCfg.inputFormat = GEMINI_INPUT_H2V2;
+	b->inputCfg.frame_width_mcus = b->width / 16;
+	b->inputCfg.frame_height_mcus = b->height / 16;
+	b->opCfg.op_mode = MSM_GEMINI_MODE_OFFLINE_ENCODE;
+	if (configure(b, b->quality) != 0 || gemini_lib_set_container(b->lib, &b->jfif) != 0)
+		return -1;
+	if (b->targetBytes && !b->retryLoop && !b->convergeShots
+		&& gemini_lib_set_target_size(b->lib, b->targetBytes, b->tolerancePercent, b->quality) != 0)
+		return -1;
+
+	b->ySize = (size_t)b->width * b->height;
+	b->cbcrSize = b->ySize / 2;
+	b->outputSize = b->ySize * 3 / 2 + 65536; // no MCU compresses worse than raw
+	b->inputs = calloc(b->inputBuffers, sizeof(*b->inputs));
+	b->outputs = calloc(b->outputBuffers, sizeof(*b->outputs));
+	b->freeInputs = calloc(b->inputBuffers, sizeof(*b->freeInputs));
+	b->freeOutputs = calloc(b->outputBuffers, sizeof(*b->freeOutputs));
+	b->shots = calloc(b->shotCount, sizeof(*b->shots));
+	if (!b->inputs || !b->outputs || !b->freeInputs || !b->freeOutputs || !b->shots)
+		return -1;
+	for (unsigned int i = 0; i < b->inputBuffers; ++i)
+	{
+		b->inputs[i].size = b->ySize + b->cbcrSize;
+		b->inputs[i].vaddr = do_mmap(b->inputs[i].size, &b->inputs[i].fd);
+		if (!b->inputs[i].vaddr)
+			return -1;
+		b->freeInputs[b->freeInputCount++] = i;
+	}
+	for (unsigned int i = 0; i < b->outputBuffers; ++i)
+	{
+		b->outputs[i].size = b->outputSize;
+		b->outputs[i].vaddr = do_mmap(b->outputs[i].size, &b->outputs[i].fd);
+		if (!b->outputs[i].vaddr)
+			return -1;
+		b->freeOutputs[b->freeOutputCount++] = i;
+	}
+	return 0;
+}
+
+static void teardown(struct bench *b)
+{
+	for (unsigned int i = 0; b->inputs && i < b->inputBuffers; ++i)
+	{
+		if (b->inputs[i].vaddr)
+			do_munmap(b->inputs[i].fd, b->inputs[i].vaddr, b->inputs[i].size);
+	}
+	for (unsigned int i = 0; b->outputs && i < b->outputBuffers; ++i)
+	{
+		if (b->outputs[i].vaddr)
+			do_munmap(b->outputs[i].fd, b->outputs[i].vaddr, b->outputs[i].size);
+	}
+	if (b->lib)
+		gemini_lib_release(b->lib);
+	if (b->sim)
+	{
+		gemini_lib_set_device_ops(NULL);
+		gemini_sim_destroy(b->sim);
+	}
+	if (b->epollFd >= 0)
+		close(b->epollFd);
+	if (b->writeFd >= 0)
+		close(b->writeFd);
+	free(b->inputs);
+	free(b->outputs);
+	free(b->freeInputs);
+	free(b->freeOutputs);
+	free(b->shots);
+	free(b->frameLatency);
+}
+
+/* Split the multipart stream of gemini_mjpeg into its frames */
+static void* streamReaderThread(void *arg)
+{
+	struct bench *b = arg;
+	FILE *stream = fdopen(b->streamFd, "r");
+	if (!stream)
+		return NULL;
+	FILE *copy = NULL;
+	if (b->outputDir)
+	{
+		char path[512];
+		snprintf(path, sizeof(path), "%s/stream.mjpeg", b->outputDir);
+		copy = fopen(path, "w");
+	}
+	char line[160];
+	char data[4096];
+	size_t length = 0;
+	unsigned long long timestampUs = 0;
+	while (fgets(line, sizeof(line), stream))
+	{
+		if (copy)
+			fputs(line, copy);
+		if (sscanf(line, "Content-Length: %zu", &length) == 1
+			|| sscanf(line, "X-Timestamp-Us: %llu", &timestampUs) == 1
+			|| strcmp(line, "\r\n") != 0 || !length)
+			continue;
+		size_t left = length + 2; // and the CRLF ending the part
+		while (left > 0)
+		{
+			size_t n = fread(data, 1, left < sizeof(data) ? left : sizeof(data), stream);
+			if (n == 0)
+				break;
+			if (copy)
+				fwrite(data, 1, n, copy);
+			left -= n;
+		}
+		const uint64_t doneUs = nowUs();
+		if (b->streamFrames < b->shotCount)
+			b->frameLatency[b->streamFrames] = doneUs - timestampUs;
+		b->streamFrames++;
+		b->streamBytes += length;
+		b->lastFrameUs = doneUs;
+		length = 0;
+	}
+	if (copy)
+		fclose(copy);
+	fclose(stream);
+	return NULL;
+}
+
+/* Feed the frames of the sensor model to a gemini_mjpeg pipeline. A paced
+ * sensor can't wait, so frames are dropped when no input buffer is free. */
+static int runMjpeg(struct bench *b)
+{
+	struct gemini_mjpeg_cfg cfg = {
+		.inputCfg = {
+			.inputFormat = GEMINI_INPUT_H2V2,
+			.frame_width_mcus = b->width / 16,
+			.frame_height_mcus = b->height / 16,
+		},
+		.opCfg = { .op_mode = MSM_GEMINI_MODE_OFFLINE_ENCODE },
+		.jfif = b->jfif,
+		.inputBuffers = b->inputBuffers,
+		.outputBuffers = b->outputBuffers,
+		.outputBufferSize = (size_t)b->width * b->height * 3 / 2 + 65536,
+		.mux = GEMINI_MJPEG_MUX_MULTIPART,
+		.dropPolicy = b->rowsPerSecond || b->intervalMs ? GEMINI_MJPEG_DROP_NEWEST : GEMINI_MJPEG_BLOCK,
+		.framesPerSecond = 30,
+	};
+	gemini_lib_quant_tables(b->quality, b->lumaTable, b->chromaTable);
+	cfg.hwCfg.quantTable[0] = b->lumaTable;
+	cfg.hwCfg.quantTable[1] = b->chromaTable;
+
+	int pipeFds[2];
+	b->frameLatency = calloc(b->shotCount, sizeof(*b->frameLatency));
+	if (!b->frameLatency || pipe2(pipeFds, O_CLOEXEC) != 0)
+		return -1;
+	b->streamFd = pipeFds[0];
+	cfg.fd = pipeFds[1];
+	pthread_t reader;
+	if (pthread_create(&reader, NULL, streamReaderThread, b) != 0)
+	{
+		close(pipeFds[0]);
+		close(pipeFds[1]);
+		return -1;
+	}
+
+	const uint64_t cpuStart = cpuUs(CLOCK_PROCESS_CPUTIME_ID);
+	struct gemini_mjpeg *m = gemini_mjpeg_create(&cfg);
+	int ret = m ? 0 : -1;
+	const unsigned int mcuRows = cfg.inputCfg.frame_height_mcus;
+	b->firstReadoutUs = nowUs();
+	for (unsigned int i = 0; m && i < b->shotCount; ++i)
+	{
+		if (b->intervalMs)
+			sleepUntilUs(b->firstReadoutUs + (uint64_t)i * b->intervalMs * 1000);
+		const uint64_t readoutStartUs = nowUs();
+		struct gemini_mjpeg_frame *frame = gemini_mjpeg_get_frame(m);
+		for (unsigned int row = 0; row < mcuRows; ++row)
+		{
+			if (frame)
+			{
+				fillRows(frame->y, b->width, row * 16, 16, i);
+				fillRows(frame->cbcr, b->width, row * 8, 8, 128 + i);
+			}
+			if (b->rowsPerSecond)
+				sleepUntilUs(readoutStartUs + (row + 1) * 1000000ULL / b->rowsPerSecond);
+		}
+		if (frame)
+			gemini_mjpeg_submit(m, frame, readoutStartUs);
+	}
+
+	struct gemini_mjpeg_stats stats;
+	memset(&stats, 0, sizeof(stats));
+	if (m)
+	{
+		// let the pipeline drain, the statistics are gone with it
+		gemini_mjpeg_get_stats(m, &stats);
+		unsigned int done = stats.written + stats.errors;
+		uint64_t progressUs = nowUs();
+		while (done < stats.submitted && nowUs() - progressUs < JOB_TIMEOUT_MS * 1000ULL)
+		{
+			usleep(1000);
+			gemini_mjpeg_get_stats(m, &stats);
+			if (stats.written + stats.errors != done)
+			{
+				done = stats.written + stats.errors;
+				progressUs = nowUs();
+			}
+		}
+		if (gemini_mjpeg_destroy(m) != 0)
+			ret = -1;
+	}
+	close(pipeFds[1]);
+	pthread_join(reader, NULL);
+	const uint64_t processCpuUs = cpuUs(CLOCK_PROCESS_CPUTIME_ID) - cpuStart;
+
+	const unsigned int frames = b->streamFrames < b->shotCount ? b->streamFrames : b->shotCount;
+	const uint64_t wallUs = b->lastFrameUs > b->firstReadoutUs ? b->lastFrameUs - b->firstReadoutUs : 1;
+	printf("mjpeg %ux%u, %u frames, %u streamed, %u dropped, %u errors\n",
+		b->width, b->height, b->shotCount, b->streamFrames, stats.dropped, stats.errors);
+	printf("sustained %.2f frames/s over %.3f s, %llu bytes per frame\n",
+		b->streamFrames * 1e6 / wallUs, wallUs / 1e6,
+		b->streamFrames ? (unsigned long long)(b->streamBytes / b->streamFrames) : 0ULL);
+	if (frames)
+	{
+		qsort(b->frameLatency, frames, sizeof(*b->frameLatency), compareU64);
+		printf("capture to stream latency (ms): p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+			percentile(b->frameLatency, frames, 50) / 1e3, percentile(b->frameLatency, frames, 90) / 1e3,
+			percentile(b->frameLatency, frames, 99) / 1e3, b->frameLatency[frames - 1] / 1e3);
+	}
+	printf("encoder: max job %.1f ms, cpu %.1f ms\n", stats.maxEncodeUs / 1e3, processCpuUs / 1e3);
+	if (b->sim)
+	{
+		struct gemini_sim_stats simStats;
+		gemini_sim_get_stats(b->sim, &simStats);
+		printf("device: %u jobs, %u aborted, %.1f%% busy\n",
+			simStats.jobs, simStats.aborted, simStats.busyUs * 100.0 / wallUs);
+	}
+	return ret;
+}
+
+/* A source image of the given format with a gradient in every plane */
+static uint8_t* makeSource(struct gemini_source_image *src, unsigned int format,
+						unsigned int width, unsigned int height)
+{
+	static const unsigned int bytesPerPixel[GEMINI_SOURCE_FORMAT_COUNT] = { 2, 1, 2, 4, 1, 1 };
+	memset(src, 0, sizeof(*src));
+	src->format = format;
+	src->width = width;
+	src->height = height;
+	src->strides[0] = width * bytesPerPixel[format];
+	size_t size = (size_t)src->strides[0] * height;
+	if (format == GEMINI_SOURCE_I420)
+	{
+		src->strides[1] = src->strides[2] = width / 2;
+		size += (size_t)width * height / 2;
+	}
+	else if (format == GEMINI_SOURCE_NV12 || format == GEMINI_SOURCE_NV21)
+	{
+		src->strides[1] = width;
+		size += (size_t)width * height / 2;
+	}
+	uint8_t *data = malloc(size);
+	if (!data)
+		return NULL;
+	for (size_t i = 0; i < size; ++i)
+		data[i] = i * 7 / 3;
+	src->planes[0] = data;
+	if (src->strides[1])
+		src->planes[1] = data + (size_t)src->strides[0] * height;
+	if (src->strides[2])
+		src->planes[2] = src->planes[1] + (size_t)src->strides[1] * height / 2;
+	return data;
+}
+
+/* Convert src into the first input buffer with the transformation and
+ * encode it, the CPU time of the conversion goes to convertUs. With src NULL
+ * the input buffer already holds the frame and is enqueued as is. */
+static int convertShot(struct bench *b, const struct gemini_source_image *src, unsigned int transform,
+						uint64_t *convertUs)
+{
+	struct msm_gemini_buf dest = {
+		.fd = b->inputs[0].fd,
+		.vaddr = b->inputs[0].vaddr,
+		.y_off = 0,
+		.y_len = b->ySize,
+		.cbcr_off = b->ySize,
+		.cbcr_len = b->cbcrSize,
+		.num_of_mcu_rows = b->inputCfg.frame_height_mcus,
+	};
+	if (src)
+		dest.cbcr_off = (size_t)src->width * src->height;
+	struct msm_gemini_buf output = {
+		.fd = b->outputs[0].fd,
+		.vaddr = b->outputs[0].vaddr,
+		.y_len = b->outputSize,
+	};
+	if (gemini_lib_output_buf_enq(b->lib, &output) != 0)
+		return -1;
+	const uint64_t startUs = cpuUs(CLOCK_THREAD_CPUTIME_ID);
+	int ret = src ? gemini_lib_transform_input(b->lib, src, transform, &dest, 0)
+		: gemini_lib_input_buf_enq(b->lib, &dest);
+	*convertUs += cpuUs(CLOCK_THREAD_CPUTIME_ID) - startUs;
+	if (ret != 0 || gemini_lib_encode(b->lib) != 0 || waitJob(b) != 0)
+	{
+		gemini_lib_stop(b->lib, 1);
+		return -1;
+	}
+	return 0;
+}
+
+/* -C: the buffers of setup() are sized for the largest frame of the sweep */
+static int runConvert(struct bench *b)
+{
+	int ret = 0;
+	printf("%-9s %-9s %9s %8s\n", "format", "frame", "MPix/s", "ms/shot");
+	for (size_t i = 0; i < sizeof(sweepSizes) / sizeof(sweepSizes[0]); ++i)
+	{
+		const unsigned int width = sweepSizes[i][0], height = sweepSizes[i][1];
+		b->inputCfg.frame_width_mcus = width / 16;
+		b->inputCfg.frame_height_mcus = height / 16;
+		if (configure(b, b->quality) != 0)
+			return -1;
+		for (unsigned int format = 0; format < GEMINI_SOURCE_FORMAT_COUNT; ++format)
+		{
+			if (b->convertFormat != GEMINI_SOURCE_FORMAT_COUNT && format != b->convertFormat)
+				continue;
+			struct gemini_source_image src;
+			uint8_t *data = makeSource(&src, format, width, height);
+			if (!data)
+				return -1;
+			uint64_t convertUs = 0;
+			unsigned int shots = 0;
+			while (shots < b->shotCount && convertShot(b, &src, GEMINI_TRANSFORM_NONE, &convertUs) == 0)
+				shots++;
+			free(data);
+			if (shots < b->shotCount)
+			{
+				printf("%-9s %4ux%-4u failed\n", sourceFormatNames[format], width, height);
+				ret = -1;
+				continue;
+			}
+			if (!convertUs)
+				convertUs = 1;
+			printf("%-9s %4ux%-4u %9.1f %8.2f\n", sourceFormatNames[format], width, height,
+				(double)width * height * shots / convertUs, convertUs / 1e3 / shots);
+		}
+	}
+	return ret;
+}
+
+/* -X: the shot time runs from the start of the conversion until the job is
+ * done, so the plain path shows what the rotation adds to the latency */
+static int runTransform(struct bench *b)
+{
+	struct gemini_source_image src;
+	uint8_t *data = makeSource(&src, GEMINI_SOURCE_NV21, b->width, b->height);
+	if (!data)
+		return -1;
+	memcpy(b->inputs[0].vaddr, data, b->ySize + b->cbcrSize);
+
+	int ret = 0;
+	printf("NV21 %ux%u, %u shots each\n", b->width, b->height, b->shotCount);
+	printf("%-10s %9s %8s %8s\n", "transform", "MPix/s", "cpu ms", "shot ms");
+	for (int transform = -1; transform <= GEMINI_TRANSFORM_ROT270; ++transform)
+	{
+		// the 90 and 270 degree variants encode a portrait frame
+		const bool swap = transform >= GEMINI_TRANSFORM_TRANSPOSE;
+		b->inputCfg.frame_width_mcus = (swap ? b->height : b->width) / 16;
+		b->inputCfg.frame_height_mcus = (swap ? b->width : b->height) / 16;
+		if (configure(b, b->quality) != 0)
+		{
+			ret = -1;
+			break;
+		}
+		const char *name = transform < 0 ? "plain" : transformNames[transform];
+		uint64_t convertUs = 0;
+		unsigned int shots = 0;
+		const uint64_t startUs = nowUs();
+		while (shots < b->shotCount
+			&& convertShot(b, transform < 0 ? NULL : &src, transform, &convertUs) == 0)
+			shots++;
+		const uint64_t wallUs = nowUs() - startUs;
+		if (shots < b->shotCount)
+		{
+			printf("%-10s failed\n", name);
+			ret = -1;
+			continue;
+		}
+		if (transform < 0)
+			printf("%-10s %9s %8.2f %8.2f\n", name, "-", convertUs / 1e3 / shots, wallUs / 1e3 / shots);
+		else
+			printf("%-10s %9.1f %8.2f %8.2f\n", name, (double)b->width * b->height * shots / (convertUs ? convertUs : 1),
+				convertUs / 1e3 / shots, wallUs / 1e3 / shots);
+	}
+	free(data);
+	return ret;
+}
+
+/* -V: the shots are read out and encoded one after the other in the first
+ * buffers, first with the retry loop, then with the quality of the size
+ * model of the target size mode */
+static int runRateCheck(struct bench *b)
+{
+	const uint32_t pixels = b->width * b->height;
+	const unsigned int initialQuality = b->configuredQuality;
+	unsigned int retryEncodes = 0, retryHits = 0;
+	unsigned int modelEncodes = 0, modelHits = 0, converged = 0;
+	struct gemini_ratectl rc;
+	gemini_ratectl_init(&rc, b->targetBytes, b->tolerancePercent, initialQuality);
+
+	for (unsigned int pass = 0; pass < 2; ++pass)
+	{
+		if (configure(b, initialQuality) != 0)
+			return -1;
+		for (unsigned int i = 0; i < b->shotCount; ++i)
+		{
+			struct shot *s = &b->shots[i];
+			memset(s, 0, sizeof(*s));
+			fillRows(b->inputs[0].vaddr, b->width, 0, b->height, i);
+			fillRows((uint8_t *)b->inputs[0].vaddr + b->ySize, b->width, 0, b->height / 2, 128 + i);
+			if (pass == 0)
+			{
+				if (encodeWithRetries(b, s) != 0)
+					return -1;
+				retryEncodes += s->encodes;
+				retryHits += gemini_ratectl_hit(&rc, s->length);
+				continue;
+			}
+			const unsigned int quality = gemini_ratectl_quality(&rc, pixels);
+			if ((quality != b->configuredQuality && configure(b, quality) != 0) || encodeOnce(b, s) != 0)
+				return -1;
+			gemini_ratectl_update(&rc, quality, s->length, pixels);
+			modelEncodes += s->encodes;
+			if (gemini_ratectl_hit(&rc, s->length))
+				modelHits++;
+			else
+				converged = i + 1;
+		}
+	}
+
+	printf("target %zu bytes -%u%%, %u shots of %ux%u\n", b->targetBytes, b->tolerancePercent,
+		b->shotCount, b->width, b->height);
+	printf("retry loop: %u encodes, %u hits\n", retryEncodes, retryHits);
+	printf("size model: %u encodes, %u hits, on target from shot %u\n", modelEncodes, modelHits, converged);
+	printf("saved re-encodes: %d, %.2f per shot\n", (int)(retryEncodes - modelEncodes),
+		((double)retryEncodes - modelEncodes) / b->shotCount);
+	if (converged >= b->shotCount || converged > b->convergeShots || modelEncodes > retryEncodes)
+	{
+		printf("FAIL: expected the size model on target from shot %u on, with at most %u encodes\n",
+			b->convergeShots, retryEncodes);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench b = {
+		.width = 2592,
+		.height = 1952,
+		.shotCount = 100,
+		.inputBuffers = 3,
+		.outputBuffers = 2,
+		.quality = 85,
+		.tolerancePercent = 10,
+		.simCfg = {
+			.nsPerMcu = 4000,
+			.startUs = 500,
+			.bytesPerMcu = 60,
+		},
+		.epollFd = -1,
+		.writeFd = -1,
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.inputCond = PTHREAD_COND_INITIALIZER,
+		.captureCond = PTHREAD_COND_INITIALIZER,
+		.outputCond = PTHREAD_COND_INITIALIZER,
+		.writeCond = PTHREAD_COND_INITIALIZER,
+	};
+	if (parseOptions(&b, argc, argv) != 0)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+	if (b.mjpeg)
+	{
+		int ret = setupDevice(&b) == 0 ? runMjpeg(&b) : -1;
+		if (ret != 0)
+			fprintf(stderr, "mjpeg run failed\n");
+		teardown(&b);
+		return ret != 0;
+	}
+	if (b.convert)
+	{
+		b.width = sweepSizes[0][0];
+		b.height = sweepSizes[0][1];
+	}
+	if (b.convert || b.transform)
+		b.inputBuffers = b.outputBuffers = 1;
+	if (setup(&b) != 0)
+	{
+		fprintf(stderr, "setup failed: %s\n", strerror(errno));
+		teardown(&b);
+		return 1;
+	}
+	if (b.convert || b.transform)
+	{
+		int ret = b.convert ? runConvert(&b) : runTransform(&b);
+		if (ret != 0)
+			fprintf(stderr, "conversion run failed\n");
+		teardown(&b);
+		return ret != 0;
+	}
+
+	if (b.convergeShots)
+	{
+		int ret = runRateCheck(&b);
+		teardown(&b);
+		return ret != 0;
+	}
+
+	const uint64_t cpuStart = cpuUs(CLOCK_PROCESS_CPUTIME_ID);
+	pthread_t sensor, writer;
+	if (pthread_create(&sensor, NULL, sensorThread, &b) != 0)
+	{
+		teardown(&b);
+		return 1;
+	}
+	if (pthread_create(&writer, NULL, writerThread, &b) != 0)
+	{
+		pthread_join(sensor, NULL);
+		teardown(&b);
+		return 1;
+	}
+	encoderLoop(&b);
+	pthread_join(sensor, NULL);
+	pthread_join(writer, NULL);
+	report(&b, cpuUs(CLOCK_PROCESS_CPUTIME_ID) - cpuStart);
+
+	teardown(&b);
+	return 0;
+}
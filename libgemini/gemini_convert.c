@@ -0,0 +1,276 @@
+/* MSM gemini (JPEG hardware encoder) userspace library
+ * Copyright (C) 2018 DafabHoid
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "gemini.h"
+#include <string.h>
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+/* Conversion of other source formats into the Y + interleaved CrCb layout
+ * (as delivered by the camera for snapshots) the hardware fetches, with
+ * horizontally subsampled chroma (H2V1) and optionally vertically
+ * subsampled chroma too (H2V2). RGB is converted with the full range JFIF
+ * equations in 8 bit fixed point. */
+
+static __inline uint8_t clampU8(int value)
+{
+	return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+static __inline uint8_t rgbToY(int r, int g, int b)
+{
+	return (77 * r + 150 * g + 29 * b + 128) >> 8;
+}
+
+static __inline uint8_t rgbToCb(int r, int g, int b)
+{
+	return clampU8(((-43 * r - 85 * g + 128 * b + 128) >> 8) + 128);
+}
+
+static __inline uint8_t rgbToCr(int r, int g, int b)
+{
+	return clampU8(((128 * r - 107 * g - 21 * b + 128) >> 8) + 128);
+}
+
+static __inline void loadRgb(const struct gemini_source_image *src, unsigned int x, unsigned int y,
+						int *r, int *g, int *b)
+{
+	const uint8_t *row = src->planes[0] + y * src->strides[0];
+	if (src->format == GEMINI_SOURCE_RGB565)
+	{
+		uint16_t p = row[2 * x] | (row[2 * x + 1] << 8);
+		unsigned int r5 = p >> 11, g6 = (p >> 5) & 0x3F, b5 = p & 0x1F;
+		*r = (r5 << 3) | (r5 >> 2);
+		*g = (g6 << 2) | (g6 >> 4);
+		*b = (b5 << 3) | (b5 >> 2);
+	}
+	else
+	{
+		*r = row[4 * x];
+		*g = row[4 * x + 1];
+		*b = row[4 * x + 2];
+	}
+}
+
+/* Luma of the pixels x and x+1 of source row y, and the sum of their
+ * chroma (counted twice where the source shares it between the pair). */
+static __inline void loadPixelPair(const struct gemini_source_image *src, unsigned int x, unsigned int y,
+						uint8_t *y0, uint8_t *y1, int *cb, int *cr)
+{
+	switch (src->format)
+	{
+	case GEMINI_SOURCE_YUYV:
+	{
+		const uint8_t *p = src->planes[0] + y * src->strides[0] + 2 * x;
+		*y0 = p[0];
+		*y1 = p[2];
+		*cb = 2 * p[1];
+		*cr = 2 * p[3];
+		break;
+	}
+	case GEMINI_SOURCE_I420:
+	{
+		const uint8_t *luma = src->planes[0] + y * src->strides[0] + x;
+		*y0 = luma[0];
+		*y1 = luma[1];
+		*cb = 2 * src->planes[1][(y / 2) * src->strides[1] + x / 2];
+		*cr = 2 * src->planes[2][(y / 2) * src->strides[2] + x / 2];
+		break;
+	}
+	default:
+	{
+		int r0, g0, b0, r1, g1, b1;
+		loadRgb(src, x, y, &r0, &g0, &b0);
+		loadRgb(src, x + 1, y, &r1, &g1, &b1);
+		*y0 = rgbToY(r0, g0, b0);
+		*y1 = rgbToY(r1, g1, b1);
+		*cb = rgbToCb(r0, g0, b0) + rgbToCb(r1, g1, b1);
+		*cr = rgbToCr(r0, g0, b0) + rgbToCr(r1, g1, b1);
+		break;
+	}
+	}
+}
+
+static void convertGroupScalar(const struct gemini_source_image *src, unsigned int y, unsigned int rows,
+						unsigned int x, uint8_t *yDest, size_t yStride, uint8_t *crcbDest)
+{
+	for (; x + 1 < src->width; x += 2)
+	{
+		int cbSum = 0, crSum = 0;
+		for (unsigned int r = 0; r < rows; ++r)
+		{
+			int cb, cr;
+			loadPixelPair(src, x, y + r, &yDest[r * yStride + x], &yDest[r * yStride + x + 1], &cb, &cr);
+			cbSum += cb;
+			crSum += cr;
+		}
+		crcbDest[x] = (crSum + rows) / (2 * rows);
+		crcbDest[x + 1] = (cbSum + rows) / (2 * rows);
+	}
+}
+
+#ifdef HAVE_NEON
+static __inline uint8x16_t lumaNeon(uint8x16_t r, uint8x16_t g, uint8x16_t b)
+{
+	uint16x8_t lo = vmull_u8(vget_low_u8(r), vdup_n_u8(77));
+	lo = vmlal_u8(lo, vget_low_u8(g), vdup_n_u8(150));
+	lo = vmlal_u8(lo, vget_low_u8(b), vdup_n_u8(29));
+	uint16x8_t hi = vmull_u8(vget_high_u8(r), vdup_n_u8(77));
+	hi = vmlal_u8(hi, vget_high_u8(g), vdup_n_u8(150));
+	hi = vmlal_u8(hi, vget_high_u8(b), vdup_n_u8(29));
+	return vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8));
+}
+
+// Interleaved CrCb of 8 averaged pixels
+static __inline uint8x8x2_t chromaNeon(uint8x8_t r8, uint8x8_t g8, uint8x8_t b8)
+{
+	int16x8_t r = vreinterpretq_s16_u16(vmovl_u8(r8));
+	int16x8_t g = vreinterpretq_s16_u16(vmovl_u8(g8));
+	int16x8_t b = vreinterpretq_s16_u16(vmovl_u8(b8));
+	int16x8_t cb = vmulq_n_s16(b, 128);
+	cb = vmlsq_n_s16(cb, r, 43);
+	cb = vmlsq_n_s16(cb, g, 85);
+	int16x8_t cr = vmulq_n_s16(r, 128);
+	cr = vmlsq_n_s16(cr, g, 107);
+	cr = vmlsq_n_s16(cr, b, 21);
+	uint8x8x2_t crcb;
+	crcb.val[0] = vqmovun_s16(vaddq_s16(vrshrq_n_s16(cr, 8), vdupq_n_s16(128)));
+	crcb.val[1] = vqmovun_s16(vaddq_s16(vrshrq_n_s16(cb, 8), vdupq_n_s16(128)));
+	return crcb;
+}
+
+static __inline uint8x8_t expand565(uint16x8_t value, int shift, int bits)
+{
+	uint16x8_t v = vandq_u16(vshlq_u16(value, vdupq_n_s16(-shift)), vdupq_n_u16((1 << bits) - 1));
+	v = vorrq_u16(vshlq_u16(v, vdupq_n_s16(8 - bits)), vshlq_u16(v, vdupq_n_s16(8 - 2 * bits)));
+	return vmovn_u16(v);
+}
+
+static __inline void loadRgbNeon(const struct gemini_source_image *src, const uint8_t *row, unsigned int x,
+						uint8x16_t *r, uint8x16_t *g, uint8x16_t *b)
+{
+	if (src->format == GEMINI_SOURCE_RGB565)
+	{
+		uint16x8_t lo = vld1q_u16((const uint16_t *)(row + 2 * x));
+		uint16x8_t hi = vld1q_u16((const uint16_t *)(row + 2 * x + 16));
+		*r = vcombine_u8(expand565(lo, 11, 5), expand565(hi, 11, 5));
+		*g = vcombine_u8(expand565(lo, 5, 6), expand565(hi, 5, 6));
+		*b = vcombine_u8(expand565(lo, 0, 5), expand565(hi, 0, 5));
+	}
+	else
+	{
+		uint8x16x4_t p = vld4q_u8(row + 4 * x);
+		*r = p.val[0];
+		*g = p.val[1];
+		*b = p.val[2];
+	}
+}
+
+/* Convert 16 pixel wide columns of a group of one or two rows, return the
+ * number of pixels done. */
+static unsigned int convertGroupNeon(const struct gemini_source_image *src, unsigned int y, unsigned int rows,
+						uint8_t *yDest, size_t yStride, uint8_t *crcbDest)
+{
+	const uint8_t *row0 = src->planes[0] + y * src->strides[0];
+	const uint8_t *row1 = row0 + (rows == 2 ? src->strides[0] : 0);
+	unsigned int x = 0;
+	switch (src->format)
+	{
+	case GEMINI_SOURCE_YUYV:
+		for (; x + 16 <= src->width; x += 16)
+		{
+			uint8x8x4_t a = vld4_u8(row0 + 2 * x);
+			uint8x8x2_t luma = {{a.val[0], a.val[2]}};
+			vst2_u8(yDest + x, luma);
+			uint8x8x2_t crcb = {{a.val[3], a.val[1]}};
+			if (rows == 2)
+			{
+				uint8x8x4_t b = vld4_u8(row1 + 2 * x);
+				uint8x8x2_t luma1 = {{b.val[0], b.val[2]}};
+				vst2_u8(yDest + yStride + x, luma1);
+				crcb.val[0] = vrhadd_u8(crcb.val[0], b.val[3]);
+				crcb.val[1] = vrhadd_u8(crcb.val[1], b.val[1]);
+			}
+			vst2_u8(crcbDest + x, crcb);
+		}
+		break;
+	case GEMINI_SOURCE_I420:
+	{
+		const uint8_t *cb = src->planes[1] + (y / 2) * src->strides[1];
+		const uint8_t *cr = src->planes[2] + (y / 2) * src->strides[2];
+		x = src->width & ~15u;
+		for (unsigned int r = 0; r < rows; ++r)
+			memcpy(yDest + r * yStride, row0 + r * src->strides[0], x);
+		for (unsigned int i = 0; i < x; i += 16)
+		{
+			uint8x8x2_t crcb = {{vld1_u8(cr + i / 2), vld1_u8(cb + i / 2)}};
+			vst2_u8(crcbDest + i, crcb);
+		}
+		break;
+	}
+	default:
+		for (; x + 16 <= src->width; x += 16)
+		{
+			uint8x16_t r, g, b;
+			loadRgbNeon(src, row0, x, &r, &g, &b);
+			vst1q_u8(yDest + x, lumaNeon(r, g, b));
+			uint16x8_t rSum = vpaddlq_u8(r), gSum = vpaddlq_u8(g), bSum = vpaddlq_u8(b);
+			uint8x8_t rAvg, gAvg, bAvg;
+			if (rows == 2)
+			{
+				loadRgbNeon(src, row1, x, &r, &g, &b);
+				vst1q_u8(yDest + yStride + x, lumaNeon(r, g, b));
+				rAvg = vrshrn_n_u16(vpadalq_u8(rSum, r), 2);
+				gAvg = vrshrn_n_u16(vpadalq_u8(gSum, g), 2);
+				bAvg = vrshrn_n_u16(vpadalq_u8(bSum, b), 2);
+			}
+			else
+			{
+				rAvg = vrshrn_n_u16(rSum, 1);
+				gAvg = vrshrn_n_u16(gSum, 1);
+				bAvg = vrshrn_n_u16(bSum, 1);
+			}
+			vst2_u8(crcbDest + x, chromaNeon(rAvg, gAvg, bAvg));
+		}
+		break;
+	}
+	return x;
+}
+#endif
+
+/** Convert the source rows firstRow..firstRow+rows-1 into the Y and CrCb
+ * planes of a band. With subsampleV, two source rows make one chroma row
+ * (H2V2), otherwise each row has its own (H2V1). The source width must be
+ * even, the number of rows too if subsampleV is set.
+ */
+void gemini_convert_rows(const struct gemini_source_image *src, unsigned int firstRow, unsigned int rows,
+						uint8_t *yDest, size_t yStride, uint8_t *crcbDest, size_t crcbStride, bool subsampleV)
+{
+	const unsigned int groupRows = subsampleV ? 2 : 1;
+	for (unsigned int r = 0; r + groupRows <= rows; r += groupRows)
+	{
+		unsigned int y = firstRow + r;
+		unsigned int x = 0;
+#ifdef HAVE_NEON
+		x = convertGroupNeon(src, y, groupRows, yDest, yStride, crcbDest);
+#endif
+		convertGroupScalar(src, y, groupRows, x, yDest, yStride, crcbDest);
+		yDest += groupRows * yStride;
+		crcbDest += crcbStride;
+	}
+}
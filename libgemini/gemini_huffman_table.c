@@ -15,6 +15,7 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
 
 #include "gemini.h"
+#include <string.h>
 
 void gemini_lib_hw_create_huffman_table(uint8_t *table, uint8_t *table2, uint16_t *table3, bool flag)
 {
@@ -70,3 +71,202 @@ void gemini_lib_hw_create_huffman_tables(const struct gemini_hw_cfg* hwCfg, uint
 	gemini_lib_hw_create_huffman_table(hwCfg->huffmanTable[2], hwCfg->huffmanTable[2] + 16, huffmanValues2, false);
 	gemini_lib_hw_create_huffman_table(hwCfg->huffmanTable[3], hwCfg->huffmanTable[3] + 16, huffmanValues4, true);
 }
+
+/* The tables from ITU-T T.81 Annex K.3, in the same bits[16] + values
+ * layout as gemini_hw_cfg.huffmanTable[]. */
+static const uint8_t g_std_luma_dc[16 + 12] = {
+	0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+};
+
+static const uint8_t g_std_chroma_dc[16 + 12] = {
+	0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+};
+
+static const uint8_t g_std_luma_ac[16 + 162] = {
+	0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7D,
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+	0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08,
+	0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16,
+	0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+	0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+	0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+	0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+	0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+	0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6,
+	0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5,
+	0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4,
+	0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+	0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA,
+	0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+	0xF9, 0xFA,
+};
+
+static const uint8_t g_std_chroma_ac[16 + 162] = {
+	0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77,
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+	0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+	0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0,
+	0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34,
+	0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26,
+	0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38,
+	0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+	0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+	0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96,
+	0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5,
+	0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4,
+	0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3,
+	0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2,
+	0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+	0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9,
+	0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+	0xF9, 0xFA,
+};
+
+/** Get the table the hardware falls back to for index (same order as
+ * gemini_hw_cfg.huffmanTable[]), if no custom tables are uploaded. */
+const uint8_t* gemini_lib_std_huffman_table(int index)
+{
+	switch (index)
+	{
+	case 0:
+		return g_std_luma_dc;
+	case 1:
+		return g_std_luma_ac;
+	case 2:
+		return g_std_chroma_dc;
+	default:
+		return g_std_chroma_ac;
+	}
+}
+
+#define MAX_CODE_LENGTH 32 // before limiting
+#define HW_MAX_CODE_LENGTH 15 // see gemini_lib_hw_create_huffman_table()
+
+static size_t symbolCount(const uint8_t *table)
+{
+	size_t count = 0;
+	for (int i = 0; i < 16; ++i)
+		count += table[i];
+	return count;
+}
+
+/** Build the table (format of gemini_hw_cfg.huffmanTable[]) with the
+ * shortest coding of symbols occurring counts[symbol] times, as in ITU-T
+ * T.81 Annex K.2. It has the symbols of the standard table for index, all of
+ * them, as the hardware needs a code for every symbol it may produce, and
+ * no code longer than the hardware supports.
+ */
+void gemini_huffman_optimal_table(const uint32_t *counts, int index, uint8_t *table)
+{
+	const uint8_t *std = gemini_lib_std_huffman_table(index);
+	const size_t symbols = symbolCount(std);
+	uint64_t freq[257];
+	int codeSize[257];
+	int others[257];
+	unsigned int bits[MAX_CODE_LENGTH + 1];
+
+	memset(freq, 0, sizeof(freq));
+	memset(codeSize, 0, sizeof(codeSize));
+	memset(bits, 0, sizeof(bits));
+	for (int i = 0; i < 257; ++i)
+		others[i] = -1;
+	for (size_t i = 0; i < symbols; ++i)
+		freq[std[16 + i]] = (uint64_t)counts[std[16 + i]] + 1; // every symbol gets a code
+	freq[256] = 1; // reserves the all ones code word
+
+	for (;;)
+	{
+		// the two least frequent trees, ties go to the larger symbol
+		int c1 = -1, c2 = -1;
+		for (int i = 0; i < 257; ++i)
+		{
+			if (freq[i] && (c1 < 0 || freq[i] <= freq[c1]))
+				c1 = i;
+		}
+		for (int i = 0; i < 257; ++i)
+		{
+			if (freq[i] && i != c1 && (c2 < 0 || freq[i] <= freq[c2]))
+				c2 = i;
+		}
+		if (c2 < 0)
+			break;
+		freq[c1] += freq[c2];
+		freq[c2] = 0;
+		codeSize[c1]++;
+		while (others[c1] >= 0)
+		{
+			c1 = others[c1];
+			codeSize[c1]++;
+		}
+		others[c1] = c2;
+		codeSize[c2]++;
+		while (others[c2] >= 0)
+		{
+			c2 = others[c2];
+			codeSize[c2]++;
+		}
+	}
+	for (int i = 0; i < 257; ++i)
+	{
+		if (codeSize[i])
+			bits[codeSize[i] > MAX_CODE_LENGTH ? MAX_CODE_LENGTH : codeSize[i]]++;
+	}
+
+	// Annex K.3: move pairs of too long codes up, taking a shorter prefix
+	for (int i = MAX_CODE_LENGTH; i > HW_MAX_CODE_LENGTH; --i)
+	{
+		while (bits[i] > 0)
+		{
+			int j = i - 2;
+			while (bits[j] == 0)
+				j--;
+			bits[i] -= 2;
+			bits[i - 1]++;
+			bits[j + 1] += 2;
+			bits[j]--;
+		}
+	}
+	int longest = HW_MAX_CODE_LENGTH;
+	while (bits[longest] == 0)
+		longest--;
+	bits[longest]--; // drop the reserved code word
+
+	for (int i = 0; i < 16; ++i)
+		table[i] = i < HW_MAX_CODE_LENGTH ? bits[i + 1] : 0;
+	size_t n = 0;
+	for (int size = 1; size <= MAX_CODE_LENGTH; ++size)
+	{
+		for (int i = 0; i < 256; ++i)
+		{
+			if (codeSize[i] == size)
+				table[16 + n++] = i;
+		}
+	}
+}
+
+/** Number of bits the Huffman codes take when coding symbols occurring
+ * counts[symbol] times with table, without the extra bits of the values.
+ */
+uint64_t gemini_huffman_code_bits(const uint32_t *counts, const uint8_t *table)
+{
+	uint64_t total = 0;
+	const uint8_t *value = table + 16;
+	for (int length = 1; length <= 16; ++length)
+	{
+		for (int i = 0; i < table[length - 1]; ++i)
+			total += (uint64_t)counts[*value++] * length;
+	}
+	return total;
+}
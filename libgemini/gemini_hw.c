@@ -383,6 +383,20 @@ static const uint32_t hw_burstmask_table[44] = {
 };
 
 struct msm_gemini_hw_cmds* gemini_lib_hw_op_cfg(const struct gemini_op_cfg* opCfg, const struct gemini_output_cfg* outCfg)
+{
+	return gemini_lib_hw_op_cfg_strided(opCfg, outCfg, 0, 0);
+}
+
+/** Like gemini_lib_hw_op_cfg(), but for input planes with padded rows.
+ * Without rotation, the realtime fetch engine walks the MCUs using two jump
+ * values: (MCU height - 1) rows of Y plus one MCU width, and 7 rows of CbCr
+ * plus one MCU width. They are derived from the line strides, which can be
+ * given explicitly here.
+ * @param yStride    Bytes per row of the Y plane, or 0 for tightly packed rows.
+ * @param cbcrStride Bytes per row of the CbCr plane, or 0 for tightly packed rows.
+ */
+struct msm_gemini_hw_cmds* gemini_lib_hw_op_cfg_strided(const struct gemini_op_cfg* opCfg, const struct gemini_output_cfg* outCfg,
+						unsigned int yStride, unsigned int cbcrStride)
 {
 	struct msm_gemini_hw_cmds* result = makeHwCmds(
 			sizeof(g_hw_op_cfg_cmds),
@@ -412,6 +426,10 @@ struct msm_gemini_hw_cmds* gemini_lib_hw_op_cfg(const struct gemini_op_cfg* opCf
 			data5_byte0 = 8;
 			data5_byte1 = 1;
 			data5_byte2 = 0;
+			if (yStride)
+				data3 = (8 * factor - 1) * yStride + (data0 << 3);
+			if (cbcrStride)
+				data4 = 7 * cbcrStride + 16;
 			
 			if (opCfg->value == 1)
 			{
@@ -0,0 +1,420 @@
+/* MSM gemini (JPEG hardware encoder) userspace library
+ * Copyright (C) 2018 DafabHoid
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#define LOG_TAG "gemini"
+#include "gemini.h"
+#include <string.h>
+#include <log/log.h>
+
+/* JPEG container (SOI up to and including SOS) for the entropy coded data
+ * the hardware produces. The writer runs twice: once without a destination
+ * to get the size, and once for real. */
+
+#define M_SOI  0xD8
+#define M_SOF0 0xC0
+#define M_DHT  0xC4
+#define M_DQT  0xDB
+#define M_DRI  0xDD
+#define M_SOS  0xDA
+#define M_APP0 0xE0
+#define M_APP1 0xE1
+#define M_APP9 0xE9
+#define M_COM  0xFE
+
+#define MAX_SEGMENT_LENGTH 0xFFFF
+
+static const uint8_t g_zigzag[64] = {
+	 0,  1,  8, 16,  9,  2,  3, 10,
+	17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34,
+	27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+struct jfifWriter
+{
+	uint8_t *dest;
+	size_t size;
+	size_t pos;
+	struct gemini_jfif_layout layout;
+};
+
+static void putByte(struct jfifWriter *w, uint8_t value)
+{
+	if (w->dest && w->pos < w->size)
+		w->dest[w->pos] = value;
+	w->pos++;
+}
+
+static void putShort(struct jfifWriter *w, uint16_t value)
+{
+	putByte(w, value >> 8);
+	putByte(w, value & 0xFF);
+}
+
+static void putBytes(struct jfifWriter *w, const uint8_t *data, size_t length)
+{
+	if (w->dest && w->pos + length <= w->size)
+		memcpy(&w->dest[w->pos], data, length);
+	w->pos += length;
+}
+
+static void putLE16(struct jfifWriter *w, uint16_t value)
+{
+	putByte(w, value & 0xFF);
+	putByte(w, value >> 8);
+}
+
+static void putLE32(struct jfifWriter *w, uint32_t value)
+{
+	putLE16(w, value & 0xFFFF);
+	putLE16(w, value >> 16);
+}
+
+static void putMarker(struct jfifWriter *w, uint8_t marker)
+{
+	putByte(w, 0xFF);
+	putByte(w, marker);
+}
+
+static void putIfdEntry(struct jfifWriter *w, uint16_t tag, uint16_t type, uint32_t value)
+{
+	putLE16(w, tag);
+	putLE16(w, type);
+	putLE32(w, 1);
+	if (type == 3) // SHORT, left justified in the value field
+	{
+		putLE16(w, value);
+		putLE16(w, 0);
+	}
+	else
+	{
+		putLE32(w, value);
+	}
+}
+
+#define TIFF_HEADER_SIZE 8
+#define IFD0_SIZE (2 + 12 + 4)
+#define IFD1_SIZE (2 + 3 * 12 + 4)
+
+/* Minimal little endian TIFF structure: IFD0 with just the orientation,
+ * IFD1 pointing to the JPEG thumbnail that directly follows it. */
+static void putExifThumbnail(struct jfifWriter *w, const struct gemini_jfif_cfg *cfg)
+{
+	const uint32_t thumbnailOffset = TIFF_HEADER_SIZE + IFD0_SIZE + IFD1_SIZE;
+	putBytes(w, (const uint8_t *)"II*\0", 4);
+	putLE32(w, TIFF_HEADER_SIZE);
+	// IFD0
+	putLE16(w, 1);
+	putIfdEntry(w, 0x0112, 3, 1); // Orientation: top-left
+	putLE32(w, TIFF_HEADER_SIZE + IFD0_SIZE);
+	// IFD1
+	putLE16(w, 3);
+	putIfdEntry(w, 0x0103, 3, 6); // Compression: JPEG
+	putIfdEntry(w, 0x0201, 4, thumbnailOffset); // JPEGInterchangeFormat
+	w->layout.thumbnailLengthOffset = w->pos + 8;
+	putIfdEntry(w, 0x0202, 4, cfg->thumbnailLength); // JPEGInterchangeFormatLength
+	putLE32(w, 0);
+	if (cfg->thumbnail)
+	{
+		putBytes(w, cfg->thumbnail, cfg->thumbnailLength);
+		return;
+	}
+	// filled in by the caller, the length is corrected with gemini_jfif_fill_thumbnail_length()
+	w->layout.thumbnailOffset = w->pos;
+	if (w->dest && w->pos + cfg->thumbnailLength <= w->size)
+		memset(&w->dest[w->pos], 0, cfg->thumbnailLength);
+	w->pos += cfg->thumbnailLength;
+}
+
+static int putAppSegment(struct jfifWriter *w, const struct gemini_jfif_cfg *cfg)
+{
+	if (cfg->embedded)
+		return 0;
+	if (cfg->exif || cfg->thumbnail || cfg->thumbnailLength)
+	{
+		if (cfg->exif && (cfg->thumbnail || cfg->thumbnailLength))
+		{
+			ALOGE("%s: thumbnail can only be embedded into the generated EXIF\n", __func__);
+			return -1;
+		}
+		size_t tiffLength = cfg->exif ? cfg->exifLength
+				: TIFF_HEADER_SIZE + IFD0_SIZE + IFD1_SIZE + cfg->thumbnailLength;
+		size_t length = 2 + 6 + tiffLength;
+		if (length > MAX_SEGMENT_LENGTH)
+		{
+			ALOGE("%s: APP1 too large (%zu bytes)\n", __func__, length);
+			return -1;
+		}
+		putMarker(w, M_APP1);
+		putShort(w, length);
+		putBytes(w, (const uint8_t *)"Exif\0\0", 6);
+		if (cfg->exif)
+			putBytes(w, cfg->exif, cfg->exifLength);
+		else
+			putExifThumbnail(w, cfg);
+	}
+	else
+	{
+		static const uint8_t jfif[14] = {
+			'J', 'F', 'I', 'F', 0,
+			1, 1, // version 1.01
+			0, // no density units, just the aspect ratio
+			0, 1, 0, 1,
+			0, 0, // no thumbnail
+		};
+		putMarker(w, M_APP0);
+		putShort(w, 2 + sizeof(jfif));
+		putBytes(w, jfif, sizeof(jfif));
+	}
+	return 0;
+}
+
+#define RESTART_INDEX_ID "RSTIDX"
+#define RESTART_INDEX_MAX_SLOTS ((MAX_SEGMENT_LENGTH - 2 - sizeof(RESTART_INDEX_ID) - 4) / 4)
+
+unsigned int gemini_lib_restart_marker_count(const struct gemini_input_cfg *inputCfg, uint16_t restartInterval)
+{
+	if (!restartInterval)
+		return 0;
+	unsigned int mcus = inputCfg->frame_width_mcus * inputCfg->frame_height_mcus;
+	return (mcus + restartInterval - 1) / restartInterval - 1;
+}
+
+/* Room for the byte offsets (relative to SOI) of all RSTn markers, filled
+ * in once the job is done: identifier, big endian count, big endian
+ * offsets. */
+static void putRestartIndex(struct jfifWriter *w,
+						const struct gemini_input_cfg *inputCfg,
+						const struct gemini_hw_cfg *hwCfg)
+{
+	unsigned int slots = gemini_lib_restart_marker_count(inputCfg, hwCfg->restartMarker);
+	if (slots > RESTART_INDEX_MAX_SLOTS)
+	{
+		ALOGE("%s: %u restart markers don't fit into an APP segment\n", __func__, slots);
+		return;
+	}
+	putMarker(w, M_APP9);
+	putShort(w, 2 + sizeof(RESTART_INDEX_ID) + 4 + 4 * slots);
+	putBytes(w, (const uint8_t *)RESTART_INDEX_ID, sizeof(RESTART_INDEX_ID));
+	w->layout.restartIndexOffset = w->pos;
+	w->layout.restartIndexSlots = slots;
+	for (unsigned int i = 0; i < 1 + slots; ++i)
+	{
+		putShort(w, 0);
+		putShort(w, 0);
+	}
+}
+
+static void putQuantTables(struct jfifWriter *w, const struct gemini_hw_cfg *hwCfg, int tableCount)
+{
+	putMarker(w, M_DQT);
+	putShort(w, 2 + tableCount * 65);
+	for (int t = 0; t < tableCount; ++t)
+	{
+		putByte(w, t); // 8 bit precision, table t
+		for (int i = 0; i < 64; ++i)
+			putByte(w, hwCfg->quantTable[t][g_zigzag[i]]);
+	}
+}
+
+static void putHuffmanTables(struct jfifWriter *w, const struct gemini_hw_cfg *hwCfg, int tableCount)
+{
+	// Same order as gemini_hw_cfg.huffmanTable[]
+	static const uint8_t tableClassAndId[4] = {0x00, 0x10, 0x01, 0x11};
+	const uint8_t *tables[4];
+	size_t length = 2;
+	for (int t = 0; t < tableCount; ++t)
+	{
+		tables[t] = hwCfg->huffmanTablesAllocated ? hwCfg->huffmanTable[t]
+				: gemini_lib_std_huffman_table(t);
+		length += 1 + 16;
+		for (int i = 0; i < 16; ++i)
+			length += tables[t][i];
+	}
+	putMarker(w, M_DHT);
+	putShort(w, length);
+	for (int t = 0; t < tableCount; ++t)
+	{
+		size_t count = 0;
+		for (int i = 0; i < 16; ++i)
+			count += tables[t][i];
+		putByte(w, tableClassAndId[t]);
+		putBytes(w, tables[t], 16 + count);
+	}
+}
+
+static void putFrameHeader(struct jfifWriter *w, const struct gemini_input_cfg *inputCfg, int components)
+{
+	unsigned int hSamp = gemini_lib_mcu_h_samp(inputCfg->inputFormat);
+	unsigned int vSamp = gemini_lib_mcu_v_samp(inputCfg->inputFormat);
+	putMarker(w, M_SOF0);
+	putShort(w, 8 + 3 * components);
+	putByte(w, 8);
+	putShort(w, inputCfg->frame_height_mcus * 8 * vSamp);
+	putShort(w, inputCfg->frame_width_mcus * 8 * hSamp);
+	putByte(w, components);
+	if (components == 1)
+	{
+		// sampling factors don't matter without other components
+		putByte(w, 1); putByte(w, 0x11); putByte(w, 0);
+		return;
+	}
+	putByte(w, 1); putByte(w, (hSamp << 4) | vSamp); putByte(w, 0);
+	putByte(w, 2); putByte(w, 0x11); putByte(w, 1);
+	putByte(w, 3); putByte(w, 0x11); putByte(w, 1);
+}
+
+static size_t scanHeaderLength(int components)
+{
+	return 2 + 6 + 2 * components;
+}
+
+static void putScanHeader(struct jfifWriter *w, int components)
+{
+	putMarker(w, M_SOS);
+	putShort(w, scanHeaderLength(components) - 2);
+	putByte(w, components);
+	putByte(w, 1); putByte(w, 0x00);
+	if (components == 3)
+	{
+		putByte(w, 2); putByte(w, 0x11);
+		putByte(w, 3); putByte(w, 0x11);
+	}
+	putByte(w, 0); // Ss
+	putByte(w, 63); // Se
+	putByte(w, 0); // Ah/Al
+}
+
+/* Pad up to the requested alignment with a COM segment, or with fill bytes
+ * (allowed in front of any marker) if there is no room for one. */
+static void putPadding(struct jfifWriter *w, unsigned int alignment, int components)
+{
+	if (alignment <= 1)
+		return;
+	size_t end = w->pos + scanHeaderLength(components);
+	size_t pad = (alignment - end % alignment) % alignment;
+	if (pad >= 4)
+	{
+		putMarker(w, M_COM);
+		putShort(w, pad - 2);
+		for (size_t i = 4; i < pad; ++i)
+			putByte(w, 0);
+	}
+	else
+	{
+		for (size_t i = 0; i < pad; ++i)
+			putByte(w, 0xFF);
+	}
+}
+
+static int writeHeader(struct jfifWriter *w,
+						const struct gemini_jfif_cfg *cfg,
+						const struct gemini_input_cfg *inputCfg,
+						const struct gemini_hw_cfg *hwCfg)
+{
+	const int components = cfg->grayscale ? 1 : 3;
+	const int tableSets = cfg->grayscale ? 1 : 2; // luma, chroma
+	if (!hwCfg->quantTable[0] || (tableSets == 2 && !hwCfg->quantTable[1]))
+	{
+		ALOGE("%s: quantization tables unknown\n", __func__);
+		return -1;
+	}
+	putMarker(w, M_SOI);
+	if (putAppSegment(w, cfg) != 0)
+		return -1;
+	putQuantTables(w, hwCfg, tableSets);
+	putFrameHeader(w, inputCfg, components);
+	putHuffmanTables(w, hwCfg, 2 * tableSets);
+	if (hwCfg->restartMarker)
+	{
+		putMarker(w, M_DRI);
+		putShort(w, 4);
+		putShort(w, hwCfg->restartMarker);
+	}
+	if (cfg->restartIndex && hwCfg->restartMarker)
+		putRestartIndex(w, inputCfg, hwCfg);
+	putPadding(w, cfg->alignment, components);
+	putScanHeader(w, components);
+	return 0;
+}
+
+int gemini_jfif_header_size(const struct gemini_jfif_cfg *cfg,
+						const struct gemini_input_cfg *inputCfg,
+						const struct gemini_hw_cfg *hwCfg)
+{
+	struct jfifWriter w = { NULL, 0, 0, { 0 } };
+	if (writeHeader(&w, cfg, inputCfg, hwCfg) != 0)
+		return -1;
+	return w.pos;
+}
+
+int gemini_jfif_write_header(uint8_t *dest, size_t size,
+						const struct gemini_jfif_cfg *cfg,
+						const struct gemini_input_cfg *inputCfg,
+						const struct gemini_hw_cfg *hwCfg,
+						struct gemini_jfif_layout *layout)
+{
+	struct jfifWriter w = { dest, size, 0, { 0 } };
+	if (writeHeader(&w, cfg, inputCfg, hwCfg) != 0)
+		return -1;
+	if (w.pos > size)
+	{
+		ALOGE("%s: header needs %zu bytes, only %zu available\n", __func__, w.pos, size);
+		return -1;
+	}
+	if (layout)
+		*layout = w.layout;
+	return w.pos;
+}
+
+/** Fill the slots reserved by gemini_jfif_cfg.restartIndex.
+ * @param base    Offset of the bitstream relative to SOI, i.e. the header length.
+ * @param offsets Byte offsets of the RSTn markers relative to the bitstream.
+ */
+void gemini_jfif_fill_restart_index(uint8_t *header, const struct gemini_jfif_layout *layout,
+						uint32_t base, const uint32_t *offsets, unsigned int count)
+{
+	if (!layout->restartIndexOffset)
+		return;
+	if (count > layout->restartIndexSlots)
+		count = layout->restartIndexSlots;
+	struct jfifWriter w = { header, layout->restartIndexOffset + 4 * (1 + count),
+			layout->restartIndexOffset, { 0 } };
+	putShort(&w, count >> 16);
+	putShort(&w, count & 0xFFFF);
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		putShort(&w, (base + offsets[i]) >> 16);
+		putShort(&w, (base + offsets[i]) & 0xFFFF);
+	}
+}
+
+/** Replace the thumbnail length in IFD1 after the reserved room has been
+ * filled with a thumbnail of length bytes.
+ */
+void gemini_jfif_fill_thumbnail_length(uint8_t *header, const struct gemini_jfif_layout *layout,
+						uint32_t length)
+{
+	if (!layout->thumbnailOffset)
+		return;
+	struct jfifWriter w = { header, layout->thumbnailLengthOffset + 4,
+			layout->thumbnailLengthOffset, { 0 } };
+	putLE32(&w, length);
+}
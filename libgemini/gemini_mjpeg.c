@@ -0,0 +1,772 @@
+/* MSM gemini (JPEG hardware encoder) userspace library
+ * Copyright (C) 2018 DafabHoid
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#define LOG_TAG "gemini"
+#include "gemini.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <log/log.h>
+#include <media/msm_gemini.h> // Kernel header
+
+/* Motion JPEG recording: a session configured once, a ring of pmem input
+ * frames the client fills, and a pool of pmem output buffers. An encoder
+ * thread restarts the hardware for every queued frame without configuring
+ * it again, a writer thread muxes the finished files into a multipart
+ * stream or an AVI file, so the disk never stalls the encoder.
+ *
+ * Frame life cycle: free -> client (gemini_mjpeg_get_frame()) -> queued
+ * (gemini_mjpeg_submit()) -> encoding -> free. Output buffers: free ->
+ * encoding -> writing -> free. Everything is protected by one mutex. */
+
+#define MULTIPART_BOUNDARY "gemini-mjpeg"
+#define MAX_FRAME_IOV (16 + 2)
+#define JOB_TIMEOUT_MS 2000
+
+struct writeItem
+{
+	unsigned int outputIndex;
+	struct iovec iov[MAX_FRAME_IOV];
+	int iovcnt;
+	size_t length;
+	uint64_t timestampUs;
+	uint64_t submitUs;
+};
+
+struct aviIndexEntry
+{
+	uint32_t offset; // relative to the "movi" list type
+	uint32_t size;
+};
+
+struct gemini_mjpeg
+{
+	struct gemini_mjpeg_cfg cfg;
+	struct gemini *lib;
+	pthread_mutex_t mutex;
+	pthread_cond_t frameCond; // free and queued frames
+	pthread_cond_t outputCond; // free output buffers
+	pthread_cond_t writeCond; // write queue
+	pthread_cond_t jobCond; // hardware job state
+	bool shouldStop;
+	pthread_t encoderThread;
+	pthread_t writerThread;
+	bool encoderStarted; // joinable, only touched by the owner
+	bool writerStarted;
+	bool encoderRunning; // cleared by the encoder thread when it exits
+
+	struct gemini_mjpeg_frame *frames;
+	struct pmemBuffer *inputMemory;
+	unsigned int *freeFrames; // stack
+	unsigned int freeFrameCount;
+	unsigned int *queue; // ring of submitted frames
+	unsigned int queueHead;
+	unsigned int queueCount;
+
+	struct pmemBuffer *outputMemory;
+	unsigned int *freeOutputs; // stack
+	unsigned int freeOutputCount;
+
+	struct writeItem *writeQueue; // ring, one slot per output buffer
+	unsigned int writeHead;
+	unsigned int writeCount;
+
+	// state of the running hardware job
+	bool jobDone;
+	bool jobError;
+	bool jobOutput;
+
+	// muxer
+	uint64_t fileOffset;
+	struct aviIndexEntry *aviIndex;
+	unsigned int aviIndexCapacity;
+	uint32_t aviMoviOffset;
+	uint32_t aviTotalFramesOffset;
+	uint32_t aviLengthOffset;
+	bool writeFailed;
+
+	struct gemini_mjpeg_stats stats;
+	uint64_t startUs;
+	uint64_t windowStartUs;
+	unsigned int windowFrames;
+};
+
+static uint64_t nowUs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Little endian header builder for the AVI structures */
+struct byteWriter
+{
+	uint8_t *data;
+	size_t pos;
+};
+
+static void put32(struct byteWriter *w, uint32_t value)
+{
+	w->data[w->pos++] = value & 0xFF;
+	w->data[w->pos++] = (value >> 8) & 0xFF;
+	w->data[w->pos++] = (value >> 16) & 0xFF;
+	w->data[w->pos++] = value >> 24;
+}
+
+static void put16(struct byteWriter *w, uint16_t value)
+{
+	w->data[w->pos++] = value & 0xFF;
+	w->data[w->pos++] = value >> 8;
+}
+
+static void putFourcc(struct byteWriter *w, const char *fourcc)
+{
+	memcpy(&w->data[w->pos], fourcc, 4);
+	w->pos += 4;
+}
+
+static int writeAll(int fd, const void *data, size_t length)
+{
+	const uint8_t *p = data;
+	while (length)
+	{
+		ssize_t n = write(fd, p, length);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		length -= n;
+	}
+	return 0;
+}
+
+static int writevAll(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0)
+	{
+		ssize_t n = writev(fd, iov, iovcnt);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+		{
+			n -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0)
+		{
+			iov->iov_base = (uint8_t *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+static void patch32(struct gemini_mjpeg *m, uint32_t offset, uint32_t value)
+{
+	uint8_t bytes[4];
+	struct byteWriter w = { bytes, 0 };
+	put32(&w, value);
+	if (pwrite(m->cfg.fd, bytes, sizeof(bytes), offset) != sizeof(bytes))
+		ALOGE("%s: can't patch AVI header at %u\n", __func__, offset);
+}
+
+/* RIFF AVI header up to and including the type of the movi list, with the
+ * sizes and frame counts filled in by finishAvi() */
+static int startAvi(struct gemini_mjpeg *m)
+{
+	const struct gemini_input_cfg *in = &m->cfg.inputCfg;
+	const uint32_t width = in->frame_width_mcus * 8 * gemini_lib_mcu_h_samp(in->inputFormat);
+	const uint32_t height = in->frame_height_mcus * 8 * gemini_lib_mcu_v_samp(in->inputFormat);
+	const uint32_t fps = m->cfg.framesPerSecond ? m->cfg.framesPerSecond : 30;
+	uint8_t header[256];
+	struct byteWriter w = { header, 0 };
+
+	putFourcc(&w, "RIFF"); put32(&w, 0); putFourcc(&w, "AVI ");
+	putFourcc(&w, "LIST"); put32(&w, 4 + 8 + 56 + 8 + 4 + 8 + 56 + 8 + 40); putFourcc(&w, "hdrl");
+	putFourcc(&w, "avih"); put32(&w, 56);
+	put32(&w, 1000000 / fps); // dwMicroSecPerFrame
+	put32(&w, 0); // dwMaxBytesPerSec
+	put32(&w, 0); // dwPaddingGranularity
+	put32(&w, 0x10); // dwFlags: AVIF_HASINDEX
+	m->aviTotalFramesOffset = w.pos;
+	put32(&w, 0); // dwTotalFrames
+	put32(&w, 0); // dwInitialFrames
+	put32(&w, 1); // dwStreams
+	put32(&w, m->cfg.outputBufferSize); // dwSuggestedBufferSize
+	put32(&w, width);
+	put32(&w, height);
+	for (int i = 0; i < 4; ++i)
+		put32(&w, 0);
+	putFourcc(&w, "LIST"); put32(&w, 4 + 8 + 56 + 8 + 40); putFourcc(&w, "strl");
+	putFourcc(&w, "strh"); put32(&w, 56);
+	putFourcc(&w, "vids");
+	putFourcc(&w, "MJPG");
+	put32(&w, 0); // dwFlags
+	put16(&w, 0); // wPriority
+	put16(&w, 0); // wLanguage
+	put32(&w, 0); // dwInitialFrames
+	put32(&w, 1); // dwScale
+	put32(&w, fps); // dwRate
+	put32(&w, 0); // dwStart
+	m->aviLengthOffset = w.pos;
+	put32(&w, 0); // dwLength
+	put32(&w, m->cfg.outputBufferSize); // dwSuggestedBufferSize
+	put32(&w, 0xFFFFFFFF); // dwQuality
+	put32(&w, 0); // dwSampleSize
+	put16(&w, 0); put16(&w, 0); put16(&w, width); put16(&w, height); // rcFrame
+	putFourcc(&w, "strf"); put32(&w, 40);
+	put32(&w, 40); // biSize
+	put32(&w, width);
+	put32(&w, height);
+	put16(&w, 1); // biPlanes
+	put16(&w, 24); // biBitCount
+	putFourcc(&w, "MJPG");
+	put32(&w, width * height * 3); // biSizeImage
+	for (int i = 0; i < 4; ++i)
+		put32(&w, 0);
+	putFourcc(&w, "LIST"); put32(&w, 0); putFourcc(&w, "movi");
+	m->aviMoviOffset = w.pos - 4;
+	m->fileOffset = w.pos;
+	return writeAll(m->cfg.fd, header, w.pos);
+}
+
+static void finishAvi(struct gemini_mjpeg *m)
+{
+	const unsigned int frames = m->stats.written;
+	uint8_t *index = malloc(8 + 16 * (size_t)frames);
+	if (!index)
+		return;
+	struct byteWriter w = { index, 0 };
+	putFourcc(&w, "idx1");
+	put32(&w, 16 * frames);
+	for (unsigned int i = 0; i < frames; ++i)
+	{
+		putFourcc(&w, "00dc");
+		put32(&w, 0x10); // AVIIF_KEYFRAME
+		put32(&w, m->aviIndex[i].offset);
+		put32(&w, m->aviIndex[i].size);
+	}
+	const uint64_t moviEnd = m->fileOffset;
+	if (writeAll(m->cfg.fd, index, w.pos) == 0)
+	{
+		m->fileOffset += w.pos;
+		patch32(m, 4, m->fileOffset - 8);
+		patch32(m, m->aviMoviOffset - 4, moviEnd - m->aviMoviOffset);
+		patch32(m, m->aviTotalFramesOffset, frames);
+		patch32(m, m->aviLengthOffset, frames);
+	}
+	free(index);
+}
+
+static int writeAviFrame(struct gemini_mjpeg *m, struct writeItem *item)
+{
+	if (m->stats.written >= m->aviIndexCapacity)
+	{
+		unsigned int capacity = m->aviIndexCapacity ? 2 * m->aviIndexCapacity : 1024;
+		struct aviIndexEntry *index = realloc(m->aviIndex, capacity * sizeof(*index));
+		if (!index)
+			return -1;
+		m->aviIndex = index;
+		m->aviIndexCapacity = capacity;
+	}
+	m->aviIndex[m->stats.written].offset = m->fileOffset - m->aviMoviOffset;
+	m->aviIndex[m->stats.written].size = item->length;
+
+	uint8_t chunkHeader[8];
+	static const uint8_t pad = 0;
+	struct byteWriter w = { chunkHeader, 0 };
+	putFourcc(&w, "00dc");
+	put32(&w, item->length);
+	struct iovec iov[MAX_FRAME_IOV + 2];
+	int n = 0;
+	iov[n].iov_base = chunkHeader;
+	iov[n++].iov_len = sizeof(chunkHeader);
+	for (int i = 0; i < item->iovcnt; ++i)
+		iov[n++] = item->iov[i];
+	if (item->length & 1)
+	{
+		iov[n].iov_base = (void *)&pad;
+		iov[n++].iov_len = 1;
+	}
+	m->fileOffset += sizeof(chunkHeader) + item->length + (item->length & 1);
+	return writevAll(m->cfg.fd, iov, n);
+}
+
+static int writeMultipartFrame(struct gemini_mjpeg *m, struct writeItem *item)
+{
+	char partHeader[160];
+	static const char partEnd[] = "\r\n";
+	int headerLength = snprintf(partHeader, sizeof(partHeader),
+			"--" MULTIPART_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n"
+			"X-Timestamp-Us: %llu\r\n\r\n", item->length, (unsigned long long)item->timestampUs);
+	struct iovec iov[MAX_FRAME_IOV + 2];
+	int n = 0;
+	iov[n].iov_base = partHeader;
+	iov[n++].iov_len = headerLength;
+	for (int i = 0; i < item->iovcnt; ++i)
+		iov[n++] = item->iov[i];
+	iov[n].iov_base = (void *)partEnd;
+	iov[n++].iov_len = sizeof(partEnd) - 1;
+	m->fileOffset += headerLength + item->length + sizeof(partEnd) - 1;
+	return writevAll(m->cfg.fd, iov, n);
+}
+
+static void* writerThread(void *arg)
+{
+	struct gemini_mjpeg *m = arg;
+	pthread_mutex_lock(&m->mutex);
+	for (;;)
+	{
+		if (m->writeCount == 0)
+		{
+			if (m->shouldStop && !m->encoderRunning)
+				break;
+			pthread_cond_wait(&m->writeCond, &m->mutex);
+			continue;
+		}
+		struct writeItem item = m->writeQueue[m->writeHead];
+		pthread_mutex_unlock(&m->mutex);
+
+		int ret = 0;
+		if (!m->writeFailed)
+		{
+			ret = m->cfg.mux == GEMINI_MJPEG_MUX_AVI ? writeAviFrame(m, &item)
+					: writeMultipartFrame(m, &item);
+		}
+		const uint64_t doneUs = nowUs();
+
+		pthread_mutex_lock(&m->mutex);
+		m->writeHead = (m->writeHead + 1) % m->cfg.outputBuffers;
+		m->writeCount--;
+		m->freeOutputs[m->freeOutputCount++] = item.outputIndex;
+		pthread_cond_signal(&m->outputCond);
+		if (ret != 0 || m->writeFailed)
+		{
+			if (!m->writeFailed)
+				ALOGE("%s: write failed: %s\n", __func__, strerror(errno));
+			m->writeFailed = true;
+			m->stats.errors++;
+			continue;
+		}
+		const uint64_t latencyUs = doneUs - item.submitUs;
+		m->stats.written++;
+		m->stats.bytes += item.length;
+		m->stats.lastLatencyUs = latencyUs;
+		m->stats.totalLatencyUs += latencyUs;
+		if (latencyUs > m->stats.maxLatencyUs)
+			m->stats.maxLatencyUs = latencyUs;
+		m->windowFrames++;
+		if (doneUs - m->windowStartUs >= 1000000)
+		{
+			m->stats.recentFpsMilli = m->windowFrames * 1000000000ULL / (doneUs - m->windowStartUs);
+			m->windowStartUs = doneUs;
+			m->windowFrames = 0;
+		}
+		if (doneUs > m->startUs)
+			m->stats.averageFpsMilli = m->stats.written * 1000000000ULL / (doneUs - m->startUs);
+	}
+	pthread_mutex_unlock(&m->mutex);
+	return NULL;
+}
+
+static void eventCallback(struct gemini *lib, struct msm_gemini_ctrl_cmd *cmd)
+{
+	struct gemini_mjpeg *m = gemini_lib_get_user_data(lib);
+	if (!m)
+		return;
+	pthread_mutex_lock(&m->mutex);
+	if (cmd->type == MSM_GEMINI_EVT_FRAMEDONE)
+		m->jobDone = true;
+	else if (cmd->type == MSM_GEMINI_EVT_ERR)
+		m->jobError = true;
+	pthread_cond_signal(&m->jobCond);
+	pthread_mutex_unlock(&m->mutex);
+}
+
+static void inputCallback(struct gemini *lib, struct msm_gemini_buf *buf)
+{
+	// the frame is recycled once the whole job is done
+	(void)lib;
+	(void)buf;
+}
+
+static void outputCallback(struct gemini *lib, struct msm_gemini_buf *buf)
+{
+	(void)buf;
+	struct gemini_mjpeg *m = gemini_lib_get_user_data(lib);
+	if (!m)
+		return;
+	pthread_mutex_lock(&m->mutex);
+	m->jobOutput = true;
+	pthread_cond_signal(&m->jobCond);
+	pthread_mutex_unlock(&m->mutex);
+}
+
+static int configure(struct gemini_mjpeg *m)
+{
+	return gemini_lib_hw_config(m->lib, &m->cfg.inputCfg, m->cfg.weCfgParams,
+								&m->cfg.hwCfg, &m->cfg.opCfg);
+}
+
+/* Run one hardware job for frame into output buffer outputIndex. Called and
+ * returns with the mutex held. */
+static int encodeFrame(struct gemini_mjpeg *m, struct gemini_mjpeg_frame *frame,
+						unsigned int outputIndex, struct writeItem *item)
+{
+	struct msm_gemini_buf input = {
+		.type = 0,
+		.fd = m->inputMemory[frame->index].fd,
+		.vaddr = m->inputMemory[frame->index].vaddr,
+		.y_off = 0,
+		.y_len = frame->yLength,
+		.cbcr_off = frame->yLength,
+		.cbcr_len = frame->cbcrLength,
+		.num_of_mcu_rows = m->cfg.inputCfg.frame_height_mcus,
+	};
+	struct msm_gemini_buf output = {
+		.type = 0,
+		.fd = m->outputMemory[outputIndex].fd,
+		.vaddr = m->outputMemory[outputIndex].vaddr,
+		.y_off = 0,
+		.y_len = m->cfg.outputBufferSize,
+	};
+	m->jobDone = m->jobError = m->jobOutput = false;
+	pthread_mutex_unlock(&m->mutex);
+
+	const uint64_t startUs = nowUs();
+	int ret = gemini_lib_output_buf_enq(m->lib, &output);
+	if (ret == 0)
+		ret = gemini_lib_input_buf_enq(m->lib, &input);
+	if (ret == 0)
+		ret = gemini_lib_encode(m->lib);
+
+	pthread_mutex_lock(&m->mutex);
+	if (ret == 0)
+	{
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += JOB_TIMEOUT_MS / 1000;
+		while (!(m->jobDone && m->jobOutput) && !m->jobError && ret == 0)
+			ret = pthread_cond_timedwait(&m->jobCond, &m->mutex, &deadline);
+		if (m->jobError && ret == 0)
+			ret = -1;
+	}
+	const uint64_t encodeUs = nowUs() - startUs;
+	m->stats.lastEncodeUs = encodeUs;
+	if (encodeUs > m->stats.maxEncodeUs)
+		m->stats.maxEncodeUs = encodeUs;
+	if (ret != 0)
+		return -1;
+
+	pthread_mutex_unlock(&m->mutex);
+	item->iovcnt = gemini_lib_container_get_iov(m->lib, item->iov, MAX_FRAME_IOV);
+	// consecutive frames are alike, the tables of this one suit the next
+	if (m->cfg.optimizeHuffman && item->iovcnt > 0)
+		gemini_lib_learn_huffman(m->lib, NULL, 0);
+	pthread_mutex_lock(&m->mutex);
+	if (item->iovcnt <= 0)
+		return -1;
+	item->length = 0;
+	for (int i = 0; i < item->iovcnt; ++i)
+		item->length += item->iov[i].iov_len;
+	item->outputIndex = outputIndex;
+	return 0;
+}
+
+static void* encoderThread(void *arg)
+{
+	struct gemini_mjpeg *m = arg;
+	pthread_mutex_lock(&m->mutex);
+	for (;;)
+	{
+		if (m->queueCount == 0 || m->freeOutputCount == 0)
+		{
+			if (m->shouldStop && m->queueCount == 0)
+				break;
+			pthread_cond_wait(m->queueCount ? &m->outputCond : &m->frameCond, &m->mutex);
+			continue;
+		}
+		const unsigned int frameIndex = m->queue[m->queueHead];
+		m->queueHead = (m->queueHead + 1) % m->cfg.inputBuffers;
+		m->queueCount--;
+		const unsigned int outputIndex = m->freeOutputs[--m->freeOutputCount];
+		struct gemini_mjpeg_frame *frame = &m->frames[frameIndex];
+
+		struct writeItem item;
+		item.timestampUs = frame->timestampUs;
+		item.submitUs = frame->submitUs;
+		if (encodeFrame(m, frame, outputIndex, &item) == 0)
+		{
+			m->stats.encoded++;
+			const unsigned int tail = (m->writeHead + m->writeCount) % m->cfg.outputBuffers;
+			m->writeQueue[tail] = item;
+			m->writeCount++;
+			pthread_cond_signal(&m->writeCond);
+		}
+		else
+		{
+			// stop the job and bring the hardware back into a known state
+			ALOGE("%s: frame %u failed\n", __func__, frameIndex);
+			m->stats.errors++;
+			m->freeOutputs[m->freeOutputCount++] = outputIndex;
+			pthread_mutex_unlock(&m->mutex);
+			gemini_lib_stop(m->lib, 1);
+			configure(m);
+			pthread_mutex_lock(&m->mutex);
+		}
+		m->freeFrames[m->freeFrameCount++] = frameIndex;
+		pthread_cond_broadcast(&m->frameCond);
+	}
+	m->encoderRunning = false;
+	pthread_cond_signal(&m->writeCond);
+	pthread_mutex_unlock(&m->mutex);
+	return NULL;
+}
+
+static void freeBuffers(struct pmemBuffer *buffers, unsigned int count)
+{
+	if (!buffers)
+		return;
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		if (buffers[i].vaddr)
+			do_munmap(buffers[i].fd, buffers[i].vaddr, buffers[i].size);
+	}
+	free(buffers);
+}
+
+static int allocBuffers(struct pmemBuffer **out, unsigned int count, size_t size)
+{
+	struct pmemBuffer *buffers = calloc(count, sizeof(*buffers));
+	*out = buffers;
+	if (!buffers)
+		return -1;
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		buffers[i].vaddr = do_mmap(size, &buffers[i].fd);
+		if (!buffers[i].vaddr)
+			return -1;
+		buffers[i].size = size;
+	}
+	return 0;
+}
+
+static void destroy(struct gemini_mjpeg *m)
+{
+	if (m->lib)
+	{
+		gemini_lib_set_user_data(m->lib, NULL);
+		gemini_lib_release(m->lib);
+	}
+	freeBuffers(m->inputMemory, m->cfg.inputBuffers);
+	freeBuffers(m->outputMemory, m->cfg.outputBuffers);
+	free(m->frames);
+	free(m->freeFrames);
+	free(m->queue);
+	free(m->freeOutputs);
+	free(m->writeQueue);
+	free(m->aviIndex);
+	pthread_mutex_destroy(&m->mutex);
+	pthread_cond_destroy(&m->frameCond);
+	pthread_cond_destroy(&m->outputCond);
+	pthread_cond_destroy(&m->writeCond);
+	pthread_cond_destroy(&m->jobCond);
+	free(m);
+}
+
+/** Open a gemini session with the fixed configuration of cfg, allocate the
+ * buffer pools and start writing the stream to cfg->fd.
+ */
+struct gemini_mjpeg* gemini_mjpeg_create(const struct gemini_mjpeg_cfg *cfg)
+{
+	if (cfg->inputBuffers == 0 || cfg->outputBuffers == 0 || cfg->fd < 0)
+		return NULL;
+	struct gemini_mjpeg *m = calloc(1, sizeof(*m));
+	if (!m)
+		return NULL;
+	m->cfg = *cfg;
+	pthread_mutex_init(&m->mutex, NULL);
+	pthread_cond_init(&m->frameCond, NULL);
+	pthread_cond_init(&m->outputCond, NULL);
+	pthread_cond_init(&m->writeCond, NULL);
+	pthread_cond_init(&m->jobCond, NULL);
+
+	const struct gemini_input_cfg *in = &m->cfg.inputCfg;
+	const size_t ySize = in->frame_width_mcus * 8 * gemini_lib_mcu_h_samp(in->inputFormat)
+						* in->frame_height_mcus * 8 * gemini_lib_mcu_v_samp(in->inputFormat);
+	const size_t cbcrSize = in->frame_width_mcus * 16 * in->frame_height_mcus * 8;
+	if (!m->cfg.outputBufferSize)
+		m->cfg.outputBufferSize = ySize;
+	const unsigned int inputs = m->cfg.inputBuffers, outputs = m->cfg.outputBuffers;
+	m->frames = calloc(inputs, sizeof(m->frames[0]));
+	m->freeFrames = calloc(inputs, sizeof(m->freeFrames[0]));
+	m->queue = calloc(inputs, sizeof(m->queue[0]));
+	m->freeOutputs = calloc(outputs, sizeof(m->freeOutputs[0]));
+	m->writeQueue = calloc(outputs, sizeof(m->writeQueue[0]));
+	if (!m->frames || !m->freeFrames || !m->queue || !m->freeOutputs || !m->writeQueue
+		|| allocBuffers(&m->inputMemory, inputs, ySize + cbcrSize) != 0
+		|| allocBuffers(&m->outputMemory, outputs, m->cfg.outputBufferSize) != 0)
+	{
+		ALOGE("%s: buffer allocation failed\n", __func__);
+		goto fail;
+	}
+	for (unsigned int i = 0; i < inputs; ++i)
+	{
+		m->frames[i].index = i;
+		m->frames[i].y = m->inputMemory[i].vaddr;
+		m->frames[i].yLength = ySize;
+		m->frames[i].cbcr = m->frames[i].y + ySize;
+		m->frames[i].cbcrLength = cbcrSize;
+		m->freeFrames[m->freeFrameCount++] = inputs - 1 - i;
+	}
+	for (unsigned int i = 0; i < outputs; ++i)
+		m->freeOutputs[m->freeOutputCount++] = i;
+
+	int *fd;
+	if (gemini_lib_init(&fd, eventCallback, inputCallback, outputCallback) < 0)
+		goto fail;
+	m->lib = gemini_lib_from_fd(fd);
+	gemini_lib_set_user_data(m->lib, m);
+	gemini_lib_set_container(m->lib, &m->cfg.jfif);
+	gemini_lib_set_huffman_optimization(m->lib, m->cfg.optimizeHuffman);
+	if (configure(m) != 0)
+	{
+		ALOGE("%s: configuration failed\n", __func__);
+		goto fail;
+	}
+	if (m->cfg.mux == GEMINI_MJPEG_MUX_AVI && startAvi(m) != 0)
+	{
+		ALOGE("%s: can't write AVI header: %s\n", __func__, strerror(errno));
+		goto fail;
+	}
+
+	m->startUs = m->windowStartUs = nowUs();
+	m->encoderRunning = true;
+	m->encoderStarted = pthread_create(&m->encoderThread, NULL, encoderThread, m) == 0;
+	m->encoderRunning = m->encoderStarted;
+	m->writerStarted = pthread_create(&m->writerThread, NULL, writerThread, m) == 0;
+	if (!m->encoderStarted || !m->writerStarted)
+	{
+		gemini_mjpeg_destroy(m);
+		return NULL;
+	}
+	return m;
+fail:
+	destroy(m);
+	return NULL;
+}
+
+/** Get an input frame to fill in. When all frames are in use, the drop
+ * policy decides: GEMINI_MJPEG_DROP_NEWEST returns NULL (the caller drops
+ * its frame), GEMINI_MJPEG_DROP_OLDEST takes back the oldest frame that
+ * waits for the encoder, GEMINI_MJPEG_BLOCK waits for one to become free.
+ */
+struct gemini_mjpeg_frame* gemini_mjpeg_get_frame(struct gemini_mjpeg *m)
+{
+	struct gemini_mjpeg_frame *frame = NULL;
+	pthread_mutex_lock(&m->mutex);
+	for (;;)
+	{
+		if (m->freeFrameCount)
+		{
+			frame = &m->frames[m->freeFrames[--m->freeFrameCount]];
+			break;
+		}
+		if (m->cfg.dropPolicy == GEMINI_MJPEG_DROP_OLDEST && m->queueCount)
+		{
+			frame = &m->frames[m->queue[m->queueHead]];
+			m->queueHead = (m->queueHead + 1) % m->cfg.inputBuffers;
+			m->queueCount--;
+			m->stats.dropped++;
+			break;
+		}
+		if (m->cfg.dropPolicy != GEMINI_MJPEG_BLOCK || m->shouldStop)
+		{
+			m->stats.dropped++;
+			break;
+		}
+		pthread_cond_wait(&m->frameCond, &m->mutex);
+	}
+	pthread_mutex_unlock(&m->mutex);
+	return frame;
+}
+
+/** Queue a frame from gemini_mjpeg_get_frame() for encoding.
+ */
+int gemini_mjpeg_submit(struct gemini_mjpeg *m, struct gemini_mjpeg_frame *frame, uint64_t timestampUs)
+{
+	pthread_mutex_lock(&m->mutex);
+	frame->timestampUs = timestampUs;
+	frame->submitUs = nowUs();
+	const unsigned int tail = (m->queueHead + m->queueCount) % m->cfg.inputBuffers;
+	m->queue[tail] = frame->index;
+	m->queueCount++;
+	m->stats.submitted++;
+	pthread_cond_broadcast(&m->frameCond);
+	pthread_mutex_unlock(&m->mutex);
+	return 0;
+}
+
+void gemini_mjpeg_get_stats(struct gemini_mjpeg *m, struct gemini_mjpeg_stats *stats)
+{
+	pthread_mutex_lock(&m->mutex);
+	*stats = m->stats;
+	pthread_mutex_unlock(&m->mutex);
+}
+
+/** Encode and write all queued frames, finish the stream (the AVI index
+ * needs a seekable file) and release everything. The file descriptor stays
+ * open.
+ * @return 0 if every frame could be written.
+ */
+int gemini_mjpeg_destroy(struct gemini_mjpeg *m)
+{
+	pthread_mutex_lock(&m->mutex);
+	m->shouldStop = true;
+	pthread_cond_broadcast(&m->frameCond);
+	pthread_cond_broadcast(&m->outputCond);
+	pthread_cond_broadcast(&m->writeCond);
+	pthread_mutex_unlock(&m->mutex);
+	if (m->encoderStarted)
+		pthread_join(m->encoderThread, NULL);
+	m->encoderStarted = false;
+	pthread_mutex_lock(&m->mutex);
+	m->encoderRunning = false;
+	pthread_cond_broadcast(&m->writeCond);
+	pthread_mutex_unlock(&m->mutex);
+	if (m->writerStarted)
+		pthread_join(m->writerThread, NULL);
+
+	static const char multipartEnd[] = "--" MULTIPART_BOUNDARY "--\r\n";
+	if (!m->writeFailed)
+	{
+		if (m->cfg.mux == GEMINI_MJPEG_MUX_AVI)
+			finishAvi(m);
+		else
+			writeAll(m->cfg.fd, multipartEnd, sizeof(multipartEnd) - 1);
+	}
+	const int ret = m->writeFailed || m->stats.errors ? -1 : 0;
+	destroy(m);
+	return ret;
+}
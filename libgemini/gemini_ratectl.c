@@ -0,0 +1,111 @@
+/* MSM gemini (JPEG hardware encoder) userspace library
+ * Copyright (C) 2018 DafabHoid
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "gemini.h"
+#include <math.h>
+
+/* Size model for the target size mode: the bytes per pixel of a job are
+ * modelled as k * s^-gamma, with s the factor the standard quantisation
+ * tables are scaled with for a quality (1 at 50, see
+ * createQuantisizerMatrix()). k follows the content as a moving average of
+ * what each job implies, gamma is re-estimated from two consecutive jobs
+ * with different scales, like a secant step. */
+
+#define MIN_QUALITY 20 // lower qualities overflow 8 bit quantisation entries
+#define MAX_QUALITY 98
+#define INITIAL_GAMMA 0.8
+#define K_SMOOTHING 0.5
+#define MIN_GAMMA_LOG_SCALE_STEP 0.1
+
+static double scaleForQuality(unsigned int quality)
+{
+	if (quality < 1)
+		quality = 1;
+	if (quality > MAX_QUALITY)
+		quality = MAX_QUALITY;
+	double frac = quality > 50 ? 50.0 / (100 - quality) : quality / 50.0;
+	return 1.0 / frac;
+}
+
+static unsigned int qualityForScale(double scale)
+{
+	double frac = 1.0 / scale;
+	double quality = frac >= 1.0 ? 100.0 - 50.0 / frac : 50.0 * frac;
+	if (!(quality >= MIN_QUALITY)) // also catches NaN
+		return MIN_QUALITY;
+	if (quality > MAX_QUALITY)
+		return MAX_QUALITY;
+	return (unsigned int)(quality + 0.5);
+}
+
+void gemini_ratectl_init(struct gemini_ratectl *rc, size_t targetBytes,
+						unsigned int tolerancePercent, unsigned int initialQuality)
+{
+	rc->targetBytes = targetBytes;
+	rc->tolerancePercent = tolerancePercent < 100 ? tolerancePercent : 99;
+	rc->initialQuality = initialQuality;
+	rc->observations = 0;
+	rc->logK = 0;
+	rc->gamma = INITIAL_GAMMA;
+	rc->lastLogScale = 0;
+	rc->lastLogBpp = 0;
+}
+
+/** Feed the size of a finished job into the model.
+ */
+void gemini_ratectl_update(struct gemini_ratectl *rc, unsigned int quality, size_t bytes, uint32_t pixels)
+{
+	if (bytes == 0 || pixels == 0)
+		return;
+	const double logScale = log(scaleForQuality(quality));
+	const double logBpp = log((double)bytes / pixels);
+	/* Steps of a few qualities mostly measure how the rounded tables change,
+	 * neighbouring qualities can even give the same size. */
+	if (rc->observations > 0 && fabs(logScale - rc->lastLogScale) > MIN_GAMMA_LOG_SCALE_STEP)
+	{
+		double gamma = -(logBpp - rc->lastLogBpp) / (logScale - rc->lastLogScale);
+		if (gamma < 0.2)
+			gamma = 0.2;
+		if (gamma > 2.5)
+			gamma = 2.5;
+		rc->gamma = 0.5 * rc->gamma + 0.5 * gamma;
+	}
+	const double logK = logBpp + rc->gamma * logScale;
+	rc->logK = rc->observations > 0 ? rc->logK + K_SMOOTHING * (logK - rc->logK) : logK;
+	rc->lastLogScale = logScale;
+	rc->lastLogBpp = logBpp;
+	rc->observations++;
+}
+
+/** Quality for the next job of pixels pixels, aiming at the middle of the
+ * tolerance band below the target size.
+ */
+unsigned int gemini_ratectl_quality(const struct gemini_ratectl *rc, uint32_t pixels)
+{
+	if (rc->observations == 0 || pixels == 0)
+		return rc->initialQuality;
+	const double aim = rc->targetBytes * (1.0 - rc->tolerancePercent / 200.0);
+	const double logScale = (rc->logK - log(aim / pixels)) / rc->gamma;
+	return qualityForScale(exp(logScale));
+}
+
+/** Whether bytes is within the tolerance band below the target.
+ */
+bool gemini_ratectl_hit(const struct gemini_ratectl *rc, size_t bytes)
+{
+	return bytes <= rc->targetBytes
+		&& bytes * 100 >= (uint64_t)rc->targetBytes * (100 - rc->tolerancePercent);
+}
@@ -0,0 +1,273 @@
+/* MSM gemini (JPEG hardware encoder) userspace library
+ * Copyright (C) 2018 DafabHoid
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "gemini.h"
+#include <string.h>
+#include <sys/types.h>
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+/* Rotation and mirroring of NV12/NV21 images into the Y + CrCb layout of the
+ * hardware. Every output plane is described as a walk over the source plane:
+ * the output element (x, y) is read from origin + x * dx + y * dy. Without
+ * transposition an output row is a (possibly reversed) source row, otherwise
+ * it is a source column, and the plane is processed in 8x8 tiles that are
+ * transposed in registers. */
+
+#define TILE 8
+
+static bool isTransposed(unsigned int transform)
+{
+	return transform >= GEMINI_TRANSFORM_TRANSPOSE;
+}
+
+/* Walk over a plane of width x height elements of elemSize bytes, in bytes */
+static void planeWalk(unsigned int transform, unsigned int width, unsigned int height, ptrdiff_t stride,
+						ptrdiff_t elemSize, ptrdiff_t *origin, ptrdiff_t *dx, ptrdiff_t *dy)
+{
+	const ptrdiff_t lastRow = (ptrdiff_t)(height - 1) * stride;
+	const ptrdiff_t lastColumn = (ptrdiff_t)(width - 1) * elemSize;
+	switch (transform)
+	{
+	default:
+	case GEMINI_TRANSFORM_NONE:
+		*origin = 0; *dx = elemSize; *dy = stride;
+		break;
+	case GEMINI_TRANSFORM_MIRROR:
+		*origin = lastColumn; *dx = -elemSize; *dy = stride;
+		break;
+	case GEMINI_TRANSFORM_ROT180:
+		*origin = lastRow + lastColumn; *dx = -elemSize; *dy = -stride;
+		break;
+	case GEMINI_TRANSFORM_FLIP:
+		*origin = lastRow; *dx = elemSize; *dy = -stride;
+		break;
+	case GEMINI_TRANSFORM_TRANSPOSE:
+		*origin = 0; *dx = stride; *dy = elemSize;
+		break;
+	case GEMINI_TRANSFORM_ROT90:
+		*origin = lastRow; *dx = -stride; *dy = elemSize;
+		break;
+	case GEMINI_TRANSFORM_TRANSVERSE:
+		*origin = lastRow + lastColumn; *dx = -stride; *dy = -elemSize;
+		break;
+	case GEMINI_TRANSFORM_ROT270:
+		*origin = lastColumn; *dx = stride; *dy = -elemSize;
+		break;
+	}
+}
+
+static __inline void putElement(uint8_t *dest, const uint8_t *src, size_t elemSize, bool swap)
+{
+	if (elemSize == 1)
+		dest[0] = src[0];
+	else if (swap)
+	{
+		dest[0] = src[1];
+		dest[1] = src[0];
+	}
+	else
+	{
+		dest[0] = src[0];
+		dest[1] = src[1];
+	}
+}
+
+static void copyRow(uint8_t *dest, const uint8_t *src, unsigned int width, ptrdiff_t dx, bool swap)
+{
+	const size_t elemSize = dx < 0 ? -dx : dx;
+	unsigned int x = 0;
+	if (dx > 0 && !swap)
+	{
+		memcpy(dest, src, width * elemSize);
+		return;
+	}
+#ifdef HAVE_NEON
+	if (elemSize == 1)
+	{
+		for (; x + 16 <= width; x += 16)
+		{
+			uint8x16_t v = vrev64q_u8(vld1q_u8(src - x - 15));
+			vst1q_u8(dest + x, vcombine_u8(vget_high_u8(v), vget_low_u8(v)));
+		}
+	}
+	else
+	{
+		for (; x + 8 <= width; x += 8)
+		{
+			uint16x8_t v;
+			if (dx < 0)
+			{
+				v = vrev64q_u16(vld1q_u16((const uint16_t *)(src - 2 * x - 14)));
+				v = vcombine_u16(vget_high_u16(v), vget_low_u16(v));
+			}
+			else
+				v = vld1q_u16((const uint16_t *)(src + 2 * x));
+			if (swap)
+				v = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(v)));
+			vst1q_u16((uint16_t *)(dest + 2 * x), v);
+		}
+	}
+#endif
+	for (; x < width; ++x)
+		putElement(dest + x * elemSize, src + x * dx, elemSize, swap);
+}
+
+static void transposeTileScalar(uint8_t *dest, size_t destStride, const uint8_t *src, ptrdiff_t dx, ptrdiff_t dy,
+						unsigned int width, unsigned int rows, size_t elemSize, bool swap)
+{
+	for (unsigned int y = 0; y < rows; ++y)
+		for (unsigned int x = 0; x < width; ++x)
+			putElement(dest + y * destStride + x * elemSize, src + x * dx + y * dy, elemSize, swap);
+}
+
+#ifdef HAVE_NEON
+static void transposeTile8(uint8_t *dest, size_t destStride, const uint8_t *src, ptrdiff_t dx, ptrdiff_t dy)
+{
+	uint8x8_t r[TILE];
+	for (int k = 0; k < TILE; ++k)
+	{
+		const uint8_t *p = src + k * dx;
+		r[k] = dy > 0 ? vld1_u8(p) : vrev64_u8(vld1_u8(p - 7));
+	}
+	uint8x8x2_t t0 = vtrn_u8(r[0], r[1]);
+	uint8x8x2_t t1 = vtrn_u8(r[2], r[3]);
+	uint8x8x2_t t2 = vtrn_u8(r[4], r[5]);
+	uint8x8x2_t t3 = vtrn_u8(r[6], r[7]);
+	uint16x4x2_t u0 = vtrn_u16(vreinterpret_u16_u8(t0.val[0]), vreinterpret_u16_u8(t1.val[0]));
+	uint16x4x2_t u1 = vtrn_u16(vreinterpret_u16_u8(t0.val[1]), vreinterpret_u16_u8(t1.val[1]));
+	uint16x4x2_t u2 = vtrn_u16(vreinterpret_u16_u8(t2.val[0]), vreinterpret_u16_u8(t3.val[0]));
+	uint16x4x2_t u3 = vtrn_u16(vreinterpret_u16_u8(t2.val[1]), vreinterpret_u16_u8(t3.val[1]));
+	uint32x2x2_t v0 = vtrn_u32(vreinterpret_u32_u16(u0.val[0]), vreinterpret_u32_u16(u2.val[0]));
+	uint32x2x2_t v1 = vtrn_u32(vreinterpret_u32_u16(u1.val[0]), vreinterpret_u32_u16(u3.val[0]));
+	uint32x2x2_t v2 = vtrn_u32(vreinterpret_u32_u16(u0.val[1]), vreinterpret_u32_u16(u2.val[1]));
+	uint32x2x2_t v3 = vtrn_u32(vreinterpret_u32_u16(u1.val[1]), vreinterpret_u32_u16(u3.val[1]));
+	vst1_u8(dest + 0 * destStride, vreinterpret_u8_u32(v0.val[0]));
+	vst1_u8(dest + 1 * destStride, vreinterpret_u8_u32(v1.val[0]));
+	vst1_u8(dest + 2 * destStride, vreinterpret_u8_u32(v2.val[0]));
+	vst1_u8(dest + 3 * destStride, vreinterpret_u8_u32(v3.val[0]));
+	vst1_u8(dest + 4 * destStride, vreinterpret_u8_u32(v0.val[1]));
+	vst1_u8(dest + 5 * destStride, vreinterpret_u8_u32(v1.val[1]));
+	vst1_u8(dest + 6 * destStride, vreinterpret_u8_u32(v2.val[1]));
+	vst1_u8(dest + 7 * destStride, vreinterpret_u8_u32(v3.val[1]));
+}
+
+static __inline uint16x8_t combineRows(uint32x4_t low, uint32x4_t high, bool upper)
+{
+	return vreinterpretq_u16_u32(upper ? vcombine_u32(vget_high_u32(low), vget_high_u32(high))
+									: vcombine_u32(vget_low_u32(low), vget_low_u32(high)));
+}
+
+// Same for the interleaved chroma plane, with CbCr pairs as elements
+static void transposeTile16(uint8_t *dest, size_t destStride, const uint8_t *src, ptrdiff_t dx, ptrdiff_t dy, bool swap)
+{
+	uint16x8_t r[TILE];
+	for (int k = 0; k < TILE; ++k)
+	{
+		const uint8_t *p = src + k * dx;
+		if (dy > 0)
+			r[k] = vld1q_u16((const uint16_t *)p);
+		else
+		{
+			uint16x8_t v = vrev64q_u16(vld1q_u16((const uint16_t *)(p - 14)));
+			r[k] = vcombine_u16(vget_high_u16(v), vget_low_u16(v));
+		}
+		if (swap)
+			r[k] = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(r[k])));
+	}
+	uint16x8x2_t t0 = vtrnq_u16(r[0], r[1]);
+	uint16x8x2_t t1 = vtrnq_u16(r[2], r[3]);
+	uint16x8x2_t t2 = vtrnq_u16(r[4], r[5]);
+	uint16x8x2_t t3 = vtrnq_u16(r[6], r[7]);
+	uint32x4x2_t u0 = vtrnq_u32(vreinterpretq_u32_u16(t0.val[0]), vreinterpretq_u32_u16(t1.val[0]));
+	uint32x4x2_t u1 = vtrnq_u32(vreinterpretq_u32_u16(t0.val[1]), vreinterpretq_u32_u16(t1.val[1]));
+	uint32x4x2_t u2 = vtrnq_u32(vreinterpretq_u32_u16(t2.val[0]), vreinterpretq_u32_u16(t3.val[0]));
+	uint32x4x2_t u3 = vtrnq_u32(vreinterpretq_u32_u16(t2.val[1]), vreinterpretq_u32_u16(t3.val[1]));
+	vst1q_u16((uint16_t *)(dest + 0 * destStride), combineRows(u0.val[0], u2.val[0], false));
+	vst1q_u16((uint16_t *)(dest + 1 * destStride), combineRows(u1.val[0], u3.val[0], false));
+	vst1q_u16((uint16_t *)(dest + 2 * destStride), combineRows(u0.val[1], u2.val[1], false));
+	vst1q_u16((uint16_t *)(dest + 3 * destStride), combineRows(u1.val[1], u3.val[1], false));
+	vst1q_u16((uint16_t *)(dest + 4 * destStride), combineRows(u0.val[0], u2.val[0], true));
+	vst1q_u16((uint16_t *)(dest + 5 * destStride), combineRows(u1.val[0], u3.val[0], true));
+	vst1q_u16((uint16_t *)(dest + 6 * destStride), combineRows(u0.val[1], u2.val[1], true));
+	vst1q_u16((uint16_t *)(dest + 7 * destStride), combineRows(u1.val[1], u3.val[1], true));
+}
+#endif
+
+/* rows output rows of width elements, src pointing at the source of the
+ * first output element */
+static void transformPlane(uint8_t *dest, size_t destStride, const uint8_t *src, ptrdiff_t dx, ptrdiff_t dy,
+						unsigned int width, unsigned int rows, size_t elemSize, bool swap)
+{
+	if (dx == (ptrdiff_t)elemSize || dx == -(ptrdiff_t)elemSize)
+	{
+		for (unsigned int y = 0; y < rows; ++y)
+			copyRow(dest + y * destStride, src + y * dy, width, dx, swap);
+		return;
+	}
+	for (unsigned int y = 0; y < rows; y += TILE)
+	{
+		const unsigned int tileRows = rows - y < TILE ? rows - y : TILE;
+		for (unsigned int x = 0; x < width; x += TILE)
+		{
+			const unsigned int tileWidth = width - x < TILE ? width - x : TILE;
+			uint8_t *tileDest = dest + y * destStride + x * elemSize;
+			const uint8_t *tileSrc = src + x * dx + y * dy;
+#ifdef HAVE_NEON
+			if (tileRows == TILE && tileWidth == TILE)
+			{
+				if (elemSize == 1)
+					transposeTile8(tileDest, destStride, tileSrc, dx, dy);
+				else
+					transposeTile16(tileDest, destStride, tileSrc, dx, dy, swap);
+				continue;
+			}
+#endif
+			transposeTileScalar(tileDest, destStride, tileSrc, dx, dy, tileWidth, tileRows, elemSize, swap);
+		}
+	}
+}
+
+void gemini_transform_size(const struct gemini_source_image *src, unsigned int transform,
+						unsigned int *width, unsigned int *height)
+{
+	*width = isTransposed(transform) ? src->height : src->width;
+	*height = isTransposed(transform) ? src->width : src->height;
+}
+
+/** Write the output rows firstRow..firstRow+rows-1 of the NV12 or NV21 image
+ * src transformed by transform (one of GEMINI_TRANSFORM_*) into the Y and
+ * CrCb planes of a band. Width and height of src and firstRow and rows must
+ * be even.
+ */
+void gemini_transform_rows(const struct gemini_source_image *src, unsigned int transform,
+						unsigned int firstRow, unsigned int rows,
+						uint8_t *yDest, size_t yStride, uint8_t *crcbDest, size_t crcbStride)
+{
+	unsigned int width, height;
+	gemini_transform_size(src, transform, &width, &height);
+	ptrdiff_t origin, dx, dy;
+
+	planeWalk(transform, src->width, src->height, src->strides[0], 1, &origin, &dx, &dy);
+	transformPlane(yDest, yStride, src->planes[0] + origin + (ptrdiff_t)firstRow * dy, dx, dy,
+					width, rows, 1, false);
+
+	planeWalk(transform, src->width / 2, src->height / 2, src->strides[1], 2, &origin, &dx, &dy);
+	transformPlane(crcbDest, crcbStride, src->planes[1] + origin + (ptrdiff_t)(firstRow / 2) * dy, dx, dy,
+					width / 2, rows / 2, 2, src->format == GEMINI_SOURCE_NV12);
+}
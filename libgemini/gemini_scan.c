@@ -0,0 +1,428 @@
+/* MSM gemini (JPEG hardware encoder) userspace library
+ * Copyright (C) 2018 DafabHoid
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#define LOG_TAG "gemini"
+#include "gemini.h"
+#include <stdlib.h>
+#include <string.h>
+#include <log/log.h>
+
+/* Software walker over the entropy coded data the hardware produced, for the
+ * things it can't do itself: statistics for better Huffman tables, and
+ * rewriting the scan with only the luma blocks. The scan is de-stuffed into
+ * a plain bit string first (RSTn markers removed, every restart interval
+ * then starts on a byte boundary). */
+
+#define LOOKUP_BITS 9
+
+struct huffmanDecoder
+{
+	int32_t maxCode[18];
+	int32_t valueOffset[17];
+	const uint8_t *values;
+	uint16_t lookup[1 << LOOKUP_BITS]; // length << 8 | value, 0 if longer
+};
+
+struct bitReader
+{
+	const uint8_t *data;
+	size_t length;
+	size_t pos; // in bits
+};
+
+/* Table in the format of gemini_hw_cfg.huffmanTable[]: 16 counts of codes
+ * per length, followed by the values. */
+static const uint8_t* huffmanTable(const struct gemini_hw_cfg *hwCfg, int index)
+{
+	return hwCfg->huffmanTablesAllocated ? hwCfg->huffmanTable[index] : gemini_lib_std_huffman_table(index);
+}
+
+// JPEG Annex C and F.2.2.3
+static void buildDecoder(struct huffmanDecoder *d, const uint8_t *table)
+{
+	int32_t code = 0;
+	int32_t index = 0;
+	d->values = table + 16;
+	memset(d->lookup, 0, sizeof(d->lookup));
+	for (int length = 1; length <= 16; ++length)
+	{
+		const unsigned int count = table[length - 1];
+		d->valueOffset[length] = index - code;
+		for (unsigned int i = 0; i < count; ++i, ++code, ++index)
+		{
+			if (length <= LOOKUP_BITS)
+			{
+				const unsigned int shift = LOOKUP_BITS - length;
+				for (unsigned int j = 0; j < (1u << shift); ++j)
+					d->lookup[(code << shift) | j] = (length << 8) | d->values[index];
+			}
+		}
+		d->maxCode[length] = count ? code - 1 : -1;
+		code <<= 1;
+	}
+	d->maxCode[17] = INT32_MAX;
+}
+
+static __inline uint32_t peekBits(const struct bitReader *r, unsigned int n)
+{
+	const size_t byte = r->pos >> 3;
+	uint32_t word = 0;
+	for (size_t i = byte; i < byte + 3; ++i)
+		word = (word << 8) | (i < r->length ? r->data[i] : 0xFF);
+	return (word >> (24 - (r->pos & 7) - n)) & ((1u << n) - 1);
+}
+
+static __inline uint32_t getBits(struct bitReader *r, unsigned int n)
+{
+	if (n == 0)
+		return 0;
+	uint32_t value = peekBits(r, n);
+	r->pos += n;
+	return value;
+}
+
+static __inline int decodeSymbol(struct bitReader *r, const struct huffmanDecoder *d)
+{
+	uint16_t entry = d->lookup[peekBits(r, LOOKUP_BITS)];
+	if (entry)
+	{
+		r->pos += entry >> 8;
+		return entry & 0xFF;
+	}
+	int32_t code = getBits(r, LOOKUP_BITS);
+	int length = LOOKUP_BITS;
+	while (code > d->maxCode[length])
+	{
+		if (++length > 16)
+			return -1;
+		code = (code << 1) | getBits(r, 1);
+	}
+	return d->values[d->valueOffset[length] + code];
+}
+
+static __inline int extendValue(uint32_t bits, unsigned int size)
+{
+	return size && bits < (1u << (size - 1)) ? (int)bits - (1 << size) + 1 : (int)bits;
+}
+
+/* Copy of the entropy coded data of all fragments without byte stuffing and
+ * RSTn markers, up to the first other marker. 0xFF is rare in the data, so
+ * the runs between two of them are found with memchr() and copied with
+ * memcpy(), both vectorised in the C library. */
+static uint8_t* destuff(const struct iovec *iov, int iovcnt, size_t *lengthOut)
+{
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; ++i)
+		total += iov[i].iov_len;
+	uint8_t *out = malloc(total ? total : 1);
+	if (!out)
+		return NULL;
+	size_t length = 0;
+	bool pendingFF = false;
+	for (int i = 0; i < iovcnt; ++i)
+	{
+		const uint8_t *p = iov[i].iov_base;
+		const size_t n = iov[i].iov_len;
+		size_t j = 0;
+		while (j < n)
+		{
+			if (pendingFF)
+			{
+				const uint8_t c = p[j++];
+				if (c == 0xFF)
+					continue; // fill byte
+				pendingFF = false;
+				if (c == 0x00)
+					out[length++] = 0xFF;
+				else if (c < 0xD0 || c > 0xD7)
+					goto done; // EOI or anything else ends the scan
+				continue;
+			}
+			const uint8_t *ff = memchr(p + j, 0xFF, n - j);
+			const size_t run = ff ? (size_t)(ff - (p + j)) : n - j;
+			memcpy(out + length, p + j, run);
+			length += run;
+			j += run;
+			if (ff)
+			{
+				pendingFF = true;
+				j++;
+			}
+		}
+	}
+done:
+	*lengthOut = length;
+	return out;
+}
+
+/** Decode the scan in iov, as encoded for inputCfg and hwCfg. For every
+ * block, visitor->block (if set) gets the component (0 Y, 1 Cb, 2 Cr), the
+ * DC value and the range of bits holding its AC coefficients in the
+ * de-stuffed data. If visitor->counts is set, the number of times each
+ * Huffman symbol is used is added to it, in the order of
+ * gemini_hw_cfg.huffmanTable[].
+ */
+int gemini_scan_walk(const struct iovec *iov, int iovcnt,
+						const struct gemini_input_cfg *inputCfg,
+						const struct gemini_hw_cfg *hwCfg,
+						const struct gemini_scan_visitor *visitor)
+{
+	struct huffmanDecoder *decoders = malloc(4 * sizeof(*decoders));
+	struct bitReader r = { NULL, 0, 0 };
+	int ret = -1;
+	if (!decoders)
+		return -1;
+	for (int i = 0; i < 4; ++i)
+		buildDecoder(&decoders[i], huffmanTable(hwCfg, i));
+	r.data = destuff(iov, iovcnt, &r.length);
+	if (!r.data)
+		goto out;
+
+	const unsigned int lumaBlocks = gemini_lib_mcu_h_samp(inputCfg->inputFormat)
+								* gemini_lib_mcu_v_samp(inputCfg->inputFormat);
+	const unsigned int mcus = inputCfg->frame_width_mcus * inputCfg->frame_height_mcus;
+	const unsigned int restartInterval = hwCfg->restartMarker;
+	int predictor[3] = {0, 0, 0};
+	for (unsigned int mcu = 0; mcu < mcus; ++mcu)
+	{
+		if (restartInterval && mcu && mcu % restartInterval == 0)
+		{
+			r.pos = (r.pos + 7) & ~(size_t)7;
+			predictor[0] = predictor[1] = predictor[2] = 0;
+		}
+		for (unsigned int block = 0; block < lumaBlocks + 2; ++block)
+		{
+			const unsigned int component = block < lumaBlocks ? 0 : block - lumaBlocks + 1;
+			const unsigned int table = component ? 2 : 0;
+			const int dcSize = decodeSymbol(&r, &decoders[table]);
+			if (dcSize < 0 || dcSize > 11)
+				goto corrupt;
+			if (visitor->counts)
+				visitor->counts[table][dcSize]++;
+			predictor[component] += extendValue(getBits(&r, dcSize), dcSize);
+			const size_t acStart = r.pos;
+			for (int k = 1; k < 64; ++k)
+			{
+				const int rs = decodeSymbol(&r, &decoders[table + 1]);
+				if (rs < 0)
+					goto corrupt;
+				if (visitor->counts)
+					visitor->counts[table + 1][rs]++;
+				if ((rs & 0xF) == 0)
+				{
+					if (rs != 0xF0)
+						break; // EOB
+					k += 15;
+					continue;
+				}
+				k += rs >> 4;
+				r.pos += rs & 0xF;
+			}
+			if (r.pos > r.length * 8)
+				goto corrupt;
+			if (visitor->block)
+				visitor->block(visitor->arg, r.data, component, predictor[component], acStart, r.pos);
+		}
+	}
+	ret = 0;
+	goto out;
+corrupt:
+	ALOGE("%s: corrupt scan at bit %zu of %zu\n", __func__, r.pos, r.length * 8);
+out:
+	free((void *)r.data);
+	free(decoders);
+	return ret;
+}
+
+/* Huffman encoder table, JPEG Annex C */
+struct huffmanEncoder
+{
+	uint16_t code[256];
+	uint8_t size[256];
+};
+
+static void buildEncoder(struct huffmanEncoder *e, const uint8_t *table)
+{
+	unsigned int code = 0, index = 0;
+	memset(e->size, 0, sizeof(e->size));
+	for (int length = 1; length <= 16; ++length)
+	{
+		for (unsigned int i = 0; i < table[length - 1]; ++i, ++code, ++index)
+		{
+			e->code[table[16 + index]] = code;
+			e->size[table[16 + index]] = length;
+		}
+		code <<= 1;
+	}
+}
+
+struct bitWriter
+{
+	uint8_t *dest;
+	size_t size;
+	size_t pos;
+	uint32_t buffer;
+	unsigned int bits;
+	bool overflow;
+};
+
+static __inline void putBits(struct bitWriter *w, uint32_t value, unsigned int n)
+{
+	w->buffer = (w->buffer << n) | (value & ((1u << n) - 1));
+	w->bits += n;
+	while (w->bits >= 8)
+	{
+		const uint8_t byte = w->buffer >> (w->bits - 8);
+		w->bits -= 8;
+		if (w->pos + 2 > w->size)
+		{
+			w->overflow = true;
+			continue;
+		}
+		w->dest[w->pos++] = byte;
+		if (byte == 0xFF)
+			w->dest[w->pos++] = 0x00;
+	}
+}
+
+static void copyBits(struct bitWriter *w, const struct bitReader *source, size_t start, size_t end)
+{
+	struct bitReader r = *source;
+	r.pos = start;
+	while (end - r.pos >= 16)
+		putBits(w, getBits(&r, 16), 16);
+	putBits(w, getBits(&r, end - r.pos), end - r.pos);
+}
+
+struct grayscaleTranscode
+{
+	const struct gemini_input_cfg *inputCfg;
+	unsigned int hSamp;
+	unsigned int vSamp;
+	unsigned int blocksPerRow; // of the MCU row, per block row
+	struct lumaBlock
+	{
+		int dc;
+		size_t acStart;
+		size_t acEnd;
+	} *row;
+	unsigned int blocksInRow;
+	size_t dataLength;
+	struct huffmanEncoder dcEncoder;
+	struct bitWriter out;
+	int predictor;
+};
+
+static unsigned int bitCount(unsigned int value)
+{
+	unsigned int n = 0;
+	for (; value; value >>= 1)
+		++n;
+	return n;
+}
+
+static void emitLumaRow(struct grayscaleTranscode *t, const uint8_t *data)
+{
+	const struct bitReader source = { data, t->dataLength, 0 };
+	for (unsigned int i = 0; i < t->vSamp * t->blocksPerRow; ++i)
+	{
+		const struct lumaBlock *b = &t->row[i];
+		const int diff = b->dc - t->predictor;
+		const unsigned int size = bitCount(diff < 0 ? -diff : diff);
+		t->predictor = b->dc;
+		putBits(&t->out, t->dcEncoder.code[size], t->dcEncoder.size[size]);
+		putBits(&t->out, diff < 0 ? diff - 1 : diff, size);
+		copyBits(&t->out, &source, b->acStart, b->acEnd);
+	}
+}
+
+static void grayscaleBlock(void *arg, const uint8_t *data, unsigned int component, int dc,
+						size_t acStart, size_t acEnd)
+{
+	struct grayscaleTranscode *t = arg;
+	if (component != 0)
+		return;
+	// interleaved MCU order to raster order of the blocks
+	const unsigned int blocksPerMcu = t->hSamp * t->vSamp;
+	const unsigned int mcu = t->blocksInRow / blocksPerMcu;
+	const unsigned int inMcu = t->blocksInRow % blocksPerMcu;
+	const unsigned int x = mcu * t->hSamp + inMcu % t->hSamp;
+	const unsigned int y = inMcu / t->hSamp;
+	struct lumaBlock *b = &t->row[y * t->blocksPerRow + x];
+	b->dc = dc;
+	b->acStart = acStart;
+	b->acEnd = acEnd;
+	if (++t->blocksInRow == blocksPerMcu * t->inputCfg->frame_width_mcus)
+	{
+		emitLumaRow(t, data);
+		t->blocksInRow = 0;
+	}
+}
+
+/** Write a single component JPEG file into dest, with the luma of the
+ * three component scan in iov that was encoded for inputCfg and hwCfg.
+ * @return The file length, or -1.
+ */
+int gemini_jfif_transcode_grayscale(const struct iovec *iov, int iovcnt,
+						const struct gemini_jfif_cfg *cfg,
+						const struct gemini_input_cfg *inputCfg,
+						const struct gemini_hw_cfg *hwCfg,
+						uint8_t *dest, size_t size)
+{
+	struct gemini_jfif_cfg grayCfg = *cfg;
+	grayCfg.grayscale = true;
+	grayCfg.restartIndex = false;
+	struct gemini_hw_cfg grayHwCfg = *hwCfg;
+	grayHwCfg.restartMarker = 0; // the rewritten scan has no restart intervals
+	int headerLength = gemini_jfif_write_header(dest, size, &grayCfg, inputCfg, &grayHwCfg, NULL);
+	if (headerLength < 0)
+		return -1;
+
+	struct grayscaleTranscode *t = calloc(1, sizeof(*t));
+	if (!t)
+		return -1;
+	t->inputCfg = inputCfg;
+	t->hSamp = gemini_lib_mcu_h_samp(inputCfg->inputFormat);
+	t->vSamp = gemini_lib_mcu_v_samp(inputCfg->inputFormat);
+	t->blocksPerRow = inputCfg->frame_width_mcus * t->hSamp;
+	t->row = calloc(t->vSamp * t->blocksPerRow, sizeof(t->row[0]));
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; ++i)
+		total += iov[i].iov_len;
+	t->dataLength = total; // upper bound, only used to clamp reads
+	buildEncoder(&t->dcEncoder, huffmanTable(hwCfg, 0));
+	t->out.dest = dest + headerLength;
+	t->out.size = size - headerLength;
+
+	int ret = -1;
+	const struct gemini_scan_visitor visitor = { grayscaleBlock, NULL, t };
+	if (t->row && gemini_scan_walk(iov, iovcnt, inputCfg, hwCfg, &visitor) == 0)
+	{
+		if (t->out.bits)
+			putBits(&t->out, 0x7F, 8 - t->out.bits); // pad with 1 bits
+		if (!t->out.overflow && t->out.pos + 2 <= t->out.size)
+		{
+			t->out.dest[t->out.pos++] = 0xFF;
+			t->out.dest[t->out.pos++] = 0xD9;
+			ret = headerLength + t->out.pos;
+		}
+		else
+			ALOGE("%s: %zu bytes are not enough\n", __func__, size);
+	}
+	free(t->row);
+	free(t);
+	return ret;
+}
@@ -0,0 +1,471 @@
+/* MSM gemini (JPEG hardware encoder) userspace library
+ * Copyright (C) 2018 DafabHoid
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#define LOG_TAG "gemini"
+#include "gemini.h"
+#include "gemini_sim.h"
+#include <stdlib.h>
+#include <log/log.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <media/msm_gemini.h> // Kernel header
+#include <linux/android_pmem.h> // Kernel header
+#include <time.h>
+#include <unistd.h>
+
+/* Simulated gemini device behind gemini_lib_set_device_ops(), for
+ * benchmarking without the hardware. It follows the kernel driver's queue
+ * semantics: buffers are enqueued, START begins a job, the encoder consumes
+ * the input buffers in order and fills the output buffers, then
+ * MSM_GEMINI_EVT_FRAMEDONE is queued. Encoding takes startUs plus nsPerMcu
+ * for every MCU of the frame size written by gemini_lib_hw_fe_cfg(), spread
+ * over the input buffers by their num_of_mcu_rows, so row by row input
+ * paces the job like on the hardware. The amount of entropy coded data
+ * follows the quantisation tables, bytesPerMcu being the size at an average
+ * quantiser step of 16. Pmem buffers come from /dev/zero, PMEM_GET_PHYS
+ * makes up physical addresses 16 MB apart for them. */
+
+#define SIM_QUEUE_SIZE 32
+#define SIM_MAX_BYTES_PER_MCU 384 // uncompressed H2V2 MCU
+#define REG_FE_FRAME_SIZE 0x3C
+#define REG_QUANT_TABLE 0x12C
+#define QUANT_TABLE_WRITES 128
+
+struct simQueue
+{
+	struct msm_gemini_buf bufs[SIM_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int count;
+};
+
+struct gemini_sim
+{
+	struct gemini_sim_cfg cfg;
+	struct gemini_device_ops ops;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t tid;
+	bool shouldStop;
+	struct simQueue input;
+	struct simQueue output;
+	struct simQueue inputDone;
+	struct simQueue outputDone;
+	int events[SIM_QUEUE_SIZE];
+	unsigned int eventHead;
+	unsigned int eventCount;
+	bool unblockEvent;
+	bool unblockInput;
+	bool unblockOutput;
+	unsigned int generation; // bumped by STOP and RESET to abort the job
+	bool jobPending;
+	unsigned int widthMcus;
+	unsigned int heightMcus;
+	uint64_t quantReciprocalSum; // of the last complete table upload
+	unsigned int quantWrites;
+	uint64_t quantAccumulator;
+	uint64_t random;
+	struct gemini_sim_stats stats;
+};
+
+static uint64_t monotonicTimeUs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool queuePush(struct simQueue *q, const struct msm_gemini_buf *buf)
+{
+	if (q->count == SIM_QUEUE_SIZE)
+		return false;
+	q->bufs[(q->head + q->count++) % SIM_QUEUE_SIZE] = *buf;
+	return true;
+}
+
+static bool queuePop(struct simQueue *q, struct msm_gemini_buf *buf)
+{
+	if (!q->count)
+		return false;
+	*buf = q->bufs[q->head];
+	q->head = (q->head + 1) % SIM_QUEUE_SIZE;
+	q->count--;
+	return true;
+}
+
+static void pushEvent(struct gemini_sim *sim, int type)
+{
+	if (sim->eventCount < SIM_QUEUE_SIZE)
+		sim->events[(sim->eventHead + sim->eventCount++) % SIM_QUEUE_SIZE] = type;
+	pthread_cond_broadcast(&sim->cond);
+}
+
+/* Sleep until deadlineUs unless the job gets aborted. Called with the mutex held. */
+static bool waitUntil(struct gemini_sim *sim, unsigned int generation, uint64_t deadlineUs)
+{
+	struct timespec ts;
+	ts.tv_sec = deadlineUs / 1000000;
+	ts.tv_nsec = (deadlineUs % 1000000) * 1000;
+	while (sim->generation == generation && !sim->shouldStop)
+	{
+		if (pthread_cond_timedwait(&sim->cond, &sim->mutex, &ts) == ETIMEDOUT)
+			break;
+	}
+	return sim->generation == generation && !sim->shouldStop;
+}
+
+/* Entropy coded looking bytes without 0xFF, so no marker is emulated. */
+static void fillScanData(struct gemini_sim *sim, uint8_t *dest, size_t length)
+{
+	uint64_t x = sim->random;
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		uint64_t v = x & 0x7F7F7F7F7F7F7F7FULL;
+		memcpy(dest + i, &v, 8);
+	}
+	for (; i < length; ++i)
+		dest[i] = (uint8_t)(x >> (i % 8 * 8)) & 0x7F;
+	sim->random = x;
+}
+
+/* Write length bytes into the output buffers, moving full ones to the done
+ * queue. Waits for more output buffers like the hardware does. */
+static bool produceOutput(struct gemini_sim *sim, unsigned int generation, struct msm_gemini_buf *current,
+						bool *haveCurrent, size_t length)
+{
+	while (length)
+	{
+		if (!*haveCurrent)
+		{
+			while (!queuePop(&sim->output, current))
+			{
+				if (sim->generation != generation || sim->shouldStop)
+					return false;
+				pthread_cond_wait(&sim->cond, &sim->mutex);
+			}
+			current->framedone_len = 0;
+			*haveCurrent = true;
+		}
+		size_t room = current->y_len - current->framedone_len;
+		size_t n = length < room ? length : room;
+		fillScanData(sim, (uint8_t *)current->vaddr + current->y_off + current->framedone_len, n);
+		current->framedone_len += n;
+		length -= n;
+		sim->stats.bytes += n;
+		if (current->framedone_len == current->y_len)
+		{
+			queuePush(&sim->outputDone, current);
+			*haveCurrent = false;
+			pthread_cond_broadcast(&sim->cond);
+		}
+	}
+	return true;
+}
+
+static size_t bytesPerMcu(const struct gemini_sim *sim)
+{
+	// reciprocals are 0x10000 / step, 0x1000 is the step of 16
+	uint64_t bytes = sim->cfg.bytesPerMcu;
+	if (sim->quantReciprocalSum)
+		bytes = bytes * sim->quantReciprocalSum / (0x1000ULL * QUANT_TABLE_WRITES);
+	return bytes < SIM_MAX_BYTES_PER_MCU ? bytes : SIM_MAX_BYTES_PER_MCU;
+}
+
+static void runJob(struct gemini_sim *sim)
+{
+	const unsigned int generation = sim->generation;
+	const uint64_t start = monotonicTimeUs();
+	uint64_t deadline = start + sim->cfg.startUs;
+	struct msm_gemini_buf output;
+	bool haveOutput = false;
+	unsigned int rows = 0;
+	size_t carry = 0; // bytes of fractional MCUs, in 1/256
+
+	if (!waitUntil(sim, generation, deadline))
+		goto aborted;
+	while (rows < sim->heightMcus)
+	{
+		struct msm_gemini_buf input;
+		while (!queuePop(&sim->input, &input))
+		{
+			if (sim->generation != generation || sim->shouldStop)
+				goto aborted;
+			pthread_cond_wait(&sim->cond, &sim->mutex);
+		}
+		unsigned int bufferRows = input.num_of_mcu_rows;
+		if (!bufferRows || bufferRows > sim->heightMcus - rows)
+			bufferRows = sim->heightMcus - rows;
+		const uint64_t mcus = (uint64_t)bufferRows * sim->widthMcus;
+		// the input may have arrived late, the job doesn't run ahead of it
+		const uint64_t now = monotonicTimeUs();
+		if (deadline < now)
+			deadline = now;
+		deadline += mcus * sim->cfg.nsPerMcu / 1000;
+		if (!waitUntil(sim, generation, deadline))
+			goto aborted;
+		carry += mcus * bytesPerMcu(sim) * 256;
+		if (!produceOutput(sim, generation, &output, &haveOutput, carry / 256))
+			goto aborted;
+		carry %= 256;
+		rows += bufferRows;
+		queuePush(&sim->inputDone, &input);
+		pthread_cond_broadcast(&sim->cond);
+	}
+	if (haveOutput)
+		queuePush(&sim->outputDone, &output);
+	sim->stats.jobs++;
+	sim->stats.busyUs += monotonicTimeUs() - start;
+	pushEvent(sim, MSM_GEMINI_EVT_FRAMEDONE);
+	return;
+
+aborted:
+	sim->stats.aborted++;
+	sim->stats.busyUs += monotonicTimeUs() - start;
+}
+
+static void* simThread(void *arg)
+{
+	struct gemini_sim *sim = arg;
+	pthread_mutex_lock(&sim->mutex);
+	while (!sim->shouldStop)
+	{
+		if (!sim->jobPending)
+		{
+			pthread_cond_wait(&sim->cond, &sim->mutex);
+			continue;
+		}
+		sim->jobPending = false;
+		runJob(sim);
+	}
+	pthread_mutex_unlock(&sim->mutex);
+	return NULL;
+}
+
+static void applyHwCmds(struct gemini_sim *sim, const struct msm_gemini_hw_cmds *cmds)
+{
+	for (uint32_t i = 0; i < cmds->m; ++i)
+	{
+		const struct msm_gemini_hw_cmd *cmd = &cmds->hw_cmd[i];
+		if (cmd->type != MSM_GEMINI_HW_CMD_TYPE_WRITE || cmd->n != 1)
+			continue;
+		if (cmd->offset == REG_FE_FRAME_SIZE)
+		{
+			sim->widthMcus = (cmd->data & 0x1FF) + 1;
+			sim->heightMcus = ((cmd->data >> 16) & 0x1FF) + 1;
+		}
+		else if (cmd->offset == REG_QUANT_TABLE)
+		{
+			sim->quantAccumulator += cmd->data;
+			if (++sim->quantWrites == QUANT_TABLE_WRITES)
+			{
+				sim->quantReciprocalSum = sim->quantAccumulator;
+				sim->quantAccumulator = 0;
+				sim->quantWrites = 0;
+			}
+		}
+	}
+}
+
+/* Blocking *_GET ioctl, -1 when unblocked */
+static int getBuffer(struct gemini_sim *sim, struct simQueue *q, bool *unblock, struct msm_gemini_buf *buf)
+{
+	while (!q->count && !*unblock && !sim->shouldStop)
+		pthread_cond_wait(&sim->cond, &sim->mutex);
+	if (*unblock || !q->count)
+	{
+		*unblock = false;
+		return -1;
+	}
+	queuePop(q, buf);
+	return 0;
+}
+
+static int simOpen(void *ctx)
+{
+	(void)ctx;
+	return open("/dev/null", O_RDWR | O_CLOEXEC);
+}
+
+static int simClose(void *ctx, int fd)
+{
+	(void)ctx;
+	return close(fd);
+}
+
+static int simOpenBuffer(void *ctx)
+{
+	(void)ctx;
+	return open("/dev/zero", O_RDWR | O_CLOEXEC);
+}
+
+static int simIoctl(void *ctx, int fd, unsigned long request, void *arg)
+{
+	struct gemini_sim *sim = ctx;
+	int ret = 0;
+	(void)fd;
+	pthread_mutex_lock(&sim->mutex);
+	switch (request)
+	{
+	case MSM_GMN_IOCTL_GET_HW_VERSION:
+		((struct msm_gemini_hw_cmd *)arg)->data = 0;
+		break;
+	case MSM_GMN_IOCTL_RESET:
+		sim->generation++;
+		sim->jobPending = false;
+		sim->input.count = sim->output.count = 0;
+		sim->inputDone.count = sim->outputDone.count = 0;
+		sim->eventCount = 0;
+		pthread_cond_broadcast(&sim->cond);
+		break;
+	case MSM_GMN_IOCTL_HW_CMDS:
+		applyHwCmds(sim, arg);
+		break;
+	case MSM_GMN_IOCTL_START:
+		if (!sim->widthMcus || !sim->heightMcus)
+		{
+			ret = -EINVAL;
+			break;
+		}
+		sim->jobPending = true;
+		pthread_cond_broadcast(&sim->cond);
+		break;
+	case MSM_GMN_IOCTL_STOP:
+		sim->generation++;
+		sim->jobPending = false;
+		sim->input.count = sim->output.count = 0;
+		pthread_cond_broadcast(&sim->cond);
+		break;
+	case MSM_GMN_IOCTL_INPUT_BUF_ENQUEUE:
+		ret = queuePush(&sim->input, arg) ? 0 : -ENOMEM;
+		pthread_cond_broadcast(&sim->cond);
+		break;
+	case MSM_GMN_IOCTL_OUTPUT_BUF_ENQUEUE:
+		ret = queuePush(&sim->output, arg) ? 0 : -ENOMEM;
+		pthread_cond_broadcast(&sim->cond);
+		break;
+	case MSM_GMN_IOCTL_INPUT_GET:
+		ret = getBuffer(sim, &sim->inputDone, &sim->unblockInput, arg);
+		break;
+	case MSM_GMN_IOCTL_OUTPUT_GET:
+		ret = getBuffer(sim, &sim->outputDone, &sim->unblockOutput, arg);
+		break;
+	case MSM_GMN_IOCTL_EVT_GET:
+		while (!sim->eventCount && !sim->unblockEvent && !sim->shouldStop)
+			pthread_cond_wait(&sim->cond, &sim->mutex);
+		if (sim->unblockEvent || !sim->eventCount)
+		{
+			sim->unblockEvent = false;
+			ret = -1;
+			break;
+		}
+		{
+			struct msm_gemini_ctrl_cmd *cmd = arg;
+			cmd->type = sim->events[sim->eventHead];
+			cmd->len = 0;
+			cmd->value = NULL;
+		}
+		sim->eventHead = (sim->eventHead + 1) % SIM_QUEUE_SIZE;
+		sim->eventCount--;
+		break;
+	case MSM_GMN_IOCTL_INPUT_GET_UNBLOCK:
+		sim->unblockInput = true;
+		pthread_cond_broadcast(&sim->cond);
+		break;
+	case MSM_GMN_IOCTL_OUTPUT_GET_UNBLOCK:
+		sim->unblockOutput = true;
+		pthread_cond_broadcast(&sim->cond);
+		break;
+	case MSM_GMN_IOCTL_EVT_GET_UNBLOCK:
+		sim->unblockEvent = true;
+		pthread_cond_broadcast(&sim->cond);
+		break;
+	case PMEM_GET_PHYS:
+		{
+			struct pmem_region *region = arg;
+			region->offset = (unsigned long)fd << 24;
+			region->len = 0;
+		}
+		break;
+	default:
+		ret = -ENOTTY;
+		break;
+	}
+	pthread_mutex_unlock(&sim->mutex);
+	return ret;
+}
+
+/** Create a simulated device, install it with
+ * gemini_lib_set_device_ops(gemini_sim_device_ops(sim)).
+ * @return the simulator or NULL
+ */
+struct gemini_sim* gemini_sim_create(const struct gemini_sim_cfg *cfg)
+{
+	struct gemini_sim *sim = calloc(1, sizeof(*sim));
+	if (!sim)
+		return NULL;
+	sim->cfg = *cfg;
+	sim->ops.open = simOpen;
+	sim->ops.close = simClose;
+	sim->ops.ioctl = simIoctl;
+	sim->ops.openBuffer = simOpenBuffer;
+	sim->ops.ctx = sim;
+	sim->random = 0x9E3779B97F4A7C15ULL;
+	pthread_mutex_init(&sim->mutex, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sim->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (pthread_create(&sim->tid, NULL, simThread, sim) != 0)
+	{
+		ALOGE("%s: thread creation failed\n", __func__);
+		pthread_mutex_destroy(&sim->mutex);
+		pthread_cond_destroy(&sim->cond);
+		free(sim);
+		return NULL;
+	}
+	return sim;
+}
+
+const struct gemini_device_ops* gemini_sim_device_ops(struct gemini_sim *sim)
+{
+	return &sim->ops;
+}
+
+void gemini_sim_get_stats(struct gemini_sim *sim, struct gemini_sim_stats *stats)
+{
+	pthread_mutex_lock(&sim->mutex);
+	*stats = sim->stats;
+	pthread_mutex_unlock(&sim->mutex);
+}
+
+/** Must not be called before the sessions on the simulator are released. */
+void gemini_sim_destroy(struct gemini_sim *sim)
+{
+	pthread_mutex_lock(&sim->mutex);
+	sim->shouldStop = true;
+	pthread_cond_broadcast(&sim->cond);
+	pthread_mutex_unlock(&sim->mutex);
+	pthread_join(sim->tid, NULL);
+	pthread_mutex_destroy(&sim->mutex);
+	pthread_cond_destroy(&sim->cond);
+	free(sim);
+}
@@ -0,0 +1,44 @@
+/* MSM gemini (JPEG hardware encoder) userspace library
+ * Copyright (C) 2018 DafabHoid
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include <stdint.h>
+
+struct gemini_device_ops;
+
+// Simulated device, see gemini_sim.c. Not part of libgemini, it is built
+// into the programs that use it, which install it with
+// gemini_lib_set_device_ops().
+struct gemini_sim;
+
+struct gemini_sim_cfg
+{
+	unsigned int nsPerMcu; // encoding time of one MCU
+	unsigned int startUs; // from MSM_GMN_IOCTL_START to the first MCU
+	unsigned int bytesPerMcu; // entropy coded data at an average quantiser step of 16
+};
+
+struct gemini_sim_stats
+{
+	unsigned int jobs;
+	unsigned int aborted; // by MSM_GMN_IOCTL_STOP or RESET
+	uint64_t busyUs;
+	uint64_t bytes;
+};
+
+struct gemini_sim* gemini_sim_create(const struct gemini_sim_cfg *cfg);
+const struct gemini_device_ops* gemini_sim_device_ops(struct gemini_sim *sim);
+void gemini_sim_get_stats(struct gemini_sim *sim, struct gemini_sim_stats *stats);
+void gemini_sim_destroy(struct gemini_sim *sim);
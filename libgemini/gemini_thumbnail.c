@@ -0,0 +1,113 @@
+/* MSM gemini (JPEG hardware encoder) userspace library
+ * Copyright (C) 2018 DafabHoid
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include "gemini.h"
+#include <string.h>
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+/* Box filter downscaling of an H2V1 or H2V2 input frame (Y + interleaved
+ * CrCb) by an integer factor into an H2V2 thumbnail frame, see
+ * gemini_lib_encode_with_thumbnail(). The source rows of one output row are
+ * summed up vertically with 16 bit lanes, then the columns are summed up
+ * and divided. Output pixels beyond the scaled image repeat the last valid
+ * row or column, up to the MCU aligned thumbnail frame size. */
+
+static void accumulateRow(uint16_t *acc, const uint8_t *src, size_t n)
+{
+	size_t i = 0;
+#ifdef HAVE_NEON
+	for (; i + 16 <= n; i += 16)
+	{
+		uint8x16_t s = vld1q_u8(src + i);
+		uint16x8_t lo = vld1q_u16(acc + i);
+		uint16x8_t hi = vld1q_u16(acc + i + 8);
+		vst1q_u16(acc + i, vaddw_u8(lo, vget_low_u8(s)));
+		vst1q_u16(acc + i + 8, vaddw_u8(hi, vget_high_u8(s)));
+	}
+#endif
+	for (; i < n; ++i)
+		acc[i] += src[i];
+}
+
+/* Sum up f columns of channels interleaved channels per output pixel. */
+static void collapseRow(const uint16_t *acc, unsigned int channels, unsigned int f,
+						unsigned int validOut, unsigned int outCount, unsigned int divisor, uint8_t *dest)
+{
+	for (unsigned int i = 0; i < validOut; ++i)
+	{
+		const uint16_t *in = acc + i * f * channels;
+		for (unsigned int ch = 0; ch < channels; ++ch)
+		{
+			uint32_t sum = 0;
+			for (unsigned int k = 0; k < f; ++k)
+				sum += in[k * channels + ch];
+			dest[i * channels + ch] = (sum + divisor / 2) / divisor;
+		}
+	}
+	for (unsigned int i = validOut; i < outCount; ++i)
+		memcpy(dest + i * channels, dest + (validOut - 1) * channels, channels);
+}
+
+static void downscalePlane(const uint8_t *src, size_t srcStride, unsigned int srcRows,
+						unsigned int channels, unsigned int hFactor, unsigned int vFactor,
+						unsigned int validCols, unsigned int firstRow, unsigned int rows,
+						unsigned int outCols, uint8_t *dest, size_t destStride, uint16_t *acc)
+{
+	const unsigned int validRows = srcRows / vFactor ? srcRows / vFactor : 1;
+	const size_t accLength = (size_t)validCols * hFactor * channels;
+	for (unsigned int r = firstRow; r < firstRow + rows; ++r)
+	{
+		const unsigned int srcRow = (r < validRows ? r : validRows - 1) * vFactor;
+		memset(acc, 0, accLength * sizeof(*acc));
+		for (unsigned int k = 0; k < vFactor; ++k)
+			accumulateRow(acc, src + (srcRow + k) * srcStride, accLength);
+		collapseRow(acc, channels, hFactor, validCols, outCols, hFactor * vFactor, dest + r * destStride);
+	}
+}
+
+/** Width and height of the thumbnail (before MCU alignment) of an image of
+ * width x height pixels scaled down by factor, both even and at least 2 as
+ * long as factor is at most half the width and height.
+ */
+void gemini_downscale_size(unsigned int width, unsigned int height, unsigned int factor,
+						unsigned int *outWidth, unsigned int *outHeight)
+{
+	*outWidth = (width / factor) & ~1u;
+	*outHeight = (height / factor) & ~1u;
+}
+
+/** Produce the MCU rows firstMcuRow up to firstMcuRow + mcuRows of the
+ * thumbnail described by d. acc needs room for d->width entries.
+ */
+void gemini_downscale_rows(const struct gemini_downscale *d, unsigned int firstMcuRow, unsigned int mcuRows,
+						uint16_t *acc)
+{
+	const unsigned int f = d->factor;
+	unsigned int width, height;
+	gemini_downscale_size(d->width, d->height, f, &width, &height);
+
+	downscalePlane(d->y, d->yStride, d->height, 1, f, f, width,
+				firstMcuRow * 16, mcuRows * 16, d->destWidth, d->yDest, d->yDestStride, acc);
+
+	// H2V1 chroma has the full number of rows
+	const unsigned int chromaRows = d->subsampledV ? d->height / 2 : d->height;
+	const unsigned int chromaVFactor = d->subsampledV ? f : 2 * f;
+	downscalePlane(d->crcb, d->crcbStride, chromaRows, 2, f, chromaVFactor, width / 2,
+				firstMcuRow * 8, mcuRows * 8, d->destWidth / 2, d->crcbDest, d->crcbDestStride, acc);
+}
@@ -20,13 +20,30 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
     rmt_storage.c \
+    rmt_storage_xfer.c \
 
 LOCAL_C_INCLUDES := $(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ/usr/include
 LOCAL_ADDITIONAL_DEPENDENCIES := $(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ/usr
 LOCAL_CFLAGS := -pthread -std=c11
-LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_SHARED_LIBRARIES := libcutils liblog
 LOCAL_CLANG := true
 LOCAL_MODULE := rmt_storage
 LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    rmt_storage_bench.c \
+    rmt_storage_xfer.c \
+
+LOCAL_C_INCLUDES := $(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ/usr/include
+LOCAL_ADDITIONAL_DEPENDENCIES := $(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ/usr
+LOCAL_CFLAGS := -pthread -std=c11
+LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_CLANG := true
+LOCAL_MODULE := rmt_storage_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
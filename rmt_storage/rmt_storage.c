@@ -18,12 +18,74 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <linux/rmt_storage_client.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <time.h>
+#include <cutils/properties.h>
 #define LOG_TAG "rmt_storage"
 #include <log/log.h>
+#include "rmt_storage_xfer.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+/* Sync policy of the sector cache, persist.rmt_storage.cache. With
+ * CACHE_WRITE_THROUGH a write status is still only sent after the sectors
+ * reached the partition. The other two policies send it as soon as the
+ * cache holds the data; a failed write-back is then reported in the next
+ * status of the partition. */
+enum cachePolicy
+{
+	CACHE_OFF,
+	CACHE_WRITE_THROUGH,
+	CACHE_DELAYED, // written back persist.rmt_storage.cache_delay_ms after the first dirty sector
+	CACHE_FLUSH_ON_CLOSE, // written back on CLOSE and SEND_USER_DATA
+};
+
+/* Whole partition held in RAM, reads are served by memcpy */
+struct sectorCache
+{
+	int fd;
+	char* data;
+	uint64_t sectors;
+	uint32_t* dirty; // one bit per sector
+	unsigned int dirtyCount;
+	unsigned long long firstDirtyUs;
+	int flushError;
+	pthread_mutex_t lock; // data, dirty bitmap and flushError
+	pthread_mutex_t flushLock; // fd, one write-back at a time
+	char* bounce;
+	unsigned int flushes;
+	unsigned long long flushedSectors;
+	unsigned int flushErrors;
+};
+
+/* When a write status is sent, persist.rmt_storage.sync */
+enum syncPolicy
+{
+	SYNC_OFF, // after the write returned, the data may still be in the page cache
+	SYNC_REQUEST, // after an fdatasync of the partition
+	SYNC_GROUP, // after one fdatasync per partition for all writes of a short window
+};
+
+#define CACHE_MAX_SIZE (16 * 1024 * 1024)
+#define CACHE_FLUSH_SECTORS 128
 
 struct partReg
 {
@@ -31,24 +93,112 @@ struct partReg
 	const char path[MAX_PATH_NAME];
 	char buffer[MAX_PATH_NAME];
 	int fd;
+	struct sectorCache* cache;
+	char* map; // whole partition, for the mmap backend
+	size_t mapSize;
+	// openCache() of this partition in progress, also guards map and mapSize
+	pthread_mutex_t loadLock;
+	pthread_cond_t loadDone;
+	bool loading;
+};
+
+/* Transfer statistics of a client, logged when it is closed */
+struct xferStats
+{
+	unsigned int events;
+	unsigned int descriptors;
+	unsigned int syscalls;
+	unsigned long long bytes;
+	unsigned long long totalUs;
+	unsigned long long maxUs;
+	unsigned int queued; // requests taken by the request queue
+	unsigned int rejected; // ... failed right away because it was full
+	unsigned int maxQueueDepth;
+	unsigned long long queueWaitUs;
+	unsigned int cacheHits; // requests completed from the sector cache
+	unsigned long long unchangedBytes; // written sectors the partition already held
+	unsigned int syncs;
+	unsigned int directRuns; // runs transferred with O_DIRECT
+	unsigned int bufferedRuns;
+};
+
+#define REQUEST_QUEUE_SIZE 8
+/* The slots beyond REQUEST_QUEUE_SIZE are kept for OPEN and CLOSE, and for
+ * the requests rejected while the queue is full */
+#define REQUEST_QUEUE_SLOTS 16
+// of the slots beyond REQUEST_QUEUE_SIZE, left to a CLOSE and the next OPEN
+#define REQUEST_QUEUE_SESSION_SLOTS 2
+
+/* A RMT_STORAGE_READ/WRITE event of a client, or the OPEN or CLOSE that
+ * starts or ends one of its sessions */
+struct xferRequest
+{
+	unsigned int eventID;
+	unsigned int xferCount;
+	int userData;
+	unsigned long long queuedUs;
+	struct rmt_storage_iovec_desc xfer_desc[RMT_STORAGE_MAX_IOVEC_XFR_CNT];
+	struct rmt_shrd_mem_param* sharedMemParam;
+	// RMT_STORAGE_OPEN and RMT_STORAGE_CLOSE
+	struct partReg* part;
+	unsigned int storageID;
+	unsigned int rejected; // requests the main loop rejected so far
+	bool reject; // rejected by the main loop, only its status is sent
+};
+
+/* Single producer, single consumer ring of requests. The main loop pushes,
+ * the client thread (or the io_uring path, under its lock) pops, so the
+ * main loop never waits for a client. */
+struct requestQueue
+{
+	struct xferRequest slots[REQUEST_QUEUE_SLOTS];
+	unsigned int head;
+	unsigned int tail;
+	unsigned int rejected; // main loop only
 };
 
 struct rmt_storage_client
 {
 	int fd;
+	// main loop only
 	unsigned int signature;
+	unsigned int openStorageID;
 	pthread_t threadID;
-	pthread_mutex_t lock;
-	pthread_cond_t cond;
+	bool threadStarted; // kept across sessions
+	sem_t wakeup; // one post per queued request
+	struct requestQueue queue;
+	// request being transferred, owned by the consumer
 	unsigned int eventID;
 	struct rmt_storage_iovec_desc xfer_desc[RMT_STORAGE_MAX_IOVEC_XFR_CNT];
 	unsigned int xferCount;
+	int xferUserData;
+	bool xferRejected;
 	char data[8];
 	int lastErrorCode;
-	int stopFlag;
 	int userData;
+	// session, owned by the consumer
+	bool sessionOpen;
+	struct partReg* nextPart; // of the OPEN taken from the queue
+	unsigned int nextStorageID;
+	unsigned int queueRejected;
 	unsigned int storageID;
 	struct rmt_shrd_mem_param* sharedMemParam;
+	struct sectorCache* cache;
+	char* map;
+	size_t mapSize;
+	int directFd; // O_DIRECT fd of the partition, -1 if not used
+	unsigned int directAlign;
+	struct xferStats stats;
+	// transfer in flight on the io_uring path
+	struct xferRun runs[MAX_STRIPES];
+	unsigned int runCount;
+	unsigned int pendingRuns;
+	bool xferFailed;
+	ssize_t xferBytes;
+	unsigned long long xferStartUs;
+	bool busy;
+	bool deferred; // waiting for room in the completion queue
+	bool commitPending; // waiting for the group commit
 };
 
 #define SIGNATURE_MAGIC 0x12345678
@@ -61,43 +211,85 @@ static struct partReg partitionRegistry[] = {
 	0x4A,
 	"/boot/modem_fs1",
 	{0},
-	-1
+	-1,
+	NULL,
+	NULL,
+	0,
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	false
 },
 {
 	0x4B,
 	"/boot/modem_fs2",
 	{0},
-	-1
+	-1,
+	NULL,
+	NULL,
+	0,
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	false
 },
 {
 	0x58,
 	"/boot/modem_fsg",
 	{0},
-	-1
+	-1,
+	NULL,
+	NULL,
+	0,
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	false
 },
 {
 	0x59,
 	"/q6_fs1_parti_id_0x59",
 	{0},
-	-1
+	-1,
+	NULL,
+	NULL,
+	0,
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	false
 },
 {
 	0x5A,
 	"/q6_fs2_parti_id_0x5A",
 	{0},
-	-1
+	-1,
+	NULL,
+	NULL,
+	0,
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	false
 },
 {
 	0x5B,
 	"/q6_fs1_parti_id_0x5B",
 	{0},
-	-1
+	-1,
+	NULL,
+	NULL,
+	0,
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	false
 },
 {
 	0x5C,
 	"ssd",
 	{0},
-	-1
+	-1,
+	NULL,
+	NULL,
+	0,
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	false
 },
 };
 static const int partitionRegistryLength = sizeof(partitionRegistry) / sizeof(partitionRegistry[0]);
@@ -109,6 +301,49 @@ static int kernelDevFd;
 static struct rmt_storage_client all_clients[MAX_NUM_CLIENTS];
 static struct rmt_shrd_mem_param sharedMemParams[5];
 
+/* Set when the io_uring backend is in use, see setupUring() */
+static bool useUring;
+
+/* Set when the partitions are mapped instead, see mapTransfer() */
+static bool useMmap;
+static uintptr_t pageMask;
+
+/* Set when aligned runs bypass the page cache, see openDirect() */
+static bool useDirect;
+
+/* Modem bring-up timing, see startPrefetch() */
+static unsigned long long daemonStartUs;
+static unsigned long long firstOpenUs;
+static bool firstRequestServed;
+
+static enum cachePolicy cachePolicy;
+static unsigned int cacheDelayMs;
+
+/* Writes back the caches for CACHE_DELAYED and CACHE_FLUSH_ON_CLOSE */
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool requested;
+	pthread_t thread;
+} flusher = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static enum syncPolicy syncPolicy;
+static unsigned int syncWindowUs;
+
+/* Writes waiting for the group commit, at most one per client */
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t committed;
+	struct rmt_storage_client* clients[MAX_NUM_CLIENTS];
+	unsigned int count;
+	unsigned int sessions; // open sessions, updated atomically
+	unsigned long long firstUs;
+	pthread_t thread;
+} committer = { .lock = PTHREAD_MUTEX_INITIALIZER, .committed = PTHREAD_COND_INITIALIZER };
+
 /* End of static data */
 
 
@@ -123,9 +358,54 @@ static void destroyRMTSClient(struct rmt_storage_client* client);
 
 static struct rmt_shrd_mem_param* findSharedMemParamBySID(unsigned int storageID);
 
+static int setupUring(void);
+
+static void dispatchUringRequests(struct rmt_storage_client* client);
+
+static bool pushRequest(struct rmt_storage_client* client, const struct rmt_storage_event* event,
+		struct rmt_shrd_mem_param* memParam);
+
+static bool pushSessionRequest(struct rmt_storage_client* client, unsigned int eventID, struct partReg* part,
+		unsigned int storageID);
+
+static bool pushRejection(struct rmt_storage_client* client, const struct rmt_storage_event* event);
+
+static void wakeClient(struct rmt_storage_client* client);
+
+static void sendStatus(struct rmt_storage_client* client, unsigned int eventID, int userData, int errorCode);
+
+static void logTransferStats(const struct rmt_storage_client* client);
+
+static void readCachePolicy(void);
+
+static struct sectorCache* openCache(struct partReg* part, int readFd, int cacheFd);
+
+static void requestCacheFlush(void);
+
+static void flushAllCaches(void);
+
+static void* flusherThread(void* arg);
+
+static void readSyncPolicy(void);
+
+static void* committerThread(void* arg);
+
+static void continueUringClient(struct rmt_storage_client* client);
+
+static char* mapPartition(struct partReg* part, size_t* size);
+
+static void openDirect(struct rmt_storage_client* client, const struct partReg* part);
+
+static void readStripePolicy(void);
+
+static unsigned long long monotonicTimeUs(void);
+
+static void startPrefetch(void);
+
 int main()
 {
 	ALOGI("rmt_storage user app start.. ignoring cmd line parameters\n");
+	daemonStartUs = monotonicTimeUs();
 	
 	// Set OOM value for this process
 	{
@@ -148,6 +428,28 @@ int main()
 	
 	ALOGI("rmt_storage open success\n");
 	
+	char value[PROPERTY_VALUE_MAX];
+	property_get("persist.rmt_storage.io_uring", value, "0");
+	if (value[0] == '1') {
+		useUring = setupUring() == 0;
+		ALOGI(useUring ? "using io_uring\n" : "io_uring unavailable, using client threads\n");
+	}
+	property_get("persist.rmt_storage.mmap", value, "0");
+	if (value[0] == '1' && !useUring) {
+		useMmap = true;
+		pageMask = sysconf(_SC_PAGESIZE) - 1;
+		ALOGI("using mapped partitions\n");
+	}
+	property_get("persist.rmt_storage.direct", value, "0");
+	if (value[0] == '1' && !useUring && !useMmap) {
+		useDirect = true;
+		ALOGI("using O_DIRECT for aligned transfers\n");
+	}
+	
+	readCachePolicy();
+	readSyncPolicy();
+	readStripePolicy();
+	
 	if (parseMMCPartitions() != 0) {
 		ALOGE("Error parsing partitions\n");
 		return -1;
@@ -165,6 +467,8 @@ int main()
 		return -1;
 	}
 	
+	startPrefetch();
+	
 	while (1) {
 		struct rmt_storage_event event;
 		if (ioctl(kernelDevFd, RMT_STORAGE_WAIT_FOR_REQ, &event) < 0)
@@ -173,33 +477,39 @@ int main()
 			
 			case RMT_STORAGE_OPEN: {
 				ALOGI("rmt_storage open event: handle=%d\n", event.handle);
+				if (!firstOpenUs)
+					__atomic_store_n(&firstOpenUs, monotonicTimeUs(), __ATOMIC_RELEASE);
 				struct rmt_storage_client* client = &all_clients[event.handle - 1];
-				client->storageID = event.sid;
-				client->signature = SIGNATURE_MAGIC;
-				pthread_mutex_init(&client->lock, NULL);
-				pthread_cond_init(&client->cond, NULL);
-				client->stopFlag = 0;
-				int fd = -1;
+				client->signature = 0;
+				struct partReg* part = NULL;
 				for (int i = 0; i < partitionRegistryLength; ++i) {
-					struct partReg* part = &partitionRegistry[i];
-					if (0 == strncmp(part->path, event.path, sizeof(part->path))) {
-						fd = part->fd;
+					if (0 == strncmp(partitionRegistry[i].path, event.path, sizeof(partitionRegistry[i].path))) {
+						part = &partitionRegistry[i];
 						break;
 					}
 				}
-				client->fd = fd;
-				if (fd < 0) {
+				if (!part || part->fd < 0) {
 					ALOGE("Unable to open %s\n", event.path);
-				} else {
-					ALOGI("Opened %s\n", event.path);
-					client->sharedMemParam = NULL;
-					if (0 == pthread_create(&client->threadID, NULL, clientThread, client)) {
+					break;
+				}
+				if (!useUring && !client->threadStarted) {
+					sem_init(&client->wakeup, 0, 0);
+					if (0 != pthread_create(&client->threadID, NULL, clientThread, client)) {
+						ALOGE("Unable to create a pthread\n");
+						destroyRMTSClient(client);
 						break;
 					}
-					ALOGE("Unable to create a pthread\n");
-					close(client->fd);
+					client->threadStarted = true;
+				}
+				// the client opens the session, and loads the cache, after the requests of the last one
+				if (!pushSessionRequest(client, RMT_STORAGE_OPEN, part, event.sid)) {
+					ALOGE("rmt_storage request queue of sid=0x%08x full\n", event.sid);
+					break;
 				}
-				destroyRMTSClient(client);
+				client->openStorageID = event.sid;
+				client->signature = SIGNATURE_MAGIC;
+				wakeClient(client);
+				ALOGI("Opened %s\n", event.path);
 				break;
 			}
 			
@@ -211,15 +521,14 @@ int main()
 					ALOGE("Invalid rmt_storage client\n");
 					break;
 				}
-				struct rmt_shrd_mem_param* memParam = findSharedMemParamBySID(client->storageID);
-				client->sharedMemParam = memParam;
+				struct rmt_shrd_mem_param* memParam = findSharedMemParamBySID(client->openStorageID);
 				if (!memParam) {
 					// Not yet retrieved from the kernel, so do it now
 					memParam = findSharedMemParamBySID(0);
 					if (!memParam)
 						break;
 					
-					memParam->sid = client->storageID;
+					memParam->sid = client->openStorageID;
 					if (ioctl(kernelDevFd, RMT_STORAGE_SHRD_MEM_PARAM, memParam) < 0) {
 						ALOGE("rmt_storage shared memory ioctl failed\n");
 						close(kernelDevFd);
@@ -228,22 +537,22 @@ int main()
 					void* result = mmap(NULL, memParam->size,
 								PROT_READ|PROT_WRITE, MAP_SHARED, kernelDevFd, memParam->start);
 					if (result == MAP_FAILED) {
-						ALOGE("mmap failed for sid=0x%08x", client->storageID);
+						ALOGE("mmap failed for sid=0x%08x", client->openStorageID);
 						close(kernelDevFd);
 						break;
 					}
 					memParam->base = result;
-					client->sharedMemParam = memParam;
 				}
-				if (!client->sharedMemParam) {
-					ALOGE("Shared mem entry for 0x%x not found\n", client->storageID);
+				if (!pushRequest(client, &event, memParam)) {
+					ALOGE("rmt_storage request queue of sid=0x%08x full\n", client->openStorageID);
+					client->queue.rejected++;
+					if (!pushRejection(client, &event)) {
+						ALOGE("rmt_storage no room to reject a request of sid=0x%08x, dropped\n",
+								client->openStorageID);
+						break;
+					}
 				}
-				pthread_mutex_lock(&client->lock);
-				client->eventID = event.id;
-				memcpy(client->xfer_desc, event.xfer_desc, event.xfer_cnt * sizeof(event.xfer_desc[0]));
-				client->xferCount = event.xfer_cnt;
-				pthread_cond_signal(&client->cond);
-				pthread_mutex_unlock(&client->lock);
+				wakeClient(client);
 				break;
 			}
 			
@@ -254,11 +563,14 @@ int main()
 					ALOGE("Invalid rmt_storage client\n");
 					break;
 				}
-				pthread_mutex_lock(&client->lock);
-				client->stopFlag = 1;
-				pthread_cond_signal(&client->cond);
-				pthread_mutex_unlock(&client->lock);
-				close(client->fd);
+				// queued requests are still transferred, the client closes the session after them
+				client->signature = 0;
+				if (!pushSessionRequest(client, RMT_STORAGE_CLOSE, NULL, 0)) {
+					// the next OPEN closes it
+					ALOGE("rmt_storage request queue of sid=0x%08x full\n", client->openStorageID);
+					break;
+				}
+				wakeClient(client);
 				break;
 			}
 			
@@ -270,6 +582,8 @@ int main()
 					break;
 				}
 				client->userData = event.usr_data;
+				if (cachePolicy != CACHE_OFF && cachePolicy != CACHE_WRITE_THROUGH)
+					requestCacheFlush();
 				break;
 			}
 			
@@ -279,6 +593,7 @@ int main()
 		ALOGI("rmt_storage events processing done\n");
 	}
 	ALOGE("rmt_storage wait event ioctl failed errno=%d\n", errno);
+	flushAllCaches();
 	close(kernelDevFd);
 	return 0;
 }
@@ -381,10 +696,7 @@ end:
 void destroyRMTSClient(struct rmt_storage_client* client)
 {
 	client->signature = 0;
-	pthread_mutex_destroy(&client->lock);
-	pthread_cond_destroy(&client->cond);
-	client->stopFlag = 0;
-	client->fd = -1;
+	sem_destroy(&client->wakeup);
 }
 
 static struct rmt_shrd_mem_param* findSharedMemParamBySID(unsigned int storageID)
@@ -398,61 +710,1355 @@ static struct rmt_shrd_mem_param* findSharedMemParamBySID(unsigned int storageID
 	return NULL;
 }
 
+static unsigned long long monotonicTimeUs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Second fd of the partition for O_DIRECT, with the alignment it needs */
+static void openDirect(struct rmt_storage_client* client, const struct partReg* part)
+{
+	int fd = open(part->buffer, O_RDWR | O_DIRECT);
+	if (fd < 0) {
+		ALOGE("Unable to open %s for O_DIRECT\n", part->buffer);
+		return;
+	}
+	int blockSize = 0;
+	struct stat st;
+	if (ioctl(fd, BLKSSZGET, &blockSize) != 0) {
+		// not a block device, use the block size of the file system
+		blockSize = fstat(fd, &st) == 0 ? st.st_blksize : 0;
+	}
+	if (blockSize <= 0 || blockSize & (blockSize - 1)) {
+		close(fd);
+		return;
+	}
+	client->directFd = fd;
+	client->directAlign = blockSize;
+}
+
+static bool runAligned(const struct xferRun* run, unsigned int align)
+{
+	const uintptr_t mask = align - 1;
+	if (run->offset & mask)
+		return false;
+	for (int i = 0; i < run->iovcnt; ++i) {
+		if (((uintptr_t)run->iov[i].iov_base | run->iov[i].iov_len) & mask)
+			return false;
+	}
+	return true;
+}
+
+/* Transfer a run with O_DIRECT straight between the device and the shared
+ * memory if it is aligned, otherwise through the page cache. The shared
+ * memory is a mapping set up by the kernel driver which the block layer may
+ * be unable to pin; then the client stays with buffered I/O. */
+static ssize_t transferRunDirect(struct rmt_storage_client* client, struct xferRun* run)
+{
+	if (client->directFd >= 0 && runAligned(run, client->directAlign)) {
+		struct xferRun direct = *run; // transferRun() advances the iovecs
+		ssize_t ret = transferRun(client->directFd, client->eventID, &direct, &client->stats.syscalls);
+		if (ret >= 0 || (errno != EFAULT && errno != EINVAL)) {
+			__atomic_add_fetch(&client->stats.directRuns, 1, __ATOMIC_RELAXED);
+			return ret;
+		}
+		ALOGE("rmt_storage O_DIRECT failed with error = %d, using buffered I/O for sid=0x%08x\n",
+				errno, client->storageID);
+		close(client->directFd);
+		client->directFd = -1;
+	}
+	if (useDirect)
+		__atomic_add_fetch(&client->stats.bufferedRuns, 1, __ATOMIC_RELAXED);
+	return transferRun(client->fd, client->eventID, run, &client->stats.syscalls);
+}
+
+static void updateTransferStats(struct rmt_storage_client* client, unsigned int runCount,
+				ssize_t bytes, unsigned long long elapsedUs)
+{
+	struct xferStats* stats = &client->stats;
+	stats->events++;
+	stats->descriptors += client->xferCount;
+	if (bytes > 0)
+		stats->bytes += bytes;
+	stats->totalUs += elapsedUs;
+	if (elapsedUs > stats->maxUs)
+		stats->maxUs = elapsedUs;
+	ALOGI("rmt_storage fop(%d): %u descriptors in %u runs, %llu us\n",
+			client->eventID, client->xferCount, runCount, elapsedUs);
+}
+
+static void sendStatus(struct rmt_storage_client* client, unsigned int eventID, int userData, int errorCode)
+{
+	struct rmt_storage_send_sts sendStatus = {
+		errorCode,
+		userData,
+		(client - all_clients) / sizeof(struct rmt_storage_client) + 1,
+		eventID
+	};
+	if (ioctl(kernelDevFd, RMT_STORAGE_SEND_STATUS, &sendStatus) < 0) {
+		ALOGE("rmt_storage send status ioctl failed\n");
+	}
+}
+
+/* Status of the request being transferred */
+static void sendTransferStatus(struct rmt_storage_client* client, int errorCode)
+{
+	client->lastErrorCode = errorCode;
+	sendStatus(client, client->eventID, client->xferUserData, errorCode);
+	// a READ or WRITE that succeeded, after an OPEN seen by the main loop
+	const unsigned long long openUs = __atomic_load_n(&firstOpenUs, __ATOMIC_ACQUIRE);
+	if (errorCode == 0 && openUs && !__atomic_exchange_n(&firstRequestServed, true, __ATOMIC_ACQ_REL)) {
+		const unsigned long long now = monotonicTimeUs();
+		ALOGI("rmt_storage first request served %llu ms after start, %llu ms after the first open\n",
+				(now - daemonStartUs) / 1000, (now - openUs) / 1000);
+	}
+}
+
+static bool pushRequest(struct rmt_storage_client* client, const struct rmt_storage_event* event,
+		struct rmt_shrd_mem_param* memParam)
+{
+	struct requestQueue* q = &client->queue;
+	const unsigned int tail = q->tail;
+	if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) >= REQUEST_QUEUE_SIZE)
+		return false;
+	struct xferRequest* req = &q->slots[tail % REQUEST_QUEUE_SLOTS];
+	req->eventID = event->id;
+	req->xferCount = event->xfer_cnt < RMT_STORAGE_MAX_IOVEC_XFR_CNT ? event->xfer_cnt : RMT_STORAGE_MAX_IOVEC_XFR_CNT;
+	req->userData = client->userData;
+	req->queuedUs = monotonicTimeUs();
+	memcpy(req->xfer_desc, event->xfer_desc, req->xferCount * sizeof(req->xfer_desc[0]));
+	req->sharedMemParam = memParam;
+	req->reject = false;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Queue the failure of a READ or WRITE that didn't fit, so the client sends
+ * its status after those of the requests queued before it */
+static bool pushRejection(struct rmt_storage_client* client, const struct rmt_storage_event* event)
+{
+	struct requestQueue* q = &client->queue;
+	const unsigned int tail = q->tail;
+	if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) >= REQUEST_QUEUE_SLOTS - REQUEST_QUEUE_SESSION_SLOTS)
+		return false;
+	struct xferRequest* req = &q->slots[tail % REQUEST_QUEUE_SLOTS];
+	req->eventID = event->id;
+	req->xferCount = 0;
+	req->userData = client->userData;
+	req->queuedUs = monotonicTimeUs();
+	req->sharedMemParam = NULL;
+	req->reject = true;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Queue the OPEN or CLOSE of a session behind the requests of the last one.
+ * It may take the slots a full queue keeps for it. */
+static bool pushSessionRequest(struct rmt_storage_client* client, unsigned int eventID, struct partReg* part,
+		unsigned int storageID)
+{
+	struct requestQueue* q = &client->queue;
+	const unsigned int tail = q->tail;
+	if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == REQUEST_QUEUE_SLOTS)
+		return false;
+	struct xferRequest* req = &q->slots[tail % REQUEST_QUEUE_SLOTS];
+	req->eventID = eventID;
+	req->xferCount = 0;
+	req->queuedUs = monotonicTimeUs();
+	req->part = part;
+	req->storageID = storageID;
+	req->rejected = q->rejected;
+	req->reject = false;
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void wakeClient(struct rmt_storage_client* client)
+{
+	if (useUring)
+		dispatchUringRequests(client);
+	else
+		sem_post(&client->wakeup);
+}
+
+/* Make the oldest request the one being transferred */
+static bool popRequest(struct rmt_storage_client* client)
+{
+	struct requestQueue* q = &client->queue;
+	const unsigned int head = q->head;
+	const unsigned int depth = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) - head;
+	if (!depth)
+		return false;
+	const struct xferRequest* req = &q->slots[head % REQUEST_QUEUE_SLOTS];
+	client->eventID = req->eventID;
+	client->xferCount = req->xferCount;
+	client->xferUserData = req->userData;
+	client->xferRejected = req->reject;
+	memcpy(client->xfer_desc, req->xfer_desc, req->xferCount * sizeof(req->xfer_desc[0]));
+	if (req->eventID == RMT_STORAGE_OPEN || req->eventID == RMT_STORAGE_CLOSE) {
+		client->nextPart = req->part;
+		client->nextStorageID = req->storageID;
+		client->queueRejected = req->rejected;
+	} else if (!req->reject) {
+		client->sharedMemParam = req->sharedMemParam;
+		client->stats.queued++;
+		if (depth > client->stats.maxQueueDepth)
+			client->stats.maxQueueDepth = depth;
+		client->stats.queueWaitUs += monotonicTimeUs() - req->queuedUs;
+	}
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void logTransferStats(const struct rmt_storage_client* client)
+{
+	const struct xferStats* stats = &client->stats;
+	ALOGI("rmt_storage sid=0x%08x: %u events, %u descriptors in %u syscalls, %llu bytes, %llu us total, %llu us max, %u syncs\n",
+			client->storageID, stats->events, stats->descriptors, stats->syscalls,
+			stats->bytes, stats->totalUs, stats->maxUs, stats->syncs);
+	ALOGI("rmt_storage sid=0x%08x: %u requests queued, %u rejected, max depth %u, %llu us waited\n",
+			client->storageID, stats->queued, stats->rejected, stats->maxQueueDepth, stats->queueWaitUs);
+	if (stats->directRuns || stats->bufferedRuns) {
+		ALOGI("rmt_storage sid=0x%08x: %u of %u runs with O_DIRECT (%u%%)\n", client->storageID,
+				stats->directRuns, stats->directRuns + stats->bufferedRuns,
+				stats->directRuns * 100 / (stats->directRuns + stats->bufferedRuns));
+	}
+}
+
+static void readCachePolicy(void)
+{
+	char value[PROPERTY_VALUE_MAX];
+	property_get("persist.rmt_storage.cache", value, "off");
+	if (0 == strcmp(value, "write-through"))
+		cachePolicy = CACHE_WRITE_THROUGH;
+	else if (0 == strcmp(value, "delayed"))
+		cachePolicy = CACHE_DELAYED;
+	else if (0 == strcmp(value, "on-close"))
+		cachePolicy = CACHE_FLUSH_ON_CLOSE;
+	else
+		return;
+	ALOGI("rmt_storage sector cache: %s\n", value);
+	property_get("persist.rmt_storage.cache_delay_ms", value, "1000");
+	cacheDelayMs = strtoul(value, NULL, 10);
+	
+	if (cachePolicy == CACHE_WRITE_THROUGH)
+		return;
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&flusher.cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (pthread_create(&flusher.thread, NULL, flusherThread, NULL) != 0) {
+		ALOGE("Unable to create a pthread, caching write-through\n");
+		cachePolicy = CACHE_WRITE_THROUGH;
+	}
+}
+
+/* pread/pwrite of the whole length. Returns 0 or -1. */
+static int transferFully(int fd, char* buffer, size_t length, off64_t offset, bool write)
+{
+	while (length) {
+		ssize_t ret = write ? pwrite64(fd, buffer, length, offset) : pread64(fd, buffer, length, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret == 0)
+			errno = EIO; // the partition ended
+		if (ret <= 0)
+			return -1;
+		buffer += ret;
+		length -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+static __inline bool sectorDirty(const struct sectorCache* cache, uint64_t sector)
+{
+	return cache->dirty[sector / 32] & (1u << (sector % 32));
+}
+
+/* Returns true if the cache was clean before. Called with cache->lock held. */
+static bool markDirty(struct sectorCache* cache, uint64_t sector, uint64_t count)
+{
+	const bool wasClean = cache->dirtyCount == 0;
+	for (; count; ++sector, --count) {
+		if (!sectorDirty(cache, sector)) {
+			cache->dirty[sector / 32] |= 1u << (sector % 32);
+			cache->dirtyCount++;
+		}
+	}
+	if (wasClean && cache->dirtyCount)
+		cache->firstDirtyUs = monotonicTimeUs();
+	return wasClean;
+}
+
+/* Cache of the partition, read completely through readFd the first time.
+ * cacheFd is the fd written back to, -1 to leave it. */
+static struct sectorCache* loadCache(struct partReg* part, int readFd, int cacheFd)
+{
+	struct sectorCache* cache = part->cache;
+	if (cache) {
+		if (cacheFd >= 0) {
+			pthread_mutex_lock(&cache->flushLock);
+			cache->fd = cacheFd;
+			pthread_mutex_unlock(&cache->flushLock);
+		}
+		return cache;
+	}
+	off64_t size = lseek64(readFd, 0, SEEK_END);
+	if (size <= 0 || size > CACHE_MAX_SIZE) {
+		ALOGE("rmt_storage not caching %s, size 0x%llx\n", part->buffer, (long long)size);
+		return NULL;
+	}
+	unsigned long long start = monotonicTimeUs();
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+	cache->fd = cacheFd;
+	cache->sectors = size / RAMFS_BLOCK_SIZE;
+	cache->data = malloc(cache->sectors * RAMFS_BLOCK_SIZE);
+	cache->dirty = calloc((cache->sectors + 31) / 32, sizeof(uint32_t));
+	cache->bounce = malloc(CACHE_FLUSH_SECTORS * RAMFS_BLOCK_SIZE);
+	if (!cache->data || !cache->dirty || !cache->bounce
+			|| transferFully(readFd, cache->data, cache->sectors * RAMFS_BLOCK_SIZE, 0, false) != 0) {
+		ALOGE("rmt_storage unable to cache %s\n", part->buffer);
+		free(cache->data);
+		free(cache->dirty);
+		free(cache->bounce);
+		free(cache);
+		return NULL;
+	}
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_mutex_init(&cache->flushLock, NULL);
+	// visible to the flusher only when complete
+	__atomic_store_n(&part->cache, cache, __ATOMIC_RELEASE);
+	ALOGI("rmt_storage cached %s: %llu sectors in %llu us\n", part->buffer,
+			(unsigned long long)cache->sectors, monotonicTimeUs() - start);
+	return cache;
+}
+
+/* The prefetch thread may be loading the same partition, an OPEN waits for
+ * that load only, not for the other partitions. */
+static struct sectorCache* openCache(struct partReg* part, int readFd, int cacheFd)
+{
+	pthread_mutex_lock(&part->loadLock);
+	while (part->loading)
+		pthread_cond_wait(&part->loadDone, &part->loadLock);
+	part->loading = true;
+	pthread_mutex_unlock(&part->loadLock);
+	
+	struct sectorCache* cache = loadCache(part, readFd, cacheFd);
+	
+	pthread_mutex_lock(&part->loadLock);
+	part->loading = false;
+	pthread_cond_broadcast(&part->loadDone);
+	pthread_mutex_unlock(&part->loadLock);
+	return cache;
+}
+
+/* Write the dirty sectors back to the partition. Called with cache->flushLock held.
+ * Returns 0 or -1, the sectors that failed stay dirty. */
+static int writeBackCache(struct sectorCache* cache)
+{
+	if (cache->fd < 0)
+		return 0;
+	int ret = 0;
+	bool wrote = false;
+	uint64_t sector = 0;
+	for (;;) {
+		pthread_mutex_lock(&cache->lock);
+		while (sector < cache->sectors && !sectorDirty(cache, sector))
+			sector = cache->dirty[sector / 32] ? sector + 1 : (sector / 32 + 1) * 32;
+		if (sector >= cache->sectors) {
+			pthread_mutex_unlock(&cache->lock);
+			break;
+		}
+		// cleared before writing, so a write coming in meanwhile dirties them again
+		const uint64_t first = sector;
+		for (; sector < cache->sectors && sector - first < CACHE_FLUSH_SECTORS && sectorDirty(cache, sector); ++sector) {
+			cache->dirty[sector / 32] &= ~(1u << (sector % 32));
+			cache->dirtyCount--;
+		}
+		if (!cache->dirtyCount)
+			cache->firstDirtyUs = 0;
+		const size_t length = (sector - first) * RAMFS_BLOCK_SIZE;
+		memcpy(cache->bounce, cache->data + first * RAMFS_BLOCK_SIZE, length);
+		pthread_mutex_unlock(&cache->lock);
+		
+		wrote = true;
+		if (transferFully(cache->fd, cache->bounce, length, (off64_t)first * RAMFS_BLOCK_SIZE, true) != 0) {
+			ALOGE("rmt_storage cache write-back failed with error = %d\n", errno);
+			pthread_mutex_lock(&cache->lock);
+			markDirty(cache, first, sector - first);
+			cache->flushError = -1;
+			cache->flushErrors++;
+			pthread_mutex_unlock(&cache->lock);
+			ret = -1;
+			break;
+		}
+		cache->flushedSectors += sector - first;
+	}
+	if (wrote) {
+		cache->flushes++;
+		if (ret == 0 && syncPolicy != SYNC_OFF && fdatasync(cache->fd) != 0) {
+			ALOGE("rmt_storage cache sync failed with error = %d\n", errno);
+			pthread_mutex_lock(&cache->lock);
+			cache->flushError = -1;
+			cache->flushErrors++;
+			pthread_mutex_unlock(&cache->lock);
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+static void requestCacheFlush(void)
+{
+	pthread_mutex_lock(&flusher.lock);
+	flusher.requested = true;
+	pthread_cond_signal(&flusher.cond);
+	pthread_mutex_unlock(&flusher.lock);
+}
+
+static void* flusherThread(void* arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&flusher.lock);
+	for (;;) {
+		const bool requested = flusher.requested;
+		flusher.requested = false;
+		pthread_mutex_unlock(&flusher.lock);
+		
+		const unsigned long long now = monotonicTimeUs();
+		unsigned long long nextUs = 0;
+		for (int i = 0; i < partitionRegistryLength; ++i) {
+			struct sectorCache* cache = __atomic_load_n(&partitionRegistry[i].cache, __ATOMIC_ACQUIRE);
+			if (!cache)
+				continue;
+			pthread_mutex_lock(&cache->lock);
+			const unsigned long long firstDirtyUs = cache->firstDirtyUs;
+			pthread_mutex_unlock(&cache->lock);
+			if (!firstDirtyUs)
+				continue;
+			const unsigned long long dueUs = firstDirtyUs + cacheDelayMs * 1000ULL;
+			if (requested || (cachePolicy == CACHE_DELAYED && dueUs <= now)) {
+				pthread_mutex_lock(&cache->flushLock);
+				writeBackCache(cache);
+				pthread_mutex_unlock(&cache->flushLock);
+			} else if (cachePolicy == CACHE_DELAYED && (!nextUs || dueUs < nextUs)) {
+				nextUs = dueUs;
+			}
+		}
+		
+		pthread_mutex_lock(&flusher.lock);
+		if (flusher.requested)
+			continue;
+		if (nextUs) {
+			struct timespec ts = { nextUs / 1000000, (nextUs % 1000000) * 1000 };
+			pthread_cond_timedwait(&flusher.cond, &flusher.lock, &ts);
+		} else {
+			pthread_cond_wait(&flusher.cond, &flusher.lock);
+		}
+	}
+	return NULL;
+}
+
+/* Descriptors of the sectors a write-through request actually changes */
+struct changedSectors
+{
+	struct rmt_storage_iovec_desc desc[RMT_STORAGE_MAX_IOVEC_XFR_CNT];
+	unsigned int count;
+	const struct rmt_storage_iovec_desc* lastSource; // request descriptor of desc[count - 1]
+	bool overflow;
+};
+
+static void addChangedSector(struct changedSectors* changed, const struct rmt_storage_iovec_desc* source, uint32_t index)
+{
+	const uint32_t sector = source->sector_addr + index;
+	const uint32_t address = source->data_phy_addr + index * RAMFS_BLOCK_SIZE;
+	if (changed->count) {
+		struct rmt_storage_iovec_desc* last = &changed->desc[changed->count - 1];
+		if (last->sector_addr + last->num_sector == sector
+				&& last->data_phy_addr + last->num_sector * RAMFS_BLOCK_SIZE == address) {
+			last->num_sector++;
+			return;
+		}
+		if (changed->count == RMT_STORAGE_MAX_IOVEC_XFR_CNT && changed->lastSource == source) {
+			// out of descriptors, rewrite the unchanged sectors in between
+			last->num_sector = sector - last->sector_addr + 1;
+			return;
+		}
+	}
+	if (changed->count == RMT_STORAGE_MAX_IOVEC_XFR_CNT) {
+		changed->overflow = true;
+		return;
+	}
+	changed->desc[changed->count++] = (struct rmt_storage_iovec_desc){ sector, address, 1 };
+	changed->lastSource = source;
+}
+
+/* Copy the sectors of a write into the cache, skipping the ones it already
+ * holds. Sectors that are dirty may differ on the partition and are never
+ * skipped. Called with cache->lock held. */
+static bool cacheWrite(struct rmt_storage_client* client, struct sectorCache* cache,
+				const struct rmt_storage_iovec_desc* desc, struct changedSectors* changed)
+{
+	char* sectorData = cache->data + (size_t)desc->sector_addr * RAMFS_BLOCK_SIZE;
+	const char* data = descriptorData(client->sharedMemParam, desc);
+	bool wasClean = false;
+	for (uint32_t i = 0; i < desc->num_sector; ++i, sectorData += RAMFS_BLOCK_SIZE, data += RAMFS_BLOCK_SIZE) {
+		const uint64_t sector = (uint64_t)desc->sector_addr + i;
+		if (!sectorDirty(cache, sector) && memcmp(sectorData, data, RAMFS_BLOCK_SIZE) == 0) {
+			client->stats.unchangedBytes += RAMFS_BLOCK_SIZE;
+			continue;
+		}
+		memcpy(sectorData, data, RAMFS_BLOCK_SIZE);
+		if (cachePolicy == CACHE_WRITE_THROUGH)
+			addChangedSector(changed, desc, i);
+		else
+			wasClean |= markDirty(cache, sector, 1);
+	}
+	return wasClean;
+}
+
+/* Completes reads and, unless the cache is write-through, writes in the
+ * cache. A write-through request is reduced to the sectors it changes.
+ * Returns false if the request still has to go to the partition. */
+static bool serveFromCache(struct rmt_storage_client* client, int* errorCode)
+{
+	struct sectorCache* cache = client->cache;
+	if (!cache || !client->sharedMemParam || !client->xferCount)
+		return false;
+	const bool write = client->eventID == RMT_STORAGE_WRITE;
+	const unsigned long long start = monotonicTimeUs();
+	ssize_t bytes = 0;
+	bool wasClean = false;
+	struct changedSectors changed = { .count = 0, .overflow = false };
+	pthread_mutex_lock(&cache->lock);
+	for (unsigned int i = 0; i < client->xferCount; ++i) {
+		const struct rmt_storage_iovec_desc* desc = &client->xfer_desc[i];
+		if ((uint64_t)desc->sector_addr + desc->num_sector > cache->sectors) {
+			ALOGE("rmt_storage fop(%d) beyond the end of the partition\n", client->eventID);
+			bytes = -1;
+			break;
+		}
+		if (write)
+			wasClean |= cacheWrite(client, cache, desc, &changed);
+		else
+			memcpy(descriptorData(client->sharedMemParam, desc),
+					cache->data + (size_t)desc->sector_addr * RAMFS_BLOCK_SIZE,
+					(size_t)desc->num_sector * RAMFS_BLOCK_SIZE);
+		bytes += (size_t)desc->num_sector * RAMFS_BLOCK_SIZE;
+	}
+	if (write && cachePolicy == CACHE_WRITE_THROUGH && bytes >= 0 && changed.count) {
+		pthread_mutex_unlock(&cache->lock);
+		if (!changed.overflow) {
+			memcpy(client->xfer_desc, changed.desc, changed.count * sizeof(changed.desc[0]));
+			client->xferCount = changed.count;
+		}
+		return false;
+	}
+	const int flushError = cache->flushError;
+	cache->flushError = 0;
+	pthread_mutex_unlock(&cache->lock);
+	
+	if (wasClean && cachePolicy == CACHE_DELAYED) {
+		// let the flusher schedule the write-back
+		pthread_mutex_lock(&flusher.lock);
+		pthread_cond_signal(&flusher.cond);
+		pthread_mutex_unlock(&flusher.lock);
+	}
+	client->stats.cacheHits++;
+	updateTransferStats(client, 0, bytes, monotonicTimeUs() - start);
+	*errorCode = bytes < 0 || flushError ? -1 : 0;
+	return true;
+}
+
+/* A failed write-through leaves the cache ahead of the partition, keep
+ * those sectors dirty so they are not skipped and get written back on close. */
+static void finishCacheWrite(struct rmt_storage_client* client, bool failed)
+{
+	struct sectorCache* cache = client->cache;
+	if (!cache || cachePolicy != CACHE_WRITE_THROUGH || client->eventID != RMT_STORAGE_WRITE)
+		return;
+	pthread_mutex_lock(&cache->lock);
+	for (unsigned int i = 0; i < client->xferCount; ++i) {
+		const struct rmt_storage_iovec_desc* desc = &client->xfer_desc[i];
+		uint64_t sector = desc->sector_addr;
+		const uint64_t end = sector + desc->num_sector;
+		if (end > cache->sectors)
+			continue;
+		for (; sector < end; ++sector) {
+			if (failed) {
+				markDirty(cache, sector, 1);
+			} else if (sectorDirty(cache, sector)) {
+				cache->dirty[sector / 32] &= ~(1u << (sector % 32));
+				cache->dirtyCount--;
+			}
+		}
+	}
+	if (!cache->dirtyCount)
+		cache->firstDirtyUs = 0;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Write back what the client left dirty before its fd is closed */
+static void closeClientCache(struct rmt_storage_client* client)
+{
+	struct sectorCache* cache = client->cache;
+	if (!cache)
+		return;
+	pthread_mutex_lock(&cache->flushLock);
+	writeBackCache(cache);
+	cache->fd = -1;
+	pthread_mutex_unlock(&cache->flushLock);
+	ALOGI("rmt_storage sid=0x%08x: %u requests from cache, %llu bytes unchanged, %u write-backs of %llu sectors, %u failed\n",
+			client->storageID, client->stats.cacheHits, client->stats.unchangedBytes,
+			cache->flushes, cache->flushedSectors, cache->flushErrors);
+	client->cache = NULL;
+}
+
+static void flushAllCaches(void)
+{
+	for (int i = 0; i < partitionRegistryLength; ++i) {
+		struct sectorCache* cache = partitionRegistry[i].cache;
+		if (!cache)
+			continue;
+		pthread_mutex_lock(&cache->flushLock);
+		writeBackCache(cache);
+		pthread_mutex_unlock(&cache->flushLock);
+	}
+}
+
+static void readSyncPolicy(void)
+{
+	char value[PROPERTY_VALUE_MAX];
+	property_get("persist.rmt_storage.sync", value, "off");
+	if (0 == strcmp(value, "request"))
+		syncPolicy = SYNC_REQUEST;
+	else if (0 == strcmp(value, "group"))
+		syncPolicy = SYNC_GROUP;
+	else
+		return;
+	ALOGI("rmt_storage write sync: %s\n", value);
+	property_get("persist.rmt_storage.sync_window_us", value, "2000");
+	syncWindowUs = strtoul(value, NULL, 10);
+	
+	if (syncPolicy != SYNC_GROUP)
+		return;
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&committer.cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (pthread_create(&committer.thread, NULL, committerThread, NULL) != 0) {
+		ALOGE("Unable to create a pthread, syncing every request\n");
+		syncPolicy = SYNC_REQUEST;
+	}
+}
+
+static int syncClient(struct rmt_storage_client* client)
+{
+	client->stats.syncs++;
+	if (fdatasync(client->fd) != 0) {
+		ALOGE("rmt_storage sync of sid=0x%08x failed with error = %d\n", client->storageID, errno);
+		return -1;
+	}
+	return 0;
+}
+
+/* Hand a completed write to the committer, which sends its status */
+static void queueCommit(struct rmt_storage_client* client)
+{
+	pthread_mutex_lock(&committer.lock);
+	client->commitPending = true;
+	committer.clients[committer.count++] = client;
+	if (committer.count == 1)
+		committer.firstUs = monotonicTimeUs();
+	// the window closes early once every open session has a write in it
+	pthread_cond_signal(&committer.cond);
+	pthread_mutex_unlock(&committer.lock);
+}
+
+static void waitCommitted(struct rmt_storage_client* client)
+{
+	pthread_mutex_lock(&committer.lock);
+	while (client->commitPending)
+		pthread_cond_wait(&committer.committed, &committer.lock);
+	pthread_mutex_unlock(&committer.lock);
+}
+
+/* Collects the writes of all clients for syncWindowUs after the first one,
+ * syncs each partition they touched once and then sends their statuses.
+ * The written sectors of a write-through cache stay dirty until the sync
+ * succeeded. */
+static void* committerThread(void* arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&committer.lock);
+	for (;;) {
+		while (!committer.count)
+			pthread_cond_wait(&committer.cond, &committer.lock);
+		const unsigned long long deadlineUs = committer.firstUs + syncWindowUs;
+		const struct timespec deadline = { deadlineUs / 1000000, (deadlineUs % 1000000) * 1000 };
+		while (committer.count < __atomic_load_n(&committer.sessions, __ATOMIC_ACQUIRE)
+				&& monotonicTimeUs() < deadlineUs)
+			pthread_cond_timedwait(&committer.cond, &committer.lock, &deadline);
+		struct rmt_storage_client* group[MAX_NUM_CLIENTS];
+		const unsigned int count = committer.count;
+		memcpy(group, committer.clients, count * sizeof(group[0]));
+		committer.count = 0;
+		pthread_mutex_unlock(&committer.lock);
+		
+		const unsigned long long start = monotonicTimeUs();
+		int fds[MAX_NUM_CLIENTS];
+		int results[MAX_NUM_CLIENTS];
+		unsigned int fdCount = 0;
+		for (unsigned int i = 0; i < count; ++i) {
+			unsigned int j = 0;
+			while (j < fdCount && fds[j] != group[i]->fd)
+				++j;
+			if (j == fdCount) {
+				fds[fdCount] = group[i]->fd;
+				results[fdCount++] = syncClient(group[i]);
+			}
+			finishCacheWrite(group[i], results[j] != 0);
+			sendTransferStatus(group[i], results[j]);
+		}
+		ALOGI("rmt_storage group commit: %u writes, %u syncs, %llu us\n",
+				count, fdCount, monotonicTimeUs() - start);
+		
+		pthread_mutex_lock(&committer.lock);
+		for (unsigned int i = 0; i < count; ++i)
+			group[i]->commitPending = false;
+		pthread_cond_broadcast(&committer.committed);
+		if (useUring) {
+			pthread_mutex_unlock(&committer.lock);
+			for (unsigned int i = 0; i < count; ++i)
+				continueUringClient(group[i]);
+			pthread_mutex_lock(&committer.lock);
+		}
+	}
+	return NULL;
+}
+
+/* Mapped once and kept, the mapping stays valid when the fd is closed. The
+ * clients of a partition share it, they may open sessions concurrently. */
+static char* mapPartition(struct partReg* part, size_t* size)
+{
+	pthread_mutex_lock(&part->loadLock);
+	if (!part->map) {
+		off64_t length = lseek64(part->fd, 0, SEEK_END);
+		if (length <= 0 || (uint64_t)length > SIZE_MAX) {
+			ALOGE("rmt_storage not mapping %s, size 0x%llx\n", part->buffer, (long long)length);
+		} else {
+			void* map = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_SHARED, part->fd, 0);
+			if (map == MAP_FAILED) {
+				ALOGE("mmap failed for %s errno=%d\n", part->buffer, errno);
+			} else {
+				part->map = map;
+				part->mapSize = length;
+			}
+		}
+	}
+	char* map = part->map;
+	*size = part->mapSize;
+	pthread_mutex_unlock(&part->loadLock);
+	return map;
+}
+
+/* memcpy between the shared memory and the partition mapping. The written
+ * pages are msync'ed with MS_SYNC for SYNC_REQUEST, with MS_ASYNC otherwise
+ * (starting the write-back like pwrite would), and not at all for
+ * SYNC_GROUP, whose fdatasync covers the mapping. An I/O error on a mapped
+ * partition raises SIGBUS, which is why this backend is opt-in.
+ * Returns the bytes transferred or -1. */
+static ssize_t mapTransfer(struct rmt_storage_client* client)
+{
+	const bool write = client->eventID == RMT_STORAGE_WRITE;
+	ssize_t bytes = 0;
+	for (unsigned int i = 0; i < client->xferCount; ++i) {
+		const struct rmt_storage_iovec_desc* desc = &client->xfer_desc[i];
+		const uint64_t offset = (uint64_t)desc->sector_addr * RAMFS_BLOCK_SIZE;
+		const size_t length = (size_t)desc->num_sector * RAMFS_BLOCK_SIZE;
+		if (offset + length > client->mapSize) {
+			ALOGE("rmt_storage fop(%d) beyond the end of the partition\n", client->eventID);
+			return -1;
+		}
+		char* mapped = client->map + offset;
+		if (!write) {
+			memcpy(descriptorData(client->sharedMemParam, desc), mapped, length);
+			bytes += length;
+			continue;
+		}
+		memcpy(mapped, descriptorData(client->sharedMemParam, desc), length);
+		bytes += length;
+		if (syncPolicy == SYNC_GROUP)
+			continue;
+		char* page = (char*)((uintptr_t)mapped & ~pageMask);
+		client->stats.syscalls++;
+		if (syncPolicy == SYNC_REQUEST)
+			client->stats.syncs++;
+		if (msync(page, mapped + length - page, syncPolicy == SYNC_REQUEST ? MS_SYNC : MS_ASYNC) != 0) {
+			ALOGE("rmt_storage msync failed with error = %d\n", errno);
+			return -1;
+		}
+	}
+	return bytes;
+}
+
+static void readStripePolicy(void)
+{
+	char value[PROPERTY_VALUE_MAX];
+	property_get("persist.rmt_storage.stripe_concurrency", value, "1");
+	unsigned int concurrency = strtoul(value, NULL, 10);
+	if (concurrency <= 1)
+		return;
+	property_get("persist.rmt_storage.stripe_kb", value, "256");
+	size_t size = (size_t)strtoul(value, NULL, 10) * 1024;
+	// with io_uring the kernel runs the stripes, the pool gets no workers
+	concurrency = setupStripes(size, concurrency, !useUring);
+	ALOGI("rmt_storage striped reads: %zu KiB stripes, %u at a time\n", size / 1024, concurrency);
+}
+
+/* Bring the partitions into memory before the modem asks for them: into the
+ * sector cache if there is one, into the page cache otherwise. The fds are
+ * dups, as a CLOSE event closes the partition fd. */
+static void* prefetchThread(void* arg)
+{
+	int* fds = arg;
+	const unsigned long long start = monotonicTimeUs();
+	unsigned int count = 0;
+	unsigned long long bytes = 0;
+	for (int i = 0; i < partitionRegistryLength; ++i) {
+		if (fds[i] < 0)
+			continue;
+		struct sectorCache* cache = NULL;
+		// written back through the partition fd once it is opened
+		if (cachePolicy != CACHE_OFF)
+			cache = openCache(&partitionRegistry[i], fds[i], -1);
+		if (cache) {
+			count++;
+			bytes += cache->sectors * RAMFS_BLOCK_SIZE;
+		} else {
+			// no sector cache, or the partition is too big for one
+			off64_t size = lseek64(fds[i], 0, SEEK_END);
+			if (size > 0 && (readahead(fds[i], 0, size) == 0
+					|| posix_fadvise(fds[i], 0, size, POSIX_FADV_WILLNEED) == 0)) {
+				count++;
+				bytes += size;
+			}
+		}
+		close(fds[i]);
+	}
+	free(fds);
+	ALOGI("rmt_storage prefetched %u partitions, %llu KiB in %llu ms, %llu ms after start\n",
+			count, bytes / 1024, (monotonicTimeUs() - start) / 1000, (monotonicTimeUs() - daemonStartUs) / 1000);
+	return NULL;
+}
+
+static void startPrefetch(void)
+{
+	char value[PROPERTY_VALUE_MAX];
+	property_get("persist.rmt_storage.prefetch", value, "1");
+	if (value[0] != '1')
+		return;
+	int* fds = malloc(partitionRegistryLength * sizeof(int));
+	if (!fds)
+		return;
+	for (int i = 0; i < partitionRegistryLength; ++i)
+		fds[i] = partitionRegistry[i].fd < 0 ? -1 : dup(partitionRegistry[i].fd);
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, prefetchThread, fds) != 0) {
+		ALOGE("Unable to create a pthread\n");
+		for (int i = 0; i < partitionRegistryLength; ++i) {
+			if (fds[i] >= 0)
+				close(fds[i]);
+		}
+		free(fds);
+		return;
+	}
+	pthread_detach(thread);
+}
+
+/* End the session of the CLOSE taken from the queue, after its requests */
+static void closeSession(struct rmt_storage_client* client)
+{
+	if (!client->sessionOpen)
+		return;
+	closeClientCache(client);
+	// openSession() left the count of the requests rejected before
+	client->stats.rejected = client->queueRejected - client->stats.rejected;
+	logTransferStats(client);
+	if (client->directFd >= 0)
+		close(client->directFd);
+	__atomic_sub_fetch(&committer.sessions, 1, __ATOMIC_ACQ_REL);
+	// the fd belongs to the partition registry, a reopen uses it again
+	client->fd = -1;
+	client->sessionOpen = false;
+}
+
+/* Start the session of the OPEN taken from the queue. The last session is
+ * closed first if its CLOSE didn't fit in the queue. Loading the cache reads
+ * the whole partition, the requests behind the OPEN wait in the queue. */
+static void openSession(struct rmt_storage_client* client)
+{
+	closeSession(client);
+	struct partReg* part = client->nextPart;
+	memset(&client->stats, 0, sizeof(client->stats));
+	client->stats.rejected = client->queueRejected;
+	client->storageID = client->nextStorageID;
+	client->fd = part->fd;
+	client->cache = NULL;
+	if (cachePolicy != CACHE_OFF)
+		client->cache = openCache(part, client->fd, client->fd);
+	client->map = NULL;
+	if (useMmap) {
+		client->map = mapPartition(part, &client->mapSize);
+	}
+	client->directFd = -1;
+	if (useDirect)
+		openDirect(client, part);
+	__atomic_add_fetch(&committer.sessions, 1, __ATOMIC_ACQ_REL);
+	client->sessionOpen = true;
+}
+
+/* OPEN and CLOSE go through the request queue, so a reopened handle starts
+ * its new session once the requests of the last one are done */
+static bool isSessionChange(const struct rmt_storage_client* client)
+{
+	return client->eventID == RMT_STORAGE_OPEN || client->eventID == RMT_STORAGE_CLOSE;
+}
+
+static void changeSession(struct rmt_storage_client* client)
+{
+	if (client->eventID == RMT_STORAGE_OPEN)
+		openSession(client);
+	else
+		closeSession(client);
+}
+
+#ifdef HAVE_IO_URING
+
+/* io_uring backend: the main loop submits all runs of an event as one chain
+ * of linked SQEs, a single reaper thread collects the completions and sends
+ * the status. No client threads are started, session changes run on a single
+ * session worker, see sessionWorkerThread(). The submission queue is written
+ * under uring.lock, by the main loop and by the reaper and the committer when
+ * they continue a client, and every submission is handed to the kernel before
+ * the lock is released. Cache hits and status ioctls run outside the lock. The completion queue is only read by the reaper.
+ * At most cqEntries operations are in flight so the completion queue can't
+ * overflow; a request that doesn't fit waits for the reaper. */
+
+#define URING_ENTRIES 64
+
+static struct
+{
+	int fd;
+	unsigned int sqEntries;
+	unsigned int* sqHead;
+	unsigned int* sqTail;
+	unsigned int* sqMask;
+	unsigned int* sqArray;
+	struct io_uring_sqe* sqes;
+	unsigned int* cqHead;
+	unsigned int* cqTail;
+	unsigned int* cqMask;
+	struct io_uring_cqe* cqes;
+	unsigned int cqEntries;
+	unsigned int inflight; // operations submitted and not reaped yet
+	unsigned int deferred; // clients waiting for room
+	pthread_t reaper;
+	pthread_mutex_t lock; // submission queue and request consumption
+} uring = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* OPEN and CLOSE of busy clients, at most one per client */
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct rmt_storage_client* clients[MAX_NUM_CLIENTS];
+	unsigned int count;
+	pthread_t thread;
+} sessionWorker = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static int submitUringTransfer(struct rmt_storage_client* client);
+
+/* Session changes write back or load a cache, the client stays busy until
+ * the session worker is done with it */
+static void queueSessionChange(struct rmt_storage_client* client)
+{
+	pthread_mutex_lock(&sessionWorker.lock);
+	sessionWorker.clients[sessionWorker.count++] = client;
+	pthread_cond_signal(&sessionWorker.cond);
+	pthread_mutex_unlock(&sessionWorker.lock);
+}
+
+static void* sessionWorkerThread(void* arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&sessionWorker.lock);
+	for (;;) {
+		while (!sessionWorker.count)
+			pthread_cond_wait(&sessionWorker.cond, &sessionWorker.lock);
+		struct rmt_storage_client* client = sessionWorker.clients[0];
+		memmove(sessionWorker.clients, sessionWorker.clients + 1,
+				--sessionWorker.count * sizeof(sessionWorker.clients[0]));
+		pthread_mutex_unlock(&sessionWorker.lock);
+		changeSession(client);
+		continueUringClient(client);
+		pthread_mutex_lock(&sessionWorker.lock);
+	}
+	return NULL;
+}
+
+/* Run the queued requests of a busy client until one is in flight or waits
+ * for the session worker. The client becomes idle, under uring.lock, when
+ * its queue is empty. Called by whoever owns the client, without uring.lock. */
+static void continueUringClient(struct rmt_storage_client* client)
+{
+	for (;;) {
+		pthread_mutex_lock(&uring.lock);
+		if (!popRequest(client)) {
+			client->busy = false;
+			pthread_mutex_unlock(&uring.lock);
+			return;
+		}
+		pthread_mutex_unlock(&uring.lock);
+		if (isSessionChange(client)) {
+			queueSessionChange(client);
+			return;
+		}
+		if (client->xferRejected) {
+			sendTransferStatus(client, -1);
+			continue;
+		}
+		int errorCode;
+		if (serveFromCache(client, &errorCode)) {
+			sendTransferStatus(client, errorCode);
+			continue;
+		}
+		pthread_mutex_lock(&uring.lock);
+		int ret = submitUringTransfer(client);
+		pthread_mutex_unlock(&uring.lock);
+		// in flight, the reaper may own the client already
+		if (ret > 0)
+			return;
+		if (ret < 0)
+			sendTransferStatus(client, -1);
+	}
+}
+
+static void dispatchUringRequests(struct rmt_storage_client* client)
+{
+	pthread_mutex_lock(&uring.lock);
+	const bool idle = !client->busy;
+	client->busy = true;
+	pthread_mutex_unlock(&uring.lock);
+	if (idle)
+		continueUringClient(client);
+}
+
+/* Submit the requests that waited for room in the completion queue. Called
+ * by the reaper whenever it reaped all completions. */
+static void resumeDeferredUring(void)
+{
+	struct rmt_storage_client* resumed[MAX_NUM_CLIENTS];
+	int results[MAX_NUM_CLIENTS];
+	unsigned int count = 0;
+	pthread_mutex_lock(&uring.lock);
+	for (unsigned int i = 0; i < MAX_NUM_CLIENTS && uring.deferred; ++i) {
+		struct rmt_storage_client* client = &all_clients[i];
+		if (!client->deferred)
+			continue;
+		client->deferred = false;
+		uring.deferred--;
+		int ret = submitUringTransfer(client);
+		if (ret > 0)
+			continue;
+		resumed[count] = client;
+		results[count++] = ret;
+	}
+	pthread_mutex_unlock(&uring.lock);
+	for (unsigned int i = 0; i < count; ++i) {
+		if (results[i] < 0)
+			sendTransferStatus(resumed[i], -1);
+		continueUringClient(resumed[i]);
+	}
+}
+
+static void finishUringTransfer(struct rmt_storage_client* client)
+{
+	const bool failed = __atomic_load_n(&client->xferFailed, __ATOMIC_ACQUIRE);
+	updateTransferStats(client, client->runCount, failed ? -1 : client->xferBytes,
+			monotonicTimeUs() - client->xferStartUs);
+	if (!failed && client->eventID == RMT_STORAGE_WRITE && syncPolicy == SYNC_GROUP) {
+		// the client stays busy until the committer continues it
+		queueCommit(client);
+		return;
+	}
+	// a strict sync is part of the transfer
+	finishCacheWrite(client, failed);
+	sendTransferStatus(client, failed ? -1 : 0);
+	continueUringClient(client);
+}
+
+static void completeUringRun(const struct io_uring_cqe* cqe)
+{
+	struct rmt_storage_client* client = &all_clients[cqe->user_data >> 8];
+	const unsigned int index = cqe->user_data & 0xFF;
+	if (index == client->runCount) {
+		// the fdatasync linked behind the runs
+		client->stats.syncs++;
+		if (cqe->res < 0) {
+			if (cqe->res != -ECANCELED)
+				ALOGE("rmt_storage sync of sid=0x%08x failed with error = %d\n", client->storageID, -cqe->res);
+			__atomic_store_n(&client->xferFailed, true, __ATOMIC_RELEASE);
+		}
+	} else if (cqe->res < 0 || (size_t)cqe->res != client->runs[index].length) {
+		if (cqe->res != -ECANCELED)
+			ALOGE("rmt_storage fop(%d) failed with error = %d \n", client->eventID, -cqe->res);
+		__atomic_store_n(&client->xferFailed, true, __ATOMIC_RELEASE);
+	} else {
+		client->xferBytes += cqe->res;
+	}
+	if (__atomic_sub_fetch(&client->pendingRuns, 1, __ATOMIC_ACQ_REL) == 0)
+		finishUringTransfer(client);
+}
+
+static void* uringReaperThread(void* arg)
+{
+	(void)arg;
+	for (;;) {
+		unsigned int head = *uring.cqHead;
+		if (head == __atomic_load_n(uring.cqTail, __ATOMIC_ACQUIRE)) {
+			resumeDeferredUring();
+			if (syscall(__NR_io_uring_enter, uring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+					&& errno != EINTR) {
+				ALOGE("io_uring wait failed errno=%d\n", errno);
+				break;
+			}
+			continue;
+		}
+		__atomic_sub_fetch(&uring.inflight, 1, __ATOMIC_ACQ_REL);
+		completeUringRun(&uring.cqes[head & *uring.cqMask]);
+		__atomic_store_n(uring.cqHead, head + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static int setupUring(void)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (uring.fd < 0)
+		return -1;
+	
+	size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	char* sq = mmap(NULL, sqSize, PROT_READ|PROT_WRITE, MAP_SHARED, uring.fd, IORING_OFF_SQ_RING);
+	char* cq = mmap(NULL, cqSize, PROT_READ|PROT_WRITE, MAP_SHARED, uring.fd, IORING_OFF_CQ_RING);
+	void* sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+				PROT_READ|PROT_WRITE, MAP_SHARED, uring.fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+		ALOGE("io_uring mmap failed errno=%d\n", errno);
+		close(uring.fd);
+		uring.fd = -1;
+		return -1;
+	}
+	uring.sqEntries = params.sq_entries;
+	uring.sqHead = (unsigned int*)(sq + params.sq_off.head);
+	uring.sqTail = (unsigned int*)(sq + params.sq_off.tail);
+	uring.sqMask = (unsigned int*)(sq + params.sq_off.ring_mask);
+	uring.sqArray = (unsigned int*)(sq + params.sq_off.array);
+	uring.sqes = sqes;
+	uring.cqHead = (unsigned int*)(cq + params.cq_off.head);
+	uring.cqTail = (unsigned int*)(cq + params.cq_off.tail);
+	uring.cqMask = (unsigned int*)(cq + params.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	uring.cqEntries = params.cq_entries;
+	
+	if (pthread_create(&sessionWorker.thread, NULL, sessionWorkerThread, NULL) != 0
+			|| pthread_create(&uring.reaper, NULL, uringReaperThread, NULL) != 0) {
+		ALOGE("Unable to create a pthread\n");
+		close(uring.fd);
+		uring.fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns 1 when the transfer is in flight or waits for room, 0 if there
+ * was nothing to transfer, -1 on failure. Called with uring.lock held. */
+static int submitUringTransfer(struct rmt_storage_client* client)
+{
+	if (!client->xferCount)
+		return 0;
+	if (!client->sharedMemParam) {
+		ALOGE("No shared mem for sid=0x%08x\n", client->storageID);
+		return -1;
+	}
+	unsigned int runCount = buildTransferRuns(client->sharedMemParam, client->xfer_desc, client->xferCount, client->runs);
+	if (shouldStripe(client->eventID, client->runs, runCount)) {
+		struct xferRun runs[RMT_STORAGE_MAX_IOVEC_XFR_CNT];
+		memcpy(runs, client->runs, runCount * sizeof(runs[0]));
+		runCount = buildStripes(runs, runCount, client->runs);
+	}
+	// a strict sync is linked behind the writes, it only runs if they succeeded
+	const bool sync = client->eventID == RMT_STORAGE_WRITE && syncPolicy == SYNC_REQUEST;
+	const unsigned int sqeCount = runCount + sync;
+	if (__atomic_load_n(&uring.inflight, __ATOMIC_ACQUIRE) + sqeCount > uring.cqEntries) {
+		// the reaper submits it once it reaped the completions in the way
+		client->deferred = true;
+		uring.deferred++;
+		return 1;
+	}
+	// the submissions under the lock leave the submission queue empty
+	unsigned int tail = *uring.sqTail;
+	client->runCount = runCount;
+	client->pendingRuns = sqeCount;
+	client->xferFailed = false;
+	client->xferBytes = 0;
+	client->xferStartUs = monotonicTimeUs();
+	
+	const uint64_t clientIndex = client - all_clients;
+	for (unsigned int i = 0; i < sqeCount; ++i) {
+		const unsigned int index = tail & *uring.sqMask;
+		struct io_uring_sqe* sqe = &uring.sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		// reads run in parallel, writes in order
+		sqe->flags = i + 1 < sqeCount && client->eventID == RMT_STORAGE_WRITE ? IOSQE_IO_LINK : 0;
+		sqe->fd = client->fd;
+		sqe->user_data = clientIndex << 8 | i;
+		if (i == runCount) {
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		} else {
+			sqe->opcode = client->eventID == RMT_STORAGE_WRITE ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->off = client->runs[i].offset;
+			sqe->addr = (uintptr_t)client->runs[i].iov;
+			sqe->len = client->runs[i].iovcnt;
+		}
+		uring.sqArray[index] = index;
+		++tail;
+	}
+	__atomic_store_n(uring.sqTail, tail, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&uring.inflight, sqeCount, __ATOMIC_ACQ_REL);
+	
+	unsigned int submitted = 0;
+	while (submitted < sqeCount) {
+		int ret = syscall(__NR_io_uring_enter, uring.fd, sqeCount - submitted, 0, 0, NULL, 0);
+		client->stats.syscalls++;
+		if (ret >= 0) {
+			submitted += ret;
+		} else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			ALOGE("io_uring submit failed errno=%d\n", errno);
+			// the kernel didn't take the rest, withdraw it
+			__atomic_store_n(uring.sqTail, tail - (sqeCount - submitted), __ATOMIC_RELEASE);
+			__atomic_sub_fetch(&uring.inflight, sqeCount - submitted, __ATOMIC_ACQ_REL);
+			if (submitted == 0)
+				return -1;
+			// the submitted part completes the transfer, with an error
+			__atomic_store_n(&client->xferFailed, true, __ATOMIC_RELEASE);
+			if (__atomic_sub_fetch(&client->pendingRuns, sqeCount - submitted, __ATOMIC_ACQ_REL) == 0)
+				return -1;
+			break;
+		}
+	}
+	return 1;
+}
+
+#else
+
+static int setupUring(void)
+{
+	return -1;
+}
+
+static void dispatchUringRequests(struct rmt_storage_client* client)
+{
+	(void)client;
+}
+
+static void continueUringClient(struct rmt_storage_client* client)
+{
+	(void)client;
+}
+
+#endif
+
 static void* clientThread(void* arg)
 {
 	struct rmt_storage_client* client = arg;
 	ALOGI("rmt_storage client thread started\n");
-	pthread_mutex_lock(&client->lock);
 	
-	ssize_t lastTransferredByteCount = 0;
-	while (!client->stopFlag) {
-		if (client->xferCount && !client->sharedMemParam) {
+	for (;;) {
+		while (sem_wait(&client->wakeup) != 0 && errno == EINTR)
+			;
+		if (!popRequest(client))
+			continue;
+		if (isSessionChange(client)) {
+			changeSession(client);
+			continue;
+		}
+		if (client->xferRejected) {
+			sendTransferStatus(client, -1);
+			continue;
+		}
+		ALOGI("unblock rmt_storage client thread\n");
+		if (client->xferCount == 0)
+			continue;
+		if (!client->sharedMemParam) {
 			ALOGE("No shared mem for sid=0x%08x\n", client->storageID);
-			break;
+			sendTransferStatus(client, -1);
+			continue;
 		}
-		for (unsigned int i = 0; i < client->xferCount; ++i) {
-			struct rmt_storage_iovec_desc* xferDesc = &client->xfer_desc[i];
-			
-			lseek(client->fd, xferDesc->sector_addr * RAMFS_BLOCK_SIZE, SEEK_SET);
-			
-			struct rmt_shrd_mem_param* memParam = client->sharedMemParam;
-			char* dataAddress = (char*)memParam->base - memParam->start + xferDesc->data_phy_addr;
-			size_t length = xferDesc->num_sector * RAMFS_BLOCK_SIZE;
-			
-			if (client->eventID == 1) {
-				lastTransferredByteCount = write(client->fd, dataAddress, length);
+		int errorCode;
+		if (serveFromCache(client, &errorCode)) {
+			sendTransferStatus(client, errorCode);
+			continue;
+		}
+		struct xferRun runs[RMT_STORAGE_MAX_IOVEC_XFR_CNT];
+		unsigned int runCount = 0;
+		unsigned long long start = monotonicTimeUs();
+		ssize_t lastTransferredByteCount = 0;
+		if (client->map) {
+			lastTransferredByteCount = mapTransfer(client);
+		} else {
+			runCount = buildTransferRuns(client->sharedMemParam, client->xfer_desc, client->xferCount, runs);
+			if (shouldStripe(client->eventID, runs, runCount)) {
+				lastTransferredByteCount = transferStriped(client->fd, client->eventID, runs, runCount,
+						&client->stats.syscalls);
 			} else {
-				lastTransferredByteCount = read(client->fd, dataAddress, length);
-			}
-			
-			if (lastTransferredByteCount < 0) {
-				ALOGE("rmt_storage fop(%d) failed with error = %d \n", client->eventID, errno);
-				break;
+				for (unsigned int i = 0; i < runCount; ++i) {
+					ssize_t ret = transferRunDirect(client, &runs[i]);
+					if (ret < 0) {
+						ALOGE("rmt_storage fop(%d) failed with error = %d \n", client->eventID, errno);
+						lastTransferredByteCount = ret;
+						break;
+					}
+					lastTransferredByteCount += ret;
+				}
 			}
-			
-			ALOGI("rmt_storage fop(%d): bytes transferred = %d\n", client->eventID, lastTransferredByteCount);
-		}
-		if (client->xferCount != 0) {
-			int errorCode = lastTransferredByteCount < 0 ? lastTransferredByteCount : 0;
-			client->lastErrorCode = errorCode;
-			struct rmt_storage_send_sts sendStatus = {
-				errorCode,
-				client->userData,
-				(client - all_clients) / sizeof(struct rmt_storage_client) + 1,
-				client->eventID
-			};
-			if (ioctl(kernelDevFd, RMT_STORAGE_SEND_STATUS, &sendStatus) < 0) {
-				ALOGE("rmt_storage send status ioctl failed\n");
+		}
+		updateTransferStats(client, runCount, lastTransferredByteCount, monotonicTimeUs() - start);
+		int status = lastTransferredByteCount < 0 ? lastTransferredByteCount : 0;
+		if (status == 0 && client->eventID == RMT_STORAGE_WRITE) {
+			if (syncPolicy == SYNC_GROUP) {
+				queueCommit(client);
+				waitCommitted(client);
+				continue;
 			}
-			client->xferCount = 0;
+			// msync already waited for a mapped partition
+			if (syncPolicy == SYNC_REQUEST && !client->map)
+				status = syncClient(client);
 		}
-		pthread_cond_wait(&client->cond, &client->lock);
-		ALOGI("unblock rmt_storage client thread\n");
+		finishCacheWrite(client, status != 0);
+		sendTransferStatus(client, status);
 	}
-	
-	pthread_mutex_unlock(&client->lock);
-	destroyRMTSClient(client);
-	ALOGI("rmt_storage client thread exited\n");
 	return NULL;
 }
 
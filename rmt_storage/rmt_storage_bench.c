@@ -0,0 +1,439 @@
+/* rmt_storage transfer benchmark
+ * Copyright (C) 2018 DafabHoid
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "rmt_storage_xfer.h"
+
+/* Compares the two ways rmt_storage moves sectors between the shared
+ * memory of the modem and a partition: the descriptors merged into runs of
+ * one preadv/pwritev each (the client threads, with the transfer code of
+ * the daemon in rmt_storage_xfer.c), and memcpy to a mapping of the
+ * partition followed by an msync of the written pages
+ * (persist.rmt_storage.mmap). Both run the same
+ * generated requests against the same partition or image file, with the
+ * partition in the page cache after a first pass over it.
+ *
+ * The descriptor sizes follow what the modem EFS sends: mostly single
+ * sectors and small runs of its 2 KiB pages, a few larger ones when it
+ * rewrites a whole image. Change sizeDistribution to match a trace.
+ *
+ * With -B it measures the read of the whole image at modem boot instead,
+ * a few huge descriptors read run after run as a client thread does,
+ * against the same runs cut into stripes and read on the stripe pool of
+ * rmt_storage_xfer.c (persist.rmt_storage.stripe_kb and
+ * stripe_concurrency). The image is dropped from the page cache before
+ * every read. */
+
+#define SECTOR_SIZE RAMFS_BLOCK_SIZE
+#define SHARED_MEM_SIZE (1024 * 1024)
+
+static const struct
+{
+	unsigned int sectors;
+	unsigned int percent;
+} sizeDistribution[] = {
+	{ 1, 45 },
+	{ 4, 30 },
+	{ 8, 12 },
+	{ 16, 8 },
+	{ 64, 4 },
+	{ 256, 1 },
+};
+
+struct request
+{
+	bool write;
+	unsigned int count;
+	struct rmt_storage_iovec_desc desc[RMT_STORAGE_MAX_IOVEC_XFR_CNT];
+};
+
+struct result
+{
+	uint64_t* readUs;
+	uint64_t* writeUs;
+	unsigned int reads;
+	unsigned int writes;
+	unsigned long long bytes;
+	unsigned long long syscalls;
+	uint64_t totalUs;
+	unsigned int errors;
+};
+
+struct bench
+{
+	const char* path;
+	size_t sizeMB;
+	unsigned int requestCount;
+	unsigned int writePercent;
+	bool syncWrites;
+	unsigned int seed;
+	bool bootRead;
+	unsigned int bootDescriptors;
+	unsigned int concurrency;
+	size_t stripeBytes;
+	unsigned int iterations;
+
+	int fd;
+	size_t size;
+	char* map;
+	char* shared;
+	struct rmt_shrd_mem_param memParam; // shared, as the daemon sees it
+	struct request* requests;
+};
+
+static uint64_t nowUs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned int descriptorSize(void)
+{
+	unsigned int pick = rand() % 100;
+	for (unsigned int i = 0; i < sizeof(sizeDistribution) / sizeof(sizeDistribution[0]); ++i) {
+		if (pick < sizeDistribution[i].percent)
+			return sizeDistribution[i].sectors;
+		pick -= sizeDistribution[i].percent;
+	}
+	return 1;
+}
+
+static void generateRequests(struct bench* b)
+{
+	const uint64_t sectors = b->size / SECTOR_SIZE;
+	srand(b->seed);
+	for (unsigned int i = 0; i < b->requestCount; ++i) {
+		struct request* req = &b->requests[i];
+		req->write = (unsigned int)(rand() % 100) < b->writePercent;
+		// mostly one descriptor, up to five
+		req->count = rand() % 4 ? 1 : 2 + rand() % (RMT_STORAGE_MAX_IOVEC_XFR_CNT - 1);
+		size_t shared = 0;
+		for (unsigned int j = 0; j < req->count; ++j) {
+			struct rmt_storage_iovec_desc* desc = &req->desc[j];
+			desc->num_sector = descriptorSize();
+			if (desc->num_sector > sectors)
+				desc->num_sector = sectors;
+			desc->sector_addr = (uint64_t)rand() % (sectors - desc->num_sector + 1);
+			desc->data_phy_addr = shared;
+			shared += (size_t)desc->num_sector * SECTOR_SIZE;
+		}
+	}
+}
+
+static int transferFully(int fd, char* buffer, size_t length, off_t offset, bool write)
+{
+	while (length) {
+		ssize_t ret = write ? pwrite(fd, buffer, length, offset) : pread(fd, buffer, length, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buffer += ret;
+		length -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+static int syscallTransfer(struct bench* b, const struct request* req, struct result* res)
+{
+	struct xferRun runs[RMT_STORAGE_MAX_IOVEC_XFR_CNT];
+	const unsigned int runCount = buildTransferRuns(&b->memParam, req->desc, req->count, runs);
+	unsigned int syscalls = 0;
+	int ret = 0;
+	for (unsigned int i = 0; i < runCount && ret == 0; ++i) {
+		if (transferRun(b->fd, req->write ? RMT_STORAGE_WRITE : RMT_STORAGE_READ, &runs[i], &syscalls) < 0)
+			ret = -1;
+	}
+	res->syscalls += syscalls;
+	if (ret != 0)
+		return ret;
+	if (req->write && b->syncWrites) {
+		res->syscalls++;
+		return fdatasync(b->fd);
+	}
+	return 0;
+}
+
+static int mmapTransfer(struct bench* b, const struct request* req, struct result* res)
+{
+	const uintptr_t pageMask = sysconf(_SC_PAGESIZE) - 1;
+	for (unsigned int i = 0; i < req->count; ++i) {
+		const struct rmt_storage_iovec_desc* desc = &req->desc[i];
+		char* mapped = b->map + (size_t)desc->sector_addr * SECTOR_SIZE;
+		const size_t length = (size_t)desc->num_sector * SECTOR_SIZE;
+		if (!req->write) {
+			memcpy(descriptorData(&b->memParam, desc), mapped, length);
+			continue;
+		}
+		memcpy(mapped, descriptorData(&b->memParam, desc), length);
+		char* page = (char*)((uintptr_t)mapped & ~pageMask);
+		res->syscalls++;
+		if (msync(page, mapped + length - page, b->syncWrites ? MS_SYNC : MS_ASYNC) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void run(struct bench* b, int (*transfer)(struct bench*, const struct request*, struct result*),
+		struct result* res)
+{
+	const uint64_t start = nowUs();
+	for (unsigned int i = 0; i < b->requestCount; ++i) {
+		const struct request* req = &b->requests[i];
+		const uint64_t reqStart = nowUs();
+		if (transfer(b, req, res) != 0)
+			res->errors++;
+		const uint64_t elapsed = nowUs() - reqStart;
+		if (req->write)
+			res->writeUs[res->writes++] = elapsed;
+		else
+			res->readUs[res->reads++] = elapsed;
+		for (unsigned int j = 0; j < req->count; ++j)
+			res->bytes += (size_t)req->desc[j].num_sector * SECTOR_SIZE;
+	}
+	res->totalUs = nowUs() - start;
+}
+
+static int compareU64(const void* a, const void* b)
+{
+	const uint64_t x = *(const uint64_t*)a;
+	const uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void printLatency(const char* name, uint64_t* us, unsigned int count)
+{
+	if (!count)
+		return;
+	qsort(us, count, sizeof(*us), compareU64);
+	unsigned long long sum = 0;
+	for (unsigned int i = 0; i < count; ++i)
+		sum += us[i];
+	printf("    %-5s %6u   mean %7.1f  p50 %5llu  p99 %6llu  max %6llu us\n", name, count,
+			(double)sum / count, (unsigned long long)us[count / 2],
+			(unsigned long long)us[(unsigned long long)count * 99 / 100],
+			(unsigned long long)us[count - 1]);
+}
+
+static void printResult(const char* name, struct result* res)
+{
+	printf("%s: %.1f ms, %.1f MB/s, %llu syscalls, %u errors\n", name, res->totalUs / 1e3,
+			res->totalUs ? res->bytes / (double)res->totalUs : 0.0, res->syscalls, res->errors);
+	printLatency("read", res->readUs, res->reads);
+	printLatency("write", res->writeUs, res->writes);
+}
+
+/* Read the whole image in bootDescriptors descriptors, serially or striped */
+static uint64_t bootRead(struct bench* b, bool striped, unsigned int* errors)
+{
+	struct rmt_storage_iovec_desc desc[RMT_STORAGE_MAX_IOVEC_XFR_CNT];
+	const size_t piece = (b->size / b->bootDescriptors + SECTOR_SIZE - 1) & ~(size_t)(SECTOR_SIZE - 1);
+	unsigned int count = 0;
+	for (size_t offset = 0; offset < b->size; offset += piece) {
+		// the shared memory holds the image in one piece
+		const size_t length = b->size - offset < piece ? b->size - offset : piece;
+		desc[count].sector_addr = offset / SECTOR_SIZE;
+		desc[count].data_phy_addr = offset;
+		desc[count].num_sector = length / SECTOR_SIZE;
+		++count;
+	}
+	struct xferRun runs[RMT_STORAGE_MAX_IOVEC_XFR_CNT];
+	const unsigned int runCount = buildTransferRuns(&b->memParam, desc, count, runs);
+	unsigned int syscalls = 0;
+	
+	fdatasync(b->fd);
+	posix_fadvise(b->fd, 0, b->size, POSIX_FADV_DONTNEED);
+	const uint64_t start = nowUs();
+	if (striped) {
+		if (transferStriped(b->fd, RMT_STORAGE_READ, runs, runCount, &syscalls) < 0)
+			++*errors;
+	} else {
+		for (unsigned int i = 0; i < runCount; ++i) {
+			if (transferRun(b->fd, RMT_STORAGE_READ, &runs[i], &syscalls) < 0)
+				++*errors;
+		}
+	}
+	return nowUs() - start;
+}
+
+static void runBootRead(struct bench* b)
+{
+	uint64_t serial[b->iterations];
+	uint64_t striped[b->iterations];
+	unsigned int errors = 0;
+	for (unsigned int i = 0; i < b->iterations; ++i) {
+		serial[i] = bootRead(b, false, &errors);
+		striped[i] = bootRead(b, true, &errors);
+	}
+	qsort(serial, b->iterations, sizeof(serial[0]), compareU64);
+	qsort(striped, b->iterations, sizeof(striped[0]), compareU64);
+	printf("%s: boot read of %zu KiB, %u iterations, %u errors\n", b->path, b->size / 1024, b->iterations, errors);
+	printf("    serial, %u descriptors       median %7.1f  min %7.1f ms\n", b->bootDescriptors,
+			serial[b->iterations / 2] / 1e3, serial[0] / 1e3);
+	printf("    striped, %zu KiB x %u threads  median %7.1f  min %7.1f ms\n", b->stripeBytes / 1024,
+			b->concurrency, striped[b->iterations / 2] / 1e3, striped[0] / 1e3);
+}
+
+static void usage(const char* name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -f PATH   partition or image file, overwritten (/data/local/tmp/rmt_storage_bench.img)\n"
+		"  -s MB     size of a created image file (3)\n"
+		"  -n N      requests (20000)\n"
+		"  -w N      percentage of writes (30)\n"
+		"  -S        sync every write (fdatasync / MS_SYNC)\n"
+		"  -r N      random seed (1)\n"
+		"  -B        boot read of the whole image instead, serial and striped\n"
+		"  -d N      descriptors of the boot read, up to 5 (3)\n"
+		"  -c N      threads of the striped boot read, up to 16 (4)\n"
+		"  -k KB     stripe size (256)\n"
+		"  -i N      boot read iterations (5)\n",
+		name);
+}
+
+int main(int argc, char** argv)
+{
+	struct bench b = {
+		.path = "/data/local/tmp/rmt_storage_bench.img",
+		.sizeMB = 3,
+		.requestCount = 20000,
+		.writePercent = 30,
+		.seed = 1,
+		.bootDescriptors = 3,
+		.concurrency = 4,
+		.stripeBytes = 256 * 1024,
+		.iterations = 5,
+		.fd = -1,
+	};
+	int opt;
+	while ((opt = getopt(argc, argv, "f:s:n:w:Sr:Bd:c:k:i:")) != -1) {
+		switch (opt) {
+			case 'f': b.path = optarg; break;
+			case 's': b.sizeMB = strtoul(optarg, NULL, 10); break;
+			case 'n': b.requestCount = strtoul(optarg, NULL, 10); break;
+			case 'w': b.writePercent = strtoul(optarg, NULL, 10); break;
+			case 'S': b.syncWrites = true; break;
+			case 'r': b.seed = strtoul(optarg, NULL, 10); break;
+			case 'B': b.bootRead = true; break;
+			case 'd': b.bootDescriptors = strtoul(optarg, NULL, 10); break;
+			case 'c': b.concurrency = strtoul(optarg, NULL, 10); break;
+			case 'k': b.stripeBytes = (size_t)strtoul(optarg, NULL, 10) * 1024; break;
+			case 'i': b.iterations = strtoul(optarg, NULL, 10); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (!b.requestCount || b.writePercent > 100 || !b.bootDescriptors
+			|| b.bootDescriptors > RMT_STORAGE_MAX_IOVEC_XFR_CNT || !b.concurrency
+			|| b.concurrency > MAX_STRIPE_CONCURRENCY || b.stripeBytes < SECTOR_SIZE || !b.iterations) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	b.fd = open(b.path, O_RDWR | O_CREAT, 0600);
+	if (b.fd < 0) {
+		fprintf(stderr, "unable to open %s: %s\n", b.path, strerror(errno));
+		return 1;
+	}
+	struct stat st;
+	fstat(b.fd, &st);
+	if (S_ISREG(st.st_mode) && (size_t)st.st_size < b.sizeMB * 1024 * 1024) {
+		// written out, reads of a sparse file wouldn't reach the storage
+		static char chunk[64 * 1024];
+		for (size_t i = 0; i < sizeof(chunk); ++i)
+			chunk[i] = (char)(i * 31 + 3);
+		for (size_t offset = 0; offset < b.sizeMB * 1024 * 1024; offset += sizeof(chunk)) {
+			if (transferFully(b.fd, chunk, sizeof(chunk), offset, true) != 0) {
+				fprintf(stderr, "unable to size %s: %s\n", b.path, strerror(errno));
+				return 1;
+			}
+		}
+	}
+	off_t size = lseek(b.fd, 0, SEEK_END);
+	if (size < SECTOR_SIZE) {
+		fprintf(stderr, "%s is too small\n", b.path);
+		return 1;
+	}
+	b.size = size;
+	if (b.bootRead) {
+		b.size &= ~(size_t)(SECTOR_SIZE - 1);
+		b.stripeBytes &= ~(size_t)(SECTOR_SIZE - 1);
+		b.shared = malloc(b.size);
+		if (!b.shared) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+		b.memParam.size = b.size;
+		b.memParam.base = b.shared;
+		b.concurrency = setupStripes(b.stripeBytes, b.concurrency, true);
+		runBootRead(&b);
+		close(b.fd);
+		return 0;
+	}
+	b.map = mmap(NULL, b.size, PROT_READ | PROT_WRITE, MAP_SHARED, b.fd, 0);
+	b.shared = malloc(SHARED_MEM_SIZE);
+	b.requests = calloc(b.requestCount, sizeof(*b.requests));
+	struct result results[2];
+	memset(results, 0, sizeof(results));
+	for (int i = 0; i < 2; ++i) {
+		results[i].readUs = calloc(b.requestCount, sizeof(uint64_t));
+		results[i].writeUs = calloc(b.requestCount, sizeof(uint64_t));
+		if (!results[i].readUs || !results[i].writeUs) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+	}
+	if (b.map == MAP_FAILED || !b.shared || !b.requests) {
+		fprintf(stderr, "setup failed: %s\n", strerror(errno));
+		return 1;
+	}
+	for (size_t i = 0; i < SHARED_MEM_SIZE; ++i)
+		b.shared[i] = (char)(i * 131 + 7);
+	b.memParam.size = SHARED_MEM_SIZE;
+	b.memParam.base = b.shared;
+	generateRequests(&b);
+
+	// bring the whole partition into the page cache first
+	volatile char sum = 0;
+	for (size_t offset = 0; offset < b.size; offset += 4096)
+		sum += b.map[offset];
+	(void)sum;
+
+	printf("%s: %zu KiB, %u requests, %u%% writes%s\n", b.path, b.size / 1024,
+			b.requestCount, b.writePercent, b.syncWrites ? ", synced" : "");
+	run(&b, syscallTransfer, &results[0]);
+	run(&b, mmapTransfer, &results[1]);
+	printResult("preadv/pwritev", &results[0]);
+	printResult("mmap/msync", &results[1]);
+
+	munmap(b.map, b.size);
+	close(b.fd);
+	return 0;
+}
@@ -0,0 +1,289 @@
+/* rmt_storage transfers between shared memory and a partition
+ * Copyright (C) 2018 DafabHoid
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+#define LOG_TAG "rmt_storage"
+#include <log/log.h>
+#include "rmt_storage_xfer.h"
+
+/* A large read being executed by the stripe workers and its caller */
+struct stripedTransfer
+{
+	int fd;
+	unsigned int eventID;
+	unsigned int* syscalls;
+	struct xferRun stripes[MAX_STRIPES];
+	unsigned int count;
+	// protected by stripePool.lock
+	unsigned int next; // first stripe not claimed yet
+	unsigned int remaining; // stripes not finished
+	bool failed;
+	ssize_t bytes;
+};
+
+static size_t stripeSize;
+static unsigned int stripeConcurrency = 1;
+
+/* Workers for the striped reads. Stripes are claimed and finished under the
+ * lock, so a transfer is no longer touched once its caller saw all of them
+ * finished and returned. */
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	struct stripedTransfer* active[MAX_NUM_CLIENTS];
+	unsigned int activeCount;
+} stripePool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, {NULL}, 0 };
+
+/* Sort the descriptors by sector and merge the ones that continue each
+ * other on disk into runs, joining their iovecs when they are adjacent in
+ * shared memory too. Overlapping descriptors are kept in the order the
+ * modem sent them, so the last write still wins. */
+unsigned int buildTransferRuns(const struct rmt_shrd_mem_param* memParam,
+		const struct rmt_storage_iovec_desc* descs, unsigned int count, struct xferRun* runs)
+{
+	const struct rmt_storage_iovec_desc* order[RMT_STORAGE_MAX_IOVEC_XFR_CNT];
+	bool overlap = false;
+	for (unsigned int i = 0; i < count; ++i) {
+		const struct rmt_storage_iovec_desc* desc = &descs[i];
+		unsigned int j = i;
+		for (; j > 0 && order[j - 1]->sector_addr > desc->sector_addr; --j)
+			order[j] = order[j - 1];
+		order[j] = desc;
+	}
+	for (unsigned int i = 1; i < count; ++i) {
+		if ((uint64_t)order[i - 1]->sector_addr + order[i - 1]->num_sector > order[i]->sector_addr)
+			overlap = true;
+	}
+	if (overlap) {
+		for (unsigned int i = 0; i < count; ++i)
+			order[i] = &descs[i];
+	}
+	
+	unsigned int runCount = 0;
+	uint64_t nextSector = 0;
+	for (unsigned int i = 0; i < count; ++i) {
+		const struct rmt_storage_iovec_desc* desc = order[i];
+		char* data = descriptorData(memParam, desc);
+		size_t length = (size_t)desc->num_sector * RAMFS_BLOCK_SIZE;
+		if (runCount == 0 || desc->sector_addr != nextSector) {
+			struct xferRun* run = &runs[runCount++];
+			run->offset = (off64_t)desc->sector_addr * RAMFS_BLOCK_SIZE;
+			run->iovcnt = 0;
+			run->length = 0;
+		}
+		struct xferRun* run = &runs[runCount - 1];
+		struct iovec* last = run->iovcnt ? &run->iov[run->iovcnt - 1] : NULL;
+		if (last && (char*)last->iov_base + last->iov_len == data) {
+			last->iov_len += length;
+		} else {
+			run->iov[run->iovcnt].iov_base = data;
+			run->iov[run->iovcnt].iov_len = length;
+			run->iovcnt++;
+		}
+		run->length += length;
+		nextSector = (uint64_t)desc->sector_addr + desc->num_sector;
+	}
+	return runCount;
+}
+
+/* One preadv/pwritev per run, repeated for short transfers.
+ * Returns the bytes transferred or -1. */
+ssize_t transferRun(int fd, unsigned int eventID, struct xferRun* run, unsigned int* syscalls)
+{
+	struct iovec* iov = run->iov;
+	int iovcnt = run->iovcnt;
+	off64_t offset = run->offset;
+	size_t done = 0;
+	while (done < run->length) {
+		ssize_t ret;
+		if (eventID == RMT_STORAGE_WRITE)
+			ret = pwritev64(fd, iov, iovcnt, offset);
+		else
+			ret = preadv64(fd, iov, iovcnt, offset);
+		// stripes of a client run in parallel
+		__atomic_add_fetch(syscalls, 1, __ATOMIC_RELAXED);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret == 0)
+			errno = EIO; // the partition ended
+		if (ret <= 0)
+			return -1;
+		ALOGI("rmt_storage fop(%d): bytes transferred = %d\n", eventID, (int)ret);
+		done += ret;
+		offset += ret;
+		while (iovcnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char*)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return done;
+}
+
+/* Claim the next stripe of xfer and execute it. Called with stripePool.lock
+ * held, which is dropped during the transfer. */
+static void runStripe(struct stripedTransfer* xfer)
+{
+	const unsigned int i = xfer->next++;
+	pthread_mutex_unlock(&stripePool.lock);
+	// always buffered, a failing O_DIRECT fd is only dropped by its client thread
+	ssize_t ret = transferRun(xfer->fd, xfer->eventID, &xfer->stripes[i], xfer->syscalls);
+	if (ret < 0)
+		ALOGE("rmt_storage fop(%d) failed with error = %d \n", xfer->eventID, errno);
+	pthread_mutex_lock(&stripePool.lock);
+	if (ret < 0)
+		xfer->failed = true;
+	else
+		xfer->bytes += ret;
+	if (--xfer->remaining == 0)
+		pthread_cond_broadcast(&stripePool.done);
+}
+
+static void* stripeWorkerThread(void* arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&stripePool.lock);
+	for (;;) {
+		struct stripedTransfer* xfer = NULL;
+		for (unsigned int i = 0; i < stripePool.activeCount && !xfer; ++i) {
+			if (stripePool.active[i]->next < stripePool.active[i]->count)
+				xfer = stripePool.active[i];
+		}
+		if (xfer)
+			runStripe(xfer);
+		else
+			pthread_cond_wait(&stripePool.work, &stripePool.lock);
+	}
+	return NULL;
+}
+
+unsigned int setupStripes(size_t size, unsigned int concurrency, bool workers)
+{
+	if (concurrency > MAX_STRIPE_CONCURRENCY)
+		concurrency = MAX_STRIPE_CONCURRENCY;
+	stripeConcurrency = concurrency ? concurrency : 1;
+	stripeSize = size < RAMFS_BLOCK_SIZE ? RAMFS_BLOCK_SIZE : size & ~(size_t)(RAMFS_BLOCK_SIZE - 1);
+	if (!workers)
+		return stripeConcurrency;
+	for (unsigned int i = 1; i < stripeConcurrency; ++i) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, stripeWorkerThread, NULL) != 0) {
+			ALOGE("Unable to create a pthread\n");
+			stripeConcurrency = i;
+			break;
+		}
+		pthread_detach(thread);
+	}
+	return stripeConcurrency;
+}
+
+bool shouldStripe(unsigned int eventID, const struct xferRun* runs, unsigned int runCount)
+{
+	if (stripeConcurrency <= 1 || eventID != RMT_STORAGE_READ)
+		return false;
+	size_t total = 0;
+	for (unsigned int i = 0; i < runCount; ++i)
+		total += runs[i].length;
+	return total >= 2 * stripeSize;
+}
+
+/* Cut the runs of a large read into stripes of stripeSize, made larger
+ * where needed so there are no more than stripeConcurrency of them plus
+ * one per run. */
+unsigned int buildStripes(const struct xferRun* runs, unsigned int runCount, struct xferRun* stripes)
+{
+	size_t total = 0;
+	for (unsigned int i = 0; i < runCount; ++i)
+		total += runs[i].length;
+	size_t size = (total / stripeConcurrency + RAMFS_BLOCK_SIZE - 1) & ~(size_t)(RAMFS_BLOCK_SIZE - 1);
+	if (size < stripeSize)
+		size = stripeSize;
+	
+	unsigned int count = 0;
+	for (unsigned int r = 0; r < runCount; ++r) {
+		const struct xferRun* run = &runs[r];
+		int iovIndex = 0;
+		size_t iovOffset = 0;
+		for (size_t done = 0; done < run->length; ) {
+			struct xferRun* stripe = &stripes[count++];
+			stripe->offset = run->offset + done;
+			stripe->length = run->length - done < size ? run->length - done : size;
+			stripe->iovcnt = 0;
+			for (size_t left = stripe->length; left; ) {
+				const struct iovec* iov = &run->iov[iovIndex];
+				size_t length = iov->iov_len - iovOffset < left ? iov->iov_len - iovOffset : left;
+				stripe->iov[stripe->iovcnt].iov_base = (char*)iov->iov_base + iovOffset;
+				stripe->iov[stripe->iovcnt].iov_len = length;
+				stripe->iovcnt++;
+				left -= length;
+				iovOffset += length;
+				if (iovOffset == iov->iov_len) {
+					++iovIndex;
+					iovOffset = 0;
+				}
+			}
+			done += stripe->length;
+		}
+	}
+	return count;
+}
+
+/* Read the runs in stripes on the worker pool, the calling thread taking
+ * its share, like gemini_bandpool_run() does with bands. */
+ssize_t transferStriped(int fd, unsigned int eventID, const struct xferRun* runs, unsigned int runCount,
+		unsigned int* syscalls)
+{
+	struct stripedTransfer xfer;
+	xfer.fd = fd;
+	xfer.eventID = eventID;
+	xfer.syscalls = syscalls;
+	xfer.count = buildStripes(runs, runCount, xfer.stripes);
+	xfer.next = 0;
+	xfer.remaining = xfer.count;
+	xfer.failed = false;
+	xfer.bytes = 0;
+	
+	pthread_mutex_lock(&stripePool.lock);
+	const bool shared = stripePool.activeCount < MAX_NUM_CLIENTS;
+	if (shared) {
+		stripePool.active[stripePool.activeCount++] = &xfer;
+		pthread_cond_broadcast(&stripePool.work);
+	}
+	while (xfer.remaining) {
+		if (xfer.next < xfer.count)
+			runStripe(&xfer);
+		else
+			pthread_cond_wait(&stripePool.done, &stripePool.lock);
+	}
+	for (unsigned int i = 0; shared && i < stripePool.activeCount; ++i) {
+		if (stripePool.active[i] == &xfer) {
+			stripePool.active[i] = stripePool.active[--stripePool.activeCount];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&stripePool.lock);
+	ALOGI("rmt_storage fop(%d): %u stripes\n", eventID, xfer.count);
+	return xfer.failed ? -1 : xfer.bytes;
+}
@@ -0,0 +1,61 @@
+/* rmt_storage transfers between shared memory and a partition
+ * Copyright (C) 2018 DafabHoid
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/rmt_storage_client.h>
+
+// Used by the rmt_storage daemon and by rmt_storage_bench, which measures
+// exactly the code the client threads run.
+
+/* Sector-contiguous descriptors, transferred with one preadv/pwritev */
+struct xferRun
+{
+	off64_t offset;
+	struct iovec iov[RMT_STORAGE_MAX_IOVEC_XFR_CNT];
+	int iovcnt;
+	size_t length;
+};
+
+static __inline char* descriptorData(const struct rmt_shrd_mem_param* memParam, const struct rmt_storage_iovec_desc* desc)
+{
+	return (char*)memParam->base - memParam->start + desc->data_phy_addr;
+}
+
+unsigned int buildTransferRuns(const struct rmt_shrd_mem_param* memParam,
+		const struct rmt_storage_iovec_desc* descs, unsigned int count, struct xferRun* runs);
+
+// eventID is RMT_STORAGE_READ or RMT_STORAGE_WRITE, syscalls is counted atomically
+ssize_t transferRun(int fd, unsigned int eventID, struct xferRun* run, unsigned int* syscalls);
+
+#define MAX_STRIPE_CONCURRENCY 16
+/* buildStripes() makes at most one stripe more per run than the concurrency */
+#define MAX_STRIPES (MAX_STRIPE_CONCURRENCY + RMT_STORAGE_MAX_IOVEC_XFR_CNT)
+
+// Reads of at least two stripes of size bytes are split, see buildStripes().
+// With workers it starts the pool for transferStriped(), the caller being
+// one of the concurrency threads. Returns the concurrency reached.
+unsigned int setupStripes(size_t size, unsigned int concurrency, bool workers);
+
+bool shouldStripe(unsigned int eventID, const struct xferRun* runs, unsigned int runCount);
+
+unsigned int buildStripes(const struct xferRun* runs, unsigned int runCount, struct xferRun* stripes);
+
+// Returns the bytes transferred or -1
+ssize_t transferStriped(int fd, unsigned int eventID, const struct xferRun* runs, unsigned int runCount,
+		unsigned int* syscalls);